@@ -56,6 +56,11 @@ typedef enum _XENBUS_EVTCHN_TYPE {
 */
 typedef struct _XENBUS_EVTCHN_CHANNEL XENBUS_EVTCHN_CHANNEL, *PXENBUS_EVTCHN_CHANNEL;
 
+/*! \typedef XENBUS_EVTCHN_GROUP
+    \brief Event channel group handle
+*/
+typedef struct _XENBUS_EVTCHN_GROUP XENBUS_EVTCHN_GROUP, *PXENBUS_EVTCHN_GROUP;
+
 /*! \typedef XENBUS_EVTCHN_ACQUIRE
     \brief Acquire a reference to the EVTCHN interface
 
@@ -186,6 +191,10 @@ typedef VOID
     \param Interface The interface header
     \param Channel The channel handle
     \param Timeout An optional timeout value (similar to KeWaitForSingleObject(), but non-zero values are allowed at DISPATCH_LEVEL).
+
+    Callers below DISPATCH_LEVEL block until the channel fires. Callers
+    at DISPATCH_LEVEL spin, progressively backing off and eventually
+    yielding the vCPU to Xen.
 */
 typedef NTSTATUS
 (*XENBUS_EVTCHN_WAIT)(
@@ -219,6 +228,161 @@ typedef VOID
     IN  PXENBUS_EVTCHN_CHANNEL  Channel
     );
 
+/*! \typedef XENBUS_EVTCHN_GROUP_CALLBACK
+    \brief Event channel group callback
+
+    \param Argument The context argument passed to \a XENBUS_EVTCHN_GROUP_CREATE
+    \param Arguments The context arguments of the member channels that had
+    an event pending
+    \param Count The number of entries in \a Arguments
+    \return TRUE if any work was done
+*/
+typedef BOOLEAN
+(*XENBUS_EVTCHN_GROUP_CALLBACK)(
+    IN  PVOID   Argument,
+    IN  PVOID   *Arguments,
+    IN  ULONG   Count
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_CREATE
+    \brief Create an event channel group
+
+    \param Interface The interface header
+    \param Callback The function to invoke for pending member channels
+    \param Argument An optional context argument passed to the callback
+    \param Group A pointer to a group handle to be initialized
+
+    Events on member channels are masked (if requested when the channel
+    was opened) and acknowledged as usual but, rather than invoking each
+    channel's own callback, all members found pending in the same upcall
+    are handed to \a Callback in a single call
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_GROUP_CREATE)(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_EVTCHN_GROUP_CALLBACK    Callback,
+    IN  PVOID                           Argument OPTIONAL,
+    OUT PXENBUS_EVTCHN_GROUP            *Group
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_DESTROY
+    \brief Destroy an event channel group
+
+    \param Interface The interface header
+    \param Group The group handle
+
+    All member channels must have been removed from the group
+*/
+typedef VOID
+(*XENBUS_EVTCHN_GROUP_DESTROY)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_ADD
+    \brief Add an event channel to a group
+
+    \param Interface The interface header
+    \param Group The group handle
+    \param Channel The channel handle
+
+    A channel may be a member of at most one group
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_GROUP_ADD)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_REMOVE
+    \brief Remove an event channel from its group
+
+    \param Interface The interface header
+    \param Channel The channel handle
+
+    Once this returns the group callback will not be handed the channel's
+    argument again. Closing a channel implicitly removes it from its group.
+*/
+typedef VOID
+(*XENBUS_EVTCHN_GROUP_REMOVE)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    );
+
+/*! \def XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT
+    \brief Number of buckets in each channel latency histogram
+
+    Bucket N counts samples below 2^(N+1) microseconds, except for the
+    last bucket which counts all samples of 2^N microseconds or more.
+*/
+#define XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT    16
+
+/*! \struct _XENBUS_EVTCHN_STATISTICS
+    \brief Event channel statistics
+
+    Only \a Events is maintained unless the EvtchnStatistics driver
+    parameter is set.
+*/
+typedef struct _XENBUS_EVTCHN_STATISTICS {
+    ULONG   Events;                                         /*!< Events delivered since the channel was opened */
+    ULONG   Rate;                                           /*!< Events per second over the last complete second */
+    ULONG   Callback[XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT]; /*!< Callback execution time */
+    ULONG   Dispatch[XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT]; /*!< Time from upcall entry to callback */
+    ULONG   Unmask[XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT];   /*!< Time from automatic mask to unmask */
+} XENBUS_EVTCHN_STATISTICS, *PXENBUS_EVTCHN_STATISTICS;
+
+/*! \typedef XENBUS_EVTCHN_GET_STATISTICS
+    \brief Get a snapshot of the statistics of an event channel
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Statistics Buffer to receive the statistics
+
+    Counters are updated without synchronization so the snapshot may be
+    slightly inconsistent. Group members have no callback execution time.
+*/
+typedef VOID
+(*XENBUS_EVTCHN_GET_STATISTICS)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel,
+    OUT PXENBUS_EVTCHN_STATISTICS   Statistics
+    );
+
+/*! \def XENBUS_EVTCHN_PRIORITY_HIGHEST
+    \brief Highest event channel priority
+*/
+#define XENBUS_EVTCHN_PRIORITY_HIGHEST  0
+
+/*! \def XENBUS_EVTCHN_PRIORITY_DEFAULT
+    \brief Priority of a newly opened event channel
+*/
+#define XENBUS_EVTCHN_PRIORITY_DEFAULT  7
+
+/*! \def XENBUS_EVTCHN_PRIORITY_LOWEST
+    \brief Lowest event channel priority
+*/
+#define XENBUS_EVTCHN_PRIORITY_LOWEST   15
+
+/*! \typedef XENBUS_EVTCHN_SET_PRIORITY
+    \brief Set the priority of an event channel
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Priority A value between XENBUS_EVTCHN_PRIORITY_HIGHEST and XENBUS_EVTCHN_PRIORITY_LOWEST
+
+    Pending events on higher priority channels are delivered ahead of
+    those on lower priority channels bound to the same CPU. Priorities
+    are only supported by the FIFO ABI; with the 2-level ABI this method
+    succeeds but has no effect.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_SET_PRIORITY)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Priority
+    );
+
 // {BE2440AC-1098-4150-AF4D-452FADCEF923}
 DEFINE_GUID(GUID_XENBUS_EVTCHN_INTERFACE,
 0xbe2440ac, 0x1098, 0x4150, 0xaf, 0x4d, 0x45, 0x2f, 0xad, 0xce, 0xf9, 0x23);
@@ -308,7 +472,76 @@ struct _XENBUS_EVTCHN_INTERFACE_V5 {
     XENBUS_EVTCHN_CLOSE     EvtchnClose;
 };
 
-typedef struct _XENBUS_EVTCHN_INTERFACE_V5 XENBUS_EVTCHN_INTERFACE, *PXENBUS_EVTCHN_INTERFACE;
+/*! \struct _XENBUS_EVTCHN_INTERFACE_V6
+    \brief EVTCHN interface version 6
+    \ingroup interfaces
+*/
+struct _XENBUS_EVTCHN_INTERFACE_V6 {
+    INTERFACE                   Interface;
+    XENBUS_EVTCHN_ACQUIRE       EvtchnAcquire;
+    XENBUS_EVTCHN_RELEASE       EvtchnRelease;
+    XENBUS_EVTCHN_OPEN          EvtchnOpen;
+    XENBUS_EVTCHN_BIND          EvtchnBind;
+    XENBUS_EVTCHN_UNMASK        EvtchnUnmask;
+    XENBUS_EVTCHN_SEND          EvtchnSend;
+    XENBUS_EVTCHN_TRIGGER       EvtchnTrigger;
+    XENBUS_EVTCHN_WAIT          EvtchnWait;
+    XENBUS_EVTCHN_GET_PORT      EvtchnGetPort;
+    XENBUS_EVTCHN_CLOSE         EvtchnClose;
+    XENBUS_EVTCHN_GROUP_CREATE  EvtchnGroupCreate;
+    XENBUS_EVTCHN_GROUP_DESTROY EvtchnGroupDestroy;
+    XENBUS_EVTCHN_GROUP_ADD     EvtchnGroupAdd;
+    XENBUS_EVTCHN_GROUP_REMOVE  EvtchnGroupRemove;
+};
+
+/*! \struct _XENBUS_EVTCHN_INTERFACE_V7
+    \brief EVTCHN interface version 7
+    \ingroup interfaces
+*/
+struct _XENBUS_EVTCHN_INTERFACE_V7 {
+    INTERFACE                    Interface;
+    XENBUS_EVTCHN_ACQUIRE        EvtchnAcquire;
+    XENBUS_EVTCHN_RELEASE        EvtchnRelease;
+    XENBUS_EVTCHN_OPEN           EvtchnOpen;
+    XENBUS_EVTCHN_BIND           EvtchnBind;
+    XENBUS_EVTCHN_UNMASK         EvtchnUnmask;
+    XENBUS_EVTCHN_SEND           EvtchnSend;
+    XENBUS_EVTCHN_TRIGGER        EvtchnTrigger;
+    XENBUS_EVTCHN_WAIT           EvtchnWait;
+    XENBUS_EVTCHN_GET_PORT       EvtchnGetPort;
+    XENBUS_EVTCHN_CLOSE          EvtchnClose;
+    XENBUS_EVTCHN_GROUP_CREATE   EvtchnGroupCreate;
+    XENBUS_EVTCHN_GROUP_DESTROY  EvtchnGroupDestroy;
+    XENBUS_EVTCHN_GROUP_ADD      EvtchnGroupAdd;
+    XENBUS_EVTCHN_GROUP_REMOVE   EvtchnGroupRemove;
+    XENBUS_EVTCHN_GET_STATISTICS EvtchnGetStatistics;
+};
+
+/*! \struct _XENBUS_EVTCHN_INTERFACE_V8
+    \brief EVTCHN interface version 8
+    \ingroup interfaces
+*/
+struct _XENBUS_EVTCHN_INTERFACE_V8 {
+    INTERFACE                    Interface;
+    XENBUS_EVTCHN_ACQUIRE        EvtchnAcquire;
+    XENBUS_EVTCHN_RELEASE        EvtchnRelease;
+    XENBUS_EVTCHN_OPEN           EvtchnOpen;
+    XENBUS_EVTCHN_BIND           EvtchnBind;
+    XENBUS_EVTCHN_UNMASK         EvtchnUnmask;
+    XENBUS_EVTCHN_SEND           EvtchnSend;
+    XENBUS_EVTCHN_TRIGGER        EvtchnTrigger;
+    XENBUS_EVTCHN_WAIT           EvtchnWait;
+    XENBUS_EVTCHN_GET_PORT       EvtchnGetPort;
+    XENBUS_EVTCHN_CLOSE          EvtchnClose;
+    XENBUS_EVTCHN_GROUP_CREATE   EvtchnGroupCreate;
+    XENBUS_EVTCHN_GROUP_DESTROY  EvtchnGroupDestroy;
+    XENBUS_EVTCHN_GROUP_ADD      EvtchnGroupAdd;
+    XENBUS_EVTCHN_GROUP_REMOVE   EvtchnGroupRemove;
+    XENBUS_EVTCHN_GET_STATISTICS EvtchnGetStatistics;
+    XENBUS_EVTCHN_SET_PRIORITY   EvtchnSetPriority;
+};
+
+typedef struct _XENBUS_EVTCHN_INTERFACE_V8 XENBUS_EVTCHN_INTERFACE, *PXENBUS_EVTCHN_INTERFACE;
 
 /*! \def XENBUS_EVTCHN
     \brief Macro at assist in method invocation
@@ -319,7 +552,7 @@ typedef struct _XENBUS_EVTCHN_INTERFACE_V5 XENBUS_EVTCHN_INTERFACE, *PXENBUS_EVT
 #endif  // _WINDLL
 
 #define XENBUS_EVTCHN_INTERFACE_VERSION_MIN 1
-#define XENBUS_EVTCHN_INTERFACE_VERSION_MAX 5
+#define XENBUS_EVTCHN_INTERFACE_VERSION_MAX 8
 
 #endif  // _XENBUS_EVTCHN_INTERFACE_H
 
@@ -47,6 +47,18 @@
 #define DEFINE_REVISION_TABLE                                               \
     DEFINE_REVISION(0x08000009,  1,  2,  4,  1,  1,  1,  1,  1,  1,  1),    \
     DEFINE_REVISION(0x0800000A,  1,  2,  5,  1,  1,  1,  1,  1,  1,  1),    \
-    DEFINE_REVISION(0x0800000B,  1,  2,  5,  1,  2,  1,  1,  2,  1,  1)
+    DEFINE_REVISION(0x0800000B,  1,  2,  5,  1,  2,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x0800000C,  1,  2,  5,  1,  3,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x0800000D,  1,  2,  5,  1,  4,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x0800000E,  1,  2,  5,  1,  5,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x0800000F,  1,  2,  5,  1,  6,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000010,  1,  2,  5,  1,  7,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000011,  1,  2,  5,  1,  8,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000012,  1,  2,  5,  1,  9,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000013,  1,  2,  5,  1, 10,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000014,  1,  3,  5,  1, 10,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000015,  1,  3,  6,  1, 10,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000016,  1,  3,  7,  1, 10,  1,  1,  2,  1,  1),    \
+    DEFINE_REVISION(0x08000017,  1,  3,  8,  1, 10,  1,  1,  2,  1,  1)
 
 #endif  // _REVISION_H
@@ -50,6 +50,16 @@ typedef struct _XENBUS_STORE_TRANSACTION    XENBUS_STORE_TRANSACTION, *PXENBUS_S
 */
 typedef struct _XENBUS_STORE_WATCH          XENBUS_STORE_WATCH, *PXENBUS_STORE_WATCH;
 
+/*! \typedef XENBUS_STORE_DIRECTORY
+    \brief XenStore directory iterator handle
+*/
+typedef struct _XENBUS_STORE_DIRECTORY      XENBUS_STORE_DIRECTORY, *PXENBUS_STORE_DIRECTORY;
+
+/*! \typedef XENBUS_STORE_PATH
+    \brief XenStore path handle
+*/
+typedef struct _XENBUS_STORE_PATH           XENBUS_STORE_PATH, *PXENBUS_STORE_PATH;
+
 /*! \typedef XENBUS_STORE_PERMISSION_MASK
     \brief Bitmask of XenStore key permissions
 */
@@ -67,6 +77,15 @@ typedef struct _XENBUS_STORE_PERMISSION {
     XENBUS_STORE_PERMISSION_MASK    Mask;
 } XENBUS_STORE_PERMISSION, *PXENBUS_STORE_PERMISSION;
 
+/*! \typedef XENBUS_STORE_ITEM
+    \brief XenStore key and value, as used by batch methods
+*/
+typedef struct _XENBUS_STORE_ITEM {
+    PCHAR       Node;
+    PCHAR       Value;
+    NTSTATUS    Status;
+} XENBUS_STORE_ITEM, *PXENBUS_STORE_ITEM;
+
 /*! \typedef XENBUS_STORE_ACQUIRE
     \brief Acquire a reference to the STORE interface
 
@@ -286,6 +305,404 @@ typedef NTSTATUS
     IN  ULONG                       NumberPermissions
     );
 
+/*! \typedef XENBUS_STORE_COMPLETION
+    \brief Completion routine for an asynchronous XenStore request
+
+    \param Argument Context \a Argument supplied when the request was
+    submitted
+    \param Status The status of the completed request
+    \param Buffer A memory buffer containing the value read or the NUL
+    separated list of key names (NULL if the request failed or does not
+    return data)
+
+    The completion routine is invoked at DISPATCH_LEVEL. A non-NULL
+    \a Buffer should be freed using \a XENBUS_STORE_FREE
+*/
+typedef VOID
+(*XENBUS_STORE_COMPLETION)(
+    IN  PVOID       Argument,
+    IN  NTSTATUS    Status,
+    IN  PCHAR       Buffer OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_READ_ASYNC
+    \brief Asynchronously read a value from XenStore
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this read is not
+    part of a transaction)
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key to read
+    \param Completion The routine to invoke when the read completes
+    \param Argument An optional context argument passed to \a Completion
+
+    If this method succeeds then \a Completion will be invoked exactly once.
+    If it fails then \a Completion will not be invoked
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_READ_ASYNC)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_WRITE_ASYNC
+    \brief Asynchronously write a value to XenStore
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this write is not
+    part of a transaction)
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key to write
+    \param Value The NUL terminated value to write
+    \param Completion The routine to invoke when the write completes
+    \param Argument An optional context argument passed to \a Completion
+
+    If this method succeeds then \a Completion will be invoked exactly once.
+    If it fails then \a Completion will not be invoked
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_WRITE_ASYNC)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PCHAR                       Value,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_REMOVE_ASYNC
+    \brief Asynchronously remove a key from XenStore
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this removal is not
+    part of a transaction)
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key to remove
+    \param Completion The routine to invoke when the removal completes
+    \param Argument An optional context argument passed to \a Completion
+
+    If this method succeeds then \a Completion will be invoked exactly once.
+    If it fails then \a Completion will not be invoked
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_REMOVE_ASYNC)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_DIRECTORY_ASYNC
+    \brief Asynchronously enumerate all immediate child keys of a XenStore key
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this enumeration is
+    not part of a transaction)
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key to enumerate
+    \param Completion The routine to invoke when the enumeration completes
+    \param Argument An optional context argument passed to \a Completion
+
+    If this method succeeds then \a Completion will be invoked exactly once.
+    If it fails then \a Completion will not be invoked
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_DIRECTORY_ASYNC)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_READ_BATCH
+    \brief Read a number of values from XenStore
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if these reads are not
+    part of a transaction)
+    \param Prefix An optional prefix for the \a Node of each item
+    \param Items An array of items. On entry the \a Node of each item
+    specifies the XenStore key to read. On return the \a Status of each
+    item is set to the outcome of the individual read and, if that
+    succeeded, \a Value points at a memory buffer containing the value read
+    \param Count The number of elements in the \a Items array
+
+    All the reads are queued on the ring before any reply is awaited.
+    If this method fails then no reads were performed. Each non-NULL
+    \a Value should be freed using \a XENBUS_STORE_FREE
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_READ_BATCH)(
+    IN      PINTERFACE                  Interface,
+    IN      PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN      PCHAR                       Prefix OPTIONAL,
+    IN OUT  PXENBUS_STORE_ITEM          Items,
+    IN      ULONG                       Count
+    );
+
+/*! \typedef XENBUS_STORE_WATCH_CALLBACK
+    \brief Watch callback function
+
+    \param Argument The context argument passed to
+    \a XENBUS_STORE_WATCH_ADD_CALLBACK
+    \param Path The XenStore path that fired. If a number of events were
+    coalesced then this is the deepest path that is common to all of them
+*/
+typedef VOID
+(*XENBUS_STORE_WATCH_CALLBACK)(
+    IN  PVOID   Argument,
+    IN  PCHAR   Path
+    );
+
+/*! \typedef XENBUS_STORE_WATCH_ADD_CALLBACK
+    \brief Add a XenStore watch that invokes a callback
+
+    \param Interface The interface header
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key to watch
+    \param Callback The function to invoke when the watch fires
+    \param Argument An optional context argument passed to \a Callback
+    \param Window The period, in milliseconds, from the first event over
+    which further events are coalesced into the same invocation of
+    \a Callback
+    \param Watch A pointer to a watch handle to be initialized
+
+    \a Callback is invoked at PASSIVE_LEVEL and must not remove its own
+    watch. \a XENBUS_STORE_WATCH_REMOVE must be called at PASSIVE_LEVEL for
+    such a watch and will not return while \a Callback is running.
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_WATCH_ADD_CALLBACK)(
+    IN  PINTERFACE                  Interface,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_WATCH_CALLBACK Callback,
+    IN  PVOID                       Argument OPTIONAL,
+    IN  ULONG                       Window,
+    OUT PXENBUS_STORE_WATCH         *Watch
+    );
+
+/*! \typedef XENBUS_STORE_TRANSACTION_BODY
+    \brief Transaction body function
+
+    \param Argument The context argument passed to
+    \a XENBUS_STORE_TRANSACTION_RUN
+    \param Transaction The transaction handle to use for all accesses
+
+    Returning STATUS_SUCCESS causes the transaction to be committed.
+    Returning STATUS_RETRY causes it to be abandoned and the body to be
+    run again. Any other error causes it to be abandoned and the error to
+    be returned.
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_TRANSACTION_BODY)(
+    IN  PVOID                       Argument,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction
+    );
+
+/*! \typedef XENBUS_STORE_TRANSACTION_RUN
+    \brief Run a function within a XenStore transaction
+
+    \param Interface The interface header
+    \param Body The function to run
+    \param Argument An optional context argument passed to \a Body
+
+    \a Body is run within a new transaction, which is committed if
+    \a Body succeeds. If the commit fails because of a conflicting
+    update then, after a bounded exponential backoff, \a Body is run
+    again in a fresh transaction. After a fixed number of attempts
+    STATUS_RETRY is returned. This method must be called below
+    DISPATCH_LEVEL.
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_TRANSACTION_RUN)(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_STORE_TRANSACTION_BODY   Body,
+    IN  PVOID                           Argument OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_HISTOGRAM_RESET
+    \brief Reset the XenStore latency histograms
+
+    \param Interface The interface header
+
+    The histograms record the time from submission of each request to
+    the arrival of its reply, by request type, and the duration of
+    stalls caused by a full request ring. They are shown by the debug
+    interface.
+*/
+typedef VOID
+(*XENBUS_STORE_HISTOGRAM_RESET)(
+    IN  PINTERFACE  Interface
+    );
+
+/*! \typedef XENBUS_STORE_DIRECTORY_OPEN
+    \brief Open an iterator over the children of a XenStore key
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this is not
+    part of a transaction)
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key to enumerate
+    \param Directory A pointer to an iterator handle to be initialized
+    \param Count An optional pointer to a value to be set to the number
+    of children
+
+    The children are read when the iterator is opened. If they do not fit
+    in a single reply they are read in parts, which is repeated if the key
+    changes part way through.
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_DIRECTORY_OPEN)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PXENBUS_STORE_DIRECTORY     *Directory,
+    OUT PULONG                      Count OPTIONAL
+    );
+
+/*! \typedef XENBUS_STORE_DIRECTORY_NEXT
+    \brief Get the name of the next child from a directory iterator
+
+    \param Interface The interface header
+    \param Directory The iterator handle
+    \param Name A pointer to a string pointer to be set to the name of the
+    next child. The string is valid until the iterator is closed and must
+    not be modified.
+    \return STATUS_NO_MORE_ENTRIES when there are no more children
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_DIRECTORY_NEXT)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_STORE_DIRECTORY Directory,
+    OUT PCHAR                   *Name
+    );
+
+/*! \typedef XENBUS_STORE_DIRECTORY_CLOSE
+    \brief Close a directory iterator
+
+    \param Interface The interface header
+    \param Directory The iterator handle
+*/
+typedef VOID
+(*XENBUS_STORE_DIRECTORY_CLOSE)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_STORE_DIRECTORY Directory
+    );
+
+/*! \typedef XENBUS_STORE_WRITE_BATCH
+    \brief Write a number of values to XenStore
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if these writes are not
+    part of a transaction)
+    \param Prefix An optional prefix for the \a Node of each item
+    \param Items An array of items. On entry the \a Node and \a Value of
+    each item specify the XenStore key to write and the value to write to
+    it. On return the \a Status of each item is set to the outcome of the
+    individual write
+    \param Count The number of elements in the \a Items array
+    \return The \a Status of the first item that failed, or STATUS_SUCCESS
+
+    All the writes are queued on the ring before any reply is awaited.
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_WRITE_BATCH)(
+    IN      PINTERFACE                  Interface,
+    IN      PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN      PCHAR                       Prefix OPTIONAL,
+    IN OUT  PXENBUS_STORE_ITEM          Items,
+    IN      ULONG                       Count
+    );
+
+/*! \typedef XENBUS_STORE_PATH_OPEN
+    \brief Format a XenStore path once for repeated use
+
+    \param Interface The interface header
+    \param Prefix An optional prefix for the \a Node
+    \param Node The concatenation of the \a Prefix and this value specifies
+    the XenStore key
+    \param Path A pointer to a path handle to be initialized
+
+    The path handle should be closed using \a XENBUS_STORE_PATH_CLOSE
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_PATH_OPEN)(
+    IN  PINTERFACE          Interface,
+    IN  PCHAR               Prefix OPTIONAL,
+    IN  PCHAR               Node,
+    OUT PXENBUS_STORE_PATH  *Path
+    );
+
+/*! \typedef XENBUS_STORE_PATH_CLOSE
+    \brief Close a path handle
+
+    \param Interface The interface header
+    \param Path The path handle
+*/
+typedef VOID
+(*XENBUS_STORE_PATH_CLOSE)(
+    IN  PINTERFACE          Interface,
+    IN  PXENBUS_STORE_PATH  Path
+    );
+
+/*! \typedef XENBUS_STORE_PATH_READ
+    \brief Read a value from XenStore using a path handle
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this read is not
+    part of a transaction)
+    \param Path The path handle
+    \param Buffer A pointer to a pointer that will be initialized with a
+    memory buffer containing the value read
+
+    The \a Buffer should be freed using \a XENBUS_STORE_FREE
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_PATH_READ)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    OUT PCHAR                       *Buffer
+    );
+
+/*! \typedef XENBUS_STORE_PATH_PRINTF
+    \brief Write a value to XenStore using a path handle
+
+    \param Interface The interface header
+    \param Transaction The transaction handle (NULL if this write is not
+    part of a transaction)
+    \param Path The path handle
+    \param Format A format specifier
+    \param ... Additional parameters required by \a Format
+
+    If the key does not exist then it is created
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_PATH_PRINTF)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    IN  const CHAR                  *Format,
+    ...
+    );
+
 // {86824C3B-D34E-4753-B281-2F1E3AD214D7}
 DEFINE_GUID(GUID_XENBUS_STORE_INTERFACE,
 0x86824c3b, 0xd34e, 0x4753, 0xb2, 0x81, 0x2f, 0x1e, 0x3a, 0xd2, 0x14, 0xd7);
@@ -331,7 +748,244 @@ struct _XENBUS_STORE_INTERFACE_V2 {
     XENBUS_STORE_POLL               StorePoll;
 };
 
-typedef struct _XENBUS_STORE_INTERFACE_V2 XENBUS_STORE_INTERFACE, *PXENBUS_STORE_INTERFACE;
+/*! \struct _XENBUS_STORE_INTERFACE_V3
+    \brief STORE interface version 3
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V3 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V4
+    \brief STORE interface version 4
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V4 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V5
+    \brief STORE interface version 5
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V5 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+    XENBUS_STORE_WATCH_ADD_CALLBACK StoreWatchAddCallback;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V6
+    \brief STORE interface version 6
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V6 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+    XENBUS_STORE_WATCH_ADD_CALLBACK StoreWatchAddCallback;
+    XENBUS_STORE_TRANSACTION_RUN    StoreTransactionRun;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V7
+    \brief STORE interface version 7
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V7 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+    XENBUS_STORE_WATCH_ADD_CALLBACK StoreWatchAddCallback;
+    XENBUS_STORE_TRANSACTION_RUN    StoreTransactionRun;
+    XENBUS_STORE_HISTOGRAM_RESET    StoreHistogramReset;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V8
+    \brief STORE interface version 8
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V8 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+    XENBUS_STORE_WATCH_ADD_CALLBACK StoreWatchAddCallback;
+    XENBUS_STORE_TRANSACTION_RUN    StoreTransactionRun;
+    XENBUS_STORE_HISTOGRAM_RESET    StoreHistogramReset;
+    XENBUS_STORE_DIRECTORY_OPEN     StoreDirectoryOpen;
+    XENBUS_STORE_DIRECTORY_NEXT     StoreDirectoryNext;
+    XENBUS_STORE_DIRECTORY_CLOSE    StoreDirectoryClose;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V9
+    \brief STORE interface version 9
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V9 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+    XENBUS_STORE_WATCH_ADD_CALLBACK StoreWatchAddCallback;
+    XENBUS_STORE_TRANSACTION_RUN    StoreTransactionRun;
+    XENBUS_STORE_HISTOGRAM_RESET    StoreHistogramReset;
+    XENBUS_STORE_DIRECTORY_OPEN     StoreDirectoryOpen;
+    XENBUS_STORE_DIRECTORY_NEXT     StoreDirectoryNext;
+    XENBUS_STORE_DIRECTORY_CLOSE    StoreDirectoryClose;
+    XENBUS_STORE_WRITE_BATCH        StoreWriteBatch;
+};
+
+/*! \struct _XENBUS_STORE_INTERFACE_V10
+    \brief STORE interface version 10
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V10 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_READ_ASYNC         StoreReadAsync;
+    XENBUS_STORE_WRITE_ASYNC        StoreWriteAsync;
+    XENBUS_STORE_REMOVE_ASYNC       StoreRemoveAsync;
+    XENBUS_STORE_DIRECTORY_ASYNC    StoreDirectoryAsync;
+    XENBUS_STORE_READ_BATCH         StoreReadBatch;
+    XENBUS_STORE_WATCH_ADD_CALLBACK StoreWatchAddCallback;
+    XENBUS_STORE_TRANSACTION_RUN    StoreTransactionRun;
+    XENBUS_STORE_HISTOGRAM_RESET    StoreHistogramReset;
+    XENBUS_STORE_DIRECTORY_OPEN     StoreDirectoryOpen;
+    XENBUS_STORE_DIRECTORY_NEXT     StoreDirectoryNext;
+    XENBUS_STORE_DIRECTORY_CLOSE    StoreDirectoryClose;
+    XENBUS_STORE_WRITE_BATCH        StoreWriteBatch;
+    XENBUS_STORE_PATH_OPEN          StorePathOpen;
+    XENBUS_STORE_PATH_CLOSE         StorePathClose;
+    XENBUS_STORE_PATH_READ          StorePathRead;
+    XENBUS_STORE_PATH_PRINTF        StorePathPrintf;
+};
+
+typedef struct _XENBUS_STORE_INTERFACE_V10 XENBUS_STORE_INTERFACE, *PXENBUS_STORE_INTERFACE;
 
 /*! \def XENBUS_STORE
     \brief Macro at assist in method invocation
@@ -342,7 +996,7 @@ typedef struct _XENBUS_STORE_INTERFACE_V2 XENBUS_STORE_INTERFACE, *PXENBUS_STORE
 #endif  // _WINDLL
 
 #define XENBUS_STORE_INTERFACE_VERSION_MIN  1
-#define XENBUS_STORE_INTERFACE_VERSION_MAX  2
+#define XENBUS_STORE_INTERFACE_VERSION_MAX  10
 
 #endif  // _XENBUS_STORE_INTERFACE_H
 
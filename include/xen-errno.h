@@ -101,6 +101,10 @@
                 _status = STATUS_PIPE_CONNECTED;            \
                 break;                                      \
                                                             \
+            case E2BIG:                                     \
+                _status = STATUS_BUFFER_OVERFLOW;           \
+                break;                                      \
+                                                            \
             case EPERM:                                     \
                 _status = STATUS_ACCESS_DENIED;             \
                 break;                                      \
@@ -234,6 +234,14 @@ EventChannelUnmask(
     IN  ULONG   LocalPort
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelSetPriority(
+    IN  ULONG   LocalPort,
+    IN  ULONG   Priority
+    );
+
 // GRANT TABLE
 
 __checkReturn
@@ -385,3 +385,33 @@ fail1:
 
     return status;
 }
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelSetPriority(
+    IN  ULONG                   LocalPort,
+    IN  ULONG                   Priority
+    )
+{
+    struct evtchn_set_priority  op;
+    LONG_PTR                    rc;
+    NTSTATUS                    status;
+
+    op.port = LocalPort;
+    op.priority = Priority;
+
+    rc = EventChannelOp(EVTCHNOP_set_priority, &op);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
@@ -32,14 +32,15 @@
 #include <ntddk.h>
 #include <procgrp.h>
 #include <stdarg.h>
+#include <ntstrsafe.h>
 #include <xen.h>
 
 #include "evtchn.h"
 #include "evtchn_2l.h"
 #include "evtchn_fifo.h"
 #include "fdo.h"
-#include "hash_table.h"
 #include "registry.h"
+#include "thread.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -70,33 +71,102 @@ typedef struct _XENBUS_EVTCHN_PARAMETERS {
 
 #pragma warning(pop)
 
+#define XENBUS_EVTCHN_GROUP_MAGIC   'PURG'
+
+struct _XENBUS_EVTCHN_GROUP {
+    ULONG                           Magic;
+    LIST_ENTRY                      ListEntry;
+    PVOID                           Caller;
+    XENBUS_EVTCHN_GROUP_CALLBACK    Callback;
+    PVOID                           Argument;
+    LONG                            Members;
+    LONG                            Deliveries;
+};
+
 #define XENBUS_EVTCHN_CHANNEL_MAGIC 'NAHC'
 
+// A waiter lives on the stack of a thread blocked in EvtchnWait(). It is
+// linked on the context WaitList, under the channel lock, and signalled
+// from EvtchnDpc() once the channel's event count moves past Events.
+typedef struct _XENBUS_EVTCHN_WAITER {
+    LIST_ENTRY              ListEntry;
+    PXENBUS_EVTCHN_CHANNEL  Channel;
+    ULONG                   Events;
+    KEVENT                  Event;
+} XENBUS_EVTCHN_WAITER, *PXENBUS_EVTCHN_WAITER;
+
 struct _XENBUS_EVTCHN_CHANNEL {
+    SLIST_ENTRY                 PendingListEntry;
+    LONG                        Pending;
     ULONG                       Magic;
     KSPIN_LOCK                  Lock;
     LIST_ENTRY                  ListEntry;
-    LIST_ENTRY                  PendingListEntry;
     PVOID                       Caller;
     PKSERVICE_ROUTINE           Callback;
     PVOID                       Argument;
+    PXENBUS_EVTCHN_GROUP        Group;
     BOOLEAN                     Active; // Must be tested at >= DISPATCH_LEVEL
     ULONG                       Events;
+    LONG                        Waiters;
     XENBUS_EVTCHN_TYPE          Type;
     XENBUS_EVTCHN_PARAMETERS    Parameters;
     BOOLEAN                     Mask;
     ULONG                       LocalPort;
     PROCESSOR_NUMBER            ProcNumber;
+    BOOLEAN                     Pinned;
+    ULONG                       BalanceEvents;
+    ULONG                       BalanceDelta;
     BOOLEAN                     Closed;
+    BOOLEAN                     Lost;   // Port went away across suspend
+    BOOLEAN                     Polled;
+    ULONG                       PollIdle;
+    ULONGLONG                   RateStart;
+    ULONG                       RateEvents;
+    XENBUS_EVTCHN_STATISTICS    Statistics;
+    LONGLONG                    StatisticsStart;
+    ULONG                       StatisticsEvents;
+    LONGLONG                    MaskStart;
 };
 
+// Channels are pushed onto a processor's PendingList by any CPU (upcall,
+// EvtchnTrigger) without taking a lock. Only the owning CPU pops them, with
+// its interrupt lock held, so the list has a single consumer.
 typedef struct _XENBUS_EVTCHN_PROCESSOR {
+    SLIST_HEADER        PendingList;
     PXENBUS_INTERRUPT   Interrupt;
-    LIST_ENTRY          PendingList;
     KDPC                Dpc;
+    ULONG               PollCount;
+    ULONG               PollRounds;
+    BOOLEAN             PollYield;
+    LONG                Wake;
+    LONGLONG            Ticks;
+    LONGLONG            BalanceTicks;
     BOOLEAN             UpcallEnabled;
 } XENBUS_EVTCHN_PROCESSOR, *PXENBUS_EVTCHN_PROCESSOR;
 
+// A processor's DPC holds its guard while it uses the processor state so
+// that EvtchnRelease() can wait for it without the DPC having to take the
+// context lock. Guards live as long as the context, and each has a cache
+// line to itself.
+typedef struct _XENBUS_EVTCHN_GUARD {
+    LONG    Count;
+    UCHAR   Pad[64 - sizeof (LONG)];
+} XENBUS_EVTCHN_GUARD, *PXENBUS_EVTCHN_GUARD;
+
+C_ASSERT(XENBUS_EVTCHN_PRIORITY_HIGHEST == EVTCHN_FIFO_PRIORITY_MAX);
+C_ASSERT(XENBUS_EVTCHN_PRIORITY_DEFAULT == EVTCHN_FIFO_PRIORITY_DEFAULT);
+C_ASSERT(XENBUS_EVTCHN_PRIORITY_LOWEST == EVTCHN_FIFO_PRIORITY_MIN);
+
+//
+// Ports map to channels through a two-level table. The root is part of
+// the context and each leaf is a page of channel pointers that is only
+// allocated when a port in its range is first opened. Leaves are not
+// freed until teardown so the upcall path can walk the table without
+// taking a lock.
+//
+#define XENBUS_EVTCHN_PORT_LEAF_COUNT   (PAGE_SIZE / sizeof (PXENBUS_EVTCHN_CHANNEL))
+#define XENBUS_EVTCHN_PORT_ROOT_COUNT   (EVTCHN_FIFO_NR_CHANNELS / XENBUS_EVTCHN_PORT_LEAF_COUNT)
+
 struct _XENBUS_EVTCHN_CONTEXT {
     PXENBUS_FDO                     Fdo;
     KSPIN_LOCK                      Lock;
@@ -104,6 +174,8 @@ struct _XENBUS_EVTCHN_CONTEXT {
     PXENBUS_INTERRUPT               Interrupt;
     PXENBUS_EVTCHN_PROCESSOR        Processor;
     ULONG                           ProcessorCount;
+    PXENBUS_EVTCHN_GUARD            Guard;
+    ULONG                           GuardCount;
     XENBUS_SUSPEND_INTERFACE        SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK        SuspendCallbackEarly;
     PXENBUS_SUSPEND_CALLBACK        SuspendCallbackLate;
@@ -114,8 +186,16 @@ struct _XENBUS_EVTCHN_CONTEXT {
     PXENBUS_EVTCHN_ABI_CONTEXT      EvtchnFifoContext;
     XENBUS_EVTCHN_ABI               EvtchnAbi;
     BOOLEAN                         UseEvtchnFifoAbi;
-    PXENBUS_HASH_TABLE              Table;
+    ULONG                           PollThreshold;
+    ULONG                           BalancePeriod;
+    BOOLEAN                         Statistics;
+    LARGE_INTEGER                   Frequency;
+    PXENBUS_THREAD                  BalanceThread;
+    PXENBUS_EVTCHN_CHANNEL          *PortTable[XENBUS_EVTCHN_PORT_ROOT_COUNT];
+    KSPIN_LOCK                      ChannelLock;    // List and WaitList
     LIST_ENTRY                      List;
+    LIST_ENTRY                      GroupList;
+    LIST_ENTRY                      WaitList;
 };
 
 #define XENBUS_EVTCHN_TAG  'CTVE'
@@ -136,6 +216,118 @@ __EvtchnFree(
     ExFreePoolWithTag(Buffer, XENBUS_EVTCHN_TAG);
 }
 
+static NTSTATUS
+EvtchnPortAdd(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    ULONG                       Root;
+    PXENBUS_EVTCHN_CHANNEL      *Leaf;
+    NTSTATUS                    status;
+
+    Root = Port / XENBUS_EVTCHN_PORT_LEAF_COUNT;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Root >= XENBUS_EVTCHN_PORT_ROOT_COUNT)
+        goto fail1;
+
+    Leaf = Context->PortTable[Root];
+    if (Leaf == NULL) {
+        PXENBUS_EVTCHN_CHANNEL  *New;
+
+        New = __EvtchnAllocate(PAGE_SIZE);
+
+        status = STATUS_NO_MEMORY;
+        if (New == NULL)
+            goto fail2;
+
+        Leaf = InterlockedCompareExchangePointer((PVOID *)&Context->PortTable[Root],
+                                                 New,
+                                                 NULL);
+        if (Leaf == NULL) {
+            Leaf = New;
+        } else {
+            // Somebody beat us to it
+            __EvtchnFree(New);
+        }
+    }
+
+    ASSERT3P(Leaf[Port % XENBUS_EVTCHN_PORT_LEAF_COUNT], ==, NULL);
+    (VOID) InterlockedExchangePointer((PVOID *)&Leaf[Port % XENBUS_EVTCHN_PORT_LEAF_COUNT],
+                                      Channel);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+EvtchnPortRemove(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    ULONG                       Root;
+    PXENBUS_EVTCHN_CHANNEL      *Leaf;
+
+    Root = Port / XENBUS_EVTCHN_PORT_LEAF_COUNT;
+    ASSERT3U(Root, <, XENBUS_EVTCHN_PORT_ROOT_COUNT);
+
+    Leaf = Context->PortTable[Root];
+    ASSERT(Leaf != NULL);
+
+    ASSERT(Leaf[Port % XENBUS_EVTCHN_PORT_LEAF_COUNT] != NULL);
+    (VOID) InterlockedExchangePointer((PVOID *)&Leaf[Port % XENBUS_EVTCHN_PORT_LEAF_COUNT],
+                                      NULL);
+}
+
+static FORCEINLINE PXENBUS_EVTCHN_CHANNEL
+__EvtchnPortLookup(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    ULONG                       Root;
+    PXENBUS_EVTCHN_CHANNEL      *Leaf;
+
+    Root = Port / XENBUS_EVTCHN_PORT_LEAF_COUNT;
+    if (Root >= XENBUS_EVTCHN_PORT_ROOT_COUNT)
+        return NULL;
+
+    Leaf = *(PXENBUS_EVTCHN_CHANNEL * volatile *)&Context->PortTable[Root];
+    if (Leaf == NULL)
+        return NULL;
+
+    return *(PXENBUS_EVTCHN_CHANNEL volatile *)&Leaf[Port % XENBUS_EVTCHN_PORT_LEAF_COUNT];
+}
+
+static VOID
+EvtchnPortTableFree(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Root;
+
+    for (Root = 0; Root < XENBUS_EVTCHN_PORT_ROOT_COUNT; Root++) {
+        PXENBUS_EVTCHN_CHANNEL  *Leaf = Context->PortTable[Root];
+
+        if (Leaf == NULL)
+            continue;
+
+        ASSERT(IsZeroMemory(Leaf, PAGE_SIZE));
+        __EvtchnFree(Leaf);
+        Context->PortTable[Root] = NULL;
+    }
+}
+
 static NTSTATUS
 EvtchnOpenFixed(
     IN  PXENBUS_EVTCHN_CHANNEL  Channel,
@@ -320,25 +512,21 @@ EvtchnOpen(
 
     Trace("%u\n", LocalPort);
 
-    InitializeListHead(&Channel->PendingListEntry);
-
     status = XENBUS_EVTCHN_ABI(PortEnable,
                                &Context->EvtchnAbi,
                                LocalPort);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    status = HashTableAdd(Context->Table,
-                          LocalPort,
-                          (ULONG_PTR)Channel);
+    status = EvtchnPortAdd(Context, LocalPort, Channel);
     if (!NT_SUCCESS(status))
         goto fail4;
 
     Channel->Active = TRUE;
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    KeAcquireSpinLockAtDpcLevel(&Context->ChannelLock);
     InsertTailList(&Context->List, &Channel->ListEntry);
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    KeReleaseSpinLockFromDpcLevel(&Context->ChannelLock);
 
     KeLowerIrql(Irql);
 
@@ -356,8 +544,7 @@ fail4:
 fail3:
     Error("fail3\n");
 
-    ASSERT(IsListEmpty(&Channel->PendingListEntry));
-    RtlZeroMemory(&Channel->PendingListEntry, sizeof (LIST_ENTRY));
+    ASSERT3U(Channel->Pending, ==, 0);
 
     Channel->LocalPort = 0;
     Channel->Mask = FALSE;
@@ -405,6 +592,7 @@ EvtchnReap(
 
     ASSERT(Channel->Closed);
     Channel->Closed = FALSE;
+    Channel->Lost = FALSE;
 
     RtlZeroMemory(&Channel->Lock, sizeof (KSPIN_LOCK));
 
@@ -413,8 +601,24 @@ EvtchnReap(
 
     RtlZeroMemory(&Channel->ProcNumber, sizeof (PROCESSOR_NUMBER));
 
-    ASSERT(IsListEmpty(&Channel->PendingListEntry));
-    RtlZeroMemory(&Channel->PendingListEntry, sizeof (LIST_ENTRY));
+    ASSERT3P(Channel->Group, ==, NULL);
+
+    Channel->Pinned = FALSE;
+    Channel->BalanceEvents = 0;
+    Channel->BalanceDelta = 0;
+
+    ASSERT(!Channel->Polled);
+    Channel->PollIdle = 0;
+    Channel->RateStart = 0;
+    Channel->RateEvents = 0;
+
+    RtlZeroMemory(&Channel->Statistics, sizeof (XENBUS_EVTCHN_STATISTICS));
+    Channel->StatisticsStart = 0;
+    Channel->StatisticsEvents = 0;
+    Channel->MaskStart = 0;
+
+    ASSERT3U(Channel->Pending, ==, 0);
+    RtlZeroMemory(&Channel->PendingListEntry, sizeof (SLIST_ENTRY));
 
     Channel->LocalPort = 0;
     Channel->Mask = FALSE;
@@ -435,6 +639,36 @@ EvtchnReap(
     __EvtchnFree(Channel);
 }
 
+// Returns TRUE if the channel was not already queued
+static FORCEINLINE BOOLEAN
+__EvtchnQueue(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel
+    )
+{
+    if (InterlockedExchange(&Channel->Pending, 1) != 0)
+        return FALSE;
+
+    (VOID) InterlockedPushEntrySList(&Processor->PendingList,
+                                     &Channel->PendingListEntry);
+    return TRUE;
+}
+
+// Give up the channel's place on a PendingList. EvtchnClose() leaves a
+// channel that it finds queued to whoever holds it, so if it has been
+// closed meanwhile then queue it again to be reaped.
+static FORCEINLINE VOID
+__EvtchnUnqueue(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel
+    )
+{
+    (VOID) InterlockedExchange(&Channel->Pending, 0);
+
+    if (Channel->Closed && __EvtchnQueue(Processor, Channel))
+        KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+}
+
 static BOOLEAN
 EvtchnPollCallback(
     IN  PVOID                   Argument,
@@ -445,8 +679,6 @@ EvtchnPollCallback(
     ULONG                       Index;
     PXENBUS_EVTCHN_PROCESSOR    Processor;
     PXENBUS_EVTCHN_CHANNEL      Channel;
-    BOOLEAN                     Pending;
-    NTSTATUS                    status;
 
     ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
     Index = KeGetCurrentProcessorNumberEx(NULL);
@@ -454,86 +686,516 @@ EvtchnPollCallback(
     ASSERT3U(Index, <, Context->ProcessorCount);
     Processor = &Context->Processor[Index];
 
-    status = HashTableLookup(Context->Table,
-                             LocalPort,
-                             (PULONG_PTR)&Channel);
-    if (!NT_SUCCESS(status))
+    Channel = __EvtchnPortLookup(Context, LocalPort);
+    if (Channel == NULL)
         goto done;
 
     ASSERT3U(Channel->LocalPort, ==, LocalPort);
 
-    Pending = !IsListEmpty(&Channel->PendingListEntry);
-
-    if (!Pending)
-        InsertTailList(&Processor->PendingList,
-                       &Channel->PendingListEntry);
+    (VOID) __EvtchnQueue(Processor, Channel);
 
 done:
     return FALSE;
 }
 
+#define TIME_US(_us)        ((_us) * 10)
+#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
+#define TIME_S(_s)          (TIME_MS((_s) * 1000))
+#define TIME_RELATIVE(_t)   (-(_t))
+
+#define XENBUS_EVTCHN_POLL_WINDOW   TIME_MS(10)
+#define XENBUS_EVTCHN_POLL_IDLE     4   // Idle passes before unmasking
+#define XENBUS_EVTCHN_POLL_BUDGET   64  // DPC passes before yielding
+
+//
+// A channel whose event rate exceeds Context->PollThreshold is left
+// masked and is serviced from the processor's DPC instead, which keeps
+// re-queuing itself while any channel is being polled. Once a channel
+// has been seen idle for XENBUS_EVTCHN_POLL_IDLE consecutive passes it
+// is unmasked and goes back to taking upcalls. So that the processor
+// can drop below DISPATCH_LEVEL, every channel goes back to taking
+// upcalls after XENBUS_EVTCHN_POLL_BUDGET passes; any that are still
+// busy are polled again once their rate has been re-sampled. Auto-masked channels are
+// never polled since their owners already control when they are
+// unmasked, and neither are group members since polling would bypass
+// the group callback.
+//
+// All of this state is only touched by the owning processor with its
+// interrupt lock held.
+//
+
+static VOID
+EvtchnPollSample(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel
+    )
+{
+    ULONGLONG                       Now;
+    ULONGLONG                       Delta;
+    ULONGLONG                       Rate;
+
+    Channel->RateEvents++;
+
+    Now = KeQueryInterruptTime();
+    Delta = Now - Channel->RateStart;
+
+    if (Delta < XENBUS_EVTCHN_POLL_WINDOW)
+        return;
+
+    Rate = ((ULONGLONG)Channel->RateEvents * TIME_S(1)) / Delta;
+
+    Channel->RateStart = Now;
+    Channel->RateEvents = 0;
+
+    if (Rate < Context->PollThreshold ||
+        Channel->Mask ||
+        Channel->Group != NULL ||
+        Processor->PollYield)
+        return;
+
+    // The channel stays queued for as long as it is polled
+    if (!__EvtchnQueue(Processor, Channel))
+        return;
+
+    Channel->Polled = TRUE;
+    Channel->PollIdle = 0;
+
+    XENBUS_EVTCHN_ABI(PortMask,
+                      &Context->EvtchnAbi,
+                      Channel->LocalPort);
+
+    if (Processor->PollCount++ == 0)
+        KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+}
+
+static VOID
+EvtchnPollStop(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel,
+    IN  BOOLEAN                     Unmask
+    )
+{
+    ULONG                           LocalPort = Channel->LocalPort;
+
+    ASSERT(Channel->Polled);
+    Channel->Polled = FALSE;
+    Channel->PollIdle = 0;
+
+    ASSERT(Processor->PollCount != 0);
+    --Processor->PollCount;
+
+    if (!Unmask)
+        return;
+
+    __EvtchnUnqueue(Processor, Channel);
+
+    if (XENBUS_EVTCHN_ABI(PortUnmask,
+                          &Context->EvtchnAbi,
+                          LocalPort)) {
+        XENBUS_EVTCHN_ABI(PortMask,
+                          &Context->EvtchnAbi,
+                          LocalPort);
+        (VOID) EventChannelUnmask(LocalPort);
+    }
+}
+
+static VOID
+EvtchnHistogramRecord(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PULONG                  Histogram,
+    IN  LONGLONG                Ticks
+    )
+{
+    ULONGLONG                   Microseconds;
+    ULONG                       Bucket;
+
+    if (Ticks < 0)
+        Ticks = 0;
+
+    Microseconds = ((ULONGLONG)Ticks * 1000000) /
+                   (ULONGLONG)Context->Frequency.QuadPart;
+
+    // Bucket N counts latencies below 2^(N+1) microseconds
+    Bucket = 0;
+    while (Microseconds > 1 &&
+           Bucket < XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT - 1) {
+        Microseconds >>= 1;
+        Bucket++;
+    }
+
+    Histogram[Bucket]++;
+}
+
+static LONGLONG
+EvtchnStatisticsDispatch(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  LONGLONG                Upcall
+    )
+{
+    LARGE_INTEGER               Now;
+    LONGLONG                    Delta;
+
+    Now = KeQueryPerformanceCounter(NULL);
+
+    EvtchnHistogramRecord(Context,
+                          Channel->Statistics.Dispatch,
+                          Now.QuadPart - Upcall);
+
+    Channel->StatisticsEvents++;
+
+    Delta = Now.QuadPart - Channel->StatisticsStart;
+    if (Delta >= Context->Frequency.QuadPart) {
+        Channel->Statistics.Rate =
+            (ULONG)(((ULONGLONG)Channel->StatisticsEvents *
+                     (ULONGLONG)Context->Frequency.QuadPart) /
+                    (ULONGLONG)Delta);
+
+        Channel->StatisticsStart = Now.QuadPart;
+        Channel->StatisticsEvents = 0;
+    }
+
+    return Now.QuadPart;
+}
+
+static VOID
+EvtchnStatisticsCallback(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  LONGLONG                Start
+    )
+{
+    LARGE_INTEGER               Now;
+
+    Now = KeQueryPerformanceCounter(NULL);
+
+    EvtchnHistogramRecord(Context,
+                          Channel->Statistics.Callback,
+                          Now.QuadPart - Start);
+}
+
+static BOOLEAN
+EvtchnPollChannel(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel,
+    IN  LONGLONG                    Upcall
+    )
+{
+    BOOLEAN                         DoneSomething;
+
+    ASSERT(Channel->Polled);
+
+    // Joined a group since polling started; any pending event will be
+    // re-raised by the unmask
+    if (Channel->Group != NULL) {
+        EvtchnPollStop(Context, Processor, Channel, TRUE);
+        return FALSE;
+    }
+
+    if (!Channel->Active) {
+        // Lost across suspend; the port must not be touched
+        EvtchnPollStop(Context, Processor, Channel, FALSE);
+        __EvtchnUnqueue(Processor, Channel);
+        return FALSE;
+    }
+
+    DoneSomething = FALSE;
+
+    if (XENBUS_EVTCHN_ABI(PortIsPending,
+                          &Context->EvtchnAbi,
+                          Channel->LocalPort)) {
+        LONGLONG    Start;
+
+        Channel->Events++;
+        Channel->PollIdle = 0;
+
+        XENBUS_EVTCHN_ABI(PortAck,
+                          &Context->EvtchnAbi,
+                          Channel->LocalPort);
+
+        Start = (Context->Statistics) ?
+                EvtchnStatisticsDispatch(Context, Channel, Upcall) :
+                0;
+
+#pragma warning(suppress:6387)  // NULL argument
+        DoneSomething = Channel->Callback(NULL, Channel->Argument);
+
+        if (Context->Statistics)
+            EvtchnStatisticsCallback(Context, Channel, Start);
+    } else if (++Channel->PollIdle == XENBUS_EVTCHN_POLL_IDLE) {
+        EvtchnPollStop(Context, Processor, Channel, TRUE);
+        return FALSE;
+    }
+
+    if (Processor->PollYield) {
+        EvtchnPollStop(Context, Processor, Channel, TRUE);
+        return DoneSomething;
+    }
+
+    (VOID) InterlockedPushEntrySList(&Processor->PendingList,
+                                     &Channel->PendingListEntry);
+
+    return DoneSomething;
+}
+
+#define XENBUS_EVTCHN_GROUP_BATCH   16
+
+static BOOLEAN
+EvtchnGroupDeliver(
+    IN  PXENBUS_EVTCHN_GROUP    *Group,
+    IN  PVOID                   *Argument,
+    IN  ULONG                   Count
+    )
+{
+    PVOID                       Members[XENBUS_EVTCHN_GROUP_BATCH];
+    BOOLEAN                     DoneSomething;
+    ULONG                       Index;
+
+    ASSERT3U(Count, <=, XENBUS_EVTCHN_GROUP_BATCH);
+
+    DoneSomething = FALSE;
+
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_EVTCHN_GROUP    Current = Group[Index];
+        ULONG                   Next;
+        ULONG                   Found;
+
+        if (Current == NULL)
+            continue;
+
+        ASSERT3U(Current->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+        // Gather every member of this group from the rest of the batch
+        Found = 0;
+        for (Next = Index; Next < Count; Next++) {
+            if (Group[Next] != Current)
+                continue;
+
+            Members[Found++] = Argument[Next];
+            Group[Next] = NULL;
+        }
+
+        (VOID) InterlockedIncrement(&Current->Deliveries);
+
+        DoneSomething |= Current->Callback(Current->Argument,
+                                           Members,
+                                           Found);
+    }
+
+    return DoneSomething;
+}
+
 static BOOLEAN
 EvtchnPoll(
     IN  PXENBUS_EVTCHN_CONTEXT  Context,
     IN  ULONG                   Index,
-    IN  PLIST_ENTRY             List
+    IN  PSLIST_ENTRY            *Closed OPTIONAL
     )
 {
     PXENBUS_EVTCHN_PROCESSOR    Processor;
     BOOLEAN                     DoneSomething;
-    PLIST_ENTRY                 ListEntry;
+    PSLIST_ENTRY                ListEntry;
+    PSLIST_ENTRY                Head;
+    PXENBUS_EVTCHN_GROUP        Group[XENBUS_EVTCHN_GROUP_BATCH];
+    PVOID                       Argument[XENBUS_EVTCHN_GROUP_BATCH];
+    ULONG                       Count;
+    BOOLEAN                     Wake;
+    BOOLEAN                     Reap;
+    LARGE_INTEGER               Start;
 
     ASSERT3U(Index, <, Context->ProcessorCount);
     Processor = &Context->Processor[Index];
 
+    // Only statistics need to know when the upcall arrived
+    Start.QuadPart = 0;
+    if (Context->Statistics)
+        Start = KeQueryPerformanceCounter(NULL);
+
     (VOID) XENBUS_EVTCHN_ABI(Poll,
                              &Context->EvtchnAbi,
                              Index,
                              EvtchnPollCallback,
                              Context);
 
+    ListEntry = InterlockedFlushSList(&Processor->PendingList);
+
+    // The list is LIFO so reverse it to service channels in the order
+    // in which they became pending
+    Head = NULL;
+    while (ListEntry != NULL) {
+        PSLIST_ENTRY    Next = ListEntry->Next;
+
+        ListEntry->Next = Head;
+        Head = ListEntry;
+        ListEntry = Next;
+    }
+
     DoneSomething = FALSE;
+    Wake = FALSE;
+    Reap = FALSE;
+    Count = 0;
 
-    ListEntry = Processor->PendingList.Flink;
-    while (ListEntry != &Processor->PendingList) {
-        PLIST_ENTRY             Next = ListEntry->Flink;
+    while (Head != NULL) {
         PXENBUS_EVTCHN_CHANNEL  Channel;
+        LONGLONG                Dispatched;
+
+        ListEntry = Head;
+        Head = ListEntry->Next;
+        ListEntry->Next = NULL;
 
         Channel = CONTAINING_RECORD(ListEntry,
                                     XENBUS_EVTCHN_CHANNEL,
                                     PendingListEntry);
 
         ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+        ASSERT3U(Channel->Pending, !=, 0);
 
         KeMemoryBarrier();
-        if (!Channel->Closed) {
+        if (Channel->Polled && !Channel->Closed) {
+            DoneSomething |= EvtchnPollChannel(Context,
+                                               Processor,
+                                               Channel,
+                                               Start.QuadPart);
+
+            KeMemoryBarrier();
+            if (Channel->Waiters != 0)
+                Wake = TRUE;
+        } else if (!Channel->Closed) {
             Channel->Events++;
 
-            RemoveEntryList(&Channel->PendingListEntry);
-            InitializeListHead(&Channel->PendingListEntry);
+            // Pairs with the increment in EvtchnWaitBlocking()
+            KeMemoryBarrier();
+            if (Channel->Waiters != 0)
+                Wake = TRUE;
+
+            // Allow the channel to be queued again while the callback runs
+            __EvtchnUnqueue(Processor, Channel);
 
-            if (Channel->Mask)
+            if (Channel->Mask) {
                 XENBUS_EVTCHN_ABI(PortMask,
                                   &Context->EvtchnAbi,
                                   Channel->LocalPort);
 
+                if (Context->Statistics) {
+                    LARGE_INTEGER   Now;
+
+                    Now = KeQueryPerformanceCounter(NULL);
+                    Channel->MaskStart = Now.QuadPart;
+                }
+            }
+
             XENBUS_EVTCHN_ABI(PortAck,
                               &Context->EvtchnAbi,
                               Channel->LocalPort);
 
+            Dispatched = (Context->Statistics) ?
+                         EvtchnStatisticsDispatch(Context,
+                                                  Channel,
+                                                  Start.QuadPart) :
+                         0;
+
+            // EvtchnGroupRemove() synchronizes with the interrupt lock
+            // we hold, so the group cannot go away before delivery
+            Group[Count] = Channel->Group;
+            if (Group[Count] != NULL) {
+                Argument[Count] = Channel->Argument;
+
+                if (++Count == XENBUS_EVTCHN_GROUP_BATCH) {
+                    DoneSomething |= EvtchnGroupDeliver(Group, Argument, Count);
+                    Count = 0;
+                }
+
+                continue;
+            }
+
 #pragma warning(suppress:6387)  // NULL argument
             DoneSomething |= Channel->Callback(NULL, Channel->Argument);
-        } else if (List != NULL) {
-            RemoveEntryList(&Channel->PendingListEntry);
-            InsertTailList(List, &Channel->PendingListEntry);
-        }
 
-        ListEntry = Next;
+            if (Context->Statistics)
+                EvtchnStatisticsCallback(Context, Channel, Dispatched);
+
+            if (Context->PollThreshold != 0)
+                EvtchnPollSample(Context, Processor, Channel);
+        } else if (Closed != NULL) {
+            if (Channel->Polled)
+                EvtchnPollStop(Context, Processor, Channel, FALSE);
+
+            ListEntry->Next = *Closed;
+            *Closed = ListEntry;
+        } else {
+            // Leave it for the DPC to reap
+            (VOID) InterlockedPushEntrySList(&Processor->PendingList,
+                                             ListEntry);
+            Reap = TRUE;
+        }
     }
 
+    if (Count != 0)
+        DoneSomething |= EvtchnGroupDeliver(Group, Argument, Count);
+
+    if (Wake)
+        (VOID) InterlockedExchange(&Processor->Wake, TRUE);
+
+    // KeSetEvent() cannot be called from an ISR, and nor can a channel be
+    // freed, so leave it to the DPC
+    if ((Wake || Reap) && Closed == NULL)
+        KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+
     return DoneSomething;
 }
 
+// The balancer weighs processors by the time spent in their ISR and DPC.
+// The ISR can interrupt the DPC, and the balancer samples the count from
+// another processor, so 32-bit builds must not update it piecemeal.
+static FORCEINLINE VOID
+__EvtchnAccount(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  LONGLONG                    Start
+    )
+{
+    LARGE_INTEGER                   Now;
+
+    Now = KeQueryPerformanceCounter(NULL);
+    (VOID) InterlockedExchangeAdd64(&Processor->Ticks, Now.QuadPart - Start);
+}
+
+// The interrupt whose lock serializes the processor's polling
+static FORCEINLINE PXENBUS_INTERRUPT
+__EvtchnGetInterrupt(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor
+    )
+{
+    return (Processor->UpcallEnabled) ?
+           Processor->Interrupt :
+           Context->Interrupt;
+}
+
+// Must be called with the channel lock held
+static VOID
+EvtchnWake(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    PLIST_ENTRY                 ListEntry;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    for (ListEntry = Context->WaitList.Flink;
+         ListEntry != &Context->WaitList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_WAITER   Waiter;
+
+        Waiter = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_WAITER, ListEntry);
+
+        if (Waiter->Channel->Events != Waiter->Events)
+            (VOID) KeSetEvent(&Waiter->Event, IO_NO_INCREMENT, FALSE);
+    }
+}
+
 static VOID
 EvtchnFlush(
     IN  PXENBUS_EVTCHN_CONTEXT  Context,
@@ -541,29 +1203,33 @@ EvtchnFlush(
     )
 {
     PXENBUS_EVTCHN_PROCESSOR    Processor;
-    LIST_ENTRY                  List;
+    PSLIST_ENTRY                Closed;
     PXENBUS_INTERRUPT           Interrupt;
     KIRQL                       Irql;
 
     ASSERT3U(Index, <, Context->ProcessorCount);
     Processor = &Context->Processor[Index];
 
-    Interrupt = (Processor->UpcallEnabled) ?
-                Processor->Interrupt :
-                Context->Interrupt;
+    Interrupt = __EvtchnGetInterrupt(Context, Processor);
 
-    InitializeListHead(&List);
+    Closed = NULL;
 
     Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
-    (VOID) EvtchnPoll(Context, Index, &List);
+    (VOID) EvtchnPoll(Context, Index, &Closed);
     FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
 
-    while (!IsListEmpty(&List)) {
-        PLIST_ENTRY             ListEntry;
+    if (Closed == NULL)
+        return;
+
+    KeAcquireSpinLockAtDpcLevel(&Context->ChannelLock);
+
+    while (Closed != NULL) {
+        PSLIST_ENTRY            ListEntry;
         PXENBUS_EVTCHN_CHANNEL  Channel;
 
-        ListEntry = RemoveHeadList(&List);
-        ASSERT(ListEntry != &List);
+        ListEntry = Closed;
+        Closed = ListEntry->Next;
+        ListEntry->Next = NULL;
 
         Channel = CONTAINING_RECORD(ListEntry,
                                     XENBUS_EVTCHN_CHANNEL,
@@ -571,10 +1237,12 @@ EvtchnFlush(
 
         ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
 
-        InitializeListHead(&Channel->PendingListEntry);
+        Channel->Pending = 0;
 
-        EvtchnReap(Context, Channel, TRUE);
+        EvtchnReap(Context, Channel, !Channel->Lost);
     }
+
+    KeReleaseSpinLockFromDpcLevel(&Context->ChannelLock);
 }
 
 static
@@ -585,14 +1253,17 @@ _IRQL_requires_(DISPATCH_LEVEL)
 _IRQL_requires_same_
 VOID
 EvtchnDpc(
-    IN  PKDPC               Dpc,
-    IN  PVOID               _Context,
-    IN  PVOID               Argument1,
-    IN  PVOID               Argument2
+    IN  PKDPC                   Dpc,
+    IN  PVOID                   _Context,
+    IN  PVOID                   Argument1,
+    IN  PVOID                   Argument2
     )
 {
-    PXENBUS_EVTCHN_CONTEXT  Context = _Context;
-    ULONG                   Index;
+    PXENBUS_EVTCHN_CONTEXT      Context = _Context;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_GUARD        Guard;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    LARGE_INTEGER               Start;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
@@ -601,15 +1272,81 @@ EvtchnDpc(
     ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
     Index = KeGetCurrentProcessorNumberEx(NULL);
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    ASSERT3U(Index, <, Context->GuardCount);
+    Guard = &Context->Guard[Index];
+
+    // Pairs with the barrier in EvtchnRundown()
+    (VOID) InterlockedIncrement(&Guard->Count);
 
     if (Context->References == 0)
         goto done;
 
+    Start.QuadPart = 0;
+    if (Context->BalancePeriod != 0)
+        Start = KeQueryPerformanceCounter(NULL);
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = &Context->Processor[Index];
+
     EvtchnFlush(Context, Index);
 
+    if (Processor->PollCount == 0) {
+        Processor->PollRounds = 0;
+        goto wake;
+    }
+
+    if (++Processor->PollRounds < XENBUS_EVTCHN_POLL_BUDGET) {
+        KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+        goto wake;
+    }
+
+    // Let the processor drop below DISPATCH_LEVEL by handing the polled
+    // channels back to upcalls, servicing them one last time on the way.
+    // Re-arming a timer instead would leave them masked until the next
+    // clock tick.
+    Processor->PollRounds = 0;
+
+    Processor->PollYield = TRUE;
+    EvtchnFlush(Context, Index);
+
+    // An upcall may start polling again as soon as PollYield is clear
+    ASSERT3U(Processor->PollCount, ==, 0);
+    Processor->PollYield = FALSE;
+
+wake:
+    // The wait list is shared so only lock it if there is a waiter
+    if (InterlockedExchange(&Processor->Wake, FALSE)) {
+        KeAcquireSpinLockAtDpcLevel(&Context->ChannelLock);
+        EvtchnWake(Context);
+        KeReleaseSpinLockFromDpcLevel(&Context->ChannelLock);
+    }
+
+    if (Context->BalancePeriod != 0)
+        __EvtchnAccount(Processor, Start.QuadPart);
+
 done:
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    (VOID) InterlockedDecrement(&Guard->Count);
+}
+
+// Called once the last reference has been dropped. Any DPC that saw the
+// reference may still be using the processor state so wait for it to
+// finish (see EvtchnDpc()).
+static VOID
+EvtchnRundown(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+
+    ASSERT3U(Context->References, ==, 0);
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Context->GuardCount; Index++) {
+        PXENBUS_EVTCHN_GUARD    Guard = &Context->Guard[Index];
+
+        while (Guard->Count != 0)
+            _mm_pause();
+    }
 }
 
 static VOID
@@ -623,8 +1360,6 @@ EvtchnTrigger(
     PROCESSOR_NUMBER            ProcNumber;
     ULONG                       Index;
     PXENBUS_EVTCHN_PROCESSOR    Processor;
-    PXENBUS_INTERRUPT           Interrupt;
-    BOOLEAN                     Pending;
 
     ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
 
@@ -637,24 +1372,104 @@ EvtchnTrigger(
     ASSERT3U(Index, <, Context->ProcessorCount);
     Processor = &Context->Processor[Index];
 
-    Interrupt = (Processor->UpcallEnabled) ?
-                Processor->Interrupt :
-                Context->Interrupt;
+    if (!__EvtchnQueue(Processor, Channel))
+        return;
 
-    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+    KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+}
+
+static NTSTATUS
+EvtchnBindProcessor(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  USHORT                  Group,
+    IN  UCHAR                   Number,
+    IN  BOOLEAN                 Pin
+    )
+{
+    PROCESSOR_NUMBER            ProcNumber;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    PXENBUS_EVTCHN_PROCESSOR    Previous;
+    PXENBUS_INTERRUPT           Interrupt;
+    ULONG                       LocalPort;
+    unsigned int                vcpu_id;
+    KIRQL                       Irql;
+    KIRQL                       InterruptIrql;
+    NTSTATUS                    status;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    RtlZeroMemory(&ProcNumber, sizeof (PROCESSOR_NUMBER));
+    ProcNumber.Group = Group;
+    ProcNumber.Number = Number;
+
+    Index = KeGetProcessorIndexFromNumber(&ProcNumber);
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = &Context->Processor[Index];
+
+    status = STATUS_NOT_SUPPORTED;
+    if (!Processor->UpcallEnabled)
+        goto fail1;
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    if (!Channel->Active)
+        goto done;
+
+    // The balancer must not override a binding made by the owner
+    if (Pin)
+        Channel->Pinned = TRUE;
+    else if (Channel->Pinned)
+        goto done;
+
+    if (Channel->ProcNumber.Group == Group &&
+        Channel->ProcNumber.Number == Number)
+        goto done;
+
+    LocalPort = Channel->LocalPort;
+    vcpu_id = SystemVirtualCpuIndex(Index);
+
+    status = EventChannelBindVirtualCpu(LocalPort, vcpu_id);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Index = KeGetProcessorIndexFromNumber(&Channel->ProcNumber);
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Previous = &Context->Processor[Index];
+
+    Channel->ProcNumber = ProcNumber;
+
+    // The previous processor may be part way through dispatching the
+    // channel, having already given up its place on the PendingList.
+    // Wait for that to finish while still holding the channel lock, so
+    // that EvtchnClose() cannot have the channel reaped on the new
+    // processor in the meantime. Upcall callbacks must not take the
+    // channel lock (hence InUpcall in EvtchnUnmask()) so this cannot
+    // deadlock.
+    Interrupt = __EvtchnGetInterrupt(Context, Previous);
+
+    InterruptIrql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, InterruptIrql);
+
+    Info("[%u]: CPU %u:%u\n", LocalPort, Group, Number);
+
+done:
+    KeReleaseSpinLock(&Channel->Lock, Irql);
 
-    Pending = !IsListEmpty(&Channel->PendingListEntry);
+    return STATUS_SUCCESS;
 
-    if (!Pending)
-        InsertTailList(&Processor->PendingList,
-                       &Channel->PendingListEntry);
+fail2:
+    Error("fail2\n");
 
-    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+    KeReleaseSpinLock(&Channel->Lock, Irql);
 
-    if (Pending)
-        return;
+fail1:
+    Error("fail1 (%08x)\n", status);
 
-    KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+    return status;
 }
 
 static NTSTATUS
@@ -666,27 +1481,25 @@ EvtchnBind(
     )
 {
     PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
-    PROCESSOR_NUMBER            ProcNumber;
-    ULONG                       Index;
-    PXENBUS_EVTCHN_PROCESSOR    Processor;
-    ULONG                       LocalPort;
-    unsigned int                vcpu_id;
+
+    return EvtchnBindProcessor(Context, Channel, Group, Number, TRUE);
+}
+
+static NTSTATUS
+EvtchnSetPriority(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Priority
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
     KIRQL                       Irql;
     NTSTATUS                    status;
 
     ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
 
-    RtlZeroMemory(&ProcNumber, sizeof (PROCESSOR_NUMBER));
-    ProcNumber.Group = Group;
-    ProcNumber.Number = Number;
-
-    Index = KeGetProcessorIndexFromNumber(&ProcNumber);
-
-    ASSERT3U(Index, <, Context->ProcessorCount);
-    Processor = &Context->Processor[Index];
-
-    status = STATUS_NOT_SUPPORTED;
-    if (!Processor->UpcallEnabled)
+    status = STATUS_INVALID_PARAMETER;
+    if (Priority > XENBUS_EVTCHN_PRIORITY_LOWEST)
         goto fail1;
 
     KeAcquireSpinLock(&Channel->Lock, &Irql);
@@ -694,20 +1507,14 @@ EvtchnBind(
     if (!Channel->Active)
         goto done;
 
-    if (Channel->ProcNumber.Group == Group &&
-        Channel->ProcNumber.Number == Number)
-        goto done;
-
-    LocalPort = Channel->LocalPort;
-    vcpu_id = SystemVirtualCpuIndex(Index);
-
-    status = EventChannelBindVirtualCpu(LocalPort, vcpu_id);
+    status = XENBUS_EVTCHN_ABI(PortSetPriority,
+                               &Context->EvtchnAbi,
+                               Channel->LocalPort,
+                               Priority);
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    Channel->ProcNumber = ProcNumber;
-
-    Info("[%u]: CPU %u:%u\n", LocalPort, Group, Number);
+    Info("[%u]: PRIORITY %u\n", Channel->LocalPort, Priority);
 
 done:
     KeReleaseSpinLock(&Channel->Lock, Irql);
@@ -758,6 +1565,21 @@ EvtchnUnmask(
     if (!Channel->Active)
         goto done;
 
+    // Polled channels are unmasked when they go idle
+    if (Channel->Polled)
+        goto done;
+
+    if (Channel->MaskStart != 0) {
+        LARGE_INTEGER   Now;
+
+        Now = KeQueryPerformanceCounter(NULL);
+
+        EvtchnHistogramRecord(Context,
+                              Channel->Statistics.Unmask,
+                              Now.QuadPart - Channel->MaskStart);
+        Channel->MaskStart = 0;
+    }
+
     LocalPort = Channel->LocalPort;
 
     if (XENBUS_EVTCHN_ABI(PortUnmask,
@@ -818,6 +1640,164 @@ done:
     return status;
 }
 
+static NTSTATUS
+EvtchnGroupCreate(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_EVTCHN_GROUP_CALLBACK    Callback,
+    IN  PVOID                           Argument OPTIONAL,
+    OUT PXENBUS_EVTCHN_GROUP            *Group
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT              Context = Interface->Context;
+    KIRQL                               Irql;
+    NTSTATUS                            status;
+
+    *Group = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_GROUP));
+
+    status = STATUS_NO_MEMORY;
+    if (*Group == NULL)
+        goto fail1;
+
+    (*Group)->Magic = XENBUS_EVTCHN_GROUP_MAGIC;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Group)->Caller, NULL);
+
+    (*Group)->Callback = Callback;
+    (*Group)->Argument = Argument;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    InsertTailList(&Context->GroupList, &(*Group)->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+EvtchnGroupDestroy(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    KIRQL                       Irql;
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+    if (Group->Members != 0)
+        BUG("OUTSTANDING GROUP MEMBERS");
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    RemoveEntryList(&Group->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    RtlZeroMemory(&Group->ListEntry, sizeof (LIST_ENTRY));
+
+    Group->Deliveries = 0;
+    Group->Argument = NULL;
+    Group->Callback = NULL;
+    Group->Caller = NULL;
+    Group->Magic = 0;
+
+    ASSERT(IsZeroMemory(Group, sizeof (XENBUS_EVTCHN_GROUP)));
+    __EvtchnFree(Group);
+}
+
+static NTSTATUS
+EvtchnGroupAdd(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Channel->Group != NULL)
+        goto fail1;
+
+    (VOID) InterlockedIncrement(&Group->Members);
+    Channel->Group = Group;
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return status;
+}
+
+// Wait for any upcall or DPC that may still be using a stale group
+// pointer to finish
+static VOID
+EvtchnGroupSynchronize(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+    KIRQL                       Irql;
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor;
+
+        Processor = &Context->Processor[Index];
+
+        if (Processor->Interrupt == NULL)
+            continue;
+
+        Irql = FdoAcquireInterruptLock(Context->Fdo, Processor->Interrupt);
+        FdoReleaseInterruptLock(Context->Fdo, Processor->Interrupt, Irql);
+    }
+
+    Irql = FdoAcquireInterruptLock(Context->Fdo, Context->Interrupt);
+    FdoReleaseInterruptLock(Context->Fdo, Context->Interrupt, Irql);
+}
+
+static VOID
+EvtchnGroupRemove(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    PXENBUS_EVTCHN_GROUP        Group;
+    KIRQL                       Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+    Group = Channel->Group;
+    Channel->Group = NULL;
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    if (Group == NULL)
+        return;
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+    EvtchnGroupSynchronize(Context);
+
+    ASSERT(Group->Members != 0);
+    (VOID) InterlockedDecrement(&Group->Members);
+}
+
 static VOID
 EvtchnClose(
     IN  PINTERFACE              Interface,
@@ -829,22 +1809,22 @@ EvtchnClose(
     KIRQL                       Irql;
 
     ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    ASSERT3U(Channel->Waiters, ==, 0);
+
+    EvtchnGroupRemove(Interface, Channel);
 
     KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
 
     Trace("%u\n", LocalPort);
 
     if (Channel->Active) {
-        NTSTATUS    status;
-
         Channel->Active = FALSE;
 
         XENBUS_EVTCHN_ABI(PortDisable,
                           &Context->EvtchnAbi,
                           LocalPort);
 
-        status = HashTableRemove(Context->Table, LocalPort);
-        ASSERT(NT_SUCCESS(status));
+        EvtchnPortRemove(Context, LocalPort);
 
         //
         // The event may be pending on a CPU queue so we mark it as
@@ -859,12 +1839,25 @@ EvtchnClose(
         goto done;
     }
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    // Lost across suspend so the port must not be touched. The channel
+    // may still be on a PendingList, for instance if it was being
+    // polled, in which case it is reaped by the processor that holds
+    // it (see __EvtchnUnqueue()). Otherwise claim the entry so that it
+    // cannot be queued and reap it here.
+    ASSERT(Channel->Lost);
 
     Channel->Closed = TRUE;
-    EvtchnReap(Context, Channel, FALSE);
+    KeMemoryBarrier();
+
+    if (InterlockedExchange(&Channel->Pending, 1) != 0)
+        goto done;
 
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    ASSERT(!Channel->Polled);
+    Channel->Pending = 0;
+
+    KeAcquireSpinLockAtDpcLevel(&Context->ChannelLock);
+    EvtchnReap(Context, Channel, FALSE);
+    KeReleaseSpinLockFromDpcLevel(&Context->ChannelLock);
 
 done:
     KeLowerIrql(Irql);
@@ -884,29 +1877,117 @@ EvtchnGetPort(
     return Channel->LocalPort;
 }
 
+static VOID
+EvtchnStatisticsSnapshot(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel,
+    OUT PXENBUS_EVTCHN_STATISTICS   Statistics
+    )
+{
+    *Statistics = Channel->Statistics;
+    Statistics->Events = Channel->Events;
+
+    if (Context->Statistics) {
+        LARGE_INTEGER   Now;
+        LONGLONG        Delta;
+
+        Now = KeQueryPerformanceCounter(NULL);
+
+        // A channel that has gone quiet never closes its sample period
+        Delta = Now.QuadPart - Channel->StatisticsStart;
+        if (Channel->StatisticsStart != 0 &&
+            Delta >= Context->Frequency.QuadPart)
+            Statistics->Rate =
+                (ULONG)(((ULONGLONG)Channel->StatisticsEvents *
+                         (ULONGLONG)Context->Frequency.QuadPart) /
+                        (ULONGLONG)Delta);
+    }
+}
+
+static VOID
+EvtchnGetStatistics(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel,
+    OUT PXENBUS_EVTCHN_STATISTICS   Statistics
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT          Context = Interface->Context;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    EvtchnStatisticsSnapshot(Context, Channel, Statistics);
+}
+
 static NTSTATUS
-EvtchnWait(
-    IN  PINTERFACE              Interface,
+EvtchnWaitBlocking(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
     IN  PXENBUS_EVTCHN_CHANNEL  Channel,
     IN  PLARGE_INTEGER          Timeout
     )
 {
+    XENBUS_EVTCHN_WAITER        Waiter;
     KIRQL                       Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), <, DISPATCH_LEVEL);
+
+    KeInitializeEvent(&Waiter.Event, NotificationEvent, FALSE);
+    Waiter.Channel = Channel;
+
+    KeAcquireSpinLock(&Context->ChannelLock, &Irql);
+
+    // Advertise the waiter before sampling the count so that an event
+    // arriving after the sample is guaranteed to queue the DPC
+    (VOID) InterlockedIncrement(&Channel->Waiters);
+
+    Waiter.Events = Channel->Events;
+    InsertTailList(&Context->WaitList, &Waiter.ListEntry);
+
+    KeReleaseSpinLock(&Context->ChannelLock, Irql);
+
+    (VOID) KeWaitForSingleObject(&Waiter.Event,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 Timeout);
+
+    KeAcquireSpinLock(&Context->ChannelLock, &Irql);
+
+    RemoveEntryList(&Waiter.ListEntry);
+    (VOID) InterlockedDecrement(&Channel->Waiters);
+
+    KeReleaseSpinLock(&Context->ChannelLock, Irql);
+
+    // The event is only set once the count has moved, but the count may
+    // also have moved just as the wait timed out
+    return (Channel->Events != Waiter.Events) ?
+           STATUS_SUCCESS :
+           STATUS_TIMEOUT;
+}
+
+#define XENBUS_EVTCHN_WAIT_SPIN_MAX 1024    // Pauses before yielding to Xen
+
+static NTSTATUS
+EvtchnWaitSpin(
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  PLARGE_INTEGER          Timeout
+    )
+{
     ULONG                       Events;
+    ULONG                       Backoff;
     LARGE_INTEGER               Start;
     NTSTATUS                    status;
 
-    UNREFERENCED_PARAMETER(Interface);
-
-    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
-    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
     Events = Channel->Events;
     KeMemoryBarrier();
 
     KeQuerySystemTime(&Start);
+    Backoff = 1;
 
     for (;;) {
+        ULONG   Count;
+
         status = STATUS_SUCCESS;
         if (Channel->Events != Events)
             break;
@@ -935,15 +2016,40 @@ EvtchnWait(
             }
         }
 
-        _mm_pause();
+        for (Count = 0; Count < Backoff; Count++)
+            _mm_pause();
+
+        // Once spinning has gone on for a while give the physical CPU
+        // back to the hypervisor rather than burning it
+        if (Backoff < XENBUS_EVTCHN_WAIT_SPIN_MAX)
+            Backoff <<= 1;
+        else
+            SchedYield();
+
         KeMemoryBarrier();
     }
 
-    KeLowerIrql(Irql);
-
     return status;
 }
 
+static NTSTATUS
+EvtchnWait(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  PLARGE_INTEGER          Timeout
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
+
+    if (KeGetCurrentIrql() < DISPATCH_LEVEL)
+        return EvtchnWaitBlocking(Context, Channel, Timeout);
+
+    return EvtchnWaitSpin(Channel, Timeout);
+}
+
 static
 _Function_class_(KSERVICE_ROUTINE)
 __drv_requiresIRQL(HIGH_LEVEL)
@@ -955,6 +2061,7 @@ EvtchnInterruptCallback(
 {
     PXENBUS_EVTCHN_CONTEXT  Context = Argument;
     ULONG                   Index;
+    LARGE_INTEGER           Start;
     BOOLEAN                 DoneSomething;
 
     UNREFERENCED_PARAMETER(InterruptObject);
@@ -962,12 +2069,21 @@ EvtchnInterruptCallback(
     ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
     Index = KeGetCurrentProcessorNumberEx(NULL);
 
+    Start.QuadPart = 0;
+    if (Context->BalancePeriod != 0)
+        Start = KeQueryPerformanceCounter(NULL);
+
     DoneSomething = FALSE;
     while (XENBUS_SHARED_INFO(UpcallPending,
                               &Context->SharedInfoInterface,
                               Index))
         DoneSomething |= EvtchnPoll(Context, Index, NULL);
 
+    if (Context->BalancePeriod != 0) {
+        ASSERT3U(Index, <, Context->ProcessorCount);
+        __EvtchnAccount(&Context->Processor[Index], Start.QuadPart);
+    }
+
     return DoneSomething;
 }
 
@@ -1240,14 +2356,13 @@ EvtchnSuspendCallbackEarly(
         ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
 
         if (Channel->Active) {
-            ULONG       LocalPort = Channel->LocalPort;
-            NTSTATUS    status;
-
             Channel->Active = FALSE;
 
-            status = HashTableRemove(Context->Table, LocalPort);
-            ASSERT(NT_SUCCESS(status));
+            EvtchnPortRemove(Context, Channel->LocalPort);
         }
+
+        // Including channels that are closed but not yet reaped
+        Channel->Lost = TRUE;
     }
 }
 
@@ -1261,11 +2376,64 @@ EvtchnSuspendCallbackLate(
 
     EvtchnAbiRelease(Context);
 
-    status = EvtchnAbiAcquire(Context);
-    ASSERT(NT_SUCCESS(status));
+    status = EvtchnAbiAcquire(Context);
+    ASSERT(NT_SUCCESS(status));
+
+    EvtchnInterruptDisable(Context);
+    EvtchnInterruptEnable(Context);
+}
+
+static VOID
+EvtchnDebugHistogram(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  const CHAR              *Name,
+    IN  PULONG                  Histogram
+    )
+{
+    CHAR                        Buffer[XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT * 24];
+    PCHAR                       Cursor;
+    size_t                      Remaining;
+    ULONG                       Bucket;
+
+    Cursor = Buffer;
+    Remaining = sizeof (Buffer);
+    *Cursor = '\0';
+
+    for (Bucket = 0; Bucket < XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT; Bucket++) {
+        NTSTATUS    status;
+
+        if (Histogram[Bucket] == 0)
+            continue;
+
+        status = (Bucket < XENBUS_EVTCHN_HISTOGRAM_BUCKET_COUNT - 1) ?
+                 RtlStringCbPrintfExA(Cursor,
+                                      Remaining,
+                                      &Cursor,
+                                      &Remaining,
+                                      0,
+                                      " <%luus=%lu",
+                                      2ul << Bucket,
+                                      Histogram[Bucket]) :
+                 RtlStringCbPrintfExA(Cursor,
+                                      Remaining,
+                                      &Cursor,
+                                      &Remaining,
+                                      0,
+                                      " >=%luus=%lu",
+                                      1ul << Bucket,
+                                      Histogram[Bucket]);
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    if (Cursor == Buffer)
+        return;
 
-    EvtchnInterruptDisable(Context);
-    EvtchnInterruptEnable(Context);
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "%s:%s\n",
+                 Name,
+                 Buffer);
 }
 
 static VOID
@@ -1301,19 +2469,23 @@ EvtchnDebugCallback(
             if (Name != NULL) {
                 XENBUS_DEBUG(Printf,
                              &Context->DebugInterface,
-                             "- (%04x) BY %s + %p %s%s\n",
+                             "- (%04x) BY %s + %p %s%s%s%s\n",
                              Channel->LocalPort,
                              Name,
                              (PVOID)Offset,
                              (Channel->Mask) ? "AUTO-MASK " : "",
+                             (Channel->Polled) ? "POLLED " : "",
+                             (Channel->Pinned) ? "PINNED " : "",
                              (Channel->Active) ? "ACTIVE" : "");
             } else {
                 XENBUS_DEBUG(Printf,
                              &Context->DebugInterface,
-                             "- (%04x) BY %p %s%s\n",
+                             "- (%04x) BY %p %s%s%s%s\n",
                              Channel->LocalPort,
                              (PVOID)Channel->Caller,
                              (Channel->Mask) ? "AUTO-MASK " : "",
+                             (Channel->Polled) ? "POLLED " : "",
+                             (Channel->Pinned) ? "PINNED " : "",
                              (Channel->Active) ? "ACTIVE" : "");
             }
 
@@ -1354,10 +2526,265 @@ EvtchnDebugCallback(
                          &Context->DebugInterface,
                          "Events = %lu\n",
                          Channel->Events);
+
+            if (Context->Statistics) {
+                XENBUS_EVTCHN_STATISTICS    Statistics;
+
+                EvtchnStatisticsSnapshot(Context, Channel, &Statistics);
+
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "Rate = %lu/s\n",
+                             Statistics.Rate);
+
+                EvtchnDebugHistogram(Context, "Dispatch", Statistics.Dispatch);
+                EvtchnDebugHistogram(Context, "Callback", Statistics.Callback);
+                EvtchnDebugHistogram(Context, "Unmask", Statistics.Unmask);
+            }
+        }
+    }
+
+    if (!IsListEmpty(&Context->GroupList)) {
+        PLIST_ENTRY ListEntry;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "GROUPS:\n");
+
+        for (ListEntry = Context->GroupList.Flink;
+             ListEntry != &Context->GroupList;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_EVTCHN_GROUP    Group;
+            PCHAR                   Name;
+            ULONG_PTR               Offset;
+
+            Group = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_GROUP, ListEntry);
+
+            ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+            ModuleLookup((ULONG_PTR)Group->Caller, &Name, &Offset);
+
+            if (Name != NULL) {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- BY %s + %p: Members = %d Deliveries = %d\n",
+                             Name,
+                             (PVOID)Offset,
+                             Group->Members,
+                             Group->Deliveries);
+            } else {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- BY %p: Members = %d Deliveries = %d\n",
+                             (PVOID)Group->Caller,
+                             Group->Members,
+                             Group->Deliveries);
+            }
         }
     }
 }
 
+//
+// The balancer periodically compares the time each processor has spent
+// in its event channel ISR and DPC and, if the busiest processor is doing enough work
+// and is far enough ahead of the least busy processor with a per-CPU
+// upcall, moves one channel between them. The cost of a channel is
+// estimated from its share of the events handled by its processor. At
+// most one channel moves per period, and only if the move narrows the
+// gap without reversing it, so that channels do not bounce around.
+// Channels bound explicitly by their owners are never moved.
+//
+
+#define XENBUS_EVTCHN_BALANCE_BUSY  10  // Minimum % of the period spent busy
+#define XENBUS_EVTCHN_BALANCE_GAP   25  // Minimum % imbalance before moving
+
+typedef struct _XENBUS_EVTCHN_LOAD {
+    ULONGLONG   Ticks;
+    ULONG       Events;
+} XENBUS_EVTCHN_LOAD, *PXENBUS_EVTCHN_LOAD;
+
+static VOID
+EvtchnBalanceLocked(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_LOAD     Load
+    )
+{
+    LARGE_INTEGER               Frequency;
+    PLIST_ENTRY                 ListEntry;
+    ULONG                       Index;
+    ULONG                       Busiest;
+    ULONG                       Idlest;
+    ULONGLONG                   Gap;
+    ULONGLONG                   Best;
+    PXENBUS_EVTCHN_CHANNEL      Candidate;
+    PROCESSOR_NUMBER            ProcNumber;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    RtlZeroMemory(Load, sizeof (XENBUS_EVTCHN_LOAD) * Context->ProcessorCount);
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor = &Context->Processor[Index];
+        LONGLONG                    Ticks;
+
+        // Read all 64 bits at once (see __EvtchnAccount())
+        Ticks = InterlockedCompareExchange64(&Processor->Ticks, 0, 0);
+        Load[Index].Ticks = (ULONGLONG)(Ticks - Processor->BalanceTicks);
+        Processor->BalanceTicks = Ticks;
+    }
+
+    for (ListEntry = Context->List.Flink;
+         ListEntry != &Context->List;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+        ULONG                   Events;
+
+        Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        Events = Channel->Events;
+        Channel->BalanceDelta = Events - Channel->BalanceEvents;
+        Channel->BalanceEvents = Events;
+
+        Index = KeGetProcessorIndexFromNumber(&Channel->ProcNumber);
+        ASSERT3U(Index, <, Context->ProcessorCount);
+
+        Load[Index].Events += Channel->BalanceDelta;
+    }
+
+    Busiest = Idlest = Context->ProcessorCount;
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor = &Context->Processor[Index];
+
+        if (Processor->Interrupt == NULL)
+            continue;
+
+        if (Busiest == Context->ProcessorCount ||
+            Load[Index].Ticks > Load[Busiest].Ticks)
+            Busiest = Index;
+
+        if (!Processor->UpcallEnabled)
+            continue;
+
+        if (Idlest == Context->ProcessorCount ||
+            Load[Index].Ticks < Load[Idlest].Ticks)
+            Idlest = Index;
+    }
+
+    if (Busiest == Context->ProcessorCount ||
+        Idlest == Context->ProcessorCount ||
+        Busiest == Idlest ||
+        Load[Busiest].Events == 0)
+        return;
+
+    if (Load[Busiest].Ticks * 100 <
+        (ULONGLONG)Frequency.QuadPart * Context->BalancePeriod * XENBUS_EVTCHN_BALANCE_BUSY)
+        return;
+
+    Gap = Load[Busiest].Ticks - Load[Idlest].Ticks;
+    if (Gap * 100 < Load[Busiest].Ticks * XENBUS_EVTCHN_BALANCE_GAP)
+        return;
+
+    Candidate = NULL;
+    Best = 0;
+
+    for (ListEntry = Context->List.Flink;
+         ListEntry != &Context->List;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+        ULONGLONG               Cost;
+
+        Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+
+        if (!Channel->Active || Channel->Pinned || Channel->BalanceDelta == 0)
+            continue;
+
+        if (KeGetProcessorIndexFromNumber(&Channel->ProcNumber) != Busiest)
+            continue;
+
+        Cost = (Load[Busiest].Ticks * Channel->BalanceDelta) /
+               Load[Busiest].Events;
+
+        // Moving it must not simply swap the roles of the two processors
+        if (Cost * 2 > Gap || Cost <= Best)
+            continue;
+
+        Candidate = Channel;
+        Best = Cost;
+    }
+
+    if (Candidate == NULL)
+        return;
+
+    status = KeGetProcessorNumberFromIndex(Idlest, &ProcNumber);
+    ASSERT(NT_SUCCESS(status));
+
+    (VOID) EvtchnBindProcessor(Context,
+                               Candidate,
+                               ProcNumber.Group,
+                               ProcNumber.Number,
+                               FALSE);
+}
+
+static NTSTATUS
+EvtchnBalance(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = _Context;
+    PKEVENT                 Event;
+    LARGE_INTEGER           Timeout;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    Timeout.QuadPart = TIME_RELATIVE(TIME_S((LONGLONG)Context->BalancePeriod));
+
+    for (;;) {
+        PXENBUS_EVTCHN_LOAD Load;
+        KIRQL               Irql;
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     &Timeout);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+
+        if (Context->References == 0)
+            goto loop;
+
+        Load = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_LOAD) * Context->ProcessorCount);
+        if (Load == NULL)
+            goto loop;
+
+        KeAcquireSpinLockAtDpcLevel(&Context->ChannelLock);
+        EvtchnBalanceLocked(Context, Load);
+        KeReleaseSpinLockFromDpcLevel(&Context->ChannelLock);
+
+        __EvtchnFree(Load);
+
+loop:
+        KeReleaseSpinLock(&Context->Lock, Irql);
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS
 EvtchnAcquire(
     IN  PINTERFACE          Interface
@@ -1462,7 +2889,7 @@ EvtchnAcquire(
                                                     Context);
         ASSERT(Processor->Interrupt != NULL);
 
-        InitializeListHead(&Processor->PendingList);
+        InitializeSListHead(&Processor->PendingList);
 
         KeInitializeDpc(&Processor->Dpc, EvtchnDpc, Context);
         KeSetTargetProcessorDpcEx(&Processor->Dpc, &ProcNumber);
@@ -1554,6 +2981,7 @@ EvtchnRelease(
     Trace("====>\n");
 
     EvtchnInterruptDisable(Context);
+    EvtchnRundown(Context);
 
     for (Index = 0; Index < Context->ProcessorCount; Index++) {
         PXENBUS_EVTCHN_PROCESSOR Processor;
@@ -1566,9 +2994,16 @@ EvtchnRelease(
 
         EvtchnFlush(Context, Index);
 
+        ASSERT3U(Processor->PollCount, ==, 0);
+        Processor->PollRounds = 0;
+        Processor->Wake = FALSE;
+        Processor->Ticks = 0;
+        Processor->BalanceTicks = 0;
+
         (VOID) KeRemoveQueueDpc(&Processor->Dpc);
         RtlZeroMemory(&Processor->Dpc, sizeof (KDPC));
-        RtlZeroMemory(&Processor->PendingList, sizeof (LIST_ENTRY));
+        ASSERT3U(QueryDepthSList(&Processor->PendingList), ==, 0);
+        RtlZeroMemory(&Processor->PendingList, sizeof (SLIST_HEADER));
 
         FdoFreeInterrupt(Fdo, Processor->Interrupt);
         Processor->Interrupt = NULL;
@@ -1585,6 +3020,11 @@ EvtchnRelease(
     if (!IsListEmpty(&Context->List))
         BUG("OUTSTANDING EVENT CHANNELS");
 
+    if (!IsListEmpty(&Context->GroupList))
+        BUG("OUTSTANDING EVENT CHANNEL GROUPS");
+
+    ASSERT(IsListEmpty(&Context->WaitList));
+
     EvtchnAbiRelease(Context);
 
     XENBUS_SHARED_INFO(Release, &Context->SharedInfoInterface);
@@ -1679,6 +3119,63 @@ static struct _XENBUS_EVTCHN_INTERFACE_V5 EvtchnInterfaceVersion5 = {
     EvtchnClose,
 };
 
+static struct _XENBUS_EVTCHN_INTERFACE_V6 EvtchnInterfaceVersion6 = {
+    { sizeof (struct _XENBUS_EVTCHN_INTERFACE_V6), 6, NULL, NULL, NULL },
+    EvtchnAcquire,
+    EvtchnRelease,
+    EvtchnOpen,
+    EvtchnBind,
+    EvtchnUnmask,
+    EvtchnSend,
+    EvtchnTrigger,
+    EvtchnWait,
+    EvtchnGetPort,
+    EvtchnClose,
+    EvtchnGroupCreate,
+    EvtchnGroupDestroy,
+    EvtchnGroupAdd,
+    EvtchnGroupRemove
+};
+
+static struct _XENBUS_EVTCHN_INTERFACE_V7 EvtchnInterfaceVersion7 = {
+    { sizeof (struct _XENBUS_EVTCHN_INTERFACE_V7), 7, NULL, NULL, NULL },
+    EvtchnAcquire,
+    EvtchnRelease,
+    EvtchnOpen,
+    EvtchnBind,
+    EvtchnUnmask,
+    EvtchnSend,
+    EvtchnTrigger,
+    EvtchnWait,
+    EvtchnGetPort,
+    EvtchnClose,
+    EvtchnGroupCreate,
+    EvtchnGroupDestroy,
+    EvtchnGroupAdd,
+    EvtchnGroupRemove,
+    EvtchnGetStatistics
+};
+
+static struct _XENBUS_EVTCHN_INTERFACE_V8 EvtchnInterfaceVersion8 = {
+    { sizeof (struct _XENBUS_EVTCHN_INTERFACE_V8), 8, NULL, NULL, NULL },
+    EvtchnAcquire,
+    EvtchnRelease,
+    EvtchnOpen,
+    EvtchnBind,
+    EvtchnUnmask,
+    EvtchnSend,
+    EvtchnTrigger,
+    EvtchnWait,
+    EvtchnGetPort,
+    EvtchnClose,
+    EvtchnGroupCreate,
+    EvtchnGroupDestroy,
+    EvtchnGroupAdd,
+    EvtchnGroupRemove,
+    EvtchnGetStatistics,
+    EvtchnSetPriority
+};
+
 NTSTATUS
 EvtchnInitialize(
     IN  PXENBUS_FDO             Fdo,
@@ -1687,6 +3184,9 @@ EvtchnInitialize(
 {
     HANDLE                      ParametersKey;
     ULONG                       UseEvtchnFifoAbi;
+    ULONG                       PollThreshold;
+    ULONG                       BalancePeriod;
+    ULONG                       Statistics;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -1697,18 +3197,14 @@ EvtchnInitialize(
     if (*Context == NULL)
         goto fail1;
 
-    status = HashTableCreate(&(*Context)->Table);
-    if (!NT_SUCCESS(status))
-        goto fail2;
-
     status = EvtchnTwoLevelInitialize(Fdo,
                                       &(*Context)->EvtchnTwoLevelContext);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail2;
 
     status = EvtchnFifoInitialize(Fdo, &(*Context)->EvtchnFifoContext);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail3;
 
     ParametersKey = DriverGetParametersKey();
 
@@ -1720,6 +3216,35 @@ EvtchnInitialize(
 
     (*Context)->UseEvtchnFifoAbi = (UseEvtchnFifoAbi != 0) ? TRUE : FALSE;
 
+    // Events per second above which a channel is polled (0 = never)
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "EvtchnPollThreshold",
+                                     &PollThreshold);
+    if (!NT_SUCCESS(status))
+        PollThreshold = 0;
+
+    (*Context)->PollThreshold = PollThreshold;
+
+    // Seconds between balancing passes (0 = never)
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "EvtchnBalancePeriod",
+                                     &BalancePeriod);
+    if (!NT_SUCCESS(status))
+        BalancePeriod = 0;
+
+    (*Context)->BalancePeriod = BalancePeriod;
+
+    // Collect per-channel rate and latency statistics
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "EvtchnStatistics",
+                                     &Statistics);
+    if (!NT_SUCCESS(status))
+        Statistics = 0;
+
+    (*Context)->Statistics = (Statistics != 0) ? TRUE : FALSE;
+
+    (VOID) KeQueryPerformanceCounter(&(*Context)->Frequency);
+
     status = SuspendGetInterface(FdoGetSuspendContext(Fdo),
                                  XENBUS_SUSPEND_INTERFACE_VERSION_MAX,
                                  (PINTERFACE)&(*Context)->SuspendInterface,
@@ -1741,26 +3266,73 @@ EvtchnInitialize(
     ASSERT(NT_SUCCESS(status));
     ASSERT((*Context)->SharedInfoInterface.Interface.Context != NULL);
 
+    (*Context)->GuardCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Context)->Guard = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_GUARD) * (*Context)->GuardCount);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->Guard == NULL)
+        goto fail4;
+
     InitializeListHead(&(*Context)->List);
+    InitializeListHead(&(*Context)->GroupList);
+    InitializeListHead(&(*Context)->WaitList);
+    KeInitializeSpinLock(&(*Context)->ChannelLock);
     KeInitializeSpinLock(&(*Context)->Lock);
 
+    if ((*Context)->BalancePeriod != 0) {
+        status = ThreadCreate(EvtchnBalance,
+                              *Context,
+                              &(*Context)->BalanceThread);
+        if (!NT_SUCCESS(status))
+            goto fail5;
+    }
+
     (*Context)->Fdo = Fdo;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail5:
+    Error("fail5\n");
+
+    RtlZeroMemory(&(*Context)->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Context)->ChannelLock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Context)->WaitList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Context)->GroupList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Context)->List, sizeof (LIST_ENTRY));
+
+    __EvtchnFree((*Context)->Guard);
+    (*Context)->Guard = NULL;
+
 fail4:
     Error("fail4\n");
 
-    EvtchnTwoLevelTeardown((*Context)->EvtchnTwoLevelContext);
-    (*Context)->EvtchnTwoLevelContext = NULL;
+    (*Context)->GuardCount = 0;
+
+    RtlZeroMemory(&(*Context)->SharedInfoInterface,
+                  sizeof (XENBUS_SHARED_INFO_INTERFACE));
+
+    RtlZeroMemory(&(*Context)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    RtlZeroMemory(&(*Context)->SuspendInterface,
+                  sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    (*Context)->Frequency.QuadPart = 0;
+    (*Context)->Statistics = FALSE;
+    (*Context)->BalancePeriod = 0;
+    (*Context)->PollThreshold = 0;
+    (*Context)->UseEvtchnFifoAbi = FALSE;
+
+    EvtchnFifoTeardown((*Context)->EvtchnFifoContext);
+    (*Context)->EvtchnFifoContext = NULL;
 
 fail3:
     Error("fail3\n");
 
-    HashTableDestroy((*Context)->Table);
-    (*Context)->Table = NULL;
+    EvtchnTwoLevelTeardown((*Context)->EvtchnTwoLevelContext);
+    (*Context)->EvtchnTwoLevelContext = NULL;
 
 fail2:
     Error("fail2\n");
@@ -1872,6 +3444,57 @@ EvtchnGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 6: {
+        struct _XENBUS_EVTCHN_INTERFACE_V6  *EvtchnInterface;
+
+        EvtchnInterface = (struct _XENBUS_EVTCHN_INTERFACE_V6 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_EVTCHN_INTERFACE_V6))
+            break;
+
+        *EvtchnInterface = EvtchnInterfaceVersion6;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 7: {
+        struct _XENBUS_EVTCHN_INTERFACE_V7  *EvtchnInterface;
+
+        EvtchnInterface = (struct _XENBUS_EVTCHN_INTERFACE_V7 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_EVTCHN_INTERFACE_V7))
+            break;
+
+        *EvtchnInterface = EvtchnInterfaceVersion7;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 8: {
+        struct _XENBUS_EVTCHN_INTERFACE_V8  *EvtchnInterface;
+
+        EvtchnInterface = (struct _XENBUS_EVTCHN_INTERFACE_V8 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_EVTCHN_INTERFACE_V8))
+            break;
+
+        *EvtchnInterface = EvtchnInterfaceVersion8;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -1892,8 +3515,22 @@ EvtchnTeardown(
 
     Context->Fdo = NULL;
 
+    if (Context->BalanceThread != NULL) {
+        ThreadAlert(Context->BalanceThread);
+        ThreadJoin(Context->BalanceThread);
+        Context->BalanceThread = NULL;
+    }
+
     RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&Context->ChannelLock, sizeof (KSPIN_LOCK));
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->GroupList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->WaitList, sizeof (LIST_ENTRY));
+
+    ASSERT(IsZeroMemory(Context->Guard, sizeof (XENBUS_EVTCHN_GUARD) * Context->GuardCount));
+    __EvtchnFree(Context->Guard);
+    Context->Guard = NULL;
+    Context->GuardCount = 0;
 
     RtlZeroMemory(&Context->SharedInfoInterface,
                   sizeof (XENBUS_SHARED_INFO_INTERFACE));
@@ -1905,6 +3542,10 @@ EvtchnTeardown(
                   sizeof (XENBUS_SUSPEND_INTERFACE));
 
     Context->UseEvtchnFifoAbi = FALSE;
+    Context->PollThreshold = 0;
+    Context->BalancePeriod = 0;
+    Context->Statistics = FALSE;
+    Context->Frequency.QuadPart = 0;
 
     EvtchnFifoTeardown(Context->EvtchnFifoContext);
     Context->EvtchnFifoContext = NULL;
@@ -1912,8 +3553,7 @@ EvtchnTeardown(
     EvtchnTwoLevelTeardown(Context->EvtchnTwoLevelContext);
     Context->EvtchnTwoLevelContext = NULL;
 
-    HashTableDestroy(Context->Table);
-    Context->Table = NULL;
+    EvtchnPortTableFree(Context);
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_EVTCHN_CONTEXT)));
     __EvtchnFree(Context);
@@ -157,6 +157,34 @@ EvtchnTwoLevelPortUnmask(
                               Port);
 }
 
+static BOOLEAN
+EvtchnTwoLevelPortIsPending(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT      _Context,
+    IN  ULONG                           Port
+    )
+{
+    PXENBUS_EVTCHN_TWO_LEVEL_CONTEXT    Context = (PVOID)_Context;
+
+    return XENBUS_SHARED_INFO(EvtchnIsPending,
+                              &Context->SharedInfoInterface,
+                              Port);
+}
+
+static NTSTATUS
+EvtchnTwoLevelPortSetPriority(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT      _Context,
+    IN  ULONG                           Port,
+    IN  ULONG                           Priority
+    )
+{
+    UNREFERENCED_PARAMETER(_Context);
+    UNREFERENCED_PARAMETER(Port);
+    UNREFERENCED_PARAMETER(Priority);
+
+    // The 2-level ABI has no notion of priority
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS
 EvtchnTwoLevelAcquire(
     IN  PXENBUS_EVTCHN_ABI_CONTEXT      _Context
@@ -229,7 +257,9 @@ static XENBUS_EVTCHN_ABI EvtchnAbiTwoLevel = {
     EvtchnTwoLevelPortDisable,
     EvtchnTwoLevelPortAck,
     EvtchnTwoLevelPortMask,
-    EvtchnTwoLevelPortUnmask
+    EvtchnTwoLevelPortUnmask,
+    EvtchnTwoLevelPortIsPending,
+    EvtchnTwoLevelPortSetPriority
 };
 
 NTSTATUS
@@ -97,6 +97,19 @@ typedef BOOLEAN
     IN  ULONG                       Port
     );
 
+typedef BOOLEAN
+(*XENBUS_EVTCHN_ABI_PORT_IS_PENDING)(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port
+    );
+
+typedef NTSTATUS
+(*XENBUS_EVTCHN_ABI_PORT_SET_PRIORITY)(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port,
+    IN  ULONG                       Priority
+    );
+
 typedef struct _XENBUS_EVTCHN_ABI {
     PXENBUS_EVTCHN_ABI_CONTEXT              Context;
     XENBUS_EVTCHN_ABI_ACQUIRE               EvtchnAbiAcquire;
@@ -108,6 +121,8 @@ typedef struct _XENBUS_EVTCHN_ABI {
     XENBUS_EVTCHN_ABI_PORT_ACK              EvtchnAbiPortAck;
     XENBUS_EVTCHN_ABI_PORT_MASK             EvtchnAbiPortMask;
     XENBUS_EVTCHN_ABI_PORT_UNMASK           EvtchnAbiPortUnmask;
+    XENBUS_EVTCHN_ABI_PORT_IS_PENDING       EvtchnAbiPortIsPending;
+    XENBUS_EVTCHN_ABI_PORT_SET_PRIORITY     EvtchnAbiPortSetPriority;
 } XENBUS_EVTCHN_ABI, *PXENBUS_EVTCHN_ABI;
 
 #define XENBUS_EVTCHN_ABI(_Method, _Abi, ...)   \
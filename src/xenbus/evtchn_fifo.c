@@ -366,7 +366,8 @@ EvtchnFifoPoll(
 
     Ready = InterlockedExchange((LONG *)&ControlBlock->ready, 0);
 
-    while (_BitScanReverse(&Priority, Ready)) {
+    // Priority 0 is the highest so scan up from the bottom bit
+    while (_BitScanForward(&Priority, Ready)) {
         DoneSomething |= EvtchnFifoPollPriority(Context,
                                                 vcpu_id,
                                                 Priority,
@@ -460,6 +461,31 @@ EvtchnFifoPortUnmask(
     return __EvtchnFifoTestFlag(EventWord, EVTCHN_FIFO_PENDING);
 }
 
+static BOOLEAN
+EvtchnFifoPortIsPending(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  _Context,
+    IN  ULONG                       Port
+    )
+{
+    PXENBUS_EVTCHN_FIFO_CONTEXT     Context = (PVOID)_Context;
+    event_word_t                    *EventWord;
+
+    EventWord = EvtchnFifoEventWord(Context, Port);
+    return __EvtchnFifoTestFlag(EventWord, EVTCHN_FIFO_PENDING);
+}
+
+static NTSTATUS
+EvtchnFifoPortSetPriority(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  _Context,
+    IN  ULONG                       Port,
+    IN  ULONG                       Priority
+    )
+{
+    UNREFERENCED_PARAMETER(_Context);
+
+    return EventChannelSetPriority(Port, Priority);
+}
+
 static VOID
 EvtchnFifoPortDisable(
     IN  PXENBUS_EVTCHN_ABI_CONTEXT  _Context,
@@ -601,7 +627,9 @@ static XENBUS_EVTCHN_ABI EvtchnAbiFifo = {
     EvtchnFifoPortDisable,
     EvtchnFifoPortAck,
     EvtchnFifoPortMask,
-    EvtchnFifoPortUnmask
+    EvtchnFifoPortUnmask,
+    EvtchnFifoPortIsPending,
+    EvtchnFifoPortSetPriority
 };
 
 NTSTATUS
@@ -1140,64 +1140,79 @@ done:
 }
 
 static PANSI_STRING
-FdoMultiSzToUpcaseAnsi(
-    IN  PCHAR       Buffer
+FdoStoreDirectoryToUpcaseAnsi(
+    IN  PXENBUS_FDO             Fdo,
+    IN  PCHAR                   Node
     )
 {
-    PANSI_STRING    Ansi;
-    LONG            Index;
-    LONG            Count;
-    NTSTATUS        status;
-
-    Index = 0;
-    Count = 0;
-    for (;;) {
-        if (Buffer[Index] == '\0') {
-            Count++;
-            Index++;
+    PXENBUS_STORE_DIRECTORY     Directory;
+    PANSI_STRING                Ansi;
+    LONG                        Index;
+    ULONG                       Count;
+    NTSTATUS                    status;
 
-            // Check for double NUL
-            if (Buffer[Index] == '\0')
-                break;
-        } else {
-            Buffer[Index] = (CHAR)toupper(Buffer[Index]);
-            Index++;
-        }
-    }
+    status = XENBUS_STORE(DirectoryOpen,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          NULL,
+                          Node,
+                          &Directory,
+                          &Count);
+    if (!NT_SUCCESS(status))
+        goto fail1;
 
     Ansi = __FdoAllocate(sizeof (ANSI_STRING) * (Count + 1));
 
     status = STATUS_NO_MEMORY;
     if (Ansi == NULL)
-        goto fail1;
+        goto fail2;
 
-    for (Index = 0; Index < Count; Index++) {
+    for (Index = 0; Index < (LONG)Count; Index++) {
+        PCHAR   Name;
         ULONG   Length;
+        ULONG   Offset;
+
+        status = XENBUS_STORE(DirectoryNext,
+                              &Fdo->StoreInterface,
+                              Directory,
+                              &Name);
+        ASSERT(NT_SUCCESS(status));
 
-        Length = (ULONG)strlen(Buffer);
+        Length = (ULONG)strlen(Name);
         Ansi[Index].MaximumLength = (USHORT)(Length + 1);
         Ansi[Index].Buffer = __FdoAllocate(Ansi[Index].MaximumLength);
 
         status = STATUS_NO_MEMORY;
         if (Ansi[Index].Buffer == NULL)
-            goto fail2;
+            goto fail3;
 
-        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length);
-        Ansi[Index].Length = (USHORT)Length;
+        for (Offset = 0; Offset < Length; Offset++)
+            Ansi[Index].Buffer[Offset] = (CHAR)toupper(Name[Offset]);
 
-        Buffer += Length + 1;
+        Ansi[Index].Length = (USHORT)Length;
     }
 
+    XENBUS_STORE(DirectoryClose,
+                 &Fdo->StoreInterface,
+                 Directory);
+
     return Ansi;
 
-fail2:
-    Error("fail2\n");
+fail3:
+    Error("fail3\n");
 
     while (--Index >= 0)
         __FdoFree(Ansi[Index].Buffer);
 
     __FdoFree(Ansi);
 
+fail2:
+    Error("fail2\n");
+
+    XENBUS_STORE(DirectoryClose,
+                 &Fdo->StoreInterface,
+                 Directory);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -1325,7 +1340,6 @@ FdoScan(
     ParametersKey = DriverGetParametersKey();
 
     for (;;) {
-        PCHAR                   Buffer;
         PANSI_STRING            StoreClasses;
         PANSI_STRING            SyntheticClasses;
         PANSI_STRING            SupportedClasses;
@@ -1351,21 +1365,7 @@ FdoScan(
         if (__FdoGetDevicePnpState(Fdo) != Started)
             goto loop;
 
-        status = XENBUS_STORE(Directory,
-                              &Fdo->StoreInterface,
-                              NULL,
-                              NULL,
-                              "device",
-                              &Buffer);
-        if (NT_SUCCESS(status)) {
-            StoreClasses = FdoMultiSzToUpcaseAnsi(Buffer);
-
-            XENBUS_STORE(Free,
-                         &Fdo->StoreInterface,
-                         Buffer);
-        } else {
-            StoreClasses = NULL;
-        }
+        StoreClasses = FdoStoreDirectoryToUpcaseAnsi(Fdo, "device");
 
         status = RegistryQuerySzValue(ParametersKey,
                                       "SyntheticClasses",
@@ -1675,44 +1675,47 @@ FdoBalloon(
         }
 
         if (!Initialized) {
-            ULONGLONG   VideoRAM;
+            XENBUS_STORE_ITEM   Item[2];
+            ULONGLONG           VideoRAM;
 
             ASSERT(!Active);
 
-            status = XENBUS_STORE(Read,
+            RtlZeroMemory(Item, sizeof (Item));
+            Item[0].Node = "static-max";
+            Item[1].Node = "videoram";
+
+            status = XENBUS_STORE(ReadBatch,
                                   &Fdo->StoreInterface,
                                   NULL,
                                   "memory",
-                                  "static-max",
-                                  &Buffer);
+                                  Item,
+                                  ARRAYSIZE(Item));
             if (!NT_SUCCESS(status))
                 goto loop;
 
-            StaticMax = _strtoui64(Buffer, NULL, 10);
+            if (NT_SUCCESS(Item[0].Status)) {
+                StaticMax = _strtoui64(Item[0].Value, NULL, 10);
 
-            XENBUS_STORE(Free,
-                         &Fdo->StoreInterface,
-                         Buffer);
-
-            if (StaticMax == 0)
-                goto loop;
+                XENBUS_STORE(Free,
+                             &Fdo->StoreInterface,
+                             Item[0].Value);
+            } else {
+                StaticMax = 0;
+            }
 
-            status = XENBUS_STORE(Read,
-                                  &Fdo->StoreInterface,
-                                  NULL,
-                                  "memory",
-                                  "videoram",
-                                  &Buffer);
-            if (NT_SUCCESS(status)) {
-                VideoRAM = _strtoui64(Buffer, NULL, 10);
+            if (NT_SUCCESS(Item[1].Status)) {
+                VideoRAM = _strtoui64(Item[1].Value, NULL, 10);
 
                 XENBUS_STORE(Free,
                              &Fdo->StoreInterface,
-                             Buffer);
+                             Item[1].Value);
             } else {
                 VideoRAM = 0;
             }
 
+            if (StaticMax == 0)
+                goto loop;
+
             if (StaticMax < VideoRAM)
                 goto loop;
 
@@ -34,13 +34,13 @@
 #include <xen.h>
 
 #include "shared_info.h"
+#include "shared_info_scan.h"
 #include "fdo.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
-#define XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR     (sizeof (ULONG_PTR) * 8)
-#define XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT   (RTL_FIELD_SIZE(shared_info_t, evtchn_pending) / sizeof (ULONG_PTR))
+C_ASSERT(XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT == RTL_FIELD_SIZE(shared_info_t, evtchn_pending) / sizeof (ULONG_PTR));
 
 struct _XENBUS_SHARED_INFO_CONTEXT {
     PXENBUS_FDO                 Fdo;
@@ -186,8 +186,6 @@ SharedInfoEvtchnPoll(
     ULONG_PTR                       SelectorMask;
     BOOLEAN                         DoneSomething;
 
-    DoneSomething = FALSE;
-
     KeMemoryBarrier();
 
     SelectorMask = (ULONG_PTR)InterlockedExchangePointer((PVOID *)&Shared->vcpu_info[vcpu_id].evtchn_pending_sel, (PVOID)0);
@@ -196,40 +194,12 @@ SharedInfoEvtchnPoll(
 
     Port = Context->Port;
 
-    while (SelectorMask != 0) {
-        ULONG   SelectorBit;
-        ULONG   PortBit;
-
-
-        SelectorBit = Port / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
-        PortBit = Port % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
-
-        if (SharedInfoTestBit(&SelectorMask, SelectorBit)) {
-            ULONG_PTR   PortMask;
-
-            PortMask = Shared->evtchn_pending[SelectorBit];
-            PortMask &= ~Shared->evtchn_mask[SelectorBit];
-
-            while (PortMask != 0 && PortBit < XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) {
-                if (SharedInfoTestBit(&PortMask, PortBit)) {
-                    DoneSomething |= Event(Argument, (SelectorBit * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) + PortBit);
-
-                    PortMask &= ~((ULONG_PTR)1 << PortBit);
-                }
-
-                PortBit++;
-            }
-
-            // Are we done with this selector?
-            if (PortMask == 0)
-                SelectorMask &= ~((ULONG_PTR)1 << SelectorBit);
-        }
-
-        Port = (SelectorBit + 1) * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
-
-        if (Port >= XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR)
-            Port = 0;
-    }
+    DoneSomething = SharedInfoEvtchnScan(SelectorMask,
+                                         Shared->evtchn_pending,
+                                         Shared->evtchn_mask,
+                                         &Port,
+                                         Event,
+                                         Argument);
 
     Context->Port = Port;
 
@@ -318,6 +288,25 @@ SharedInfoEvtchnUnmask(
     return SharedInfoTestBit(&Shared->evtchn_pending[SelectorBit], PortBit);
 }
 
+static BOOLEAN
+SharedInfoEvtchnIsPending(
+    IN  PINTERFACE              Interface,
+    IN  ULONG                   Port
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
+    shared_info_t               *Shared;
+    ULONG                       SelectorBit;
+    ULONG                       PortBit;
+
+    Shared = Context->Shared;
+
+    SelectorBit = Port / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+    PortBit = Port % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+
+    return SharedInfoTestBit(&Shared->evtchn_pending[SelectorBit], PortBit);
+}
+
 static LARGE_INTEGER
 SharedInfoGetTime(
     IN  PINTERFACE              Interface
@@ -694,6 +683,19 @@ static struct _XENBUS_SHARED_INFO_INTERFACE_V2 SharedInfoInterfaceVersion2 = {
     SharedInfoEvtchnUnmask,
     SharedInfoGetTime
 };
+
+static struct _XENBUS_SHARED_INFO_INTERFACE_V3 SharedInfoInterfaceVersion3 = {
+    { sizeof (struct _XENBUS_SHARED_INFO_INTERFACE_V3), 3, NULL, NULL, NULL },
+    SharedInfoAcquire,
+    SharedInfoRelease,
+    SharedInfoUpcallPending,
+    SharedInfoEvtchnPoll,
+    SharedInfoEvtchnAck,
+    SharedInfoEvtchnMask,
+    SharedInfoEvtchnUnmask,
+    SharedInfoGetTime,
+    SharedInfoEvtchnIsPending
+};
                      
 NTSTATUS
 SharedInfoInitialize(
@@ -786,6 +788,23 @@ SharedInfoGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 3: {
+        struct _XENBUS_SHARED_INFO_INTERFACE_V3 *SharedInfoInterface;
+
+        SharedInfoInterface = (struct _XENBUS_SHARED_INFO_INTERFACE_V3 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_SHARED_INFO_INTERFACE_V3))
+            break;
+
+        *SharedInfoInterface = SharedInfoInterfaceVersion3;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
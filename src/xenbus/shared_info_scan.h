@@ -0,0 +1,130 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENBUS_SHARED_INFO_SCAN_H
+#define _XENBUS_SHARED_INFO_SCAN_H
+
+#include <ntddk.h>
+
+// The 2-level pending scan touches nothing but the words it is handed so
+// that it can be exercised against synthetic patterns (see
+// tools/shared_info).
+
+#define XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR     (sizeof (ULONG_PTR) * 8)
+#define XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT   (sizeof (ULONG_PTR) * 8)
+
+static FORCEINLINE BOOLEAN
+__SharedInfoFindFirstSet(
+    IN  ULONG_PTR   Mask,
+    OUT PULONG      Bit
+    )
+{
+#if defined(__i386__)
+    return _BitScanForward(Bit, Mask) ? TRUE : FALSE;
+#elif defined(__x86_64__)
+    return _BitScanForward64(Bit, Mask) ? TRUE : FALSE;
+#else
+#error 'Unrecognised architecture'
+#endif
+}
+
+// Call Event for every pending, unmasked port in the selectors set in
+// SelectorMask. The scan starts at *Port and wraps round, and *Port is
+// left just past the last selector serviced, so that busy low numbered
+// ports cannot starve the rest.
+static FORCEINLINE BOOLEAN
+SharedInfoEvtchnScan(
+    IN      ULONG_PTR           SelectorMask,
+    IN      ULONG_PTR           *Pending,
+    IN      ULONG_PTR           *Mask,
+    IN OUT  PULONG              Port,
+    IN      BOOLEAN             (*Event)(PVOID, ULONG),
+    IN      PVOID               Argument OPTIONAL
+    )
+{
+    ULONG                       Next;
+    BOOLEAN                     DoneSomething;
+
+    DoneSomething = FALSE;
+    Next = *Port;
+
+    while (SelectorMask != 0) {
+        ULONG       SelectorBit;
+        ULONG       PortBit;
+        ULONG       Bit;
+        ULONG_PTR   PortMask;
+        ULONG_PTR   Work;
+
+        SelectorBit = Next / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+        PortBit = Next % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+
+        // Find the next pending selector at or after the one we stopped
+        // at, wrapping round to the start if there is none
+        Work = SelectorMask & ((ULONG_PTR)-1 << SelectorBit);
+        if (Work == 0)
+            Work = SelectorMask;
+
+        (VOID) __SharedInfoFindFirstSet(Work, &Bit);
+        if (Bit != SelectorBit) {
+            SelectorBit = Bit;
+            PortBit = 0;
+        }
+
+        KeMemoryBarrier();
+
+        PortMask = Pending[SelectorBit];
+        PortMask &= ~Mask[SelectorBit];
+
+        // Ports below the one we stopped at wait until we come round again
+        Work = PortMask & ((ULONG_PTR)-1 << PortBit);
+
+        // Are we done with this selector?
+        if (Work == PortMask)
+            SelectorMask &= ~((ULONG_PTR)1 << SelectorBit);
+
+        while (__SharedInfoFindFirstSet(Work, &Bit)) {
+            DoneSomething |= Event(Argument, (SelectorBit * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) + Bit);
+
+            Work &= ~((ULONG_PTR)1 << Bit);
+        }
+
+        Next = (SelectorBit + 1) * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+
+        if (Next >= XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR)
+            Next = 0;
+    }
+
+    *Port = Next;
+
+    return DoneSomething;
+}
+
+#endif  // _XENBUS_SHARED_INFO_SCAN_H
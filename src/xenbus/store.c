@@ -36,8 +36,12 @@
 #include <xen.h>
 
 #include "store.h"
+#include "store_ring.h"
+#include "store_watch.h"
 #include "evtchn.h"
 #include "fdo.h"
+#include "thread.h"
+#include "registry.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -56,18 +60,35 @@ struct _XENBUS_STORE_TRANSACTION {
     PVOID       Caller;
     uint32_t    Id;
     BOOLEAN     Active; // Must be tested at >= DISPATCH_LEVEL
+    BOOLEAN     Overflow;
+    LIST_ENTRY  PathList;
 };
 
+// Nodes modified by a transaction, which only become visible to other
+// readers (and hence stale in the cache) when the transaction commits
+typedef struct _XENBUS_STORE_TRANSACTION_PATH {
+    LIST_ENTRY  ListEntry;
+    CHAR        Data[1];
+} XENBUS_STORE_TRANSACTION_PATH, *PXENBUS_STORE_TRANSACTION_PATH;
+
 #define STORE_WATCH_MAGIC 'CTAW'
 
 struct _XENBUS_STORE_WATCH {
-    LIST_ENTRY  ListEntry;
-    ULONG       Magic;
-    PVOID       Caller;
-    USHORT      Id;
-    PCHAR       Path;
-    PKEVENT     Event;
-    BOOLEAN     Active; // Must be tested at >= DISPATCH_LEVEL
+    LIST_ENTRY                  ListEntry;
+    ULONG                       Magic;
+    PVOID                       Caller;
+    PXENBUS_STORE_WATCH_NODE    Node;
+    LIST_ENTRY                  NodeListEntry;
+    PCHAR                       Path;
+    PKEVENT                     Event;
+    XENBUS_STORE_WATCH_CALLBACK Callback;
+    PVOID                       Argument;
+    LONGLONG                    Window;
+    LIST_ENTRY                  DeliveryListEntry;
+    PCHAR                       Pending;    // Must be tested at >= DISPATCH_LEVEL
+    LARGE_INTEGER               Due;
+    BOOLEAN                     Delivering; // Must be tested at >= DISPATCH_LEVEL
+    BOOLEAN                     Active;     // Must be tested at >= DISPATCH_LEVEL
 };
 
 typedef enum _XENBUS_STORE_REQUEST_STATE {
@@ -90,11 +111,38 @@ enum {
     XENBUS_STORE_RESPONSE_SEGMENT_COUNT
 };
 
+#define XENBUS_STORE_BUFFER_MAGIC   'FFUB'
+
+typedef struct _XENBUS_STORE_BUFFER {
+    SLIST_ENTRY CacheListEntry;
+    LIST_ENTRY  ListEntry;
+    ULONG       Magic;
+    ULONG       Class;
+    ULONG       Processor;
+    PVOID       Caller;
+    CHAR        Data[1];
+} XENBUS_STORE_BUFFER, *PXENBUS_STORE_BUFFER;
+
+// Buffer size classes run from 32 to 512 bytes of data. Anything
+// larger comes straight from the pool.
+#define XENBUS_STORE_BUFFER_CLASS_SHIFT 5
+#define XENBUS_STORE_BUFFER_CLASS_COUNT 5
+#define XENBUS_STORE_BUFFER_CACHE_DEPTH 32
+
+typedef struct _XENBUS_STORE_PROCESSOR {
+    SLIST_HEADER    BufferCache[XENBUS_STORE_BUFFER_CLASS_COUNT];
+    KSPIN_LOCK      Lock;
+    LIST_ENTRY      BufferList;
+} XENBUS_STORE_PROCESSOR, *PXENBUS_STORE_PROCESSOR;
+
+// The payload of a reply is received directly into a buffer sized to
+// fit, which can be handed to the caller as-is
 typedef struct _XENBUS_STORE_RESPONSE {
+    SLIST_ENTRY             ListEntry;
     struct xsd_sockmsg      Header;
-    CHAR                    Data[XENSTORE_PAYLOAD_MAX];
     XENBUS_STORE_SEGMENT    Segment[XENBUS_STORE_RESPONSE_SEGMENT_COUNT];
     ULONG                   Index;
+    PXENBUS_STORE_BUFFER    Buffer;
 } XENBUS_STORE_RESPONSE, *PXENBUS_STORE_RESPONSE;
 
 #define XENBUS_STORE_REQUEST_SEGMENT_COUNT  8
@@ -106,17 +154,106 @@ typedef struct _XENBUS_STORE_REQUEST {
     ULONG                               Count;
     ULONG                               Index;
     LIST_ENTRY                          ListEntry;
+    LIST_ENTRY                          BucketListEntry;
     PXENBUS_STORE_RESPONSE              Response;
+    XENBUS_STORE_COMPLETION             Completion;
+    PVOID                               Argument;
+    PVOID                               Caller;
+    LARGE_INTEGER                       Submitted;
+    PKEVENT                             Event;
 } XENBUS_STORE_REQUEST, *PXENBUS_STORE_REQUEST;
 
-#define XENBUS_STORE_BUFFER_MAGIC   'FFUB'
+#define STORE_DIRECTORY_MAGIC 'TCRD'
 
-typedef struct _XENBUS_STORE_BUFFER {
+// A directory is held as the list of replies that make it up, and
+// child names are returned from those replies in place
+typedef struct _XENBUS_STORE_DIRECTORY_CHUNK {
+    LIST_ENTRY                      ListEntry;
+    PXENBUS_STORE_RESPONSE          Response;
+    PCHAR                           Data;
+    ULONG                           Length;
+} XENBUS_STORE_DIRECTORY_CHUNK, *PXENBUS_STORE_DIRECTORY_CHUNK;
+
+struct _XENBUS_STORE_DIRECTORY {
+    ULONG                           Magic;
+    PVOID                           Caller;
+    LIST_ENTRY                      ChunkList;
+    PXENBUS_STORE_DIRECTORY_CHUNK   Chunk;
+    ULONG                           Offset;
+    ULONG                           Count;
+};
+
+#define STORE_PATH_MAGIC 'HTAP'
+
+// A path is formatted once so that it can be put on the ring as a
+// single segment, and its cache hash computed up front
+struct _XENBUS_STORE_PATH {
     LIST_ENTRY  ListEntry;
     ULONG       Magic;
     PVOID       Caller;
+    ULONG       Hash;
+    ULONG       Length;
     CHAR        Data[1];
-} XENBUS_STORE_BUFFER, *PXENBUS_STORE_BUFFER;
+};
+
+// Latencies are counted in buckets of powers of two microseconds
+#define XENBUS_STORE_HISTOGRAM_TYPE_COUNT   (XS_DIRECTORY_PART + 1)
+#define XENBUS_STORE_HISTOGRAM_BUCKET_COUNT 24
+
+// Store traffic can be captured into a byte ring of variable-length
+// records, each holding the message header and the whole payload so
+// that the traffic can be replayed (see tools/store/capture_replay.c).
+// The ring size is a power of two and always fits the largest record.
+#define XENBUS_STORE_CAPTURE_MINIMUM        0x4000
+#define XENBUS_STORE_CAPTURE_MAXIMUM        0x1000000
+
+// Payloads are dumped this many bytes to a line
+#define XENBUS_STORE_CAPTURE_LINE_LENGTH    64
+
+typedef struct _XENBUS_STORE_CAPTURE_RECORD {
+    LARGE_INTEGER       Timestamp;
+    BOOLEAN             Response;
+    struct xsd_sockmsg  Header;
+    ULONG               Length;
+    // Length bytes of payload follow
+} XENBUS_STORE_CAPTURE_RECORD, *PXENBUS_STORE_CAPTURE_RECORD;
+
+C_ASSERT(XENBUS_STORE_CAPTURE_MINIMUM >=
+         sizeof (XENBUS_STORE_CAPTURE_RECORD) + XENSTORE_PAYLOAD_MAX);
+
+typedef enum _XENBUS_STORE_TRANSACTION_EVENT {
+    XENBUS_STORE_TRANSACTION_COMMIT = 0,
+    XENBUS_STORE_TRANSACTION_CONFLICT,
+    XENBUS_STORE_TRANSACTION_RETRY,
+    XENBUS_STORE_TRANSACTION_EXHAUSTED,
+    XENBUS_STORE_TRANSACTION_EVENT_COUNT
+} XENBUS_STORE_TRANSACTION_EVENT, *PXENBUS_STORE_TRANSACTION_EVENT;
+
+// Outcomes of transactions, accumulated per call site
+typedef struct _XENBUS_STORE_TRANSACTION_SITE {
+    LIST_ENTRY  ListEntry;
+    PVOID       Caller;
+    ULONG       Count[XENBUS_STORE_TRANSACTION_EVENT_COUNT];
+} XENBUS_STORE_TRANSACTION_SITE, *PXENBUS_STORE_TRANSACTION_SITE;
+
+typedef struct _XENBUS_STORE_CACHE_ENTRY {
+    LIST_ENTRY  BucketListEntry;
+    LIST_ENTRY  ListEntry;
+    ULONG       Type;
+    ULONG       Hash;
+    PCHAR       Path;
+    PCHAR       Value;
+    ULONG       Length;
+    CHAR        Data[1];
+} XENBUS_STORE_CACHE_ENTRY, *PXENBUS_STORE_CACHE_ENTRY;
+
+#define XENBUS_STORE_CACHE_BUCKET_COUNT 64
+
+// Relative paths are cached under the absolute "/local/domain/<domid>"
+// form so that both spellings of a node share an entry
+#define XENBUS_STORE_DOMAIN_PATH_LENGTH 32
+
+#define XENBUS_STORE_REQUEST_BUCKET_COUNT   256
 
 struct _XENBUS_STORE_CONTEXT {
     PXENBUS_FDO                         Fdo;
@@ -126,15 +263,52 @@ struct _XENBUS_STORE_CONTEXT {
     USHORT                              RequestId;
     LIST_ENTRY                          SubmittedList;
     LIST_ENTRY                          PendingList;
+    LIST_ENTRY                          PendingBucket[XENBUS_STORE_REQUEST_BUCKET_COUNT];
+    LIST_ENTRY                          CompletedList;
     LIST_ENTRY                          TransactionList;
-    USHORT                              WatchId;
+    LIST_ENTRY                          TransactionSiteList;
     LIST_ENTRY                          WatchList;
-    LIST_ENTRY                          BufferList;
+    XENBUS_STORE_WATCH_INDEX            WatchIndex;
+    ULONG                               WatchRegistrations;
+    ULONG                               WatchMultiplexed;
+    KEVENT                              RegistrationEvent;
+    PXENBUS_THREAD                      DeliveryThread;
+    LIST_ENTRY                          DeliveryList;
+    KEVENT                              DeliveryEvent;
+    ULONG                               Deliveries;
+    ULONG                               Coalesced;
+    PXENBUS_STORE_PROCESSOR             Processor;
+    ULONG                               ProcessorCount;
+    LIST_ENTRY                          PathList;
+    ULONG                               CacheSize;
+    ULONG                               CacheCount;
+    ULONG                               CacheGeneration;
+    CHAR                                CacheDomainPath[XENBUS_STORE_DOMAIN_PATH_LENGTH];
+    LIST_ENTRY                          CacheList;
+    LIST_ENTRY                          CacheBucket[XENBUS_STORE_CACHE_BUCKET_COUNT];
+    ULONG                               CacheHits;
+    ULONG                               CacheMisses;
     KDPC                                Dpc;
     ULONG                               Polls;
     ULONG                               Dpcs;
     ULONG                               Events;
+    ULONG                               Sleeps;
+    ULONG                               Spins;
+    ULONGLONG                           BytesWritten;
+    ULONGLONG                           BytesRead;
+    ULONG                               RingFull;
+    LARGE_INTEGER                       Frequency;
+    LARGE_INTEGER                       StallStart;
+    ULONG                               Stall[XENBUS_STORE_HISTOGRAM_BUCKET_COUNT];
+    ULONG                               Latency[XENBUS_STORE_HISTOGRAM_TYPE_COUNT][XENBUS_STORE_HISTOGRAM_BUCKET_COUNT];
+    PUCHAR                              Capture;
+    ULONG                               CaptureSize;
+    ULONGLONG                           CaptureCount;
+    ULONGLONG                           CaptureHead;
+    ULONGLONG                           CaptureTail;
     XENBUS_STORE_RESPONSE               Response;
+    CHAR                                ResponseData[XENSTORE_PAYLOAD_MAX];
+    SLIST_HEADER                        ResponsePool;
     XENBUS_EVTCHN_INTERFACE             EvtchnInterface;
     PHYSICAL_ADDRESS                    Address;
     PXENBUS_EVTCHN_CHANNEL              Channel;
@@ -165,973 +339,3145 @@ __StoreFree(
     ExFreePoolWithTag(Buffer, XENBUS_STORE_TAG);
 }
 
-static NTSTATUS
-StorePrepareRequest(
-    IN  PXENBUS_STORE_CONTEXT       Context,
-    OUT PXENBUS_STORE_REQUEST       Request,
-    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
-    IN  enum xsd_sockmsg_type       Type,
-    IN  ...
+static FORCEINLINE ULONG
+__StoreBufferClassSize(
+    IN  ULONG   Class
     )
 {
-    ULONG                           Id;
-    KIRQL                           Irql;
-    PXENBUS_STORE_SEGMENT           Segment;
-    va_list                         Arguments;
-    NTSTATUS                        status;
+    return 1ul << (Class + XENBUS_STORE_BUFFER_CLASS_SHIFT);
+}
 
-    ASSERT(IsZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST)));
+static FORCEINLINE PXENBUS_STORE_PROCESSOR
+__StoreGetProcessor(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    ULONG                       Index;
 
-    if (Transaction != NULL) {
-        status = STATUS_UNSUCCESSFUL;
-        if (!Transaction->Active)
-            goto fail1;
+    Index = KeGetCurrentProcessorNumberEx(NULL);
 
-        Id = Transaction->Id;
-    } else {
-        Id = 0;
-    }
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    return &Context->Processor[Index];
+}
 
-    Request->Header.type = Type;
-    Request->Header.tx_id = Id;
-    Request->Header.len = 0;
+// Small buffers are drawn from per-processor caches of a few size
+// classes, so a typical read costs neither a pool call nor a lock.
+// The caches are interlocked lists since a buffer is often freed on a
+// different processor to the one on which it was allocated.
+static PXENBUS_STORE_BUFFER
+StoreAllocateBuffer(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  ULONG                   Length
+    )
+{
+    PXENBUS_STORE_BUFFER        Buffer;
+    ULONG                       Size;
+    ULONG                       Class;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    Request->Header.req_id = Context->RequestId++;
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    Size = Length + (sizeof (CHAR) * 2);    // Double-NUL terminate
 
-    Request->Count = 0;
-    Segment = &Request->Segment[Request->Count++];
+    for (Class = 0; Class < XENBUS_STORE_BUFFER_CLASS_COUNT; Class++)
+        if (Size <= __StoreBufferClassSize(Class))
+            break;
 
-    Segment->Data = (PCHAR)&Request->Header;
-    Segment->Offset = 0;
-    Segment->Length = sizeof (struct xsd_sockmsg);
+    if (Class < XENBUS_STORE_BUFFER_CLASS_COUNT) {
+        PXENBUS_STORE_PROCESSOR Processor;
+        PSLIST_ENTRY            ListEntry;
 
-    va_start(Arguments, Type);
-    for (;;) {
-        PCHAR   Data;
-        ULONG   Length;
+        Processor = __StoreGetProcessor(Context);
 
-        Data = va_arg(Arguments, PCHAR);
-        Length = va_arg(Arguments, ULONG);
-        
-        if (Data == NULL) {
-            ASSERT3U(Length, ==, 0);
-            break;
-        }
+        ListEntry = InterlockedPopEntrySList(&Processor->BufferCache[Class]);
+        if (ListEntry != NULL) {
+            Buffer = CONTAINING_RECORD(ListEntry, XENBUS_STORE_BUFFER, CacheListEntry);
+            ASSERT3U(Buffer->Magic, ==, XENBUS_STORE_BUFFER_MAGIC);
+            ASSERT3U(Buffer->Class, ==, Class);
 
-        Segment = &Request->Segment[Request->Count++];
-        ASSERT3U(Request->Count, <, XENBUS_STORE_REQUEST_SEGMENT_COUNT);
+            // Only the terminator need be reset; the payload will
+            // overwrite the rest
+            Buffer->Data[Length] = '\0';
+            Buffer->Data[Length + 1] = '\0';
 
-        Segment->Data = Data;
-        Segment->Offset = 0;
-        Segment->Length = Length;
+            return Buffer;
+        }
 
-        Request->Header.len += Segment->Length;
+        Size = __StoreBufferClassSize(Class);
     }
-    va_end(Arguments);
 
-    Request->State = XENBUS_STORE_REQUEST_PREPARED;
+    Buffer = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_BUFFER, Data) + Size);
+    if (Buffer == NULL)
+        return NULL;
 
-    return STATUS_SUCCESS;
+    Buffer->Magic = XENBUS_STORE_BUFFER_MAGIC;
+    Buffer->Class = Class;
 
-fail1:
-    return status;
+    return Buffer;
 }
 
-// prepare a request with known number of elements
-static NTSTATUS
-StorePrepareRequestFixed(
-    IN  PXENBUS_STORE_CONTEXT       Context,
-    OUT PXENBUS_STORE_REQUEST       Request,
-    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
-    IN  enum xsd_sockmsg_type       Type,
-    IN  PXENBUS_STORE_SEGMENT       Segments,
-    IN  ULONG                       NumberSegments
+static VOID
+StoreFreeBuffer(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_BUFFER    Buffer
     )
 {
-    ULONG                           Id;
-    KIRQL                           Irql;
-    NTSTATUS                        status;
-    ULONG                           Index;
+    ASSERT3U(Buffer->Magic, ==, XENBUS_STORE_BUFFER_MAGIC);
+    ASSERT(IsZeroMemory(&Buffer->ListEntry, sizeof (LIST_ENTRY)));
 
-    ASSERT(IsZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST)));
+    Buffer->Caller = NULL;
 
-    status = STATUS_INVALID_PARAMETER;
-    if (NumberSegments > XENBUS_STORE_REQUEST_SEGMENT_COUNT - 1) // need one for the header
-        goto fail1;
+    if (Buffer->Class < XENBUS_STORE_BUFFER_CLASS_COUNT) {
+        PXENBUS_STORE_PROCESSOR Processor;
+        PSLIST_HEADER           Cache;
 
-    if (Transaction != NULL) {
-        status = STATUS_UNSUCCESSFUL;
-        if (!Transaction->Active)
-            goto fail2;
+        Processor = __StoreGetProcessor(Context);
+        Cache = &Processor->BufferCache[Buffer->Class];
 
-        Id = Transaction->Id;
-    } else {
-        Id = 0;
+        // The depth check is racy but only bounds the cache loosely
+        if (QueryDepthSList(Cache) < XENBUS_STORE_BUFFER_CACHE_DEPTH) {
+            InterlockedPushEntrySList(Cache, &Buffer->CacheListEntry);
+            return;
+        }
     }
 
-    Request->Header.type = Type;
-    Request->Header.tx_id = Id;
-    Request->Header.len = 0;
+    __StoreFree(Buffer);
+}
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    Request->Header.req_id = Context->RequestId++;
-    KeReleaseSpinLock(&Context->Lock, Irql);
+// Outstanding buffers are tracked on a list belonging to the processor
+// that handed them out, so that leaks can still be attributed to a
+// caller without serializing every read on a single lock.
+static VOID
+StoreTrackBuffer(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_BUFFER    Buffer,
+    IN  PVOID                   Caller
+    )
+{
+    PXENBUS_STORE_PROCESSOR     Processor;
+    KIRQL                       Irql;
 
-    // header is the first, then the actual data
-    Request->Count = NumberSegments + 1;
+    ASSERT3U(Buffer->Magic, ==, XENBUS_STORE_BUFFER_MAGIC);
+    Buffer->Caller = Caller;
 
-    Request->Segment[0].Data = (PCHAR)&Request->Header;
-    Request->Segment[0].Offset = 0;
-    Request->Segment[0].Length = sizeof(struct xsd_sockmsg);
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
-    for (Index = 0; Index < NumberSegments; Index++) {
-        Request->Segment[Index+1].Data = Segments[Index].Data;
-        Request->Segment[Index+1].Offset = 0;
-        Request->Segment[Index+1].Length = Segments[Index].Length;
+    Processor = __StoreGetProcessor(Context);
+    Buffer->Processor = (ULONG)(Processor - Context->Processor);
 
-        Request->Header.len += Segments[Index].Length;
-    }
+    KeAcquireSpinLockAtDpcLevel(&Processor->Lock);
+    InsertTailList(&Processor->BufferList, &Buffer->ListEntry);
+    KeReleaseSpinLockFromDpcLevel(&Processor->Lock);
 
-    Request->State = XENBUS_STORE_REQUEST_PREPARED;
+    KeLowerIrql(Irql);
+}
 
-    return STATUS_SUCCESS;
+static VOID
+StoreUntrackBuffer(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_BUFFER    Buffer
+    )
+{
+    PXENBUS_STORE_PROCESSOR     Processor;
+    KIRQL                       Irql;
 
-fail2:
-    Error("fail2\n");
+    ASSERT3U(Buffer->Magic, ==, XENBUS_STORE_BUFFER_MAGIC);
 
-fail1:
-    Error("fail1 (%08x)\n", status);
-    return status;
+    ASSERT3U(Buffer->Processor, <, Context->ProcessorCount);
+    Processor = &Context->Processor[Buffer->Processor];
+
+    KeAcquireSpinLock(&Processor->Lock, &Irql);
+    RemoveEntryList(&Buffer->ListEntry);
+    KeReleaseSpinLock(&Processor->Lock, Irql);
+
+    RtlZeroMemory(&Buffer->ListEntry, sizeof (LIST_ENTRY));
+    Buffer->Processor = 0;
 }
 
-static ULONG
-StoreCopyToRing(
-    IN  PXENBUS_STORE_CONTEXT           Context,
-    IN  PCHAR                           Data,
-    IN  ULONG                           Length
+static FORCEINLINE ULONG
+__StoreHashString(
+    IN  ULONG       Hash,
+    IN  const CHAR  *String
     )
 {
-    struct xenstore_domain_interface    *Shared;
-    XENSTORE_RING_IDX                   cons;
-    XENSTORE_RING_IDX                   prod;
-    ULONG                               Offset;
+    while (*String != '\0')
+        Hash = (Hash * 31) + *String++;
 
-    Shared = Context->Shared;
+    return Hash;
+}
 
-    KeMemoryBarrier();
+static ULONG
+StoreCacheHash(
+    IN  PCHAR   Domain OPTIONAL,
+    IN  PCHAR   Prefix OPTIONAL,
+    IN  PCHAR   Node
+    )
+{
+    ULONG       Hash;
 
-    prod = Shared->req_prod;
-    cons = Shared->req_cons;
+    Hash = 0;
 
-    KeMemoryBarrier();
+    if (Domain != NULL) {
+        Hash = __StoreHashString(Hash, Domain);
+        Hash = __StoreHashString(Hash, "/");
+    }
 
-    Offset = 0;
-    while (Length != 0) {
-        ULONG   Available;
-        ULONG   Index;
-        ULONG   CopyLength;
+    if (Prefix != NULL) {
+        Hash = __StoreHashString(Hash, Prefix);
+        Hash = __StoreHashString(Hash, "/");
+    }
 
-        Available = cons + XENSTORE_RING_SIZE - prod;
+    return __StoreHashString(Hash, Node);
+}
 
-        if (Available == 0)
-            break;
+static FORCEINLINE BOOLEAN
+__StoreCacheMatchPart(
+    IN OUT  PCHAR   *Path,
+    IN      PCHAR   Part OPTIONAL
+    )
+{
+    ULONG           Length;
 
-        Index = MASK_XENSTORE_IDX(prod);
+    if (Part == NULL)
+        return TRUE;
 
-        CopyLength = __min(Length, Available);
-        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+    Length = (ULONG)strlen(Part);
 
-        RtlCopyMemory(&Shared->req[Index], Data + Offset, CopyLength);
+    if (strncmp(*Path, Part, Length) != 0)
+        return FALSE;
 
-        Offset += CopyLength;
-        Length -= CopyLength;
+    *Path += Length;
 
-        prod += CopyLength;
-    }
+    return (*(*Path)++ == '/') ? TRUE : FALSE;
+}
 
-    KeMemoryBarrier();
+static BOOLEAN
+StoreCacheMatch(
+    IN  PXENBUS_STORE_CACHE_ENTRY   Entry,
+    IN  ULONG                       Type,
+    IN  ULONG                       Hash,
+    IN  PCHAR                       Domain OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node
+    )
+{
+    PCHAR                           Path;
+
+    if (Entry->Type != Type || Entry->Hash != Hash)
+        return FALSE;
 
-    Shared->req_prod = prod;
+    Path = Entry->Path;
 
-    KeMemoryBarrier();
+    if (!__StoreCacheMatchPart(&Path, Domain) ||
+        !__StoreCacheMatchPart(&Path, Prefix))
+        return FALSE;
 
-    return Offset;    
+    return (strcmp(Path, Node) == 0) ? TRUE : FALSE;
 }
 
-static NTSTATUS
-StoreSendSegment(
-    IN      PXENBUS_STORE_CONTEXT   Context,
-    IN OUT  PXENBUS_STORE_SEGMENT   Segment,
-    IN OUT  PULONG                  Written
+// Is Ancestor the same node as Path, or one of its ancestors?
+static BOOLEAN
+StoreIsPathPrefix(
+    IN  PCHAR   Ancestor,
+    IN  PCHAR   Path
     )
 {
-    ULONG                           Copied;
+    ULONG       Length;
 
-    Copied = StoreCopyToRing(Context,
-                             Segment->Data + Segment->Offset,
-                             Segment->Length - Segment->Offset);
+    Length = (ULONG)strlen(Ancestor);
+    if (Length == 0)
+        return FALSE;
 
-    Segment->Offset += Copied;
-    *Written += Copied;
+    if (strncmp(Ancestor, Path, Length) != 0)
+        return FALSE;
 
-    ASSERT3U(Segment->Offset, <=, Segment->Length);
-    return (Segment->Offset == Segment->Length) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+    return (Ancestor[Length - 1] == '/' ||
+            Path[Length] == '\0' ||
+            Path[Length] == '/') ? TRUE : FALSE;
 }
 
-static VOID
-StoreSendRequests(
-    IN      PXENBUS_STORE_CONTEXT   Context,
-    IN OUT  PULONG                  Written
+// Work out the domain path that a relative Prefix/Node should be cached
+// under. This fails if the path is relative and the domain path has not
+// been learned yet.
+static BOOLEAN
+StoreCacheResolveLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    OUT PCHAR                   *Domain
     )
 {
-    if (IsListEmpty(&Context->SubmittedList))
-        return;
+    PCHAR                       First;
 
-    while (!IsListEmpty(&Context->SubmittedList)) {
-        PLIST_ENTRY             ListEntry;
-        PXENBUS_STORE_REQUEST   Request;
+    First = (Prefix != NULL) ? Prefix : Node;
 
-        ListEntry = Context->SubmittedList.Flink;
-        ASSERT3P(ListEntry, !=, &Context->SubmittedList);
+    *Domain = NULL;
 
-        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+    if (*First == '/')
+        return TRUE;
 
-        ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_SUBMITTED);
+    if (Context->CacheDomainPath[0] == '\0')
+        return FALSE;
 
-        while (Request->Index < Request->Count) {
-            NTSTATUS    status;
+    *Domain = Context->CacheDomainPath;
+    return TRUE;
+}
 
-            status = StoreSendSegment(Context,
-                                      &Request->Segment[Request->Index],
-                                      Written);
-            if (!NT_SUCCESS(status))
-                break;
+// Return the part of an absolute Path below the domain path, or NULL
+// if it lies elsewhere
+static PCHAR
+StoreCacheRelativeLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Path
+    )
+{
+    ULONG                       Length;
 
-            Request->Index++;
-        }
+    if (Context->CacheDomainPath[0] == '\0')
+        return NULL;
 
-        if (Request->Index < Request->Count)
-            break;
+    Length = (ULONG)strlen(Context->CacheDomainPath);
 
-        ListEntry = RemoveHeadList(&Context->SubmittedList);
-        ASSERT3P(ListEntry, ==, &Request->ListEntry);
+    if (strncmp(Path, Context->CacheDomainPath, Length) != 0)
+        return NULL;
 
-        InsertTailList(&Context->PendingList, &Request->ListEntry);
-        Request->State = XENBUS_STORE_REQUEST_PENDING;
-    }
+    if (Path[Length] == '\0')
+        return Path + Length;
+
+    return (Path[Length] == '/') ? Path + Length + 1 : NULL;
 }
 
-static ULONG
-StoreCopyFromRing(
-    IN  PXENBUS_STORE_CONTEXT           Context,
-    IN  PCHAR                           Data,
-    IN  ULONG                           Length
+static VOID
+StoreCacheRemoveEntry(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_CACHE_ENTRY   Entry
     )
 {
-    struct xenstore_domain_interface    *Shared;
-    XENSTORE_RING_IDX                   cons;
-    XENSTORE_RING_IDX                   prod;
-    ULONG                               Offset;
+    RemoveEntryList(&Entry->BucketListEntry);
+    RemoveEntryList(&Entry->ListEntry);
 
-    Shared = Context->Shared;
+    ASSERT(Context->CacheCount != 0);
+    --Context->CacheCount;
 
-    KeMemoryBarrier();
+    __StoreFree(Entry);
+}
 
-    cons = Shared->rsp_cons;
-    prod = Shared->rsp_prod;
+static VOID
+StoreCacheFlushLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    Context->CacheGeneration++;
 
-    KeMemoryBarrier();
+    while (!IsListEmpty(&Context->CacheList)) {
+        PXENBUS_STORE_CACHE_ENTRY   Entry;
 
-    Offset = 0;
-    while (Length != 0) {
-        ULONG   Available;
-        ULONG   Index;
-        ULONG   CopyLength;
+        Entry = CONTAINING_RECORD(Context->CacheList.Flink,
+                                  XENBUS_STORE_CACHE_ENTRY,
+                                  ListEntry);
+        StoreCacheRemoveEntry(Context, Entry);
+    }
 
-        Available = prod - cons;
+    ASSERT3U(Context->CacheCount, ==, 0);
+}
 
-        if (Available == 0)
-            break;
+// A change to Path may alter the value of Path itself, the existence
+// of any of its descendants, and the directory listing of its parent,
+// so anything above or below it in the tree is discarded. Bumping the
+// generation stops any read that was already in flight from inserting
+// what it saw before the change.
+static VOID
+StoreCacheInvalidateLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Path
+    )
+{
+    BOOLEAN                     Relative;
+    PLIST_ENTRY                 ListEntry;
 
-        Index = MASK_XENSTORE_IDX(cons);
+    if (Context->CacheSize == 0)
+        return;
 
-        CopyLength = __min(Length, Available);
-        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+    Relative = (*Path != '/') ? TRUE : FALSE;
 
-        RtlCopyMemory(Data + Offset, &Shared->rsp[Index], CopyLength);
+    // Without the domain path we cannot tell which entries alias a
+    // relative path
+    if (Relative && Context->CacheDomainPath[0] == '\0') {
+        StoreCacheFlushLocked(Context);
+        return;
+    }
 
-        Offset += CopyLength;
-        Length -= CopyLength;
+    Context->CacheGeneration++;
 
-        cons += CopyLength;
-    }
+    ListEntry = Context->CacheList.Flink;
+    while (ListEntry != &Context->CacheList) {
+        PLIST_ENTRY                 Next = ListEntry->Flink;
+        PXENBUS_STORE_CACHE_ENTRY   Entry;
+        PCHAR                       EntryPath;
 
-    KeMemoryBarrier();
+        Entry = CONTAINING_RECORD(ListEntry, XENBUS_STORE_CACHE_ENTRY, ListEntry);
 
-    Shared->rsp_cons = cons;
+        EntryPath = (Relative) ?
+                    StoreCacheRelativeLocked(Context, Entry->Path) :
+                    Entry->Path;
 
-    KeMemoryBarrier();
+        if (EntryPath != NULL &&
+            (*EntryPath == '\0' ||  // The domain path itself
+             StoreIsPathPrefix(EntryPath, Path) ||
+             StoreIsPathPrefix(Path, EntryPath)))
+            StoreCacheRemoveEntry(Context, Entry);
 
-    return Offset;    
+        ListEntry = Next;
+    }
 }
 
-static NTSTATUS
-StoreReceiveSegment(
-    IN      PXENBUS_STORE_CONTEXT   Context,
-    IN OUT  PXENBUS_STORE_SEGMENT   Segment,
-    IN OUT  PULONG                  Read
+// The node that a request modifies is the first string in its payload,
+// which may be spread over several segments
+static PCHAR
+StoreRequestPath(
+    IN  PXENBUS_STORE_REQUEST   Request
     )
 {
-    ULONG                           Copied;
+    PCHAR                       Path;
+    ULONG                       Length;
+    ULONG                       Index;
 
-    Copied = StoreCopyFromRing(Context,
-                               Segment->Data + Segment->Offset,
-                               Segment->Length - Segment->Offset);
+    Path = __StoreAllocate(Request->Header.len + sizeof (CHAR));
+    if (Path == NULL)
+        return NULL;
 
-    Segment->Offset += Copied;
-    *Read += Copied;
+    Length = 0;
+    for (Index = 1; Index < Request->Count; Index++) {
+        PXENBUS_STORE_SEGMENT   Segment = &Request->Segment[Index];
+        ULONG                   Offset;
 
-    ASSERT3U(Segment->Offset, <=, Segment->Length);
-    return (Segment->Offset == Segment->Length) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+        for (Offset = 0; Offset < Segment->Length; Offset++) {
+            Path[Length] = Segment->Data[Offset];
+            if (Path[Length] == '\0')
+                return Path;
+
+            Length++;
+        }
+    }
+
+    Path[Length] = '\0';
+    return Path;
 }
 
-static BOOLEAN
-StoreIgnoreHeaderType(
-    IN  ULONG   Type
+static PXENBUS_STORE_TRANSACTION
+StoreFindTransactionLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  uint32_t                Id
     )
 {
-    switch (Type) {
-    case XS_DEBUG:
-    case XS_GET_PERMS:
-    case XS_INTRODUCE:
-    case XS_RELEASE:
-    case XS_GET_DOMAIN_PATH:
-    case XS_MKDIR:
-    case XS_IS_DOMAIN_INTRODUCED:
-    case XS_RESUME:
-    case XS_SET_TARGET:
-    case XS_RESTRICT:
-        return TRUE;
-    default:
-        return FALSE;
+    PLIST_ENTRY                 ListEntry;
+
+    for (ListEntry = Context->TransactionList.Flink;
+         ListEntry != &Context->TransactionList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_STORE_TRANSACTION   Transaction;
+
+        Transaction = CONTAINING_RECORD(ListEntry, XENBUS_STORE_TRANSACTION, ListEntry);
+
+        if (Transaction->Active && Transaction->Id == Id)
+            return Transaction;
     }
+
+    return NULL;
 }
 
-static BOOLEAN
-StoreVerifyHeader(
-    struct xsd_sockmsg  *Header
+static VOID
+StoreCacheCommitLocked(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL
     )
 {
-    BOOLEAN             Valid;
-
-    Valid = TRUE;
+    PLIST_ENTRY                     ListEntry;
 
-    if (Header->type != XS_DIRECTORY &&
-        Header->type != XS_READ &&
-        Header->type != XS_WATCH &&
-        Header->type != XS_UNWATCH &&
-        Header->type != XS_TRANSACTION_START &&
-        Header->type != XS_TRANSACTION_END &&
-        Header->type != XS_WRITE &&
-        Header->type != XS_RM &&
-        Header->type != XS_SET_PERMS &&
-        Header->type != XS_WATCH_EVENT &&
-        Header->type != XS_ERROR &&
-        !StoreIgnoreHeaderType(Header->type)) {
-        Error("UNRECOGNIZED TYPE 0x%08x\n", Header->type);
-        Valid = FALSE;
+    if (Transaction == NULL || Transaction->Overflow) {
+        StoreCacheFlushLocked(Context);
+        return;
     }
 
-    if (Header->len >= XENSTORE_PAYLOAD_MAX) {
-        Error("ILLEGAL LENGTH 0x%08x\n", Header->len);
-        Valid = FALSE;
-    }
+    for (ListEntry = Transaction->PathList.Flink;
+         ListEntry != &Transaction->PathList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_STORE_TRANSACTION_PATH  Path;
 
-    return Valid;    
+        Path = CONTAINING_RECORD(ListEntry, XENBUS_STORE_TRANSACTION_PATH, ListEntry);
+
+        StoreCacheInvalidateLocked(Context, Path->Data);
+    }
 }
 
-static NTSTATUS
-StoreReceiveResponse(
-    IN      PXENBUS_STORE_CONTEXT   Context,
-    IN OUT  PULONG                  Read
+// Called as the reply to a request is matched. Reads that xenstored
+// handled before the request cannot have their replies processed after
+// it, so invalidating here (rather than when the request is submitted)
+// means they either find their entry discarded or the generation moved
+// on. Changes made within a transaction are only invalidated when it
+// successfully commits.
+static VOID
+StoreCacheProcessRequestLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request
     )
 {
-    PXENBUS_STORE_RESPONSE          Response = &Context->Response;
-    NTSTATUS                        status;
+    PXENBUS_STORE_RESPONSE      Response = Request->Response;
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    PCHAR                       Path;
 
-    if (Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data != NULL)
-        goto payload;
+    if (Context->CacheSize == 0)
+        return;
 
-    status = StoreReceiveSegment(Context,
-                                 &Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT],
-                                 Read);
-    if (!NT_SUCCESS(status))
-        goto done;
+    // If the reply could not be copied then assume the request succeeded
+    if (Response != NULL && Response->Header.type == XS_ERROR)
+        return;
 
-    ASSERT(StoreVerifyHeader(&Response->Header));
+    switch (Request->Header.type) {
+    case XS_WRITE:
+    case XS_MKDIR:
+    case XS_RM:
+    case XS_SET_PERMS:
+        break;
 
-    if (Response->Header.len == 0)
-        goto done;
+    case XS_TRANSACTION_END:
+        ASSERT3U(Request->Count, >, 1);
+        if (Request->Segment[1].Data[0] == 'T')
+            StoreCacheCommitLocked(Context,
+                                   StoreFindTransactionLocked(Context,
+                                                              Request->Header.tx_id));
+        return;
 
-    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length = Response->Header.len;
-    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data = Response->Data;
+    default:
+        return;
+    }
 
-payload:
-    status = StoreReceiveSegment(Context,
-                                 &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT],
-                                 Read);
+    Path = StoreRequestPath(Request);
+
+    if (Request->Header.tx_id == 0) {
+        if (Path != NULL)
+            StoreCacheInvalidateLocked(Context, Path);
+        else
+            StoreCacheFlushLocked(Context);
+    } else {
+        Transaction = StoreFindTransactionLocked(Context, Request->Header.tx_id);
+        if (Transaction == NULL)
+            goto done;
+
+        if (Path != NULL) {
+            PXENBUS_STORE_TRANSACTION_PATH  Entry;
+            ULONG                           Length;
+
+            Length = (ULONG)strlen(Path) + sizeof (CHAR);
+
+            Entry = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_TRANSACTION_PATH, Data) +
+                                    Length);
+            if (Entry != NULL) {
+                RtlCopyMemory(Entry->Data, Path, Length);
+                InsertTailList(&Transaction->PathList, &Entry->ListEntry);
+                goto done;
+            }
+        }
+
+        // We can't remember what was touched, so flush everything on commit
+        Transaction->Overflow = TRUE;
+    }
 
 done:
-    return status;    
+    if (Path != NULL)
+        __StoreFree(Path);
 }
 
-static PXENBUS_STORE_REQUEST
-StoreFindRequest(
+// Hash is that of the path as given, which is only the key if the path
+// is absolute
+static PXENBUS_STORE_BUFFER
+StoreCacheLookupHashed(
     IN  PXENBUS_STORE_CONTEXT   Context,
-    IN  uint32_t                req_id
+    IN  ULONG                   Type,
+    IN  ULONG                   Hash,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    IN  PVOID                   Caller,
+    OUT PULONG                  Generation
     )
 {
+    PCHAR                       Domain;
+    PLIST_ENTRY                 Bucket;
     PLIST_ENTRY                 ListEntry;
-    PXENBUS_STORE_REQUEST       Request;
+    PXENBUS_STORE_CACHE_ENTRY   Entry;
+    PXENBUS_STORE_BUFFER        Buffer;
+    KIRQL                       Irql;
 
-    Request = NULL;
-    for (ListEntry = Context->PendingList.Flink;
-         ListEntry != &Context->PendingList;
-         ListEntry = ListEntry->Flink) {
+    Buffer = NULL;
 
-        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+    KeAcquireSpinLock(&Context->Lock, &Irql);
 
-        if (Request->Header.req_id == req_id)
-            break;
+    *Generation = Context->CacheGeneration;
 
-        Request = NULL;
-    }
+    if (!StoreCacheResolveLocked(Context, Prefix, Node, &Domain))
+        goto done;
 
-    return Request;
-}
+    if (Domain != NULL)
+        Hash = StoreCacheHash(Domain, Prefix, Node);
 
-static PXENBUS_STORE_WATCH
-StoreFindWatch(
-    IN  PXENBUS_STORE_CONTEXT   Context,
-    IN  USHORT                  Id
-    )
-{
-    PLIST_ENTRY                 ListEntry;
-    PXENBUS_STORE_WATCH         Watch;
+    Bucket = &Context->CacheBucket[Hash % XENBUS_STORE_CACHE_BUCKET_COUNT];
 
-    Watch = NULL;
-    for (ListEntry = Context->WatchList.Flink;
-         ListEntry != &Context->WatchList;
+    Entry = NULL;
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
          ListEntry = ListEntry->Flink) {
+        Entry = CONTAINING_RECORD(ListEntry, XENBUS_STORE_CACHE_ENTRY, BucketListEntry);
 
-        Watch = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH, ListEntry);
-
-        if (Watch->Id == Id)
+        if (StoreCacheMatch(Entry, Type, Hash, Domain, Prefix, Node))
             break;
 
-        Watch = NULL;
+        Entry = NULL;
     }
 
-    return Watch;
-}
+    if (Entry == NULL)
+        goto done;
 
-static USHORT
-StoreNextWatchId(
-    IN  PXENBUS_STORE_CONTEXT   Context
-    )
-{
-    USHORT                      Id;
-    PXENBUS_STORE_WATCH         Watch;
+    Buffer = StoreAllocateBuffer(Context, Entry->Length);
+    if (Buffer == NULL)
+        goto done;
 
-    do {
-        Id = Context->WatchId++;
-        Watch = StoreFindWatch(Context, Id);
-    } while (Watch != NULL);
+    RtlCopyMemory(Buffer->Data, Entry->Value, Entry->Length);
+
+    StoreTrackBuffer(Context, Buffer, Caller);
+
+    // Keep the list in most-recently-used order
+    RemoveEntryList(&Entry->ListEntry);
+    InsertHeadList(&Context->CacheList, &Entry->ListEntry);
+
+done:
+    if (Buffer != NULL)
+        Context->CacheHits++;
+    else
+        Context->CacheMisses++;
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
 
-    return Id;
+    return Buffer;
 }
 
-#if defined(__i386__)
-#define TOKEN_LENGTH    (sizeof ("TOK|XXXXXXXX|XXXX"))
-#elif defined(__x86_64__)
-#define TOKEN_LENGTH    (sizeof ("TOK|XXXXXXXXXXXXXXXX|XXXX"))
-#else
-#error 'Unrecognised architecture'
-#endif
+static PXENBUS_STORE_BUFFER
+StoreCacheLookup(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  ULONG                   Type,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    IN  PVOID                   Caller,
+    OUT PULONG                  Generation
+    )
+{
+    return StoreCacheLookupHashed(Context,
+                                  Type,
+                                  StoreCacheHash(NULL, Prefix, Node),
+                                  Prefix,
+                                  Node,
+                                  Caller,
+                                  Generation);
+}
 
-static NTSTATUS
-StoreParseWatchEvent(
-    IN  PCHAR   Data,
-    IN  ULONG   Length,
-    OUT PCHAR   *Path,
-    OUT PVOID   *Caller,
-    OUT PUSHORT Id
+// Path is absolute, but watches may have been set on relative paths
+static BOOLEAN
+StoreCacheIsWatched(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Path
     )
 {
-    PCHAR       End;
+    PCHAR                       Relative;
 
-    *Path = Data;
-    while (*Data != '\0' && Length != 0) {
-        Data++;
-        --Length;
-    }
+    if (__StoreWatchIndexIsWatched(&Context->WatchIndex, Path))
+        return TRUE;
 
-    if (Length != TOKEN_LENGTH + 1)
-        goto fail1;
+    Relative = StoreCacheRelativeLocked(Context, Path);
+
+    return (Relative != NULL &&
+            *Relative != '\0' &&
+            __StoreWatchIndexIsWatched(&Context->WatchIndex, Relative)) ?
+           TRUE : FALSE;
+}
+
+// Only nodes covered by a registered watch are cached, since it is the
+// watch events that tell us when a cached value has become stale.
+static VOID
+StoreCacheInsert(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  ULONG                   Type,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    IN  PXENBUS_STORE_RESPONSE  Response,
+    IN  ULONG                   Generation
+    )
+{
+    PCHAR                       Domain;
+    ULONG                       PathLength;
+    ULONG                       Length;
+    PXENBUS_STORE_CACHE_ENTRY   Entry;
+    PLIST_ENTRY                 Bucket;
+    PLIST_ENTRY                 ListEntry;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    Entry = NULL;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    // Something may have changed while the request was in flight
+    if (Generation != Context->CacheGeneration)
+        goto done;
+
+    if (!StoreCacheResolveLocked(Context, Prefix, Node, &Domain))
+        goto done;
+
+    PathLength = (ULONG)strlen(Node) + sizeof (CHAR);
+    if (Domain != NULL)
+        PathLength += (ULONG)strlen(Domain) + 1;
+    if (Prefix != NULL)
+        PathLength += (ULONG)strlen(Prefix) + 1;
+
+    Length = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length;
+
+    Entry = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_CACHE_ENTRY, Data) +
+                            PathLength +
+                            Length);
+    if (Entry == NULL)
+        goto done;
+
+    Entry->Path = Entry->Data;
+
+    status = RtlStringCbPrintfA(Entry->Path,
+                                PathLength,
+                                "%s%s%s%s%s",
+                                (Domain != NULL) ? Domain : "",
+                                (Domain != NULL) ? "/" : "",
+                                (Prefix != NULL) ? Prefix : "",
+                                (Prefix != NULL) ? "/" : "",
+                                Node);
+    ASSERT(NT_SUCCESS(status));
+
+    if (!StoreCacheIsWatched(Context, Entry->Path))
+        goto done;
+
+    Entry->Value = Entry->Path + PathLength;
+    Entry->Length = Length;
+    RtlCopyMemory(Entry->Value,
+                  Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data,
+                  Length);
+
+    Entry->Type = Type;
+    Entry->Hash = StoreCacheHash(Domain, Prefix, Node);
+
+    Bucket = &Context->CacheBucket[Entry->Hash % XENBUS_STORE_CACHE_BUCKET_COUNT];
+
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
+         ListEntry = ListEntry->Flink) {
+        if (StoreCacheMatch(CONTAINING_RECORD(ListEntry,
+                                              XENBUS_STORE_CACHE_ENTRY,
+                                              BucketListEntry),
+                            Type,
+                            Entry->Hash,
+                            Domain,
+                            Prefix,
+                            Node))
+            goto done;
+    }
+
+    InsertTailList(Bucket, &Entry->BucketListEntry);
+    InsertHeadList(&Context->CacheList, &Entry->ListEntry);
+    Context->CacheCount++;
+
+    Entry = NULL;
+
+    while (Context->CacheCount > Context->CacheSize) {
+        PXENBUS_STORE_CACHE_ENTRY   Oldest;
+
+        Oldest = CONTAINING_RECORD(Context->CacheList.Blink,
+                                   XENBUS_STORE_CACHE_ENTRY,
+                                   ListEntry);
+        StoreCacheRemoveEntry(Context, Oldest);
+    }
+
+done:
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    if (Entry != NULL)
+        __StoreFree(Entry);
+}
+
+static NTSTATUS
+StorePrepareRequest(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    OUT PXENBUS_STORE_REQUEST       Request,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  enum xsd_sockmsg_type       Type,
+    IN  ...
+    )
+{
+    ULONG                           Id;
+    KIRQL                           Irql;
+    PXENBUS_STORE_SEGMENT           Segment;
+    va_list                         Arguments;
+    NTSTATUS                        status;
+
+    ASSERT(IsZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    if (Transaction != NULL) {
+        status = STATUS_UNSUCCESSFUL;
+        if (!Transaction->Active)
+            goto fail1;
+
+        Id = Transaction->Id;
+    } else {
+        Id = 0;
+    }
+
+    Request->Header.type = Type;
+    Request->Header.tx_id = Id;
+    Request->Header.len = 0;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    Request->Header.req_id = Context->RequestId++;
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    Request->Count = 0;
+    Segment = &Request->Segment[Request->Count++];
+
+    Segment->Data = (PCHAR)&Request->Header;
+    Segment->Offset = 0;
+    Segment->Length = sizeof (struct xsd_sockmsg);
+
+    va_start(Arguments, Type);
+    for (;;) {
+        PCHAR   Data;
+        ULONG   Length;
+
+        Data = va_arg(Arguments, PCHAR);
+        Length = va_arg(Arguments, ULONG);
+        
+        if (Data == NULL) {
+            ASSERT3U(Length, ==, 0);
+            break;
+        }
+
+        Segment = &Request->Segment[Request->Count++];
+        ASSERT3U(Request->Count, <, XENBUS_STORE_REQUEST_SEGMENT_COUNT);
+
+        Segment->Data = Data;
+        Segment->Offset = 0;
+        Segment->Length = Length;
+
+        Request->Header.len += Segment->Length;
+    }
+    va_end(Arguments);
+
+    Request->State = XENBUS_STORE_REQUEST_PREPARED;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    return status;
+}
+
+// prepare a request with known number of elements
+static NTSTATUS
+StorePrepareRequestFixed(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    OUT PXENBUS_STORE_REQUEST       Request,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  enum xsd_sockmsg_type       Type,
+    IN  PXENBUS_STORE_SEGMENT       Segments,
+    IN  ULONG                       NumberSegments
+    )
+{
+    ULONG                           Id;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+    ULONG                           Index;
+
+    ASSERT(IsZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    status = STATUS_INVALID_PARAMETER;
+    if (NumberSegments > XENBUS_STORE_REQUEST_SEGMENT_COUNT - 1) // need one for the header
+        goto fail1;
+
+    if (Transaction != NULL) {
+        status = STATUS_UNSUCCESSFUL;
+        if (!Transaction->Active)
+            goto fail2;
+
+        Id = Transaction->Id;
+    } else {
+        Id = 0;
+    }
+
+    Request->Header.type = Type;
+    Request->Header.tx_id = Id;
+    Request->Header.len = 0;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    Request->Header.req_id = Context->RequestId++;
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    // header is the first, then the actual data
+    Request->Count = NumberSegments + 1;
+
+    Request->Segment[0].Data = (PCHAR)&Request->Header;
+    Request->Segment[0].Offset = 0;
+    Request->Segment[0].Length = sizeof(struct xsd_sockmsg);
+
+    for (Index = 0; Index < NumberSegments; Index++) {
+        Request->Segment[Index+1].Data = Segments[Index].Data;
+        Request->Segment[Index+1].Offset = 0;
+        Request->Segment[Index+1].Length = Segments[Index].Length;
+
+        Request->Header.len += Segments[Index].Length;
+    }
+
+    Request->State = XENBUS_STORE_REQUEST_PREPARED;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+    return status;
+}
+
+static VOID
+StoreHistogramRecord(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PULONG                  Histogram,
+    IN  LONGLONG                Ticks
+    )
+{
+    ULONGLONG                   Microseconds;
+    ULONG                       Bucket;
+
+    if (Ticks < 0)
+        Ticks = 0;
+
+    Microseconds = ((ULONGLONG)Ticks * 1000000) /
+                   (ULONGLONG)Context->Frequency.QuadPart;
+
+    // Bucket N counts latencies below 2^(N+1) microseconds
+    Bucket = 0;
+    while (Microseconds > 1 &&
+           Bucket < XENBUS_STORE_HISTOGRAM_BUCKET_COUNT - 1) {
+        Microseconds >>= 1;
+        Bucket++;
+    }
+
+    Histogram[Bucket]++;
+}
+
+// Offsets into the capture ring are byte counts since it was allocated
+static VOID
+StoreCaptureCopyIn(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  ULONGLONG               Offset,
+    IN  PVOID                   Data,
+    IN  ULONG                   Length
+    )
+{
+    PUCHAR                      Source = Data;
+
+    while (Length != 0) {
+        ULONG   Index;
+        ULONG   Copy;
+
+        Index = (ULONG)(Offset & (Context->CaptureSize - 1));
+        Copy = __min(Length, Context->CaptureSize - Index);
+
+        RtlCopyMemory(&Context->Capture[Index], Source, Copy);
+
+        Offset += Copy;
+        Source += Copy;
+        Length -= Copy;
+    }
+}
+
+static VOID
+StoreCaptureCopyOut(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  ULONGLONG               Offset,
+    OUT PVOID                   Data,
+    IN  ULONG                   Length
+    )
+{
+    PUCHAR                      Destination = Data;
+
+    while (Length != 0) {
+        ULONG   Index;
+        ULONG   Copy;
+
+        Index = (ULONG)(Offset & (Context->CaptureSize - 1));
+        Copy = __min(Length, Context->CaptureSize - Index);
+
+        RtlCopyMemory(Destination, &Context->Capture[Index], Copy);
+
+        Offset += Copy;
+        Destination += Copy;
+        Length -= Copy;
+    }
+}
+
+static VOID
+StoreCaptureRecord(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  BOOLEAN                 Response,
+    IN  struct xsd_sockmsg      *Header,
+    IN  PXENBUS_STORE_SEGMENT   Segment,
+    IN  ULONG                   Count
+    )
+{
+    XENBUS_STORE_CAPTURE_RECORD Record;
+    ULONG                       Size;
+    ULONG                       Length;
+    ULONG                       Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    if (Context->CaptureSize == 0)
+        return;
+
+    Record.Timestamp = KeQueryPerformanceCounter(NULL);
+    Record.Response = Response;
+    Record.Header = *Header;
+
+    // Nothing that xenstored would accept is truncated, but the header
+    // length still shows when something was
+    Record.Length = __min(Header->len, XENSTORE_PAYLOAD_MAX);
+    Size = sizeof (XENBUS_STORE_CAPTURE_RECORD) + Record.Length;
+
+    // The oldest records are dropped to make room
+    while (Context->CaptureTail + Size - Context->CaptureHead >
+           Context->CaptureSize) {
+        XENBUS_STORE_CAPTURE_RECORD Oldest;
+
+        StoreCaptureCopyOut(Context,
+                            Context->CaptureHead,
+                            &Oldest,
+                            sizeof (XENBUS_STORE_CAPTURE_RECORD));
+
+        Context->CaptureHead += sizeof (XENBUS_STORE_CAPTURE_RECORD) +
+                                Oldest.Length;
+    }
+
+    StoreCaptureCopyIn(Context,
+                       Context->CaptureTail,
+                       &Record,
+                       sizeof (XENBUS_STORE_CAPTURE_RECORD));
+    Context->CaptureTail += sizeof (XENBUS_STORE_CAPTURE_RECORD);
+
+    Length = Record.Length;
+    for (Index = 0; Index < Count && Length != 0; Index++) {
+        ULONG   Copy;
+
+        Copy = __min(Segment[Index].Length, Length);
+        StoreCaptureCopyIn(Context,
+                           Context->CaptureTail,
+                           Segment[Index].Data,
+                           Copy);
+        Context->CaptureTail += Copy;
+        Length -= Copy;
+    }
+    ASSERT3U(Length, ==, 0);
+
+    Context->CaptureCount++;
+}
+
+static NTSTATUS
+StoreSendSegment(
+    IN      PXENBUS_STORE_CONTEXT   Context,
+    IN OUT  PXENBUS_STORE_SEGMENT   Segment,
+    IN OUT  PULONG                  Written
+    )
+{
+    ULONG                           Copied;
+
+    Copied = StoreCopyToRing(Context->Shared,
+                             Segment->Data + Segment->Offset,
+                             Segment->Length - Segment->Offset);
+
+    Segment->Offset += Copied;
+    *Written += Copied;
+
+    ASSERT3U(Segment->Offset, <=, Segment->Length);
+    return (Segment->Offset == Segment->Length) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static VOID
+StoreSendRequests(
+    IN      PXENBUS_STORE_CONTEXT   Context,
+    IN OUT  PULONG                  Written
+    )
+{
+    if (IsListEmpty(&Context->SubmittedList))
+        return;
+
+    while (!IsListEmpty(&Context->SubmittedList)) {
+        PLIST_ENTRY             ListEntry;
+        PXENBUS_STORE_REQUEST   Request;
+
+        ListEntry = Context->SubmittedList.Flink;
+        ASSERT3P(ListEntry, !=, &Context->SubmittedList);
+
+        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+
+        ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_SUBMITTED);
+
+        while (Request->Index < Request->Count) {
+            NTSTATUS    status;
+
+            status = StoreSendSegment(Context,
+                                      &Request->Segment[Request->Index],
+                                      Written);
+            if (!NT_SUCCESS(status))
+                break;
+
+            Request->Index++;
+        }
+
+        // The request ring is full
+        if (Request->Index < Request->Count) {
+            Context->RingFull++;
+
+            if (Context->StallStart.QuadPart == 0)
+                Context->StallStart = KeQueryPerformanceCounter(NULL);
+
+            return;
+        }
+
+        ListEntry = RemoveHeadList(&Context->SubmittedList);
+        ASSERT3P(ListEntry, ==, &Request->ListEntry);
+
+        InsertTailList(&Context->PendingList, &Request->ListEntry);
+        InsertTailList(&Context->PendingBucket[Request->Header.req_id % XENBUS_STORE_REQUEST_BUCKET_COUNT],
+                       &Request->BucketListEntry);
+        Request->State = XENBUS_STORE_REQUEST_PENDING;
+
+        StoreCaptureRecord(Context,
+                           FALSE,
+                           &Request->Header,
+                           &Request->Segment[1],
+                           Request->Count - 1);
+    }
+
+    if (Context->StallStart.QuadPart != 0) {
+        LARGE_INTEGER   Now;
+
+        Now = KeQueryPerformanceCounter(NULL);
+        StoreHistogramRecord(Context,
+                             Context->Stall,
+                             Now.QuadPart - Context->StallStart.QuadPart);
+
+        Context->StallStart.QuadPart = 0;
+    }
+}
+
+static NTSTATUS
+StoreReceiveSegment(
+    IN      PXENBUS_STORE_CONTEXT   Context,
+    IN OUT  PXENBUS_STORE_SEGMENT   Segment,
+    IN OUT  PULONG                  Read
+    )
+{
+    ULONG                           Copied;
+
+    Copied = StoreCopyFromRing(Context->Shared,
+                               Segment->Data + Segment->Offset,
+                               Segment->Length - Segment->Offset);
+
+    Segment->Offset += Copied;
+    *Read += Copied;
+
+    ASSERT3U(Segment->Offset, <=, Segment->Length);
+    return (Segment->Offset == Segment->Length) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static BOOLEAN
+StoreIgnoreHeaderType(
+    IN  ULONG   Type
+    )
+{
+    switch (Type) {
+    case XS_DEBUG:
+    case XS_GET_PERMS:
+    case XS_INTRODUCE:
+    case XS_RELEASE:
+    case XS_GET_DOMAIN_PATH:
+    case XS_MKDIR:
+    case XS_IS_DOMAIN_INTRODUCED:
+    case XS_RESUME:
+    case XS_SET_TARGET:
+    case XS_RESTRICT:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static BOOLEAN
+StoreVerifyHeader(
+    struct xsd_sockmsg  *Header
+    )
+{
+    BOOLEAN             Valid;
+
+    Valid = TRUE;
+
+    if (Header->type != XS_DIRECTORY &&
+        Header->type != XS_DIRECTORY_PART &&
+        Header->type != XS_READ &&
+        Header->type != XS_WATCH &&
+        Header->type != XS_UNWATCH &&
+        Header->type != XS_TRANSACTION_START &&
+        Header->type != XS_TRANSACTION_END &&
+        Header->type != XS_WRITE &&
+        Header->type != XS_RM &&
+        Header->type != XS_SET_PERMS &&
+        Header->type != XS_WATCH_EVENT &&
+        Header->type != XS_ERROR &&
+        !StoreIgnoreHeaderType(Header->type)) {
+        Error("UNRECOGNIZED TYPE 0x%08x\n", Header->type);
+        Valid = FALSE;
+    }
+
+    if (Header->len >= XENSTORE_PAYLOAD_MAX) {
+        Error("ILLEGAL LENGTH 0x%08x\n", Header->len);
+        Valid = FALSE;
+    }
+
+    return Valid;    
+}
+
+static NTSTATUS
+StoreReceiveResponse(
+    IN      PXENBUS_STORE_CONTEXT   Context,
+    IN OUT  PULONG                  Read
+    )
+{
+    PXENBUS_STORE_RESPONSE          Response = &Context->Response;
+    NTSTATUS                        status;
+
+    if (Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data != NULL)
+        goto payload;
+
+    status = StoreReceiveSegment(Context,
+                                 &Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT],
+                                 Read);
+    if (!NT_SUCCESS(status))
+        goto done;
+
+    ASSERT(StoreVerifyHeader(&Response->Header));
+
+    if (Response->Header.len == 0)
+        goto done;
+
+    ASSERT3P(Response->Buffer, ==, NULL);
+
+    // Watch events are processed in place, but a reply will be passed
+    // to the requester so give it a buffer of its own. If that cannot
+    // be allocated then the reply is still consumed, and the request
+    // will complete with no response.
+    if (Response->Header.type != XS_WATCH_EVENT &&
+        !StoreIgnoreHeaderType(Response->Header.type))
+        Response->Buffer = StoreAllocateBuffer(Context, Response->Header.len);
+
+    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length = Response->Header.len;
+    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data =
+        (Response->Buffer != NULL) ?
+        Response->Buffer->Data :
+        Context->ResponseData;
+
+payload:
+    status = StoreReceiveSegment(Context,
+                                 &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT],
+                                 Read);
+
+done:
+    return status;    
+}
+
+static PXENBUS_STORE_REQUEST
+StoreFindRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  uint32_t                req_id
+    )
+{
+    PLIST_ENTRY                 Bucket;
+    PLIST_ENTRY                 ListEntry;
+    PXENBUS_STORE_REQUEST       Request;
+
+    Bucket = &Context->PendingBucket[req_id % XENBUS_STORE_REQUEST_BUCKET_COUNT];
+
+    Request = NULL;
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
+         ListEntry = ListEntry->Flink) {
+
+        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, BucketListEntry);
+
+        if (Request->Header.req_id == req_id)
+            break;
+
+        Request = NULL;
+    }
+
+    return Request;
+}
+
+static NTSTATUS
+StoreGetWatchId(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_WATCH_NODE    Node
+    )
+{
+    PXENBUS_STORE_WATCH_TABLE   Table;
+    NTSTATUS                    status;
+
+    if (Context->WatchIndex.FreeCount == 0) {
+        Table = __StoreAllocate(sizeof (XENBUS_STORE_WATCH_TABLE));
+
+        status = STATUS_NO_MEMORY;
+        if (Table == NULL)
+            goto fail1;
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (!__StoreWatchIndexGrow(&Context->WatchIndex, Table))
+            goto fail2;
+    }
+
+    __StoreWatchIndexGetId(&Context->WatchIndex, Node);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    __StoreFree(Table);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+StoreWatchIndexRehash(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PLIST_ENTRY                 Bucket;
+
+    Bucket = __StoreAllocate(sizeof (LIST_ENTRY) <<
+                             (Context->WatchIndex.BucketShift + 1));
+
+    // Failure is not fatal; the hash chains just stay long
+    if (Bucket == NULL)
+        return;
+
+    Bucket = __StoreWatchIndexRehash(&Context->WatchIndex, Bucket);
+    if (Bucket != NULL)
+        __StoreFree(Bucket);
+}
+
+static VOID
+StoreWatchNodePrune(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_WATCH_NODE    Node
+    )
+{
+    while (Node != &Context->WatchIndex.Root &&
+           Node->State == XENBUS_STORE_WATCH_UNREGISTERED &&
+           IsListEmpty(&Node->WatchList) &&
+           IsListEmpty(&Node->ChildList)) {
+        PXENBUS_STORE_WATCH_NODE    Parent = Node->Parent;
+
+        __StoreWatchIndexRemoveChild(&Context->WatchIndex, Node);
+        __StoreFree(Node);
+
+        Node = Parent;
+    }
+}
+
+static PXENBUS_STORE_WATCH_NODE
+StoreWatchNodeLookup(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Path
+    )
+{
+    PXENBUS_STORE_WATCH_NODE    Node;
+    ULONG                       Start;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    Node = &Context->WatchIndex.Root;
+    Start = 0;
+
+    while (Path[Start] != '\0') {
+        PXENBUS_STORE_WATCH_NODE    Child;
+        ULONG                       End;
+
+        End = __StoreWatchNextComponent(Path, Start);
+
+        Child = __StoreWatchIndexFindChild(&Context->WatchIndex, Node, Path, End);
+        if (Child == NULL) {
+            Child = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_WATCH_NODE, Path) +
+                                    End +
+                                    sizeof (CHAR));
+            if (Child == NULL) {
+                StoreWatchNodePrune(Context, Node);
+                return NULL;
+            }
+
+            RtlCopyMemory(Child->Path, Path, End);
+            Child->Name = &Child->Path[Start];
+            Child->Length = End - Start;
+
+            __StoreWatchIndexInsertChild(&Context->WatchIndex, Node, Child);
+
+            if (__StoreWatchIndexRehashNeeded(&Context->WatchIndex))
+                StoreWatchIndexRehash(Context);
+        }
+
+        Node = Child;
+        Start = (Path[End] == '/') ? End + 1 : End;
+    }
+
+    return Node;
+}
+
+static PXENBUS_STORE_WATCH_NODE
+StoreWatchNodeNext(
+    IN  PXENBUS_STORE_WATCH_NODE    Node,
+    IN  PXENBUS_STORE_WATCH_NODE    Root,
+    IN  BOOLEAN                     Descend
+    )
+{
+    // Pre-order walk of the sub-tree under Root. This is iterative
+    // since the depth of the trie is bounded only by the path length.
+    if (Descend && !IsListEmpty(&Node->ChildList))
+        return CONTAINING_RECORD(Node->ChildList.Flink, XENBUS_STORE_WATCH_NODE, ListEntry);
+
+    while (Node != Root) {
+        PXENBUS_STORE_WATCH_NODE    Parent = Node->Parent;
+
+        if (Node->ListEntry.Flink != &Parent->ChildList)
+            return CONTAINING_RECORD(Node->ListEntry.Flink, XENBUS_STORE_WATCH_NODE, ListEntry);
+
+        Node = Parent;
+    }
+
+    return NULL;
+}
+
+static PXENBUS_STORE_WATCH_NODE
+StoreWatchNodeFindRegistration(
+    IN  PXENBUS_STORE_WATCH_NODE    Node
+    )
+{
+    while (Node != NULL) {
+        if (Node->State != XENBUS_STORE_WATCH_UNREGISTERED)
+            return Node;
+
+        Node = Node->Parent;
+    }
+
+    return NULL;
+}
+
+static BOOLEAN
+StoreWatchNodeIsInUse(
+    IN  PXENBUS_STORE_WATCH_NODE    Registration
+    )
+{
+    PXENBUS_STORE_WATCH_NODE        Node;
+
+    // Look for a watch that relies on this registration. Sub-trees with
+    // a registration of their own do not.
+    Node = Registration;
+    while (Node != NULL) {
+        if (Node != Registration &&
+            Node->State != XENBUS_STORE_WATCH_UNREGISTERED) {
+            Node = StoreWatchNodeNext(Node, Registration, FALSE);
+            continue;
+        }
+
+        if (!IsListEmpty(&Node->WatchList))
+            return TRUE;
+
+        Node = StoreWatchNodeNext(Node, Registration, TRUE);
+    }
+
+    return FALSE;
+}
+
+#if defined(__i386__)
+#define TOKEN_LENGTH    (sizeof ("TOK|XXXXXXXX|XXXX"))
+#elif defined(__x86_64__)
+#define TOKEN_LENGTH    (sizeof ("TOK|XXXXXXXXXXXXXXXX|XXXX"))
+#else
+#error 'Unrecognised architecture'
+#endif
+
+static NTSTATUS
+StoreParseWatchEvent(
+    IN  PCHAR   Data,
+    IN  ULONG   Length,
+    OUT PCHAR   *Path,
+    OUT PVOID   *Caller,
+    OUT PUSHORT Id
+    )
+{
+    PCHAR       End;
+
+    *Path = Data;
+    while (*Data != '\0' && Length != 0) {
+        Data++;
+        --Length;
+    }
+
+    if (Length != TOKEN_LENGTH + 1)
+        goto fail1;
 
     // Skip over the NUL
     Data++;
     --Length;
 
-    if (Data[Length - 1] != '\0')
-        goto fail2;
+    if (Data[Length - 1] != '\0')
+        goto fail2;
+
+    if (strncmp(Data, "TOK|", 4) != 0) {
+        Warning("UNRECOGNIZED PRE-AMBLE: %02X%02X%02X%02X\n",
+                Data[0],
+                Data[1],
+                Data[2],
+                Data[3]);
+
+        goto fail3;
+    }
+
+    Data += 4;
+    *Caller = (PVOID)(ULONG_PTR)_strtoui64(Data, &End, 16);
+
+    if (*End != '|')
+        goto fail4;
+
+    Data = End + 1;
+    *Id = (USHORT)strtoul(Data, &End, 16);
+
+    if (*End != '\0')
+        goto fail5;
+
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1\n");
+
+    return STATUS_UNSUCCESSFUL;
+}
+
+static VOID
+StoreTrimPath(
+    IN  PCHAR   Path,
+    IN  PCHAR   Other
+    )
+{
+    ULONG       Index;
+    ULONG       Last;
+
+    // Truncate Path to the deepest node that is also an ancestor of
+    // (or the same as) Other
+    Last = 0;
+    for (Index = 0; Path[Index] != '\0'; Index++) {
+        if (Path[Index] != Other[Index])
+            break;
+
+        if (Path[Index] == '/')
+            Last = Index;
+    }
+
+    if (Path[Index] == '\0' &&
+        (Other[Index] == '\0' || Other[Index] == '/'))
+        return;
+
+    if (Other[Index] == '\0' && Path[Index] == '/') {
+        Path[Index] = '\0';
+        return;
+    }
+
+    if (Last == 0 && Path[0] == '/')
+        Last = 1;
+
+    Path[Last] = '\0';
+}
+
+static VOID
+StoreQueueDelivery(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_WATCH     Watch,
+    IN  PCHAR                   Path
+    )
+{
+    ULONG                       Length;
+    LARGE_INTEGER               Now;
+
+    ASSERT(Watch->Callback != NULL);
+
+    // If a delivery is already queued then fold this event into it.
+    // Every event is for a node at or under the watched path so, if
+    // the watched path is to be delivered, there is nothing to do.
+    if (Watch->Pending != NULL) {
+        if (Watch->Pending != Watch->Path)
+            StoreTrimPath(Watch->Pending, Path);
+
+        Context->Coalesced++;
+        return;
+    }
+
+    Length = (ULONG)strlen(Path) + sizeof (CHAR);
+
+    Watch->Pending = __StoreAllocate(Length);
+    if (Watch->Pending != NULL)
+        RtlCopyMemory(Watch->Pending, Path, Length);
+    else
+        Watch->Pending = Watch->Path;
+
+    KeQuerySystemTime(&Now);
+    Watch->Due.QuadPart = Now.QuadPart + Watch->Window;
+
+    InsertTailList(&Context->DeliveryList, &Watch->DeliveryListEntry);
+    ThreadWake(Context->DeliveryThread);
+}
+
+static VOID
+StoreWatchFire(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_WATCH     Watch,
+    IN  PCHAR                   Path
+    )
+{
+    if (!Watch->Active)
+        return;
+
+    if (Watch->Callback != NULL)
+        StoreQueueDelivery(Context, Watch, Path);
+    else
+        KeSetEvent(Watch->Event, 0, FALSE);
+}
+
+static VOID
+StoreWatchNodeFire(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_WATCH_NODE    Node,
+    IN  PCHAR                       Path OPTIONAL
+    )
+{
+    PLIST_ENTRY                     ListEntry;
+
+    for (ListEntry = Node->WatchList.Flink;
+         ListEntry != &Node->WatchList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_STORE_WATCH Watch;
+
+        Watch = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH, NodeListEntry);
+
+        StoreWatchFire(Context,
+                       Watch,
+                       (Path != NULL) ? Path : Watch->Path);
+    }
+}
+
+static VOID
+StoreWatchNodeDispatch(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_WATCH_NODE    Registration,
+    IN  PCHAR                       Path
+    )
+{
+    PXENBUS_STORE_WATCH_NODE        Node;
+    PXENBUS_STORE_WATCH_NODE        Descendant;
+    ULONG                           Start;
+
+    Start = (ULONG)strlen(Registration->Path);
+
+    if (strncmp(Path, Registration->Path, Start) != 0)
+        goto mismatch;
+
+    if (Path[Start] == '/')
+        Start++;
+    else if (Path[Start] != '\0' &&
+             Start != 0 &&
+             Registration->Path[Start - 1] != '/')
+        goto mismatch;
+
+    // Fire every watch on the way down to the node that changed, stopping
+    // at any node that has its own registration since xenstored will also
+    // have queued an event for that
+    Node = Registration;
+    for (;;) {
+        PXENBUS_STORE_WATCH_NODE    Child;
+        ULONG                       End;
+
+        StoreWatchNodeFire(Context, Node, Path);
+
+        if (Path[Start] == '\0')
+            break;
+
+        End = __StoreWatchNextComponent(Path, Start);
+
+        Child = __StoreWatchIndexFindChild(&Context->WatchIndex, Node, Path, End);
+        if (Child == NULL ||
+            Child->State != XENBUS_STORE_WATCH_UNREGISTERED)
+            return;
+
+        Node = Child;
+        Start = (Path[End] == '/') ? End + 1 : End;
+    }
+
+    // If the node was removed then so were its descendants, and xenstored
+    // would have fired their watches with their own paths
+    Descendant = StoreWatchNodeNext(Node, Node, TRUE);
+    while (Descendant != NULL) {
+        if (Descendant->State != XENBUS_STORE_WATCH_UNREGISTERED) {
+            Descendant = StoreWatchNodeNext(Descendant, Node, FALSE);
+            continue;
+        }
+
+        StoreWatchNodeFire(Context, Descendant, NULL);
+        Descendant = StoreWatchNodeNext(Descendant, Node, TRUE);
+    }
+
+    return;
+
+mismatch:
+    Warning("UNEXPECTED WATCH EVENT (%s) FOR %s\n",
+            Path,
+            Registration->Path);
+}
+
+static VOID
+StoreProcessWatchEvent(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+    PCHAR                       Path;
+    PVOID                       Caller;
+    USHORT                      Id;
+    PXENBUS_STORE_WATCH_NODE    Node;
+    NTSTATUS                    status;
+
+    Response = &Context->Response;
+
+    ASSERT3U(Response->Header.req_id, ==, 0);
+
+    status = StoreParseWatchEvent(Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data,
+                                  Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length,
+                                  &Path,
+                                  &Caller,
+                                  &Id);
+    if (!NT_SUCCESS(status))
+        return;
+
+    Trace("%04x (%s)\n", Id, Path);
+
+    StoreCacheInvalidateLocked(Context, Path);
+
+    Node = __StoreWatchIndexFindId(&Context->WatchIndex, Id);
+
+    // An id may have been re-used since the event was queued, in which
+    // case the caller embedded in the token will not match
+    if (Node == NULL ||
+        Node->State == XENBUS_STORE_WATCH_UNREGISTERED ||
+        Node->Caller != Caller) {
+        PCHAR       Name;
+        ULONG_PTR   Offset;
+
+        ModuleLookup((ULONG_PTR)Caller, &Name, &Offset);
+        if (Name != NULL)
+            Warning("SPURIOUS WATCH EVENT (%s) FOR %s + %p\n",
+                    Path,
+                    Name,
+                    Offset);
+        else
+            Warning("SPURIOUS WATCH EVENT (%s) FOR %p\n",
+                    Path,
+                    Caller);
+
+        return;
+    }
+
+    StoreWatchNodeDispatch(Context, Node, Path);
+}
+
+static VOID
+StoreResetResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+    PXENBUS_STORE_SEGMENT       Segment;
+
+    Response = &Context->Response;
+
+    if (Response->Buffer != NULL)
+        StoreFreeBuffer(Context, Response->Buffer);
+
+    // Payloads with no buffer of their own land in the context
+    Segment = &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT];
+    if (Segment->Data == Context->ResponseData) {
+        ASSERT3U(Segment->Length, <=, sizeof (Context->ResponseData));
+        RtlZeroMemory(Context->ResponseData, Segment->Length);
+    }
+
+    RtlZeroMemory(Response, sizeof (XENBUS_STORE_RESPONSE));
+
+    Segment = &Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT];
+
+    Segment->Data = (PCHAR)&Response->Header;
+    Segment->Offset = 0;
+    Segment->Length = sizeof (struct xsd_sockmsg);
+}
+
+static PXENBUS_STORE_RESPONSE
+StoreGetResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PSLIST_ENTRY                ListEntry;
+    PXENBUS_STORE_RESPONSE      Response;
+
+    ListEntry = InterlockedPopEntrySList(&Context->ResponsePool);
+    if (ListEntry == NULL)
+        return __StoreAllocate(sizeof (XENBUS_STORE_RESPONSE));
+
+    Response = CONTAINING_RECORD(ListEntry, XENBUS_STORE_RESPONSE, ListEntry);
+    RtlZeroMemory(Response, sizeof (XENBUS_STORE_RESPONSE));
+
+    return Response;
+}
+
+static VOID
+StorePutResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_RESPONSE  Response
+    )
+{
+    ASSERT3P(Response->Buffer, ==, NULL);
+
+    (VOID) InterlockedPushEntrySList(&Context->ResponsePool,
+                                     &Response->ListEntry);
+}
+
+static PXENBUS_STORE_RESPONSE
+StoreCopyResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+    PXENBUS_STORE_SEGMENT       Segment;
+    NTSTATUS                    status;
+
+    Response = StoreGetResponse(Context);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail1;
+
+    Segment = &Context->Response.Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT];
+    ASSERT(IMPLY(Context->Response.Buffer != NULL,
+                 Segment->Data == Context->Response.Buffer->Data));
+
+    // The payload was dropped because no buffer was available
+    status = STATUS_NO_MEMORY;
+    if (Segment->Length != 0 && Context->Response.Buffer == NULL)
+        goto fail2;
+
+    Response->Header = Context->Response.Header;
+
+    Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT].Data = (PCHAR)&Response->Header;
+    Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT].Offset = sizeof (struct xsd_sockmsg);
+    Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT].Length = sizeof (struct xsd_sockmsg);
+
+    // Ownership of the payload buffer passes to the copy
+    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT] = *Segment;
+    Response->Buffer = Context->Response.Buffer;
+    Context->Response.Buffer = NULL;
+
+    return Response;
+
+fail2:
+    Error("fail2\n");
+
+    StorePutResponse(Context, Response);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
+static VOID
+StoreFreeResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_RESPONSE  Response
+    )
+{
+    if (Response->Buffer != NULL) {
+        StoreFreeBuffer(Context, Response->Buffer);
+        Response->Buffer = NULL;
+    }
+
+    StorePutResponse(Context, Response);
+}
+
+static PXENBUS_STORE_RESPONSE
+StoreErrorResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request,
+    IN  const CHAR              *Errno
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+    ULONG                       Length;
+    NTSTATUS                    status;
+
+    Response = StoreGetResponse(Context);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail1;
+
+    Length = (ULONG)strlen(Errno) + sizeof (CHAR);
+
+    Response->Buffer = StoreAllocateBuffer(Context, Length);
+
+    status = STATUS_NO_MEMORY;
+    if (Response->Buffer == NULL)
+        goto fail2;
+
+    RtlCopyMemory(Response->Buffer->Data, Errno, Length);
+
+    Response->Header.type = XS_ERROR;
+    Response->Header.req_id = Request->Header.req_id;
+    Response->Header.tx_id = Request->Header.tx_id;
+    Response->Header.len = Length;
+
+    Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT].Data = (PCHAR)&Response->Header;
+    Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT].Offset = sizeof (struct xsd_sockmsg);
+    Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT].Length = sizeof (struct xsd_sockmsg);
+
+    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data = Response->Buffer->Data;
+    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Offset = Length;
+    Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length = Length;
+
+    return Response;
+
+fail2:
+    Error("fail2\n");
+
+    StorePutResponse(Context, Response);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
+static VOID
+StoreSignalRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request
+    )
+{
+    Request->State = XENBUS_STORE_REQUEST_COMPLETED;
+
+    KeMemoryBarrier();
+
+    // Synchronous requests submitted below DISPATCH_LEVEL have a waiter
+    // sleeping on an event. It re-acquires the lock before it looks at
+    // the request so the event cannot go away under us.
+    if (Request->Event != NULL)
+        KeSetEvent(Request->Event, IO_NO_INCREMENT, FALSE);
+
+    // Asynchronous requests are completed by the DPC, outside the lock
+    if (Request->Completion != NULL) {
+        InsertTailList(&Context->CompletedList, &Request->ListEntry);
+        (VOID) KeInsertQueueDpc(&Context->Dpc, NULL, NULL);
+    }
+}
+
+static VOID
+StoreProcessResponse(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+    PXENBUS_STORE_REQUEST       Request;
+
+    Response = &Context->Response;
+
+    StoreCaptureRecord(Context,
+                       TRUE,
+                       &Response->Header,
+                       &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT],
+                       1);
+
+    if (StoreIgnoreHeaderType(Response->Header.type)) {
+        Warning("IGNORING RESPONSE TYPE %08X\n", Response->Header.type);
+        StoreResetResponse(Context);
+        return;
+    }
+
+    if (Response->Header.type == XS_WATCH_EVENT) {
+        StoreProcessWatchEvent(Context);
+        StoreResetResponse(Context);
+        return;
+    }
+
+    Request = StoreFindRequest(Context, Response->Header.req_id);
+    if (Request == NULL) {
+        Warning("SPURIOUS RESPONSE ID %08X\n", Response->Header.req_id);
+        StoreResetResponse(Context);
+        return;
+    }
+
+    ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_PENDING);
+
+    RemoveEntryList(&Request->ListEntry);
+    RemoveEntryList(&Request->BucketListEntry);
+    RtlZeroMemory(&Request->BucketListEntry, sizeof (LIST_ENTRY));
+
+    Request->Response = StoreCopyResponse(Context);
+    StoreResetResponse(Context);
+
+    StoreCacheProcessRequestLocked(Context, Request);
+
+    if (Request->Header.type < XENBUS_STORE_HISTOGRAM_TYPE_COUNT) {
+        LARGE_INTEGER   Now;
+
+        Now = KeQueryPerformanceCounter(NULL);
+        StoreHistogramRecord(Context,
+                             Context->Latency[Request->Header.type],
+                             Now.QuadPart - Request->Submitted.QuadPart);
+    }
+
+    StoreSignalRequest(Context, Request);
+}
+
+static VOID
+StoreAbortRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request
+    )
+{
+    Trace("type = %u req_id = %u tx_id = %u\n",
+          Request->Header.type,
+          Request->Header.req_id,
+          Request->Header.tx_id);
+
+    // Fail the request as xenstored would if it were busy so that the
+    // caller can decide whether it is safe to try again
+    Request->Response = StoreErrorResponse(Context, Request, "EAGAIN");
+    StoreSignalRequest(Context, Request);
+}
+
+static BOOLEAN
+StoreIsRequestReplayable(
+    IN  PXENBUS_STORE_REQUEST   Request
+    )
+{
+    // Nothing of it can have reached the old ring
+    if (Request->Index != 0 || Request->Segment[0].Offset != 0)
+        return FALSE;
+
+    // Transaction ids do not survive
+    if (Request->Header.tx_id != 0)
+        return FALSE;
+
+    // Watch ids were released by the early suspend callback
+    if (Request->Header.type == XS_WATCH ||
+        Request->Header.type == XS_UNWATCH)
+        return FALSE;
+
+    return TRUE;
+}
+
+static NTSTATUS
+StoreCheckResponse(
+    IN  PXENBUS_STORE_RESPONSE  Response
+    )
+{
+    NTSTATUS                    status;
+
+    status = STATUS_SUCCESS;
+
+    if (Response->Header.type == XS_ERROR) {
+        PCHAR   Error;
+        ULONG   Length;
+        ULONG   Index;
+
+        Error = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data;
+        Length = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length;
+
+        if (strncmp(Error, "EQUOTA", Length) == 0) {
+            status = STATUS_QUOTA_EXCEEDED;
+            goto done;
+        }
+
+        for (Index = 0;
+             Index < sizeof (xsd_errors) / sizeof (xsd_errors[0]);
+             Index++) {
+            struct xsd_errors   *Entry = &xsd_errors[Index];
+            
+            if (strncmp(Error, Entry->errstring, Length) == 0) {
+                ERRNO_TO_STATUS(Entry->errnum, status);
+                goto done;
+            }
+        }
+
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+done:
+    return status;
+}
+
+static PXENBUS_STORE_BUFFER
+StoreCopyPayload(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_RESPONSE  Response,
+    IN  PVOID                   Caller
+    )
+{
+    PXENBUS_STORE_BUFFER        Buffer;
+    NTSTATUS                    status;
+
+    // The payload was received directly into a buffer of the right size
+    // so there is no need to copy it again
+    Buffer = Response->Buffer;
+    Response->Buffer = NULL;
+
+    if (Buffer == NULL) {
+        ASSERT3U(Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length, ==, 0);
+
+        Buffer = StoreAllocateBuffer(Context, 0);
+
+        status  = STATUS_NO_MEMORY;
+        if (Buffer == NULL)
+            goto fail1;
+    }
+
+    StoreTrackBuffer(Context, Buffer, Caller);
+
+    return Buffer;        
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
+static VOID
+StoreFreePayload(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_BUFFER    Buffer
+    )
+{
+    StoreUntrackBuffer(Context, Buffer);
+    StoreFreeBuffer(Context, Buffer);
+}
+
+static VOID
+StoreCompleteRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+    PCHAR                       Value;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_COMPLETED);
+    ASSERT(Request->Completion != NULL);
+
+    Response = Request->Response;
+    Value = NULL;
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto done;
+
+    ASSERT(Response->Header.type == XS_ERROR ||
+           Response->Header.type == Request->Header.type);
+
+    status = StoreCheckResponse(Response);
+    if (NT_SUCCESS(status) &&
+        (Request->Header.type == XS_READ ||
+         Request->Header.type == XS_DIRECTORY)) {
+        PXENBUS_STORE_BUFFER    Buffer;
+
+        Buffer = StoreCopyPayload(Context, Response, Request->Caller);
+
+        if (Buffer != NULL)
+            Value = Buffer->Data;
+        else
+            status = STATUS_NO_MEMORY;
+    }
+
+    StoreFreeResponse(Context, Response);
+
+done:
+    Request->Completion(Request->Argument, status, Value);
+
+    __StoreFree(Request);
+}
+
+static VOID
+StorePollLocked(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    ULONG                       Read;
+    ULONG                       Written;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    Context->Polls++;
+
+    do {
+        Read = Written = 0;
+
+        StoreSendRequests(Context, &Written);
+        Context->BytesWritten += Written;
+
+        if (Written != 0)
+            (VOID) XENBUS_EVTCHN(Send,
+                                 &Context->EvtchnInterface,
+                                 Context->Channel);
+
+        status = StoreReceiveResponse(Context, &Read);
+        Context->BytesRead += Read;
+
+        if (NT_SUCCESS(status))
+            StoreProcessResponse(Context);
+
+        if (Read != 0)
+            (VOID) XENBUS_EVTCHN(Send,
+                                 &Context->EvtchnInterface,
+                                 Context->Channel);
+
+    } while (Written != 0 || Read != 0);
+}
+
+static
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+StoreDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               _Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENBUS_STORE_CONTEXT   Context = _Context;
+    LIST_ENTRY              List;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Context != NULL);
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    if (Context->References != 0)
+        StorePollLocked(Context);
+
+    while (!IsListEmpty(&Context->CompletedList)) {
+        PLIST_ENTRY ListEntry;
+
+        ListEntry = RemoveHeadList(&Context->CompletedList);
+        InsertTailList(&List, ListEntry);
+    }
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY             ListEntry;
+        PXENBUS_STORE_REQUEST   Request;
+
+        ListEntry = RemoveHeadList(&List);
+        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+
+        StoreCompleteRequest(Context, Request);
+    }
+}
+
+#define TIME_US(_us)        ((_us) * 10)
+#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
+#define TIME_S(_s)          (TIME_MS((_s) * 1000))
+#define TIME_RELATIVE(_t)   (-(_t))
+
+#define XENBUS_STORE_POLL_PERIOD 5
+
+static FORCEINLINE BOOLEAN
+__StoreRequestsCompleted(
+    IN      PXENBUS_STORE_REQUEST   Request,
+    IN      ULONG                   Count,
+    IN OUT  PULONG                  Index
+    )
+{
+    while (*Index < Count &&
+           Request[*Index].State == XENBUS_STORE_REQUEST_COMPLETED)
+        (*Index)++;
+
+    return (*Index == Count) ? TRUE : FALSE;
+}
+
+static VOID
+StoreSubmitRequests(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request,
+    IN  ULONG                   Count,
+    OUT PXENBUS_STORE_RESPONSE  *Response
+    )
+{
+    KEVENT                      Event;
+    BOOLEAN                     Sleep;
+    KIRQL                       Irql;
+    LARGE_INTEGER               Timeout;
+    ULONG                       Index;
+
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
+
+    // Callers below DISPATCH_LEVEL sleep until StoreDpc() has processed
+    // their replies. Requests in flight across suspend are failed by the
+    // late suspend callback so there is no need to hold off suspend while
+    // we wait.
+    Sleep = (KeGetCurrentIrql() < DISPATCH_LEVEL) ? TRUE : FALSE;
+
+    if (Sleep)
+        KeInitializeEvent(&Event, SynchronizationEvent, FALSE);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+
+    // Queue everything before polling so that the ring is filled
+    // before we wait for the first reply
+    for (Index = 0; Index < Count; Index++) {
+        ASSERT3U(Request[Index].State, ==, XENBUS_STORE_REQUEST_PREPARED);
+
+        InsertTailList(&Context->SubmittedList, &Request[Index].ListEntry);
+        Request[Index].State = XENBUS_STORE_REQUEST_SUBMITTED;
+        Request[Index].Submitted = KeQueryPerformanceCounter(NULL);
+        Request[Index].Event = (Sleep) ? &Event : NULL;
+    }
+
+    StorePollLocked(Context);
+    KeMemoryBarrier();
+
+    Timeout.QuadPart = TIME_RELATIVE(TIME_S(XENBUS_STORE_POLL_PERIOD));
+
+    Index = 0;
+    while (!__StoreRequestsCompleted(Request, Count, &Index)) {
+        NTSTATUS    status;
+
+        if (Sleep) {
+            Context->Sleeps++;
+
+            KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+            KeLowerIrql(Irql);
+
+            status = KeWaitForSingleObject(&Event,
+                                           Executive,
+                                           KernelMode,
+                                           FALSE,
+                                           &Timeout);
+
+            KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+            KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+
+            if (status != STATUS_TIMEOUT)
+                continue;
+
+            // Fall back to polling in case an event has been lost
+            Warning("TIMED OUT\n");
+        } else {
+            Context->Spins++;
+
+            status = XENBUS_EVTCHN(Wait,
+                                   &Context->EvtchnInterface,
+                                   Context->Channel,
+                                   &Timeout);
+            if (status == STATUS_TIMEOUT)
+                Warning("TIMED OUT\n");
+        }
+
+        StorePollLocked(Context);
+        KeMemoryBarrier();
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+
+    for (Index = 0; Index < Count; Index++) {
+        Response[Index] = Request[Index].Response;
+        ASSERT(Response[Index] == NULL ||
+               Response[Index]->Header.type == XS_ERROR ||
+               Response[Index]->Header.type == Request[Index].Header.type);
+
+        RtlZeroMemory(&Request[Index], sizeof (XENBUS_STORE_REQUEST));
+    }
+
+    KeLowerIrql(Irql);
+}
+
+static PXENBUS_STORE_RESPONSE
+StoreSubmitRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request
+    )
+{
+    PXENBUS_STORE_RESPONSE      Response;
+
+    StoreSubmitRequests(Context, Request, 1, &Response);
+
+    return Response;
+}
+
+static VOID
+StoreFree(
+    IN  PINTERFACE          Interface,
+    IN  PCHAR               Value
+    )
+{
+    PXENBUS_STORE_CONTEXT   Context = Interface->Context;
+    PXENBUS_STORE_BUFFER    Buffer;
+
+    Buffer = CONTAINING_RECORD(Value, XENBUS_STORE_BUFFER, Data);
+
+    StoreFreePayload(Context, Buffer);
+}
+
+extern USHORT
+RtlCaptureStackBackTrace(
+    __in        ULONG   FramesToSkip,
+    __in        ULONG   FramesToCapture,
+    __out       PVOID   *BackTrace,
+    __out_opt   PULONG  BackTraceHash
+    );
+
+// Relative paths are only cached once we know which domain they are
+// relative to, so look that up the first time one is read
+static VOID
+StoreCacheLearnDomainPath(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node
+    )
+{
+    PCHAR                       First;
+    XENBUS_STORE_REQUEST        Request;
+    PXENBUS_STORE_RESPONSE      Response;
+    ULONG                       Domid;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    First = (Prefix != NULL) ? Prefix : Node;
+
+    if (*First == '/' || Context->CacheDomainPath[0] != '\0')
+        return;
+
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+
+    status = StorePrepareRequest(Context,
+                                 &Request,
+                                 NULL,
+                                 XS_READ,
+                                 "domid", 6,
+                                 NULL, 0);
+    ASSERT(NT_SUCCESS(status));
+
+    Response = StoreSubmitRequest(Context, &Request);
+    if (Response == NULL)
+        goto done;
+
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Domid = strtoul(Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data,
+                    NULL,
+                    10);
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    status = RtlStringCbPrintfA(Context->CacheDomainPath,
+                                sizeof (Context->CacheDomainPath),
+                                "/local/domain/%u",
+                                Domid);
+    ASSERT(NT_SUCCESS(status));
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
 
-    if (strncmp(Data, "TOK|", 4) != 0) {
-        Warning("UNRECOGNIZED PRE-AMBLE: %02X%02X%02X%02X\n",
-                Data[0],
-                Data[1],
-                Data[2],
-                Data[3]);
+fail1:
+    StoreFreeResponse(Context, Response);
 
-        goto fail3;
+done:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+}
+
+static NTSTATUS
+StoreRead(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PCHAR                       *Value
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
+    XENBUS_STORE_REQUEST            Request;
+    PXENBUS_STORE_RESPONSE          Response;
+    PXENBUS_STORE_BUFFER            Buffer;
+    ULONG                           Generation;
+    NTSTATUS                        status;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    Generation = 0;
+
+    if (Transaction == NULL && Context->CacheSize != 0) {
+        StoreCacheLearnDomainPath(Context, Prefix, Node);
+
+        Buffer = StoreCacheLookup(Context,
+                                  XS_READ,
+                                  Prefix,
+                                  Node,
+                                  Caller,
+                                  &Generation);
+        if (Buffer != NULL) {
+            *Value = Buffer->Data;
+            return STATUS_SUCCESS;
+        }
     }
 
-    Data += 4;
-    *Caller = (PVOID)(ULONG_PTR)_strtoui64(Data, &End, 16);
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
-    if (*End != '|')
+    if (Prefix == NULL) {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_READ,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     NULL, 0);
+    } else {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_READ,
+                                     Prefix, strlen(Prefix),
+                                     "/", 1,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     NULL, 0);
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Response = StoreSubmitRequest(Context, &Request);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail2;
+
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    Buffer = StoreCopyPayload(Context, Response, Caller);
+
+    status = STATUS_NO_MEMORY;
+    if (Buffer == NULL)
         goto fail4;
 
-    Data = End + 1;
-    *Id = (USHORT)strtoul(Data, &End, 16);
+    if (Transaction == NULL && Context->CacheSize != 0)
+        StoreCacheInsert(Context,
+                         XS_READ,
+                         Prefix,
+                         Node,
+                         Response,
+                         Generation);
 
-    if (*End != '\0')
-        goto fail5;
+    StoreFreeResponse(Context, Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    return STATUS_SUCCESS;
+    *Value = Buffer->Data;
 
-fail5:
-    Error("fail5\n");
+    return STATUS_SUCCESS;
 
 fail4:
-    Error("fail4\n");
-
 fail3:
-    Error("fail3\n");
+    StoreFreeResponse(Context, Response);
 
 fail2:
-    Error("fail2\n");
-
 fail1:
-    Error("fail1\n");
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    return STATUS_UNSUCCESSFUL;
+    return status;
 }
 
-static VOID
-StoreProcessWatchEvent(
-    IN  PXENBUS_STORE_CONTEXT   Context
+static NTSTATUS
+StoreWrite(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PCHAR                       Value
     )
 {
-    PXENBUS_STORE_RESPONSE      Response;
-    PCHAR                       Path;
-    PVOID                       Caller;
-    USHORT                      Id;
-    PXENBUS_STORE_WATCH         Watch;
-    NTSTATUS                    status;
+    XENBUS_STORE_REQUEST            Request;
+    PXENBUS_STORE_RESPONSE          Response;
+    NTSTATUS                        status;
 
-    Response = &Context->Response;
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
-    ASSERT3U(Response->Header.req_id, ==, 0);
+    if (Prefix == NULL) {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_WRITE,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     Value, strlen(Value),
+                                     NULL, 0);
+    } else {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_WRITE,
+                                     Prefix, strlen(Prefix),
+                                     "/", 1,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     Value, strlen(Value),
+                                     NULL, 0);
+    }
 
-    status = StoreParseWatchEvent(Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data,
-                                  Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length,
-                                  &Path,
-                                  &Caller,
-                                  &Id);
     if (!NT_SUCCESS(status))
-        return;
+        goto fail1;
 
-    Trace("%04x (%s)\n", Id, Path);
+    Response = StoreSubmitRequest(Context, &Request);
 
-    Watch = StoreFindWatch(Context, Id);
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail2;
 
-    if (Watch == NULL) {
-        PCHAR       Name;
-        ULONG_PTR   Offset;
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-        ModuleLookup((ULONG_PTR)Caller, &Name, &Offset);
-        if (Name != NULL)
-            Warning("SPURIOUS WATCH EVENT (%s) FOR %s + %p\n",
-                    Path,
-                    Name,
-                    Offset);
-        else
-            Warning("SPURIOUS WATCH EVENT (%s) FOR %p\n",
-                    Path,
-                    Caller);
+    StoreFreeResponse(Context, Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-        return;
-    }
+    return STATUS_SUCCESS;
 
-    ASSERT3P(Caller, ==, Watch->Caller);
+fail3:
+    StoreFreeResponse(Context, Response);
 
-    if (Watch->Active)
-        KeSetEvent(Watch->Event, 0, FALSE);
+fail2:
+fail1:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return status;
 }
 
-static VOID
-StoreResetResponse(
-    IN  PXENBUS_STORE_CONTEXT   Context
+#define XENBUS_STORE_VALUE_INLINE_LENGTH    64
+
+// Short values, which are the common case, are formatted into the
+// caller's buffer. Anything longer needs an allocation.
+static NTSTATUS
+StoreFormatValue(
+    IN  PCHAR       Inline,
+    IN  ULONG       InlineLength,
+    IN  const CHAR  *Format,
+    IN  va_list     Arguments,
+    OUT PCHAR       *Value
     )
 {
-    PXENBUS_STORE_RESPONSE      Response;
-    PXENBUS_STORE_SEGMENT       Segment;
+    PCHAR           Buffer;
+    ULONG           Length;
+    NTSTATUS        status;
+
+    status = RtlStringCbVPrintfA(Inline,
+                                 InlineLength,
+                                 Format,
+                                 Arguments);
+    if (NT_SUCCESS(status)) {
+        *Value = Inline;
+        return STATUS_SUCCESS;
+    }
 
-    Response = &Context->Response;
+    if (status != STATUS_BUFFER_OVERFLOW)
+        goto fail1;
 
-    RtlZeroMemory(Response, sizeof (XENBUS_STORE_RESPONSE));
+    Length = InlineLength << 1;
+    for (;;) {
+        Buffer = __StoreAllocate(Length);
 
-    Segment = &Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT];
+        status = STATUS_NO_MEMORY;
+        if (Buffer == NULL)
+            goto fail2;
 
-    Segment->Data = (PCHAR)&Response->Header;
-    Segment->Offset = 0;
-    Segment->Length = sizeof (struct xsd_sockmsg);
+        status = RtlStringCbVPrintfA(Buffer,
+                                     Length,
+                                     Format,
+                                     Arguments);
+        if (NT_SUCCESS(status))
+            break;
+
+        if (status != STATUS_BUFFER_OVERFLOW)
+            goto fail3;
+
+        __StoreFree(Buffer);
+        Length <<= 1;
+
+        ASSERT3U(Length, <=, 1024);
+    }
+
+    *Value = Buffer;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    __StoreFree(Buffer);
+
+fail2:
+fail1:
+    return status;
 }
 
-static PXENBUS_STORE_RESPONSE
-StoreCopyResponse(
-    IN  PXENBUS_STORE_CONTEXT   Context
+static NTSTATUS
+StoreVPrintf(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  const CHAR                  *Format,
+    IN  va_list                     Arguments
     )
 {
-    PXENBUS_STORE_RESPONSE      Response;
-    PXENBUS_STORE_SEGMENT       Segment;
-    NTSTATUS                    status;
-
-    Response = __StoreAllocate(sizeof (XENBUS_STORE_RESPONSE));
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    CHAR                            Inline[XENBUS_STORE_VALUE_INLINE_LENGTH];
+    PCHAR                           Buffer;
+    NTSTATUS                        status;
 
-    status = STATUS_NO_MEMORY;
-    if (Response == NULL)
+    status = StoreFormatValue(Inline,
+                              sizeof (Inline),
+                              Format,
+                              Arguments,
+                              &Buffer);
+    if (!NT_SUCCESS(status))
         goto fail1;
 
-    *Response = Context->Response;
-
-    Segment = &Response->Segment[XENBUS_STORE_RESPONSE_HEADER_SEGMENT];
-    ASSERT3P(Segment->Data, ==, (PCHAR)&Context->Response.Header);
-    Segment->Data = (PCHAR)&Response->Header;
+    status = StoreWrite(Context,
+                          Transaction,
+                          Prefix,
+                          Node,
+                          Buffer);
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
-    Segment = &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT];
-    if (Segment->Length != 0) {
-        ASSERT3P(Segment->Data, ==, Context->Response.Data);
-        Segment->Data = Response->Data;
-    } else {
-        ASSERT3P(Segment->Data, ==, NULL);
-    }
+    if (Buffer != Inline)
+        __StoreFree(Buffer);
 
-    return Response;
+    return STATUS_SUCCESS;
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+fail2:
+    if (Buffer != Inline)
+        __StoreFree(Buffer);
 
-    return NULL;
+fail1:
+    return status;
 }
 
-static VOID
-StoreFreeResponse(
-    IN  PXENBUS_STORE_RESPONSE  Response
+static NTSTATUS
+StorePrintf(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  const CHAR                  *Format,
+    ...
     )
 {
-    __StoreFree(Response);    
+    va_list                         Arguments;
+    NTSTATUS                        status;
+
+    va_start(Arguments, Format);
+    status = StoreVPrintf(Interface,
+                            Transaction,
+                            Prefix,
+                            Node,
+                            Format,
+                            Arguments);
+    va_end(Arguments);
+
+    return status;
 }
 
-static VOID
-StoreProcessResponse(
-    IN  PXENBUS_STORE_CONTEXT   Context
+static NTSTATUS
+StorePathOpen(
+    IN  PINTERFACE              Interface,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    OUT PXENBUS_STORE_PATH      *Path
     )
 {
-    PXENBUS_STORE_RESPONSE      Response;
-    PXENBUS_STORE_REQUEST       Request;
+    PXENBUS_STORE_CONTEXT       Context = Interface->Context;
+    ULONG                       Length;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
 
-    Response = &Context->Response;
+    if (Prefix == NULL)
+        Length = (ULONG)strlen(Node);
+    else
+        Length = (ULONG)strlen(Prefix) + 1 + (ULONG)strlen(Node);
 
-    if (StoreIgnoreHeaderType(Response->Header.type)) {
-        Warning("IGNORING RESPONSE TYPE %08X\n", Response->Header.type);
-        StoreResetResponse(Context);
-        return;
-    }
+    *Path = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_PATH, Data) +
+                            Length +
+                            sizeof (CHAR));
 
-    if (Response->Header.type == XS_WATCH_EVENT) {
-        StoreProcessWatchEvent(Context);
-        StoreResetResponse(Context);
-        return;
-    }
+    status = STATUS_NO_MEMORY;
+    if (*Path == NULL)
+        goto fail1;
 
-    Request = StoreFindRequest(Context, Response->Header.req_id);
-    if (Request == NULL) {
-        Warning("SPURIOUS RESPONSE ID %08X\n", Response->Header.req_id);
-        StoreResetResponse(Context);
-        return;
-    }
+    (*Path)->Magic = STORE_PATH_MAGIC;
+    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Path)->Caller, NULL);
 
-    ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_PENDING);
+    status = (Prefix == NULL) ?
+             RtlStringCbPrintfA((*Path)->Data, Length + sizeof (CHAR), "%s", Node) :
+             RtlStringCbPrintfA((*Path)->Data, Length + sizeof (CHAR), "%s/%s", Prefix, Node);
+    ASSERT(NT_SUCCESS(status));
 
-    RemoveEntryList(&Request->ListEntry);
+    (*Path)->Length = Length;
+    (*Path)->Hash = StoreCacheHash(NULL, NULL, (*Path)->Data);
 
-    Request->Response = StoreCopyResponse(Context);
-    StoreResetResponse(Context);
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    InsertTailList(&Context->PathList, &(*Path)->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
 
-    Request->State = XENBUS_STORE_REQUEST_COMPLETED;
+    return STATUS_SUCCESS;
 
-    KeMemoryBarrier();
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
 }
 
 static VOID
-StorePollLocked(
-    IN  PXENBUS_STORE_CONTEXT   Context
+StorePathClose(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_STORE_PATH      Path
     )
 {
-    ULONG                       Read;
-    ULONG                       Written;
-    NTSTATUS                    status;
-
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
-
-    Context->Polls++;
+    PXENBUS_STORE_CONTEXT       Context = Interface->Context;
+    KIRQL                       Irql;
 
-    do {
-        Read = Written = 0;
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
 
-        StoreSendRequests(Context, &Written);
-        if (Written != 0)
-            (VOID) XENBUS_EVTCHN(Send,
-                                 &Context->EvtchnInterface,
-                                 Context->Channel);
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    RemoveEntryList(&Path->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
 
-        status = StoreReceiveResponse(Context, &Read);
-        if (NT_SUCCESS(status))
-            StoreProcessResponse(Context);
+    RtlZeroMemory(&Path->ListEntry, sizeof (LIST_ENTRY));
 
-        if (Read != 0)
-            (VOID) XENBUS_EVTCHN(Send,
-                                 &Context->EvtchnInterface,
-                                 Context->Channel);
+    RtlZeroMemory(Path->Data, Path->Length);
+    Path->Hash = 0;
+    Path->Length = 0;
+    Path->Caller = NULL;
+    Path->Magic = 0;
 
-    } while (Written != 0 || Read != 0);
+    ASSERT(IsZeroMemory(Path, FIELD_OFFSET(XENBUS_STORE_PATH, Data) + sizeof (CHAR)));
+    __StoreFree(Path);
 }
 
-static
-_Function_class_(KDEFERRED_ROUTINE)
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_min_(DISPATCH_LEVEL)
-_IRQL_requires_(DISPATCH_LEVEL)
-_IRQL_requires_same_
-VOID
-StoreDpc(
-    IN  PKDPC               Dpc,
-    IN  PVOID               _Context,
-    IN  PVOID               Argument1,
-    IN  PVOID               Argument2
+static NTSTATUS
+StorePathRead(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    OUT PCHAR                       *Value
     )
 {
-    PXENBUS_STORE_CONTEXT   Context = _Context;
-
-    UNREFERENCED_PARAMETER(Dpc);
-    UNREFERENCED_PARAMETER(Argument1);
-    UNREFERENCED_PARAMETER(Argument2);
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
+    XENBUS_STORE_REQUEST            Request;
+    PXENBUS_STORE_RESPONSE          Response;
+    PXENBUS_STORE_BUFFER            Buffer;
+    ULONG                           Generation;
+    NTSTATUS                        status;
 
-    ASSERT(Context != NULL);
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
-    if (Context->References != 0)
-        StorePollLocked(Context);
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
-}
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);
 
-#define TIME_US(_us)        ((_us) * 10)
-#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
-#define TIME_S(_s)          (TIME_MS((_s) * 1000))
-#define TIME_RELATIVE(_t)   (-(_t))
+    Generation = 0;
 
-#define XENBUS_STORE_POLL_PERIOD 5
+    if (Transaction == NULL && Context->CacheSize != 0) {
+        StoreCacheLearnDomainPath(Context, NULL, Path->Data);
 
-static PXENBUS_STORE_RESPONSE
-StoreSubmitRequest(
-    IN  PXENBUS_STORE_CONTEXT   Context,
-    IN  PXENBUS_STORE_REQUEST   Request
-    )
-{
-    PXENBUS_STORE_RESPONSE      Response;
-    KIRQL                       Irql;
-    LARGE_INTEGER               Timeout;
+        Buffer = StoreCacheLookupHashed(Context,
+                                        XS_READ,
+                                        Path->Hash,
+                                        NULL,
+                                        Path->Data,
+                                        Caller,
+                                        &Generation);
+        if (Buffer != NULL) {
+            *Value = Buffer->Data;
+            return STATUS_SUCCESS;
+        }
+    }
 
-    ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_PREPARED);
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
-    // Make sure we don't suspend
-    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
-    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    // The path and its terminator go on the ring as a single segment
+    status = StorePrepareRequest(Context,
+                                 &Request,
+                                 Transaction,
+                                 XS_READ,
+                                 Path->Data, Path->Length + 1,
+                                 NULL, 0);
+    if (!NT_SUCCESS(status))
+        goto fail1;
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    Response = StoreSubmitRequest(Context, &Request);
 
-    InsertTailList(&Context->SubmittedList, &Request->ListEntry);
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail2;
 
-    Request->State = XENBUS_STORE_REQUEST_SUBMITTED;
-    StorePollLocked(Context);
-    KeMemoryBarrier();
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-    Timeout.QuadPart = TIME_RELATIVE(TIME_S(XENBUS_STORE_POLL_PERIOD));
+    Buffer = StoreCopyPayload(Context, Response, Caller);
 
-    while (Request->State != XENBUS_STORE_REQUEST_COMPLETED) {
-        NTSTATUS    status;
+    status = STATUS_NO_MEMORY;
+    if (Buffer == NULL)
+        goto fail4;
 
-        status = XENBUS_EVTCHN(Wait,
-                               &Context->EvtchnInterface,
-                               Context->Channel,
-                               &Timeout);
-        if (status == STATUS_TIMEOUT)
-            Warning("TIMED OUT\n");
+    if (Transaction == NULL && Context->CacheSize != 0)
+        StoreCacheInsert(Context,
+                         XS_READ,
+                         NULL,
+                         Path->Data,
+                         Response,
+                         Generation);
 
-        StorePollLocked(Context);
-        KeMemoryBarrier();
-    }
+    StoreFreeResponse(Context, Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    *Value = Buffer->Data;
 
-    Response = Request->Response;
-    ASSERT(Response == NULL ||
-           Response->Header.type == XS_ERROR ||
-           Response->Header.type == Request->Header.type);
+    return STATUS_SUCCESS;
 
-    RtlZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST));
+fail4:
+fail3:
+    StoreFreeResponse(Context, Response);
 
-    KeLowerIrql(Irql);
+fail2:
+fail1:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    return Response;
+    return status;
 }
 
 static NTSTATUS
-StoreCheckResponse(
-    IN  PXENBUS_STORE_RESPONSE  Response
+StorePathVPrintf(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    IN  const CHAR                  *Format,
+    IN  va_list                     Arguments
     )
 {
-    NTSTATUS                    status;
-
-    status = STATUS_SUCCESS;
-
-    if (Response->Header.type == XS_ERROR) {
-        PCHAR   Error;
-        ULONG   Length;
-        ULONG   Index;
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    CHAR                            Inline[XENBUS_STORE_VALUE_INLINE_LENGTH];
+    PCHAR                           Value;
+    XENBUS_STORE_REQUEST            Request;
+    PXENBUS_STORE_RESPONSE          Response;
+    NTSTATUS                        status;
 
-        Error = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data;
-        Length = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length;
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
 
-        if (strncmp(Error, "EQUOTA", Length) == 0) {
-            status = STATUS_QUOTA_EXCEEDED;
-            goto done;
-        }
+    status = StoreFormatValue(Inline,
+                              sizeof (Inline),
+                              Format,
+                              Arguments,
+                              &Value);
+    if (!NT_SUCCESS(status))
+        goto fail1;
 
-        for (Index = 0;
-             Index < sizeof (xsd_errors) / sizeof (xsd_errors[0]);
-             Index++) {
-            struct xsd_errors   *Entry = &xsd_errors[Index];
-            
-            if (strncmp(Error, Entry->errstring, Length) == 0) {
-                ERRNO_TO_STATUS(Entry->errnum, status);
-                goto done;
-            }
-        }
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
-        status = STATUS_UNSUCCESSFUL;
-    }
+    status = StorePrepareRequest(Context,
+                                 &Request,
+                                 Transaction,
+                                 XS_WRITE,
+                                 Path->Data, Path->Length + 1,
+                                 Value, strlen(Value),
+                                 NULL, 0);
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
-done:
-    return status;
-}
+    Response = StoreSubmitRequest(Context, &Request);
 
-static PXENBUS_STORE_BUFFER
-StoreCopyPayload(
-    IN  PXENBUS_STORE_CONTEXT   Context,
-    IN  PXENBUS_STORE_RESPONSE  Response,
-    IN  PVOID                   Caller
-    )
-{
-    PCHAR                       Data;
-    ULONG                       Length;
-    PXENBUS_STORE_BUFFER        Buffer;
-    KIRQL                       Irql;
-    NTSTATUS                    status;
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail3;
 
-    Data = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data;
-    Length = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length;
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail4;
 
-    Buffer = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_BUFFER, Data) +
-                             Length +
-                             (sizeof (CHAR) * 2));  // Double-NUL terminate
+    StoreFreeResponse(Context, Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    status  = STATUS_NO_MEMORY;
-    if (Buffer == NULL)
-        goto fail1;
+    if (Value != Inline)
+        __StoreFree(Value);
 
-    Buffer->Magic = XENBUS_STORE_BUFFER_MAGIC;
-    Buffer->Caller = Caller;
+    return STATUS_SUCCESS;
 
-    RtlCopyMemory(Buffer->Data, Data, Length);
+fail4:
+    StoreFreeResponse(Context, Response);
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    InsertTailList(&Context->BufferList, &Buffer->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
+fail3:
+fail2:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    return Buffer;        
+    if (Value != Inline)
+        __StoreFree(Value);
 
 fail1:
-    Error("fail1 (%08x)\n", status);
-
-    return NULL;
+    return status;
 }
 
-static VOID
-StoreFreePayload(
-    IN  PXENBUS_STORE_CONTEXT   Context,
-    IN  PXENBUS_STORE_BUFFER    Buffer
+static NTSTATUS
+StorePathPrintf(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    IN  const CHAR                  *Format,
+    ...
     )
 {
-    KIRQL                       Irql;
-
-    ASSERT3U(Buffer->Magic, ==, XENBUS_STORE_BUFFER_MAGIC);
+    va_list                         Arguments;
+    NTSTATUS                        status;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    RemoveEntryList(&Buffer->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    va_start(Arguments, Format);
+    status = StorePathVPrintf(Interface,
+                              Transaction,
+                              Path,
+                              Format,
+                              Arguments);
+    va_end(Arguments);
 
-    __StoreFree(Buffer);
+    return status;
 }
 
-static VOID
-StoreFree(
-    IN  PINTERFACE          Interface,
-    IN  PCHAR               Value
+static NTSTATUS
+StoreRemove(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node
     )
 {
-    PXENBUS_STORE_CONTEXT   Context = Interface->Context;
-    PXENBUS_STORE_BUFFER    Buffer;
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    XENBUS_STORE_REQUEST            Request;
+    PXENBUS_STORE_RESPONSE          Response;
+    NTSTATUS                        status;
 
-    Buffer = CONTAINING_RECORD(Value, XENBUS_STORE_BUFFER, Data);
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
-    StoreFreePayload(Context, Buffer);
-}
+    if (Prefix == NULL) {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_RM,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     NULL, 0);
+    } else {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_RM,
+                                     Prefix, strlen(Prefix),
+                                     "/", 1,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     NULL, 0);
+    }
 
-extern USHORT
-RtlCaptureStackBackTrace(
-    __in        ULONG   FramesToSkip,
-    __in        ULONG   FramesToCapture,
-    __out       PVOID   *BackTrace,
-    __out_opt   PULONG  BackTraceHash
-    );
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Response = StoreSubmitRequest(Context, &Request);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail2;
+
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    StoreFreeResponse(Context, Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return STATUS_SUCCESS;
+
+fail3:
+    StoreFreeResponse(Context, Response);
+
+fail2:
+fail1:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return status;
+}
 
 static NTSTATUS
-StoreRead(
+StoreDirectory(
     IN  PINTERFACE                  Interface,
     IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
     IN  PCHAR                       Prefix OPTIONAL,
@@ -1144,17 +3490,35 @@ StoreRead(
     XENBUS_STORE_REQUEST            Request;
     PXENBUS_STORE_RESPONSE          Response;
     PXENBUS_STORE_BUFFER            Buffer;
+    ULONG                           Generation;
     NTSTATUS                        status;
 
     (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
 
+    Generation = 0;
+
+    if (Transaction == NULL && Context->CacheSize != 0) {
+        StoreCacheLearnDomainPath(Context, Prefix, Node);
+
+        Buffer = StoreCacheLookup(Context,
+                                  XS_DIRECTORY,
+                                  Prefix,
+                                  Node,
+                                  Caller,
+                                  &Generation);
+        if (Buffer != NULL) {
+            *Value = Buffer->Data;
+            return STATUS_SUCCESS;
+        }
+    }
+
     RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
     if (Prefix == NULL) {
         status = StorePrepareRequest(Context,
                                      &Request,
                                      Transaction,
-                                     XS_READ,
+                                     XS_DIRECTORY,
                                      Node, strlen(Node),
                                      "", 1,
                                      NULL, 0);
@@ -1162,7 +3526,7 @@ StoreRead(
         status = StorePrepareRequest(Context,
                                      &Request,
                                      Transaction,
-                                     XS_READ,
+                                     XS_DIRECTORY,
                                      Prefix, strlen(Prefix),
                                      "/", 1,
                                      Node, strlen(Node),
@@ -1189,7 +3553,15 @@ StoreRead(
     if (Buffer == NULL)
         goto fail4;
 
-    StoreFreeResponse(Response);
+    if (Transaction == NULL && Context->CacheSize != 0)
+        StoreCacheInsert(Context,
+                         XS_DIRECTORY,
+                         Prefix,
+                         Node,
+                         Response,
+                         Generation);
+
+    StoreFreeResponse(Context, Response);
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
     *Value = Buffer->Data;
@@ -1198,311 +3570,669 @@ StoreRead(
 
 fail4:
 fail3:
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
+
+fail2:
+fail1:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return status;
+}
+
+static NTSTATUS
+StoreDirectoryFetch(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Path,
+    IN  PCHAR                       Offset OPTIONAL,
+    OUT PXENBUS_STORE_RESPONSE      *Response
+    )
+{
+    XENBUS_STORE_REQUEST            Request;
+    NTSTATUS                        status;
+
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+
+    if (Offset == NULL) {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_DIRECTORY,
+                                     Path, strlen(Path),
+                                     "", 1,
+                                     NULL, 0);
+    } else {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_DIRECTORY_PART,
+                                     Path, strlen(Path),
+                                     "", 1,
+                                     Offset, strlen(Offset),
+                                     "", 1,
+                                     NULL, 0);
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    *Response = StoreSubmitRequest(Context, &Request);
+
+    status = STATUS_NO_MEMORY;
+    if (*Response == NULL)
+        goto fail2;
+
+    status = StoreCheckResponse(*Response);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return STATUS_SUCCESS;
+
+fail3:
+    StoreFreeResponse(Context, *Response);
+    *Response = NULL;
+
+fail2:
+fail1:
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return status;
+}
+
+static NTSTATUS
+StoreDirectoryAddChunk(
+    IN  PXENBUS_STORE_DIRECTORY         Directory,
+    IN  PXENBUS_STORE_RESPONSE          Response,
+    IN  PCHAR                           Data,
+    IN  ULONG                           Length
+    )
+{
+    PXENBUS_STORE_DIRECTORY_CHUNK       Chunk;
+
+    Chunk = __StoreAllocate(sizeof (XENBUS_STORE_DIRECTORY_CHUNK));
+    if (Chunk == NULL)
+        return STATUS_NO_MEMORY;
+
+    Chunk->Response = Response;
+    Chunk->Data = Data;
+    Chunk->Length = Length;
+
+    InsertTailList(&Directory->ChunkList, &Chunk->ListEntry);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+StoreDirectoryFreeChunks(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_DIRECTORY Directory
+    )
+{
+    while (!IsListEmpty(&Directory->ChunkList)) {
+        PLIST_ENTRY                     ListEntry;
+        PXENBUS_STORE_DIRECTORY_CHUNK   Chunk;
+
+        ListEntry = RemoveHeadList(&Directory->ChunkList);
+        Chunk = CONTAINING_RECORD(ListEntry, XENBUS_STORE_DIRECTORY_CHUNK, ListEntry);
+
+        StoreFreeResponse(Context, Chunk->Response);
+        __StoreFree(Chunk);
+    }
+}
+
+#define XENBUS_STORE_DIRECTORY_ATTEMPTS 8
+
+static NTSTATUS
+StoreDirectoryFetchParts(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Path,
+    IN  PXENBUS_STORE_DIRECTORY     Directory
+    )
+{
+    CHAR                            Generation[sizeof ("18446744073709551615")];
+    PXENBUS_STORE_RESPONSE          Response;
+    ULONG                           Attempt;
+    ULONG                           Offset;
+    NTSTATUS                        status;
+
+    Generation[0] = '\0';
+    Attempt = 0;
+    Offset = 0;
+
+    for (;;) {
+        CHAR                    OffsetString[sizeof ("4294967295")];
+        PCHAR                   Data;
+        ULONG                   Length;
+        ULONG                   Skip;
+        BOOLEAN                 Last;
+
+        status = RtlStringCbPrintfA(OffsetString,
+                                    sizeof (OffsetString),
+                                    "%lu",
+                                    Offset);
+        ASSERT(NT_SUCCESS(status));
+
+        status = StoreDirectoryFetch(Context,
+                                     Transaction,
+                                     Path,
+                                     OffsetString,
+                                     &Response);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        Data = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data;
+        Length = Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length;
+
+        // Each part starts with the generation of the node. The payload
+        // is NUL terminated beyond Length so strlen() is safe here.
+        status = STATUS_UNSUCCESSFUL;
+        if (Length == 0)
+            goto fail2;
+
+        Skip = (ULONG)strlen(Data) + 1;
+        if (Skip >= Length || Skip > sizeof (Generation))
+            goto fail2;
+
+        if (Offset == 0) {
+            RtlCopyMemory(Generation, Data, Skip);
+        } else if (strcmp(Generation, Data) != 0) {
+            // The directory has changed so start again
+            StoreFreeResponse(Context, Response);
+            StoreDirectoryFreeChunks(Context, Directory);
+
+            status = STATUS_RETRY;
+            if (++Attempt == XENBUS_STORE_DIRECTORY_ATTEMPTS)
+                goto fail1;
+
+            Offset = 0;
+            continue;
+        }
+
+        Data += Skip;
+        Length -= Skip;
+
+        // The last part is terminated by an empty name
+        Last = (Length == 1 || Data[Length - 2] == '\0') ? TRUE : FALSE;
+        if (Last)
+            --Length;
+
+        status = STATUS_UNSUCCESSFUL;
+        if (!Last && Length == 0)
+            goto fail2;
+
+        status = StoreDirectoryAddChunk(Directory, Response, Data, Length);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        if (Last)
+            break;
+
+        Offset += Length;
+    }
+
+    return STATUS_SUCCESS;
 
 fail2:
+    Error("fail2\n");
+
+    StoreFreeResponse(Context, Response);
+
 fail1:
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    Error("fail1 (%08x)\n", status);
+
+    StoreDirectoryFreeChunks(Context, Directory);
 
     return status;
 }
 
 static NTSTATUS
-StoreWrite(
-    IN  PXENBUS_STORE_CONTEXT       Context,
+StoreDirectoryOpen(
+    IN  PINTERFACE                  Interface,
     IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
     IN  PCHAR                       Prefix OPTIONAL,
     IN  PCHAR                       Node,
-    IN  PCHAR                       Value
+    OUT PXENBUS_STORE_DIRECTORY     *Directory,
+    OUT PULONG                      Count OPTIONAL
     )
 {
-    XENBUS_STORE_REQUEST            Request;
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    ULONG                           Length;
+    PCHAR                           Path;
     PXENBUS_STORE_RESPONSE          Response;
+    PLIST_ENTRY                     ListEntry;
     NTSTATUS                        status;
 
-    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
-
-    if (Prefix == NULL) {
-        status = StorePrepareRequest(Context,
-                                     &Request,
-                                     Transaction,
-                                     XS_WRITE,
-                                     Node, strlen(Node),
-                                     "", 1,
-                                     Value, strlen(Value),
-                                     NULL, 0);
-    } else {
-        status = StorePrepareRequest(Context,
-                                     &Request,
-                                     Transaction,
-                                     XS_WRITE,
-                                     Prefix, strlen(Prefix),
-                                     "/", 1,
-                                     Node, strlen(Node),
-                                     "", 1,
-                                     Value, strlen(Value),
-                                     NULL, 0);
-    }
+    *Directory = __StoreAllocate(sizeof (XENBUS_STORE_DIRECTORY));
 
-    if (!NT_SUCCESS(status))
+    status = STATUS_NO_MEMORY;
+    if (*Directory == NULL)
         goto fail1;
 
-    Response = StoreSubmitRequest(Context, &Request);
+    (*Directory)->Magic = STORE_DIRECTORY_MAGIC;
+    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Directory)->Caller, NULL);
+
+    InitializeListHead(&(*Directory)->ChunkList);
+
+    if (Prefix == NULL)
+        Length = (ULONG)strlen(Node) + sizeof (CHAR);
+    else
+        Length = (ULONG)strlen(Prefix) + 1 + (ULONG)strlen(Node) + sizeof (CHAR);
+
+    Path = __StoreAllocate(Length);
 
     status = STATUS_NO_MEMORY;
-    if (Response == NULL)
+    if (Path == NULL)
         goto fail2;
 
-    status = StoreCheckResponse(Response);
+    status = (Prefix == NULL) ?
+             RtlStringCbPrintfA(Path, Length, "%s", Node) :
+             RtlStringCbPrintfA(Path, Length, "%s/%s", Prefix, Node);
+    ASSERT(NT_SUCCESS(status));
+
+    status = StoreDirectoryFetch(Context,
+                                 Transaction,
+                                 Path,
+                                 NULL,
+                                 &Response);
+    if (NT_SUCCESS(status)) {
+        status = StoreDirectoryAddChunk(*Directory,
+                                        Response,
+                                        Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Data,
+                                        Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT].Length);
+        if (!NT_SUCCESS(status))
+            StoreFreeResponse(Context, Response);
+    } else if (status == STATUS_BUFFER_OVERFLOW) {
+        // The child names do not fit in a single reply
+        status = StoreDirectoryFetchParts(Context,
+                                          Transaction,
+                                          Path,
+                                          *Directory);
+    }
+
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    StoreFreeResponse(Response);
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    __StoreFree(Path);
+
+    (*Directory)->Count = 0;
+    for (ListEntry = (*Directory)->ChunkList.Flink;
+         ListEntry != &(*Directory)->ChunkList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_STORE_DIRECTORY_CHUNK   Chunk;
+        ULONG                           Offset;
+
+        Chunk = CONTAINING_RECORD(ListEntry, XENBUS_STORE_DIRECTORY_CHUNK, ListEntry);
+
+        for (Offset = 0; Offset < Chunk->Length; Offset++)
+            if (Chunk->Data[Offset] == '\0' &&
+                Offset != 0 &&
+                Chunk->Data[Offset - 1] != '\0')
+                (*Directory)->Count++;
+    }
+
+    ListEntry = (*Directory)->ChunkList.Flink;
+    (*Directory)->Chunk = (ListEntry != &(*Directory)->ChunkList) ?
+                          CONTAINING_RECORD(ListEntry, XENBUS_STORE_DIRECTORY_CHUNK, ListEntry) :
+                          NULL;
+    (*Directory)->Offset = 0;
+
+    if (Count != NULL)
+        *Count = (*Directory)->Count;
 
     return STATUS_SUCCESS;
 
 fail3:
-    StoreFreeResponse(Response);
+    StoreDirectoryFreeChunks(Context, *Directory);
+    __StoreFree(Path);
 
 fail2:
-fail1:
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    RtlZeroMemory(&(*Directory)->ChunkList, sizeof (LIST_ENTRY));
+
+    (*Directory)->Caller = NULL;
+    (*Directory)->Magic = 0;
 
+    ASSERT(IsZeroMemory(*Directory, sizeof (XENBUS_STORE_DIRECTORY)));
+    __StoreFree(*Directory);
+
+fail1:
     return status;
 }
 
 static NTSTATUS
-StoreVPrintf(
-    IN  PINTERFACE                  Interface,
-    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
-    IN  PCHAR                       Prefix OPTIONAL,
-    IN  PCHAR                       Node,
-    IN  const CHAR                  *Format,
-    IN  va_list                     Arguments
+StoreDirectoryNext(
+    IN  PINTERFACE                      Interface,
+    IN  PXENBUS_STORE_DIRECTORY         Directory,
+    OUT PCHAR                           *Name
     )
 {
-    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
-    PCHAR                           Buffer;
-    ULONG                           Length;
-    NTSTATUS                        status;
-
-    Length = 32;
-    for (;;) {
-        Buffer = __StoreAllocate(Length);
+    PXENBUS_STORE_DIRECTORY_CHUNK       Chunk;
 
-        status = STATUS_NO_MEMORY;
-        if (Buffer == NULL)
-            goto fail1;
+    UNREFERENCED_PARAMETER(Interface);
 
-        status = RtlStringCbVPrintfA(Buffer,
-                                     Length,
-                                     Format,
-                                     Arguments);
-        if (NT_SUCCESS(status))
-            break;
+    ASSERT3U(Directory->Magic, ==, STORE_DIRECTORY_MAGIC);
 
-        if (status != STATUS_BUFFER_OVERFLOW)
-            goto fail2;
+    for (;;) {
+        PLIST_ENTRY ListEntry;
+        ULONG       Length;
 
-        __StoreFree(Buffer);
-        Length <<= 1;
+        Chunk = Directory->Chunk;
+        if (Chunk == NULL)
+            break;
 
-        ASSERT3U(Length, <=, 1024);
-    }
+        if (Directory->Offset < Chunk->Length) {
+            *Name = Chunk->Data + Directory->Offset;
 
-    status = StoreWrite(Context,
-                          Transaction,
-                          Prefix,
-                          Node,
-                          Buffer);
-    if (!NT_SUCCESS(status))
-        goto fail3;
+            Length = (ULONG)strlen(*Name);
+            Directory->Offset += Length + 1;
 
-    __StoreFree(Buffer);
+            if (Length != 0)
+                return STATUS_SUCCESS;
 
-    return STATUS_SUCCESS;
+            continue;
+        }
 
-fail3:
-fail2:
-    __StoreFree(Buffer);
+        ListEntry = Chunk->ListEntry.Flink;
+        Directory->Chunk = (ListEntry != &Directory->ChunkList) ?
+                           CONTAINING_RECORD(ListEntry, XENBUS_STORE_DIRECTORY_CHUNK, ListEntry) :
+                           NULL;
+        Directory->Offset = 0;
+    }
 
-fail1:
-    return status;
+    *Name = NULL;
+    return STATUS_NO_MORE_ENTRIES;
 }
 
-static NTSTATUS
-StorePrintf(
-    IN  PINTERFACE                  Interface,
-    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
-    IN  PCHAR                       Prefix OPTIONAL,
-    IN  PCHAR                       Node,
-    IN  const CHAR                  *Format,
-    ...
+static VOID
+StoreDirectoryClose(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_STORE_DIRECTORY Directory
     )
 {
-    va_list                         Arguments;
-    NTSTATUS                        status;
+    PXENBUS_STORE_CONTEXT       Context = Interface->Context;
 
-    va_start(Arguments, Format);
-    status = StoreVPrintf(Interface,
-                            Transaction,
-                            Prefix,
-                            Node,
-                            Format,
-                            Arguments);
-    va_end(Arguments);
+    ASSERT3U(Directory->Magic, ==, STORE_DIRECTORY_MAGIC);
 
-    return status;
+    StoreDirectoryFreeChunks(Context, Directory);
+
+    RtlZeroMemory(&Directory->ChunkList, sizeof (LIST_ENTRY));
+
+    Directory->Offset = 0;
+    Directory->Chunk = NULL;
+    Directory->Count = 0;
+
+    Directory->Caller = NULL;
+    Directory->Magic = 0;
+
+    ASSERT(IsZeroMemory(Directory, sizeof (XENBUS_STORE_DIRECTORY)));
+    __StoreFree(Directory);
 }
 
 static NTSTATUS
-StoreRemove(
-    IN  PINTERFACE                  Interface,
-    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
-    IN  PCHAR                       Prefix OPTIONAL,
-    IN  PCHAR                       Node
+StoreReadBatch(
+    IN      PINTERFACE                  Interface,
+    IN      PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN      PCHAR                       Prefix OPTIONAL,
+    IN OUT  PXENBUS_STORE_ITEM          Items,
+    IN      ULONG                       Count
     )
 {
-    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
-    XENBUS_STORE_REQUEST            Request;
-    PXENBUS_STORE_RESPONSE          Response;
-    NTSTATUS                        status;
-
-    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+    PXENBUS_STORE_CONTEXT               Context = Interface->Context;
+    PVOID                               Caller;
+    PXENBUS_STORE_REQUEST               Request;
+    PXENBUS_STORE_RESPONSE              *Response;
+    ULONG                               Index;
+    NTSTATUS                            status;
 
-    if (Prefix == NULL) {
-        status = StorePrepareRequest(Context,
-                                     &Request,
-                                     Transaction,
-                                     XS_RM,
-                                     Node, strlen(Node),
-                                     "", 1,
-                                     NULL, 0);
-    } else {
-        status = StorePrepareRequest(Context,
-                                     &Request,
-                                     Transaction,
-                                     XS_RM,
-                                     Prefix, strlen(Prefix),
-                                     "/", 1,
-                                     Node, strlen(Node),
-                                     "", 1,
-                                     NULL, 0);
-    }
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
 
-    if (!NT_SUCCESS(status))
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0)
         goto fail1;
 
-    Response = StoreSubmitRequest(Context, &Request);
+    Request = __StoreAllocate(sizeof (XENBUS_STORE_REQUEST) * Count);
 
     status = STATUS_NO_MEMORY;
-    if (Response == NULL)
+    if (Request == NULL)
         goto fail2;
 
-    status = StoreCheckResponse(Response);
-    if (!NT_SUCCESS(status))
+    Response = __StoreAllocate(sizeof (PXENBUS_STORE_RESPONSE) * Count);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
         goto fail3;
 
-    StoreFreeResponse(Response);
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_STORE_ITEM  Item = &Items[Index];
+
+        Item->Value = NULL;
+
+        if (Prefix == NULL) {
+            status = StorePrepareRequest(Context,
+                                         &Request[Index],
+                                         Transaction,
+                                         XS_READ,
+                                         Item->Node, strlen(Item->Node),
+                                         "", 1,
+                                         NULL, 0);
+        } else {
+            status = StorePrepareRequest(Context,
+                                         &Request[Index],
+                                         Transaction,
+                                         XS_READ,
+                                         Prefix, strlen(Prefix),
+                                         "/", 1,
+                                         Item->Node, strlen(Item->Node),
+                                         "", 1,
+                                         NULL, 0);
+        }
 
-    return STATUS_SUCCESS;
+        if (!NT_SUCCESS(status))
+            goto fail4;
+    }
 
-fail3:
-    StoreFreeResponse(Response);
+    StoreSubmitRequests(Context, Request, Count, Response);
 
-fail2:
-fail1:
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_STORE_ITEM      Item = &Items[Index];
+        PXENBUS_STORE_BUFFER    Buffer;
 
-    return status;
-}
+        ASSERT(IsZeroMemory(&Request[Index], sizeof (XENBUS_STORE_REQUEST)));
 
-static NTSTATUS
-StoreDirectory(
-    IN  PINTERFACE                  Interface,
-    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
-    IN  PCHAR                       Prefix OPTIONAL,
-    IN  PCHAR                       Node,
-    OUT PCHAR                       *Value
-    )
-{
-    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
-    PVOID                           Caller;
-    XENBUS_STORE_REQUEST            Request;
-    PXENBUS_STORE_RESPONSE          Response;
-    PXENBUS_STORE_BUFFER            Buffer;
-    NTSTATUS                        status;
+        Item->Status = STATUS_NO_MEMORY;
+        if (Response[Index] == NULL)
+            continue;
 
-    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+        Item->Status = StoreCheckResponse(Response[Index]);
+        if (NT_SUCCESS(Item->Status)) {
+            Buffer = StoreCopyPayload(Context, Response[Index], Caller);
 
-    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+            if (Buffer != NULL)
+                Item->Value = Buffer->Data;
+            else
+                Item->Status = STATUS_NO_MEMORY;
+        }
 
-    if (Prefix == NULL) {
-        status = StorePrepareRequest(Context,
-                                     &Request,
-                                     Transaction,
-                                     XS_DIRECTORY,
-                                     Node, strlen(Node),
-                                     "", 1,
-                                     NULL, 0);
-    } else {
-        status = StorePrepareRequest(Context,
-                                     &Request,
-                                     Transaction,
-                                     XS_DIRECTORY,
-                                     Prefix, strlen(Prefix),
-                                     "/", 1,
-                                     Node, strlen(Node),
-                                     "", 1,
-                                     NULL, 0);
+        StoreFreeResponse(Context, Response[Index]);
     }
 
-    if (!NT_SUCCESS(status))
+    __StoreFree(Response);
+    __StoreFree(Request);
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    // Nothing has been submitted so the prepared requests can simply
+    // be discarded
+    RtlZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST) * Count);
+
+    __StoreFree(Response);
+
+fail3:
+    Error("fail3\n");
+
+    __StoreFree(Request);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StoreWriteBatch(
+    IN      PINTERFACE                  Interface,
+    IN      PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN      PCHAR                       Prefix OPTIONAL,
+    IN OUT  PXENBUS_STORE_ITEM          Items,
+    IN      ULONG                       Count
+    )
+{
+    PXENBUS_STORE_CONTEXT               Context = Interface->Context;
+    PXENBUS_STORE_REQUEST               Request;
+    PXENBUS_STORE_RESPONSE              *Response;
+    ULONG                               Index;
+    NTSTATUS                            status;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0)
         goto fail1;
 
-    Response = StoreSubmitRequest(Context, &Request);
+    Request = __StoreAllocate(sizeof (XENBUS_STORE_REQUEST) * Count);
 
     status = STATUS_NO_MEMORY;
-    if (Response == NULL)
+    if (Request == NULL)
         goto fail2;
 
-    status = StoreCheckResponse(Response);
-    if (!NT_SUCCESS(status))
+    Response = __StoreAllocate(sizeof (PXENBUS_STORE_RESPONSE) * Count);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
         goto fail3;
 
-    Buffer = StoreCopyPayload(Context, Response, Caller);
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_STORE_ITEM  Item = &Items[Index];
+
+        if (Prefix == NULL) {
+            status = StorePrepareRequest(Context,
+                                         &Request[Index],
+                                         Transaction,
+                                         XS_WRITE,
+                                         Item->Node, strlen(Item->Node),
+                                         "", 1,
+                                         Item->Value, strlen(Item->Value),
+                                         NULL, 0);
+        } else {
+            status = StorePrepareRequest(Context,
+                                         &Request[Index],
+                                         Transaction,
+                                         XS_WRITE,
+                                         Prefix, strlen(Prefix),
+                                         "/", 1,
+                                         Item->Node, strlen(Item->Node),
+                                         "", 1,
+                                         Item->Value, strlen(Item->Value),
+                                         NULL, 0);
+        }
 
-    status = STATUS_NO_MEMORY;
-    if (Buffer == NULL)
-        goto fail4;
+        if (!NT_SUCCESS(status))
+            goto fail4;
+    }
 
-    StoreFreeResponse(Response);
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    StoreSubmitRequests(Context, Request, Count, Response);
 
-    *Value = Buffer->Data;
+    status = STATUS_SUCCESS;
 
-    return STATUS_SUCCESS;
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_STORE_ITEM  Item = &Items[Index];
+
+        ASSERT(IsZeroMemory(&Request[Index], sizeof (XENBUS_STORE_REQUEST)));
+
+        Item->Status = STATUS_NO_MEMORY;
+        if (Response[Index] != NULL) {
+            Item->Status = StoreCheckResponse(Response[Index]);
+            StoreFreeResponse(Context, Response[Index]);
+        }
+
+        // Report the first failure
+        if (NT_SUCCESS(status))
+            status = Item->Status;
+    }
+
+    __StoreFree(Response);
+    __StoreFree(Request);
+
+    return status;
 
 fail4:
+    Error("fail4\n");
+
+    // Nothing has been submitted so the prepared requests can simply
+    // be discarded
+    RtlZeroMemory(Request, sizeof (XENBUS_STORE_REQUEST) * Count);
+
+    __StoreFree(Response);
+
 fail3:
-    StoreFreeResponse(Response);
+    Error("fail3\n");
+
+    __StoreFree(Request);
 
 fail2:
+    Error("fail2\n");
+
 fail1:
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    Error("fail1 (%08x)\n", status);
 
     return status;
 }
 
+static VOID
+StoreTransactionCountLocked(
+    IN  PXENBUS_STORE_CONTEXT           Context,
+    IN  PVOID                           Caller,
+    IN  XENBUS_STORE_TRANSACTION_EVENT  Event
+    )
+{
+    PLIST_ENTRY                         ListEntry;
+    PXENBUS_STORE_TRANSACTION_SITE      Site;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    for (ListEntry = Context->TransactionSiteList.Flink;
+         ListEntry != &Context->TransactionSiteList;
+         ListEntry = ListEntry->Flink) {
+        Site = CONTAINING_RECORD(ListEntry, XENBUS_STORE_TRANSACTION_SITE, ListEntry);
+
+        if (Site->Caller == Caller)
+            goto found;
+    }
+
+    Site = __StoreAllocate(sizeof (XENBUS_STORE_TRANSACTION_SITE));
+    if (Site == NULL)
+        return;
+
+    Site->Caller = Caller;
+    InsertTailList(&Context->TransactionSiteList, &Site->ListEntry);
+
+found:
+    Site->Count[Event]++;
+}
+
 static NTSTATUS
-StoreTransactionStart(
-    IN  PINTERFACE                  Interface,
+StoreTransactionCreate(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PVOID                       Caller,
     OUT PXENBUS_STORE_TRANSACTION   *Transaction
     )
 {
-    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
     XENBUS_STORE_REQUEST            Request;
     PXENBUS_STORE_RESPONSE          Response;
     KIRQL                           Irql;
@@ -1515,7 +4245,7 @@ StoreTransactionStart(
         goto fail1;
 
     (*Transaction)->Magic = STORE_TRANSACTION_MAGIC;
-    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Transaction)->Caller, NULL);    
+    (*Transaction)->Caller = Caller;
 
     RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
 
@@ -1542,9 +4272,11 @@ StoreTransactionStart(
                                            10);
     ASSERT((*Transaction)->Id != 0);
 
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
+    InitializeListHead(&(*Transaction)->PathList);
+
     KeAcquireSpinLock(&Context->Lock, &Irql);
     (*Transaction)->Active = TRUE;
     InsertTailList(&Context->TransactionList, &(*Transaction)->ListEntry);
@@ -1555,7 +4287,7 @@ StoreTransactionStart(
 fail3:
     Error("fail3\n");
 
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
     (*Transaction)->Caller = NULL;
@@ -1573,6 +4305,20 @@ fail1:
     return status;
 }
 
+static NTSTATUS
+StoreTransactionStart(
+    IN  PINTERFACE                  Interface,
+    OUT PXENBUS_STORE_TRANSACTION   *Transaction
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return StoreTransactionCreate(Context, Caller, Transaction);
+}
+
 static NTSTATUS
 StoreTransactionEnd(
     IN  PINTERFACE                  Interface,
@@ -1616,18 +4362,41 @@ StoreTransactionEnd(
     if (!NT_SUCCESS(status) && status != STATUS_RETRY)
         goto fail2;
 
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
     Transaction->Active = FALSE;
 
 done:
+    if (Commit) {
+        if (NT_SUCCESS(status))
+            StoreTransactionCountLocked(Context,
+                                        Transaction->Caller,
+                                        XENBUS_STORE_TRANSACTION_COMMIT);
+        else if (status == STATUS_RETRY)
+            StoreTransactionCountLocked(Context,
+                                        Transaction->Caller,
+                                        XENBUS_STORE_TRANSACTION_CONFLICT);
+    }
+
     RemoveEntryList(&Transaction->ListEntry);
     KeReleaseSpinLock(&Context->Lock, Irql);
 
     RtlZeroMemory(&Transaction->ListEntry, sizeof (LIST_ENTRY));
 
+    while (!IsListEmpty(&Transaction->PathList)) {
+        PLIST_ENTRY                     ListEntry;
+        PXENBUS_STORE_TRANSACTION_PATH  Path;
+
+        ListEntry = RemoveHeadList(&Transaction->PathList);
+        Path = CONTAINING_RECORD(ListEntry, XENBUS_STORE_TRANSACTION_PATH, ListEntry);
+        __StoreFree(Path);
+    }
+
+    RtlZeroMemory(&Transaction->PathList, sizeof (LIST_ENTRY));
+    Transaction->Overflow = FALSE;
+
     Transaction->Id = 0;
 
     Transaction->Caller = NULL;
@@ -1641,7 +4410,7 @@ done:
 fail2:
     ASSERT3U(status, !=, STATUS_RETRY);
 
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
 
 fail1:
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
@@ -1649,24 +4418,197 @@ fail1:
     return status;
 }
 
+#define XENBUS_STORE_TRANSACTION_ATTEMPTS       8
+#define XENBUS_STORE_TRANSACTION_BACKOFF_MIN    1   // ms
+#define XENBUS_STORE_TRANSACTION_BACKOFF_MAX    128 // ms
+
+static VOID
+StoreTransactionBackoff(
+    IN      ULONG   Attempt,
+    IN OUT  PULONG  Seed
+    )
+{
+    ULONG           Delay;
+    LARGE_INTEGER   Timeout;
+
+    ASSERT(Attempt != 0);
+
+    Delay = XENBUS_STORE_TRANSACTION_BACKOFF_MIN;
+    while (--Attempt != 0 && Delay < XENBUS_STORE_TRANSACTION_BACKOFF_MAX)
+        Delay <<= 1;
+
+    Delay = __min(Delay, XENBUS_STORE_TRANSACTION_BACKOFF_MAX);
+
+    // Add up to half as much again so that contending callers drift apart
+    Delay = TIME_MS(Delay);
+    Delay += RtlRandomEx(Seed) % ((Delay / 2) + 1);
+
+    Timeout.QuadPart = TIME_RELATIVE((LONGLONG)Delay);
+    (VOID) KeDelayExecutionThread(KernelMode, FALSE, &Timeout);
+}
+
 static NTSTATUS
-StoreWatchAdd(
-    IN  PINTERFACE              Interface,
-    IN  PCHAR                   Prefix OPTIONAL,
-    IN  PCHAR                   Node,
-    IN  PKEVENT                 Event,
-    OUT PXENBUS_STORE_WATCH     *Watch
+StoreTransactionRun(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_STORE_TRANSACTION_BODY   Body,
+    IN  PVOID                           Argument OPTIONAL
+    )
+{
+    PXENBUS_STORE_CONTEXT               Context = Interface->Context;
+    PVOID                               Caller;
+    PXENBUS_STORE_TRANSACTION           Transaction;
+    LARGE_INTEGER                       Now;
+    ULONG                               Seed;
+    ULONG                               Attempt;
+    KIRQL                               Irql;
+    NTSTATUS                            status;
+
+    ASSERT3U(KeGetCurrentIrql(), <, DISPATCH_LEVEL);
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);
+
+    KeQuerySystemTime(&Now);
+    Seed = Now.LowPart;
+
+    for (Attempt = 1;; Attempt++) {
+        status = StoreTransactionCreate(Context, Caller, &Transaction);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        status = Body(Argument, Transaction);
+
+        if (NT_SUCCESS(status))
+            status = StoreTransactionEnd(Interface, Transaction, TRUE);
+        else
+            (VOID) StoreTransactionEnd(Interface, Transaction, FALSE);
+
+        if (status != STATUS_RETRY)
+            break;
+
+        if (Attempt == XENBUS_STORE_TRANSACTION_ATTEMPTS)
+            goto fail2;
+
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+        StoreTransactionCountLocked(Context,
+                                    Caller,
+                                    XENBUS_STORE_TRANSACTION_RETRY);
+        KeReleaseSpinLock(&Context->Lock, Irql);
+
+        StoreTransactionBackoff(Attempt, &Seed);
+    }
+
+    return status;
+
+fail2:
+    Error("fail2\n");
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    StoreTransactionCountLocked(Context,
+                                Caller,
+                                XENBUS_STORE_TRANSACTION_EXHAUSTED);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StoreWatchRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  enum xsd_sockmsg_type   Type,
+    IN  PCHAR                   Path,
+    IN  PCHAR                   Token
+    )
+{
+    XENBUS_STORE_REQUEST        Request;
+    PXENBUS_STORE_RESPONSE      Response;
+    NTSTATUS                    status;
+
+    ASSERT(Type == XS_WATCH || Type == XS_UNWATCH);
+
+    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+
+    status = StorePrepareRequest(Context,
+                                 &Request,
+                                 NULL,
+                                 Type,
+                                 Path, strlen(Path),
+                                 "", 1,
+                                 Token, strlen(Token), 
+                                 "", 1,
+                                 NULL, 0);
+    ASSERT(NT_SUCCESS(status));
+
+    Response = StoreSubmitRequest(Context, &Request);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail1;
+
+    status = StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    StoreFreeResponse(Context, Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    StoreFreeResponse(Context, Response);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+    return status;
+}
+
+static VOID
+StoreWatchToken(
+    IN  PXENBUS_STORE_WATCH_NODE    Node,
+    OUT PCHAR                       Token
+    )
+{
+    NTSTATUS                        status;
+
+    status = RtlStringCbPrintfA(Token,
+                                TOKEN_LENGTH,
+                                "TOK|%p|%04X",
+                                Node->Caller,
+                                Node->Id);
+    ASSERT(NT_SUCCESS(status));
+    ASSERT3U(strlen(Token), ==, TOKEN_LENGTH - 1);
+}
+
+static NTSTATUS
+StoreWatchCreate(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PKEVENT                     Event OPTIONAL,
+    IN  XENBUS_STORE_WATCH_CALLBACK Callback OPTIONAL,
+    IN  PVOID                       Argument OPTIONAL,
+    IN  ULONG                       Window,
+    IN  PVOID                       Caller,
+    OUT PXENBUS_STORE_WATCH         *Watch
     )
 {
-    PXENBUS_STORE_CONTEXT       Context = Interface->Context;
     ULONG                       Length;
     PCHAR                       Path;
+    PXENBUS_STORE_WATCH_NODE    WatchNode;
+    PXENBUS_STORE_WATCH_NODE    Registration;
     CHAR                        Token[TOKEN_LENGTH];
-    XENBUS_STORE_REQUEST        Request;
-    PXENBUS_STORE_RESPONSE      Response;
     KIRQL                       Irql;
     NTSTATUS                    status;
 
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
     *Watch = __StoreAllocate(sizeof (XENBUS_STORE_WATCH));
 
     status = STATUS_NO_MEMORY;
@@ -1674,7 +4616,7 @@ StoreWatchAdd(
         goto fail1;
 
     (*Watch)->Magic = STORE_WATCH_MAGIC;
-    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Watch)->Caller, NULL);    
+    (*Watch)->Caller = Caller;
 
     if (Prefix == NULL)
         Length = (ULONG)strlen(Node) + sizeof (CHAR);
@@ -1694,67 +4636,128 @@ StoreWatchAdd(
     
     (*Watch)->Path = Path;
     (*Watch)->Event = Event;
+    (*Watch)->Callback = Callback;
+    (*Watch)->Argument = Argument;
+    (*Watch)->Window = TIME_MS((LONGLONG)Window);
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
-    (*Watch)->Id = StoreNextWatchId(Context);
+
+    WatchNode = StoreWatchNodeLookup(Context, Path);
+
+    status = STATUS_NO_MEMORY;
+    if (WatchNode == NULL) {
+        KeReleaseSpinLock(&Context->Lock, Irql);
+        goto fail3;
+    }
+
+    (*Watch)->Node = WatchNode;
+    InsertTailList(&WatchNode->WatchList, &(*Watch)->NodeListEntry);
+
     (*Watch)->Active = TRUE;
     InsertTailList(&Context->WatchList, &(*Watch)->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
 
-    status = RtlStringCbPrintfA(Token,
-                                sizeof (Token),
-                                "TOK|%p|%04X",
-                                (*Watch)->Caller,
-                                (*Watch)->Id);
-    ASSERT(NT_SUCCESS(status));
-    ASSERT3U(strlen(Token), ==, TOKEN_LENGTH - 1);
+    // If xenstored is already watching the path, or one of its ancestors,
+    // then there is no need for another watch. Only the event that
+    // xenstored fires when a watch is registered need be emulated.
+    // A registration that is still in flight may yet fail, so wait for
+    // its outcome; if it does fail then register the path here instead.
+    for (;;) {
+        Registration = StoreWatchNodeFindRegistration(WatchNode);
+        if (Registration == NULL)
+            break;
 
-    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+        if (Registration->State == XENBUS_STORE_WATCH_REGISTERED) {
+            Context->WatchMultiplexed++;
+            StoreWatchFire(Context, *Watch, Path);
 
-    status = StorePrepareRequest(Context,
-                                 &Request,
-                                 NULL,
-                                 XS_WATCH,
-                                 Path, strlen(Path),
-                                 "", 1,
-                                 Token, strlen(Token), 
-                                 "", 1,
-                                 NULL, 0);
-    ASSERT(NT_SUCCESS(status));
+            KeReleaseSpinLock(&Context->Lock, Irql);
 
-    Response = StoreSubmitRequest(Context, &Request);
+            return STATUS_SUCCESS;
+        }
 
-    status = STATUS_NO_MEMORY;
-    if (Response == NULL)
-        goto fail3;
+        ASSERT3U(Registration->State, ==, XENBUS_STORE_WATCH_REGISTERING);
+
+        KeClearEvent(&Context->RegistrationEvent);
+        KeReleaseSpinLock(&Context->Lock, Irql);
+
+        (VOID) KeWaitForSingleObject(&Context->RegistrationEvent,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+    }
+
+    status = StoreGetWatchId(Context, WatchNode);
+    if (!NT_SUCCESS(status)) {
+        KeReleaseSpinLock(&Context->Lock, Irql);
+        goto fail4;
+    }
+
+    WatchNode->Caller = Caller;
+    WatchNode->State = XENBUS_STORE_WATCH_REGISTERING;
+
+    StoreWatchToken(WatchNode, Token);
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    status = StoreWatchRequest(Context, XS_WATCH, WatchNode->Path, Token);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    // A suspend will have expired the registration if it happened
+    // while the request was in flight
+    if (WatchNode->State == XENBUS_STORE_WATCH_REGISTERING) {
+        WatchNode->State = XENBUS_STORE_WATCH_REGISTERED;
+        Context->WatchRegistrations++;
+    }
 
-    status = StoreCheckResponse(Response);
-    if (!NT_SUCCESS(status))
-        goto fail4;
+    KeSetEvent(&Context->RegistrationEvent, IO_NO_INCREMENT, FALSE);
 
-    StoreFreeResponse(Response);
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    KeReleaseSpinLock(&Context->Lock, Irql);
 
     return STATUS_SUCCESS;
 
-fail4:
-    Error("fail4\n");
+fail5:
+    Error("fail5\n");
 
-    StoreFreeResponse(Response);
+    KeAcquireSpinLock(&Context->Lock, &Irql);
 
-fail3:
-    Error("fail3\n");
+    if (WatchNode->State == XENBUS_STORE_WATCH_REGISTERING) {
+        WatchNode->State = XENBUS_STORE_WATCH_UNREGISTERED;
+        __StoreWatchIndexPutId(&Context->WatchIndex, WatchNode);
+        WatchNode->Caller = NULL;
+    }
 
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    // Any watch that is waiting on this registration will now try to
+    // register for itself
+    KeSetEvent(&Context->RegistrationEvent, IO_NO_INCREMENT, FALSE);
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+fail4:
+    Error("fail4\n");
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
     (*Watch)->Active = FALSE;
-    (*Watch)->Id = 0;
     RemoveEntryList(&(*Watch)->ListEntry);
+    RemoveEntryList(&(*Watch)->NodeListEntry);
+    StoreWatchNodePrune(Context, WatchNode);
     KeReleaseSpinLock(&Context->Lock, Irql);
 
+    RtlZeroMemory(&(*Watch)->NodeListEntry, sizeof (LIST_ENTRY));
     RtlZeroMemory(&(*Watch)->ListEntry, sizeof (LIST_ENTRY));
+    (*Watch)->Node = NULL;
 
+fail3:
+    Error("fail3\n");
+
+    (*Watch)->Window = 0;
+    (*Watch)->Argument = NULL;
+    (*Watch)->Callback = NULL;
     (*Watch)->Event = NULL;
     (*Watch)->Path = NULL;
 
@@ -1775,6 +4778,58 @@ fail1:
     return status;
 }
 
+static NTSTATUS
+StoreWatchAdd(
+    IN  PINTERFACE              Interface,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    IN  PKEVENT                 Event,
+    OUT PXENBUS_STORE_WATCH     *Watch
+    )
+{
+    PXENBUS_STORE_CONTEXT       Context = Interface->Context;
+    PVOID                       Caller;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return StoreWatchCreate(Context,
+                            Prefix,
+                            Node,
+                            Event,
+                            NULL,
+                            NULL,
+                            0,
+                            Caller,
+                            Watch);
+}
+
+static NTSTATUS
+StoreWatchAddCallback(
+    IN  PINTERFACE                  Interface,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_WATCH_CALLBACK Callback,
+    IN  PVOID                       Argument OPTIONAL,
+    IN  ULONG                       Window,
+    OUT PXENBUS_STORE_WATCH         *Watch
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return StoreWatchCreate(Context,
+                            Prefix,
+                            Node,
+                            NULL,
+                            Callback,
+                            Argument,
+                            Window,
+                            Caller,
+                            Watch);
+}
+
 static NTSTATUS
 StoreWatchRemove(
     IN  PINTERFACE              Interface,
@@ -1783,67 +4838,86 @@ StoreWatchRemove(
 {
     PXENBUS_STORE_CONTEXT       Context = Interface->Context;
     PCHAR                       Path;
+    PXENBUS_STORE_WATCH_NODE    Registration;
+    PCHAR                       Unwatch;
     CHAR                        Token[TOKEN_LENGTH];
-    XENBUS_STORE_REQUEST        Request;
-    PXENBUS_STORE_RESPONSE      Response;
     KIRQL                       Irql;
-    NTSTATUS                    status;
 
     ASSERT3U(Watch->Magic, ==, STORE_WATCH_MAGIC);
 
     Path = Watch->Path;
+    Unwatch = NULL;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
 
-    if (!Watch->Active)
-        goto done;
+    RemoveEntryList(&Watch->NodeListEntry);
+    RtlZeroMemory(&Watch->NodeListEntry, sizeof (LIST_ENTRY));
+
+    // The xenstored watch can be dropped once nothing relies on it. The
+    // path is copied since the node may be pruned before the request
+    // is sent. If the copy cannot be made then the registration is
+    // simply left in place.
+    Registration = StoreWatchNodeFindRegistration(Watch->Node);
+    if (Registration != NULL &&
+        Registration->State == XENBUS_STORE_WATCH_REGISTERED &&
+        !StoreWatchNodeIsInUse(Registration)) {
+        ULONG   Length = (ULONG)strlen(Registration->Path) + sizeof (CHAR);
+
+        Unwatch = __StoreAllocate(Length);
+        if (Unwatch != NULL) {
+            RtlCopyMemory(Unwatch, Registration->Path, Length);
+            StoreWatchToken(Registration, Token);
+
+            Registration->State = XENBUS_STORE_WATCH_UNREGISTERED;
+            __StoreWatchIndexPutId(&Context->WatchIndex, Registration);
+            Registration->Caller = NULL;
+
+            --Context->WatchRegistrations;
+        }
+    }
 
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    StoreWatchNodePrune(Context, Watch->Node);
+    Watch->Node = NULL;
 
-    status = RtlStringCbPrintfA(Token,
-                                sizeof (Token),
-                                "TOK|%p|%04X",
-                                Watch->Caller,
-                                Watch->Id);
-    ASSERT(NT_SUCCESS(status));
-    ASSERT3U(strlen(Token), ==, TOKEN_LENGTH - 1);
+    Watch->Active = FALSE;
 
-    RtlZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST));
+    // Cached nodes may no longer be covered by a watch
+    StoreCacheInvalidateLocked(Context, Path);
 
-    status = StorePrepareRequest(Context,
-                                 &Request,
-                                 NULL,
-                                 XS_UNWATCH,
-                                 Path, strlen(Path),
-                                 "", 1,
-                                 Token, strlen(Token), 
-                                 "", 1,
-                                 NULL, 0);
-    ASSERT(NT_SUCCESS(status));
+    RemoveEntryList(&Watch->ListEntry);
 
-    Response = StoreSubmitRequest(Context, &Request);
+    if (Watch->Pending != NULL) {
+        RemoveEntryList(&Watch->DeliveryListEntry);
+        RtlZeroMemory(&Watch->DeliveryListEntry, sizeof (LIST_ENTRY));
 
-    status = STATUS_NO_MEMORY;
-    if (Response == NULL)
-        goto fail1;
+        if (Watch->Pending != Watch->Path)
+            __StoreFree(Watch->Pending);
+        Watch->Pending = NULL;
+        Watch->Due.QuadPart = 0;
+    }
 
-    status = StoreCheckResponse(Response);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    // Make sure the callback is not running before the watch goes away
+    while (Watch->Delivering) {
+        KeClearEvent(&Context->DeliveryEvent);
+        KeReleaseSpinLock(&Context->Lock, Irql);
 
-    StoreFreeResponse(Response);
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+        ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+        (VOID) KeWaitForSingleObject(&Context->DeliveryEvent,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    Watch->Active = FALSE;
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+    }
 
-done:
-    Watch->Id = 0;
-    RemoveEntryList(&Watch->ListEntry);
     KeReleaseSpinLock(&Context->Lock, Irql);
 
     RtlZeroMemory(&Watch->ListEntry, sizeof (LIST_ENTRY));
 
+    Watch->Window = 0;
+    Watch->Argument = NULL;
+    Watch->Callback = NULL;
     Watch->Event = NULL;
     Watch->Path = NULL;
 
@@ -1855,19 +4929,127 @@ done:
     ASSERT(IsZeroMemory(Watch, sizeof (XENBUS_STORE_WATCH)));
     __StoreFree(Watch);
 
+    // Events that race with the removal are discarded as spurious since
+    // the id has already been released
+    if (Unwatch != NULL) {
+        (VOID) StoreWatchRequest(Context, XS_UNWATCH, Unwatch, Token);
+        __StoreFree(Unwatch);
+    }
+
     return STATUS_SUCCESS;
+}
 
-fail2:
-    Error("fail2\n");
+static NTSTATUS
+StoreDeliver(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
+    )
+{
+    PXENBUS_STORE_CONTEXT   Context = _Context;
+    PKEVENT                 Event;
+    LIST_ENTRY              List;
+    LARGE_INTEGER           Timeout;
+
+    Trace("====>\n");
 
-    StoreFreeResponse(Response);
+    Event = ThreadGetEvent(Self);
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+    InitializeListHead(&List);
+    Timeout.QuadPart = 0;
 
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    for (;;) {
+        KIRQL           Irql;
+        LARGE_INTEGER   Now;
+        PLIST_ENTRY     ListEntry;
+
+        // A non-zero timeout is the absolute time at which the next
+        // coalescing window closes
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     (Timeout.QuadPart != 0) ? &Timeout : NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
 
-    return status;
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+
+        KeQuerySystemTime(&Now);
+        Timeout.QuadPart = 0;
+
+        // Move the watches that are due onto a local list. They remain
+        // pending so StoreWatchRemove() can still unlink them.
+        ListEntry = Context->DeliveryList.Flink;
+        while (ListEntry != &Context->DeliveryList) {
+            PLIST_ENTRY         Next = ListEntry->Flink;
+            PXENBUS_STORE_WATCH Watch;
+
+            Watch = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH, DeliveryListEntry);
+
+            if (Watch->Due.QuadPart <= Now.QuadPart) {
+                RemoveEntryList(ListEntry);
+                InsertTailList(&List, ListEntry);
+            } else if (Timeout.QuadPart == 0 ||
+                       Watch->Due.QuadPart < Timeout.QuadPart) {
+                Timeout = Watch->Due;
+            }
+
+            ListEntry = Next;
+        }
+
+        while (!IsListEmpty(&List)) {
+            PXENBUS_STORE_WATCH Watch;
+            PCHAR               Path;
+
+            ListEntry = RemoveHeadList(&List);
+            RtlZeroMemory(ListEntry, sizeof (LIST_ENTRY));
+
+            Watch = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH, DeliveryListEntry);
+
+            Path = Watch->Pending;
+            Watch->Pending = NULL;
+            Watch->Due.QuadPart = 0;
+            Watch->Delivering = TRUE;
+
+            KeReleaseSpinLock(&Context->Lock, Irql);
+
+            Watch->Callback(Watch->Argument, Path);
+
+            if (Path != Watch->Path)
+                __StoreFree(Path);
+
+            KeAcquireSpinLock(&Context->Lock, &Irql);
+
+            Watch->Delivering = FALSE;
+            Context->Deliveries++;
+
+            KeSetEvent(&Context->DeliveryEvent, 0, FALSE);
+        }
+
+        KeReleaseSpinLock(&Context->Lock, Irql);
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+StoreHistogramReset(
+    IN  PINTERFACE          Interface
+    )
+{
+    PXENBUS_STORE_CONTEXT   Context = Interface->Context;
+    KIRQL                   Irql;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    RtlZeroMemory(Context->Latency, sizeof (Context->Latency));
+    RtlZeroMemory(Context->Stall, sizeof (Context->Stall));
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
 }
 
 static VOID
@@ -2020,7 +5202,7 @@ StorePermissionsSet(
     if (!NT_SUCCESS(status))
         goto fail6;
 
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
     __StoreFree(Path);
@@ -2030,29 +5212,226 @@ StorePermissionsSet(
 
 fail6:
     Error("fail6\n");
-    StoreFreeResponse(Response);
+    StoreFreeResponse(Context, Response);
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+    __StoreFree(Path);
+    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+
+fail2:
+    Error("fail2\n");
+
+    __StoreFree(PermissionString);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StoreSubmitRequestAsync(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  enum xsd_sockmsg_type       Type,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PCHAR                       Value OPTIONAL,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL,
+    IN  PVOID                       Caller
+    )
+{
+    PXENBUS_STORE_REQUEST           Request;
+    ULONG                           PathLength;
+    ULONG                           Length;
+    PCHAR                           Data;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    if (Prefix == NULL)
+        PathLength = (ULONG)strlen(Node) + sizeof (CHAR);
+    else
+        PathLength = (ULONG)strlen(Prefix) + 1 + (ULONG)strlen(Node) + sizeof (CHAR);
+
+    Length = PathLength;
+    if (Value != NULL)
+        Length += (ULONG)strlen(Value);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Length > XENSTORE_PAYLOAD_MAX)
+        goto fail1;
+
+    // The caller's strings need not outlive this call so the payload
+    // is copied in behind the request
+    Request = __StoreAllocate(sizeof (XENBUS_STORE_REQUEST) + Length);
+
+    status = STATUS_NO_MEMORY;
+    if (Request == NULL)
+        goto fail2;
+
+    Data = (PCHAR)(Request + 1);
+
+    status = (Prefix == NULL) ?
+             RtlStringCbPrintfA(Data, PathLength, "%s", Node) :
+             RtlStringCbPrintfA(Data, PathLength, "%s/%s", Prefix, Node);
+    ASSERT(NT_SUCCESS(status));
+
+    if (Value != NULL)
+        RtlCopyMemory(Data + PathLength, Value, Length - PathLength);
+
+    status = StorePrepareRequest(Context,
+                                 Request,
+                                 Transaction,
+                                 Type,
+                                 Data, Length,
+                                 NULL, 0);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    Request->Completion = Completion;
+    Request->Argument = Argument;
+    Request->Caller = Caller;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    InsertTailList(&Context->SubmittedList, &Request->ListEntry);
+
+    Request->State = XENBUS_STORE_REQUEST_SUBMITTED;
+    Request->Submitted = KeQueryPerformanceCounter(NULL);
+    StorePollLocked(Context);
+
+    // The request may already have been completed so it must not be
+    // touched beyond this point
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    __StoreFree(Request);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StoreReadAsync(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return StoreSubmitRequestAsync(Context,
+                                   Transaction,
+                                   XS_READ,
+                                   Prefix,
+                                   Node,
+                                   NULL,
+                                   Completion,
+                                   Argument,
+                                   Caller);
+}
+
+static NTSTATUS
+StoreWriteAsync(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PCHAR                       Value,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
 
-fail5:
-    Error("fail5\n");
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
 
-fail4:
-    Error("fail4\n");
+    return StoreSubmitRequestAsync(Context,
+                                   Transaction,
+                                   XS_WRITE,
+                                   Prefix,
+                                   Node,
+                                   Value,
+                                   Completion,
+                                   Argument,
+                                   Caller);
+}
 
-fail3:
-    Error("fail3\n");
+static NTSTATUS
+StoreRemoveAsync(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
 
-    __StoreFree(Path);
-    ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
 
-fail2:
-    Error("fail2\n");
+    return StoreSubmitRequestAsync(Context,
+                                   Transaction,
+                                   XS_RM,
+                                   Prefix,
+                                   Node,
+                                   NULL,
+                                   Completion,
+                                   Argument,
+                                   Caller);
+}
 
-    __StoreFree(PermissionString);
+static NTSTATUS
+StoreDirectoryAsync(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  XENBUS_STORE_COMPLETION     Completion,
+    IN  PVOID                       Argument OPTIONAL
+    )
+{
+    PXENBUS_STORE_CONTEXT           Context = Interface->Context;
+    PVOID                           Caller;
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
 
-    return status;
+    return StoreSubmitRequestAsync(Context,
+                                   Transaction,
+                                   XS_DIRECTORY,
+                                   Prefix,
+                                   Node,
+                                   NULL,
+                                   Completion,
+                                   Argument,
+                                   Caller);
 }
 
 static
@@ -2155,9 +5534,10 @@ StoreSuspendCallbackEarly(
     IN  PVOID               Argument
     )
 {
-    PXENBUS_STORE_CONTEXT   Context = Argument;
-    PLIST_ENTRY             ListEntry;
-    PHYSICAL_ADDRESS        Address;
+    PXENBUS_STORE_CONTEXT       Context = Argument;
+    PLIST_ENTRY                 ListEntry;
+    PXENBUS_STORE_WATCH_NODE    Node;
+    PHYSICAL_ADDRESS            Address;
 
     Address = StoreGetAddress(Context);
     ASSERT3U(Address.QuadPart, ==, Context->Address.QuadPart);
@@ -2181,6 +5561,22 @@ StoreSuspendCallbackEarly(
 
         Watch->Active = FALSE;
     }
+
+    // The watches held by xenstored will not survive so release the
+    // ids of all the registrations
+    for (Node = &Context->WatchIndex.Root;
+         Node != NULL;
+         Node = StoreWatchNodeNext(Node, &Context->WatchIndex.Root, TRUE)) {
+        if (Node->State == XENBUS_STORE_WATCH_UNREGISTERED)
+            continue;
+
+        if (Node->State == XENBUS_STORE_WATCH_REGISTERED)
+            --Context->WatchRegistrations;
+
+        Node->State = XENBUS_STORE_WATCH_UNREGISTERED;
+        __StoreWatchIndexPutId(&Context->WatchIndex, Node);
+        Node->Caller = NULL;
+    }
 }
 
 static VOID
@@ -2199,6 +5595,49 @@ StoreSuspendCallbackLate(
 
     StoreDisable(Context);
     StoreResetResponse(Context);
+    StoreCacheFlushLocked(Context);
+
+    // The domain id may change across migration
+    RtlZeroMemory(Context->CacheDomainPath, sizeof (Context->CacheDomainPath));
+
+    // Any reply to a request that was in flight has been lost, and
+    // whether xenstored acted on it is unknown, so fail it back to the
+    // caller rather than blindly sending it again
+    while (!IsListEmpty(&Context->PendingList)) {
+        PXENBUS_STORE_REQUEST   Request;
+
+        ListEntry = RemoveHeadList(&Context->PendingList);
+        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+
+        ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_PENDING);
+
+        RemoveEntryList(&Request->BucketListEntry);
+        RtlZeroMemory(&Request->BucketListEntry, sizeof (LIST_ENTRY));
+
+        StoreAbortRequest(Context, Request);
+    }
+
+    // Requests that have not yet been sent can go to the new ring, unless
+    // they were partially sent or refer to state lost across suspend
+    ListEntry = Context->SubmittedList.Flink;
+    while (ListEntry != &Context->SubmittedList) {
+        PLIST_ENTRY             Next = ListEntry->Flink;
+        PXENBUS_STORE_REQUEST   Request;
+
+        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+
+        ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_SUBMITTED);
+
+        if (!StoreIsRequestReplayable(Request)) {
+            RemoveEntryList(&Request->ListEntry);
+            StoreAbortRequest(Context, Request);
+        }
+
+        ListEntry = Next;
+    }
+
+    Context->StallStart.QuadPart = 0;
+
     StoreEnable(Context);
 
     for (ListEntry = Context->WatchList.Flink;
@@ -2208,12 +5647,240 @@ StoreSuspendCallbackLate(
 
         Watch = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH, ListEntry);
 
-        KeSetEvent(Watch->Event, 0, FALSE);
+        if (Watch->Callback != NULL)
+            StoreQueueDelivery(Context, Watch, Watch->Path);
+        else
+            KeSetEvent(Watch->Event, 0, FALSE);
     }
 
     KeReleaseSpinLock(&Context->Lock, Irql);
 }
 
+static const CHAR *
+StoreTypeName(
+    IN  ULONG   Type
+    )
+{
+#define _STORE_TYPE_NAME(_Type) \
+    case XS_ ## _Type:          \
+        return #_Type;
+
+    switch (Type) {
+    _STORE_TYPE_NAME(DEBUG);
+    _STORE_TYPE_NAME(DIRECTORY);
+    _STORE_TYPE_NAME(READ);
+    _STORE_TYPE_NAME(GET_PERMS);
+    _STORE_TYPE_NAME(WATCH);
+    _STORE_TYPE_NAME(UNWATCH);
+    _STORE_TYPE_NAME(TRANSACTION_START);
+    _STORE_TYPE_NAME(TRANSACTION_END);
+    _STORE_TYPE_NAME(INTRODUCE);
+    _STORE_TYPE_NAME(RELEASE);
+    _STORE_TYPE_NAME(GET_DOMAIN_PATH);
+    _STORE_TYPE_NAME(WRITE);
+    _STORE_TYPE_NAME(MKDIR);
+    _STORE_TYPE_NAME(RM);
+    _STORE_TYPE_NAME(SET_PERMS);
+    _STORE_TYPE_NAME(WATCH_EVENT);
+    _STORE_TYPE_NAME(ERROR);
+    _STORE_TYPE_NAME(IS_DOMAIN_INTRODUCED);
+    _STORE_TYPE_NAME(RESUME);
+    _STORE_TYPE_NAME(SET_TARGET);
+    _STORE_TYPE_NAME(RESTRICT);
+    _STORE_TYPE_NAME(RESET_WATCHES);
+    _STORE_TYPE_NAME(DIRECTORY_PART);
+    default:
+        break;
+    }
+
+    return "UNKNOWN";
+
+#undef  _STORE_TYPE_NAME
+}
+
+static VOID
+StoreDebugHistogram(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  const CHAR              *Name,
+    IN  PULONG                  Histogram
+    )
+{
+    CHAR                        Buffer[XENBUS_STORE_HISTOGRAM_BUCKET_COUNT * 24];
+    PCHAR                       Cursor;
+    size_t                      Remaining;
+    ULONG                       Bucket;
+
+    Cursor = Buffer;
+    Remaining = sizeof (Buffer);
+    *Cursor = '\0';
+
+    for (Bucket = 0; Bucket < XENBUS_STORE_HISTOGRAM_BUCKET_COUNT; Bucket++) {
+        NTSTATUS    status;
+
+        if (Histogram[Bucket] == 0)
+            continue;
+
+        status = (Bucket < XENBUS_STORE_HISTOGRAM_BUCKET_COUNT - 1) ?
+                 RtlStringCbPrintfExA(Cursor,
+                                      Remaining,
+                                      &Cursor,
+                                      &Remaining,
+                                      0,
+                                      " <%luus=%lu",
+                                      2ul << Bucket,
+                                      Histogram[Bucket]) :
+                 RtlStringCbPrintfExA(Cursor,
+                                      Remaining,
+                                      &Cursor,
+                                      &Remaining,
+                                      0,
+                                      " >=%luus=%lu",
+                                      1ul << Bucket,
+                                      Histogram[Bucket]);
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    if (Cursor == Buffer)
+        return;
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "- %s:%s\n",
+                 Name,
+                 Buffer);
+}
+
+static VOID
+StoreDebugHistograms(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    ULONG                       Type;
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "LATENCY:\n");
+
+    for (Type = 0; Type < XENBUS_STORE_HISTOGRAM_TYPE_COUNT; Type++)
+        StoreDebugHistogram(Context,
+                            StoreTypeName(Type),
+                            Context->Latency[Type]);
+
+    StoreDebugHistogram(Context,
+                        "RING FULL",
+                        Context->Stall);
+}
+
+// Render part of a captured payload on one line, escaping the NUL
+// separators and anything else that is not printable
+static VOID
+StoreCaptureRender(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  ULONGLONG               Offset,
+    IN  ULONG                   Length,
+    OUT PCHAR                   Buffer,
+    IN  ULONG                   Size
+    )
+{
+    CHAR                        Data[XENBUS_STORE_CAPTURE_LINE_LENGTH];
+    PCHAR                       Cursor;
+    ULONG                       Index;
+
+    ASSERT3U(Length, <=, XENBUS_STORE_CAPTURE_LINE_LENGTH);
+    ASSERT3U(Size, >=, (XENBUS_STORE_CAPTURE_LINE_LENGTH * 4) + 1);
+
+    StoreCaptureCopyOut(Context, Offset, Data, Length);
+
+    Cursor = Buffer;
+    for (Index = 0; Index < Length; Index++) {
+        CHAR    Character = Data[Index];
+
+        if (Character == '\0') {
+            *Cursor++ = '\\';
+            *Cursor++ = '0';
+        } else if (Character == '\\' || Character == '"' ||
+                   Character < ' ' || Character > '~') {
+            (VOID) RtlStringCbPrintfA(Cursor,
+                                      Size - (Cursor - Buffer),
+                                      "\\x%02X",
+                                      (UCHAR)Character);
+            Cursor += 4;
+        } else {
+            *Cursor++ = Character;
+        }
+    }
+    *Cursor = '\0';
+}
+
+static VOID
+StoreDebugCapture(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    ULONGLONG                   Offset;
+
+    if (Context->CaptureSize == 0)
+        return;
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "CAPTURE: (%llu RECORDS)\n",
+                 Context->CaptureCount);
+
+    // Each record is a line holding the header and the start of the
+    // payload followed by a '+' line for each further part of it
+    Offset = Context->CaptureHead;
+    while (Offset < Context->CaptureTail) {
+        XENBUS_STORE_CAPTURE_RECORD Record;
+        CHAR                        Buffer[(XENBUS_STORE_CAPTURE_LINE_LENGTH * 4) + 1];
+        ULONG                       Length;
+        ULONG                       Done;
+        ULONGLONG                   Microseconds;
+
+        StoreCaptureCopyOut(Context,
+                            Offset,
+                            &Record,
+                            sizeof (XENBUS_STORE_CAPTURE_RECORD));
+        Offset += sizeof (XENBUS_STORE_CAPTURE_RECORD);
+
+        // The ring is not locked so stop at a record that is being
+        // overwritten
+        if (Record.Length > XENSTORE_PAYLOAD_MAX ||
+            Offset + Record.Length > Context->CaptureTail)
+            break;
+
+        Length = __min(Record.Length, XENBUS_STORE_CAPTURE_LINE_LENGTH);
+        StoreCaptureRender(Context, Offset, Length, Buffer, sizeof (Buffer));
+
+        Microseconds = ((ULONGLONG)Record.Timestamp.QuadPart * 1000000) /
+                       (ULONGLONG)Context->Frequency.QuadPart;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "- %llu %s %s req_id = %08x tx_id = %08x len = %u \"%s\"\n",
+                     Microseconds,
+                     (Record.Response) ? "<" : ">",
+                     StoreTypeName(Record.Header.type),
+                     Record.Header.req_id,
+                     Record.Header.tx_id,
+                     Record.Header.len,
+                     Buffer);
+
+        for (Done = Length; Done < Record.Length; Done += Length) {
+            Length = __min(Record.Length - Done, XENBUS_STORE_CAPTURE_LINE_LENGTH);
+            StoreCaptureRender(Context, Offset + Done, Length, Buffer, sizeof (Buffer));
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "+ \"%s\"\n",
+                         Buffer);
+        }
+
+        Offset += Record.Length;
+    }
+}
+
 static VOID
 StoreDebugCallback(
     IN  PVOID               Argument,
@@ -2221,6 +5888,8 @@ StoreDebugCallback(
     )
 {
     PXENBUS_STORE_CONTEXT   Context = Argument;
+    BOOLEAN                 Buffers;
+    ULONG                   Index;
 
     XENBUS_DEBUG(Printf,
                  &Context->DebugInterface,
@@ -2253,15 +5922,57 @@ StoreDebugCallback(
                  Context->Dpcs,
                  Context->Polls);
 
-    if (!IsListEmpty(&Context->BufferList)) {
-        PLIST_ENTRY ListEntry;
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "Sleeps = %lu Spins = %lu\n",
+                 Context->Sleeps,
+                 Context->Spins);
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "BytesWritten = %llu BytesRead = %llu RingFull = %lu\n",
+                 Context->BytesWritten,
+                 Context->BytesRead,
+                 Context->RingFull);
+
+    StoreDebugHistograms(Context);
+    StoreDebugCapture(Context);
 
+    Buffers = FALSE;
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "Deliveries = %lu Coalesced = %lu\n",
+                 Context->Deliveries,
+                 Context->Coalesced);
+
+    if (Context->CacheSize != 0)
         XENBUS_DEBUG(Printf,
                      &Context->DebugInterface,
-                     "BUFFERS:\n");
+                     "CacheHits = %lu CacheMisses = %lu CacheEntries = %lu/%lu\n",
+                     Context->CacheHits,
+                     Context->CacheMisses,
+                     Context->CacheCount,
+                     Context->CacheSize);
+
+    // Outstanding buffers are spread across the processors that handed
+    // them out so merge them here
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_STORE_PROCESSOR Processor = &Context->Processor[Index];
+        PLIST_ENTRY             ListEntry;
+
+        if (IsListEmpty(&Processor->BufferList))
+            continue;
+
+        if (!Buffers) {
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "BUFFERS:\n");
+            Buffers = TRUE;
+        }
 
-        for (ListEntry = Context->BufferList.Flink;
-             ListEntry != &(Context->BufferList);
+        for (ListEntry = Processor->BufferList.Flink;
+             ListEntry != &(Processor->BufferList);
              ListEntry = ListEntry->Flink) {
             PXENBUS_STORE_BUFFER    Buffer;
             PCHAR                   Name;
@@ -2289,7 +6000,8 @@ StoreDebugCallback(
     }
 
     if (!IsListEmpty(&Context->WatchList)) {
-        PLIST_ENTRY ListEntry;
+        PLIST_ENTRY                 ListEntry;
+        PXENBUS_STORE_WATCH_NODE    Node;
 
         XENBUS_DEBUG(Printf,
                      &Context->DebugInterface,
@@ -2309,8 +6021,7 @@ StoreDebugCallback(
             if (Name != NULL) {
                 XENBUS_DEBUG(Printf,
                              &Context->DebugInterface,
-                             "- (%04X) ON %s BY %s + %p [%s]\n",
-                             Watch->Id,
+                             "- ON %s BY %s + %p [%s]\n",
                              Watch->Path,
                              Name,
                              (PVOID)Offset,
@@ -2318,13 +6029,33 @@ StoreDebugCallback(
             } else {
                 XENBUS_DEBUG(Printf,
                              &Context->DebugInterface,
-                             "- (%04X) ON %s BY %p [%s]\n",
-                             Watch->Id,
+                             "- ON %s BY %p [%s]\n",
                              Watch->Path,
                              (PVOID)Watch->Caller,
                              (Watch->Active) ? "ACTIVE" : "EXPIRED");
             }
         }
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "REGISTRATIONS: (%lu, %lu multiplexed)\n",
+                     Context->WatchRegistrations,
+                     Context->WatchMultiplexed);
+
+        for (Node = &Context->WatchIndex.Root;
+             Node != NULL;
+             Node = StoreWatchNodeNext(Node, &Context->WatchIndex.Root, TRUE)) {
+            if (Node->State == XENBUS_STORE_WATCH_UNREGISTERED)
+                continue;
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "- (%04X) ON %s [%s]\n",
+                         Node->Id,
+                         Node->Path,
+                         (Node->State == XENBUS_STORE_WATCH_REGISTERED) ?
+                         "REGISTERED" : "REGISTERING");
+        }
     }
 
     if (!IsListEmpty(&Context->TransactionList)) {
@@ -2363,6 +6094,82 @@ StoreDebugCallback(
             }
         }
     }
+
+    if (!IsListEmpty(&Context->PathList)) {
+        PLIST_ENTRY ListEntry;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "PATHS:\n");
+
+        for (ListEntry = Context->PathList.Flink;
+             ListEntry != &(Context->PathList);
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_STORE_PATH  Path;
+            PCHAR               Name;
+            ULONG_PTR           Offset;
+
+            Path = CONTAINING_RECORD(ListEntry, XENBUS_STORE_PATH, ListEntry);
+
+            ModuleLookup((ULONG_PTR)Path->Caller, &Name, &Offset);
+
+            if (Name != NULL) {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- %s BY %s + %p\n",
+                             Path->Data,
+                             Name,
+                             (PVOID)Offset);
+            } else {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- %s BY %p\n",
+                             Path->Data,
+                             (PVOID)Path->Caller);
+            }
+        }
+    }
+
+    if (!IsListEmpty(&Context->TransactionSiteList)) {
+        PLIST_ENTRY ListEntry;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "TRANSACTION SITES:\n");
+
+        for (ListEntry = Context->TransactionSiteList.Flink;
+             ListEntry != &(Context->TransactionSiteList);
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_STORE_TRANSACTION_SITE  Site;
+            PCHAR                           Name;
+            ULONG_PTR                       Offset;
+
+            Site = CONTAINING_RECORD(ListEntry, XENBUS_STORE_TRANSACTION_SITE, ListEntry);
+
+            ModuleLookup((ULONG_PTR)Site->Caller, &Name, &Offset);
+
+            if (Name != NULL) {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- %s + %p: COMMIT = %lu CONFLICT = %lu RETRY = %lu EXHAUSTED = %lu\n",
+                             Name,
+                             (PVOID)Offset,
+                             Site->Count[XENBUS_STORE_TRANSACTION_COMMIT],
+                             Site->Count[XENBUS_STORE_TRANSACTION_CONFLICT],
+                             Site->Count[XENBUS_STORE_TRANSACTION_RETRY],
+                             Site->Count[XENBUS_STORE_TRANSACTION_EXHAUSTED]);
+            } else {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- %p: COMMIT = %lu CONFLICT = %lu RETRY = %lu EXHAUSTED = %lu\n",
+                             Site->Caller,
+                             Site->Count[XENBUS_STORE_TRANSACTION_COMMIT],
+                             Site->Count[XENBUS_STORE_TRANSACTION_CONFLICT],
+                             Site->Count[XENBUS_STORE_TRANSACTION_RETRY],
+                             Site->Count[XENBUS_STORE_TRANSACTION_EXHAUSTED]);
+            }
+        }
+    }
 }
 
 static NTSTATUS
@@ -2468,7 +6275,9 @@ fail3:
     Error("fail3\n");
 
     StoreDisable(Context);
+    StoreResetResponse(Context);
     RtlZeroMemory(&Context->Response, sizeof (XENBUS_STORE_RESPONSE));
+    RtlZeroMemory(Context->ResponseData, sizeof (Context->ResponseData));
 
     XENBUS_EVTCHN(Release, &Context->EvtchnInterface);
 
@@ -2497,6 +6306,7 @@ StoreRelease(
 {
     PXENBUS_STORE_CONTEXT   Context = Interface->Context;
     KIRQL                   Irql;    
+    ULONG                   Index;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
 
@@ -2511,8 +6321,20 @@ StoreRelease(
     if (!IsListEmpty(&Context->TransactionList))
         BUG("OUTSTANDING TRANSACTIONS");
 
-    if (!IsListEmpty(&Context->BufferList))
-        BUG("OUTSTANDING BUFFER");
+    if (!IsListEmpty(&Context->PathList))
+        BUG("OUTSTANDING PATHS");
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        if (!IsListEmpty(&Context->Processor[Index].BufferList))
+            BUG("OUTSTANDING BUFFER");
+    }
+
+    if (!IsListEmpty(&Context->SubmittedList) ||
+        !IsListEmpty(&Context->PendingList) ||
+        !IsListEmpty(&Context->CompletedList))
+        BUG("OUTSTANDING REQUESTS");
+
+    StoreCacheFlushLocked(Context);
 
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
@@ -2535,39 +6357,230 @@ StoreRelease(
 
     StoreDisable(Context);
     StorePollLocked(Context);
+    StoreResetResponse(Context);
     RtlZeroMemory(&Context->Response, sizeof (XENBUS_STORE_RESPONSE));
+    RtlZeroMemory(Context->ResponseData, sizeof (Context->ResponseData));
+
+    XENBUS_EVTCHN(Release, &Context->EvtchnInterface);
+
+    MmUnmapIoSpace(Context->Shared, PAGE_SIZE);
+    Context->Shared = NULL;
+
+    Context->Address.QuadPart = 0;
+
+    Trace("<====\n");
+
+done:
+    KeReleaseSpinLock(&Context->Lock, Irql);
+}
+
+static struct _XENBUS_STORE_INTERFACE_V1 StoreInterfaceVersion1 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V1), 1, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll
+};
+                     
+static struct _XENBUS_STORE_INTERFACE_V2 StoreInterfaceVersion2 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V2), 2, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll
+};
+
+static struct _XENBUS_STORE_INTERFACE_V3 StoreInterfaceVersion3 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V3), 3, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync
+};
 
-    XENBUS_EVTCHN(Release, &Context->EvtchnInterface);
+static struct _XENBUS_STORE_INTERFACE_V4 StoreInterfaceVersion4 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V4), 4, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch
+};
 
-    MmUnmapIoSpace(Context->Shared, PAGE_SIZE);
-    Context->Shared = NULL;
+static struct _XENBUS_STORE_INTERFACE_V5 StoreInterfaceVersion5 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V5), 5, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch,
+    StoreWatchAddCallback
+};
 
-    Context->Address.QuadPart = 0;
+static struct _XENBUS_STORE_INTERFACE_V6 StoreInterfaceVersion6 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V6), 6, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch,
+    StoreWatchAddCallback,
+    StoreTransactionRun
+};
 
-    Trace("<====\n");
+static struct _XENBUS_STORE_INTERFACE_V7 StoreInterfaceVersion7 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V7), 7, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch,
+    StoreWatchAddCallback,
+    StoreTransactionRun,
+    StoreHistogramReset
+};
 
-done:
-    KeReleaseSpinLock(&Context->Lock, Irql);
-}
+static struct _XENBUS_STORE_INTERFACE_V8 StoreInterfaceVersion8 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V8), 8, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StorePermissionsSet,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch,
+    StoreWatchAddCallback,
+    StoreTransactionRun,
+    StoreHistogramReset,
+    StoreDirectoryOpen,
+    StoreDirectoryNext,
+    StoreDirectoryClose
+};
 
-static struct _XENBUS_STORE_INTERFACE_V1 StoreInterfaceVersion1 = {
-    { sizeof (struct _XENBUS_STORE_INTERFACE_V1), 1, NULL, NULL, NULL },
+static struct _XENBUS_STORE_INTERFACE_V9 StoreInterfaceVersion9 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V9), 9, NULL, NULL, NULL },
     StoreAcquire,
     StoreRelease,
     StoreFree,
     StoreRead,
     StorePrintf,
+    StorePermissionsSet,
     StoreRemove,
     StoreDirectory,
     StoreTransactionStart,
     StoreTransactionEnd,
     StoreWatchAdd,
     StoreWatchRemove,
-    StorePoll
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch,
+    StoreWatchAddCallback,
+    StoreTransactionRun,
+    StoreHistogramReset,
+    StoreDirectoryOpen,
+    StoreDirectoryNext,
+    StoreDirectoryClose,
+    StoreWriteBatch
 };
-                     
-static struct _XENBUS_STORE_INTERFACE_V2 StoreInterfaceVersion2 = {
-    { sizeof (struct _XENBUS_STORE_INTERFACE_V2), 2, NULL, NULL, NULL },
+
+static struct _XENBUS_STORE_INTERFACE_V10 StoreInterfaceVersion10 = {
+    { sizeof (struct _XENBUS_STORE_INTERFACE_V10), 10, NULL, NULL, NULL },
     StoreAcquire,
     StoreRelease,
     StoreFree,
@@ -2580,7 +6593,23 @@ static struct _XENBUS_STORE_INTERFACE_V2 StoreInterfaceVersion2 = {
     StoreTransactionEnd,
     StoreWatchAdd,
     StoreWatchRemove,
-    StorePoll
+    StorePoll,
+    StoreReadAsync,
+    StoreWriteAsync,
+    StoreRemoveAsync,
+    StoreDirectoryAsync,
+    StoreReadBatch,
+    StoreWatchAddCallback,
+    StoreTransactionRun,
+    StoreHistogramReset,
+    StoreDirectoryOpen,
+    StoreDirectoryNext,
+    StoreDirectoryClose,
+    StoreWriteBatch,
+    StorePathOpen,
+    StorePathClose,
+    StorePathRead,
+    StorePathPrintf
 };
 
 NTSTATUS
@@ -2589,8 +6618,12 @@ StoreInitialize(
     OUT PXENBUS_STORE_CONTEXT   *Context
     )
 {
+    HANDLE                      ParametersKey;
+    ULONG                       CacheSize;
+    ULONG                       CaptureSize;
     LARGE_INTEGER               Now;
     ULONG                       Seed;
+    ULONG                       Index;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -2630,13 +6663,88 @@ StoreInitialize(
     (*Context)->RequestId = (USHORT)RtlRandomEx(&Seed);
     InitializeListHead(&(*Context)->SubmittedList);
     InitializeListHead(&(*Context)->PendingList);
+    for (Index = 0; Index < XENBUS_STORE_REQUEST_BUCKET_COUNT; Index++)
+        InitializeListHead(&(*Context)->PendingBucket[Index]);
+    InitializeListHead(&(*Context)->CompletedList);
 
     InitializeListHead(&(*Context)->TransactionList);
+    InitializeListHead(&(*Context)->TransactionSiteList);
 
-    (*Context)->WatchId = (USHORT)RtlRandomEx(&Seed);
     InitializeListHead(&(*Context)->WatchList);
+    __StoreWatchIndexInitialize(&(*Context)->WatchIndex,
+                                (USHORT)RtlRandomEx(&Seed));
+    KeInitializeEvent(&(*Context)->RegistrationEvent, NotificationEvent, FALSE);
+
+    InitializeListHead(&(*Context)->PathList);
 
-    InitializeListHead(&(*Context)->BufferList);
+    (*Context)->ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Context)->Processor = __StoreAllocate(sizeof (XENBUS_STORE_PROCESSOR) *
+                                            (*Context)->ProcessorCount);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->Processor == NULL)
+        goto fail2;
+
+    for (Index = 0; Index < (*Context)->ProcessorCount; Index++) {
+        PXENBUS_STORE_PROCESSOR Processor = &(*Context)->Processor[Index];
+        ULONG                   Class;
+
+        for (Class = 0; Class < XENBUS_STORE_BUFFER_CLASS_COUNT; Class++)
+            InitializeSListHead(&Processor->BufferCache[Class]);
+
+        KeInitializeSpinLock(&Processor->Lock);
+        InitializeListHead(&Processor->BufferList);
+    }
+
+    InitializeSListHead(&(*Context)->ResponsePool);
+
+    ParametersKey = DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "StoreCacheSize",
+                                     &CacheSize);
+    if (!NT_SUCCESS(status))
+        CacheSize = 0;
+
+    (*Context)->CacheSize = CacheSize;
+
+    InitializeListHead(&(*Context)->CacheList);
+    for (Index = 0; Index < XENBUS_STORE_CACHE_BUCKET_COUNT; Index++)
+        InitializeListHead(&(*Context)->CacheBucket[Index]);
+
+    (VOID) KeQueryPerformanceCounter(&(*Context)->Frequency);
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "StoreCaptureSize",
+                                     &CaptureSize);
+    if (!NT_SUCCESS(status))
+        CaptureSize = 0;
+
+    // Capture is a diagnostic aid so failing to allocate the ring
+    // simply leaves it disabled. The size is in bytes.
+    if (CaptureSize != 0) {
+        ULONG   Size;
+
+        CaptureSize = __min(CaptureSize, XENBUS_STORE_CAPTURE_MAXIMUM);
+
+        Size = XENBUS_STORE_CAPTURE_MINIMUM;
+        while (Size < CaptureSize)
+            Size <<= 1;
+
+        (*Context)->Capture = __StoreAllocate(Size);
+        if ((*Context)->Capture != NULL)
+            (*Context)->CaptureSize = Size;
+        else
+            Warning("CAPTURE DISABLED (%lu BYTES)\n",
+                    Size);
+    }
+
+    InitializeListHead(&(*Context)->DeliveryList);
+    KeInitializeEvent(&(*Context)->DeliveryEvent, NotificationEvent, FALSE);
+
+    status = ThreadCreate(StoreDeliver, *Context, &(*Context)->DeliveryThread);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
     KeInitializeDpc(&(*Context)->Dpc, StoreDpc, *Context);
 
@@ -2646,6 +6754,21 @@ StoreInitialize(
 
     return STATUS_SUCCESS;
 
+fail3:
+    Error("fail3\n");
+
+    if ((*Context)->Capture != NULL)
+        __StoreFree((*Context)->Capture);
+
+    __StoreFree((*Context)->Processor);
+
+fail2:
+    Error("fail2\n");
+
+    // Nothing else but list heads and interface copies has been set up
+    RtlZeroMemory(*Context, sizeof (XENBUS_STORE_CONTEXT));
+    __StoreFree(*Context);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -2699,6 +6822,142 @@ StoreGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 3: {
+        struct _XENBUS_STORE_INTERFACE_V3  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V3 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V3))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion3;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 4: {
+        struct _XENBUS_STORE_INTERFACE_V4  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V4 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V4))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion4;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 5: {
+        struct _XENBUS_STORE_INTERFACE_V5  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V5 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V5))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion5;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 6: {
+        struct _XENBUS_STORE_INTERFACE_V6  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V6 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V6))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion6;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 7: {
+        struct _XENBUS_STORE_INTERFACE_V7  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V7 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V7))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion7;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 8: {
+        struct _XENBUS_STORE_INTERFACE_V8  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V8 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V8))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion8;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 9: {
+        struct _XENBUS_STORE_INTERFACE_V9  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V9 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V9))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion9;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 10: {
+        struct _XENBUS_STORE_INTERFACE_V10  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V10 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_STORE_INTERFACE_V10))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion10;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -2712,6 +6971,8 @@ StoreTeardown(
     IN  PXENBUS_STORE_CONTEXT   Context
     )
 {
+    ULONG                       Index;
+
     Trace("====>\n");
 
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
@@ -2719,19 +6980,133 @@ StoreTeardown(
 
     Context->Polls = 0;
     Context->Dpcs = 0;
+    Context->Sleeps = 0;
+    Context->Spins = 0;
     Context->Events = 0;
 
+    RtlZeroMemory(Context->Latency, sizeof (Context->Latency));
+    RtlZeroMemory(Context->Stall, sizeof (Context->Stall));
+    Context->StallStart.QuadPart = 0;
+    Context->Frequency.QuadPart = 0;
+
+    Context->RingFull = 0;
+    Context->BytesRead = 0;
+    Context->BytesWritten = 0;
+
     Context->Fdo = NULL;
 
     RtlZeroMemory(&Context->Dpc, sizeof (KDPC));
 
-    RtlZeroMemory(&Context->BufferList, sizeof (LIST_ENTRY));
+    ThreadAlert(Context->DeliveryThread);
+    ThreadJoin(Context->DeliveryThread);
+    Context->DeliveryThread = NULL;
+
+    ASSERT(IsListEmpty(&Context->DeliveryList));
+    RtlZeroMemory(&Context->DeliveryEvent, sizeof (KEVENT));
+    RtlZeroMemory(&Context->DeliveryList, sizeof (LIST_ENTRY));
+
+    Context->Coalesced = 0;
+    Context->Deliveries = 0;
+
+    if (Context->Capture != NULL) {
+        __StoreFree(Context->Capture);
+        Context->Capture = NULL;
+    }
+    Context->CaptureSize = 0;
+    Context->CaptureCount = 0;
+    Context->CaptureHead = 0;
+    Context->CaptureTail = 0;
+
+    Context->CacheHits = 0;
+    Context->CacheMisses = 0;
+
+    ASSERT3U(Context->CacheCount, ==, 0);
+    RtlZeroMemory(&Context->CacheBucket, sizeof (Context->CacheBucket));
+    RtlZeroMemory(&Context->CacheList, sizeof (LIST_ENTRY));
+    Context->CacheGeneration = 0;
+    RtlZeroMemory(Context->CacheDomainPath, sizeof (Context->CacheDomainPath));
+    Context->CacheSize = 0;
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_STORE_PROCESSOR Processor = &Context->Processor[Index];
+        ULONG                   Class;
+
+        ASSERT(IsListEmpty(&Processor->BufferList));
+
+        for (Class = 0; Class < XENBUS_STORE_BUFFER_CLASS_COUNT; Class++) {
+            for (;;) {
+                PSLIST_ENTRY            ListEntry;
+                PXENBUS_STORE_BUFFER    Buffer;
+
+                ListEntry = InterlockedPopEntrySList(&Processor->BufferCache[Class]);
+                if (ListEntry == NULL)
+                    break;
+
+                Buffer = CONTAINING_RECORD(ListEntry, XENBUS_STORE_BUFFER, CacheListEntry);
+                __StoreFree(Buffer);
+            }
+        }
+    }
+
+    RtlZeroMemory(&Context->PathList, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(Context->Processor,
+                  sizeof (XENBUS_STORE_PROCESSOR) * Context->ProcessorCount);
+    __StoreFree(Context->Processor);
+    Context->Processor = NULL;
+    Context->ProcessorCount = 0;
+
+    for (;;) {
+        PSLIST_ENTRY            ListEntry;
+        PXENBUS_STORE_RESPONSE  Response;
+
+        ListEntry = InterlockedPopEntrySList(&Context->ResponsePool);
+        if (ListEntry == NULL)
+            break;
+
+        Response = CONTAINING_RECORD(ListEntry, XENBUS_STORE_RESPONSE, ListEntry);
+        __StoreFree(Response);
+    }
+
+    RtlZeroMemory(&Context->ResponsePool, sizeof (SLIST_HEADER));
+
+    while (Context->WatchIndex.TableCount != 0) {
+        Index = --Context->WatchIndex.TableCount;
+
+        __StoreFree(Context->WatchIndex.Table[Index]);
+        Context->WatchIndex.Table[Index] = NULL;
+    }
+
+    ASSERT3U(Context->WatchIndex.NodeCount, ==, 0);
+    if (Context->WatchIndex.Bucket != Context->WatchIndex.MinimumBucket)
+        __StoreFree(Context->WatchIndex.Bucket);
+
+    ASSERT(IsListEmpty(&Context->WatchIndex.Root.ChildList));
+    ASSERT(IsListEmpty(&Context->WatchIndex.Root.WatchList));
+    ASSERT3U(Context->WatchIndex.Root.State, ==, XENBUS_STORE_WATCH_UNREGISTERED);
+    RtlZeroMemory(&Context->WatchIndex, sizeof (XENBUS_STORE_WATCH_INDEX));
+
+    Context->WatchMultiplexed = 0;
+    ASSERT3U(Context->WatchRegistrations, ==, 0);
+
+    RtlZeroMemory(&Context->RegistrationEvent, sizeof (KEVENT));
 
     RtlZeroMemory(&Context->WatchList, sizeof (LIST_ENTRY));
-    Context->WatchId = 0;
 
+    while (!IsListEmpty(&Context->TransactionSiteList)) {
+        PLIST_ENTRY                     ListEntry;
+        PXENBUS_STORE_TRANSACTION_SITE  Site;
+
+        ListEntry = RemoveHeadList(&Context->TransactionSiteList);
+        Site = CONTAINING_RECORD(ListEntry, XENBUS_STORE_TRANSACTION_SITE, ListEntry);
+        __StoreFree(Site);
+    }
+
+    RtlZeroMemory(&Context->TransactionSiteList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Context->TransactionList, sizeof (LIST_ENTRY));
 
+    RtlZeroMemory(&Context->CompletedList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->PendingBucket, sizeof (Context->PendingBucket));
     RtlZeroMemory(&Context->PendingList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Context->SubmittedList, sizeof (LIST_ENTRY));
     Context->RequestId = 0;
@@ -0,0 +1,144 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENBUS_STORE_RING_H
+#define _XENBUS_STORE_RING_H
+
+#include <ntddk.h>
+#include <xen.h>
+
+// The ring copy routines touch nothing but the shared page so that they
+// can be exercised against a page that is not shared with Xen (see
+// tools/store).
+
+static FORCEINLINE ULONG
+StoreCopyToRing(
+    IN  struct xenstore_domain_interface    *Shared,
+    IN  PCHAR                               Data,
+    IN  ULONG                               Length
+    )
+{
+    XENSTORE_RING_IDX                       cons;
+    XENSTORE_RING_IDX                       prod;
+    ULONG                                   Offset;
+
+    KeMemoryBarrier();
+
+    prod = Shared->req_prod;
+    cons = Shared->req_cons;
+
+    KeMemoryBarrier();
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Available = cons + XENSTORE_RING_SIZE - prod;
+
+        if (Available == 0)
+            break;
+
+        Index = MASK_XENSTORE_IDX(prod);
+
+        CopyLength = __min(Length, Available);
+        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+
+        RtlCopyMemory(&Shared->req[Index], Data + Offset, CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        prod += CopyLength;
+    }
+
+    KeMemoryBarrier();
+
+    Shared->req_prod = prod;
+
+    KeMemoryBarrier();
+
+    return Offset;
+}
+
+static FORCEINLINE ULONG
+StoreCopyFromRing(
+    IN  struct xenstore_domain_interface    *Shared,
+    IN  PCHAR                               Data,
+    IN  ULONG                               Length
+    )
+{
+    XENSTORE_RING_IDX                       cons;
+    XENSTORE_RING_IDX                       prod;
+    ULONG                                   Offset;
+
+    KeMemoryBarrier();
+
+    cons = Shared->rsp_cons;
+    prod = Shared->rsp_prod;
+
+    KeMemoryBarrier();
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Available = prod - cons;
+
+        if (Available == 0)
+            break;
+
+        Index = MASK_XENSTORE_IDX(cons);
+
+        CopyLength = __min(Length, Available);
+        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+
+        RtlCopyMemory(Data + Offset, &Shared->rsp[Index], CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        cons += CopyLength;
+    }
+
+    KeMemoryBarrier();
+
+    Shared->rsp_cons = cons;
+
+    KeMemoryBarrier();
+
+    return Offset;
+}
+
+#endif  // _XENBUS_STORE_RING_H
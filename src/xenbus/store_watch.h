@@ -0,0 +1,452 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENBUS_STORE_WATCH_H
+#define _XENBUS_STORE_WATCH_H
+
+#include <ntddk.h>
+
+#include "assert.h"
+
+// The watch index neither allocates nor locks. The caller allocates
+// nodes and id tables and serializes access (see store.c), which keeps
+// it usable by the host benchmark in tools/store.
+
+typedef enum _XENBUS_STORE_WATCH_STATE {
+    XENBUS_STORE_WATCH_UNREGISTERED = 0,
+    XENBUS_STORE_WATCH_REGISTERING,
+    XENBUS_STORE_WATCH_REGISTERED
+} XENBUS_STORE_WATCH_STATE, *PXENBUS_STORE_WATCH_STATE;
+
+typedef struct _XENBUS_STORE_WATCH_NODE XENBUS_STORE_WATCH_NODE, *PXENBUS_STORE_WATCH_NODE;
+
+// Watches are kept in a trie of path components. Only a node that is
+// not covered by an ancestor holds a watch in xenstored and the events
+// for that watch are dispatched to every watch in its sub-tree. Nodes
+// are also hashed on their full path so that a child is found without
+// searching its siblings.
+struct _XENBUS_STORE_WATCH_NODE {
+    LIST_ENTRY                  ListEntry;
+    LIST_ENTRY                  BucketListEntry;
+    ULONG                       Hash;
+    PXENBUS_STORE_WATCH_NODE    Parent;
+    LIST_ENTRY                  ChildList;
+    LIST_ENTRY                  WatchList;
+    XENBUS_STORE_WATCH_STATE    State;  // Must be tested at >= DISPATCH_LEVEL
+    PVOID                       Caller;
+    USHORT                      Id;
+    PCHAR                       Name;
+    ULONG                       Length;
+    CHAR                        Path[1];
+};
+
+// The hash starts with a small embedded bucket array. The caller
+// supplies a larger one whenever __StoreWatchIndexRehashNeeded() says
+// that the chains have grown too long.
+#define XENBUS_STORE_WATCH_BUCKET_MIN_SHIFT 6
+#define XENBUS_STORE_WATCH_BUCKET_MAX_SHIFT 16
+#define XENBUS_STORE_WATCH_BUCKET_LOAD      2
+
+#define XENBUS_STORE_WATCH_TABLE_SHIFT  8
+#define XENBUS_STORE_WATCH_TABLE_SIZE   (1 << XENBUS_STORE_WATCH_TABLE_SHIFT)
+#define XENBUS_STORE_WATCH_TABLE_MASK   (XENBUS_STORE_WATCH_TABLE_SIZE - 1)
+#define XENBUS_STORE_WATCH_TABLE_COUNT  (0x10000 >> XENBUS_STORE_WATCH_TABLE_SHIFT)
+
+// Watch ids index a two-level table so that the node for an event can
+// be found without a search. Free slots are chained through Next.
+typedef struct _XENBUS_STORE_WATCH_TABLE {
+    PXENBUS_STORE_WATCH_NODE    Node[XENBUS_STORE_WATCH_TABLE_SIZE];
+    USHORT                      Next[XENBUS_STORE_WATCH_TABLE_SIZE];
+} XENBUS_STORE_WATCH_TABLE, *PXENBUS_STORE_WATCH_TABLE;
+
+typedef struct _XENBUS_STORE_WATCH_INDEX {
+    XENBUS_STORE_WATCH_NODE     Root;
+    PLIST_ENTRY                 Bucket;
+    ULONG                       BucketShift;
+    ULONG                       NodeCount;
+    LIST_ENTRY                  MinimumBucket[1 << XENBUS_STORE_WATCH_BUCKET_MIN_SHIFT];
+    USHORT                      IdBase;
+    PXENBUS_STORE_WATCH_TABLE   Table[XENBUS_STORE_WATCH_TABLE_COUNT];
+    ULONG                       TableCount;
+    ULONG                       FreeCount;
+    USHORT                      FreeHead;
+    USHORT                      FreeTail;
+} XENBUS_STORE_WATCH_INDEX, *PXENBUS_STORE_WATCH_INDEX;
+
+static FORCEINLINE VOID
+__StoreWatchIndexInitialize(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  USHORT                      IdBase
+    )
+{
+    ULONG                           Bucket;
+
+    InitializeListHead(&Index->Root.ChildList);
+    InitializeListHead(&Index->Root.WatchList);
+    Index->Root.Name = Index->Root.Path;
+
+    for (Bucket = 0; Bucket < (1u << XENBUS_STORE_WATCH_BUCKET_MIN_SHIFT); Bucket++)
+        InitializeListHead(&Index->MinimumBucket[Bucket]);
+
+    Index->Bucket = Index->MinimumBucket;
+    Index->BucketShift = XENBUS_STORE_WATCH_BUCKET_MIN_SHIFT;
+
+    Index->IdBase = IdBase;
+}
+
+static FORCEINLINE ULONG
+__StoreWatchHash(
+    IN  ULONG   Hash,
+    IN  PCHAR   Data,
+    IN  ULONG   Length
+    )
+{
+    while (Length-- != 0)
+        Hash = (Hash * 31) + *Data++;
+
+    return Hash;
+}
+
+// Sibling paths often differ only in a trailing digit, which leaves
+// their hashes adjacent, so scatter them before picking a bucket
+static FORCEINLINE PLIST_ENTRY
+__StoreWatchIndexBucket(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  ULONG                       Hash
+    )
+{
+    return &Index->Bucket[(Hash * 0x9E3779B1u) >> (32 - Index->BucketShift)];
+}
+
+// If this returns TRUE then the caller should allocate an array of
+// (1 << (Index->BucketShift + 1)) list heads and pass it to
+// __StoreWatchIndexRehash(). It is fine not to: lookups just get slower.
+static FORCEINLINE BOOLEAN
+__StoreWatchIndexRehashNeeded(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index
+    )
+{
+    return (Index->BucketShift < XENBUS_STORE_WATCH_BUCKET_MAX_SHIFT &&
+            (Index->NodeCount >> Index->BucketShift) >= XENBUS_STORE_WATCH_BUCKET_LOAD) ?
+           TRUE :
+           FALSE;
+}
+
+// Move every node into Bucket. Returns the array that it replaces, which
+// the caller must free, or NULL if that was the embedded one.
+static FORCEINLINE PLIST_ENTRY
+__StoreWatchIndexRehash(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PLIST_ENTRY                 Bucket
+    )
+{
+    PLIST_ENTRY                     Old;
+    ULONG                           Count;
+    ULONG                           Entry;
+
+    Old = Index->Bucket;
+    Count = 1u << Index->BucketShift;
+
+    for (Entry = 0; Entry < (Count << 1); Entry++)
+        InitializeListHead(&Bucket[Entry]);
+
+    Index->Bucket = Bucket;
+    Index->BucketShift++;
+
+    for (Entry = 0; Entry < Count; Entry++) {
+        while (!IsListEmpty(&Old[Entry])) {
+            PLIST_ENTRY                 ListEntry;
+            PXENBUS_STORE_WATCH_NODE    Node;
+
+            ListEntry = Old[Entry].Flink;
+            RemoveEntryList(ListEntry);
+
+            Node = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH_NODE, BucketListEntry);
+            InsertTailList(__StoreWatchIndexBucket(Index, Node->Hash),
+                           &Node->BucketListEntry);
+        }
+    }
+
+    return (Old == Index->MinimumBucket) ? NULL : Old;
+}
+
+static FORCEINLINE ULONG
+__StoreWatchNodePathLength(
+    IN  PXENBUS_STORE_WATCH_NODE    Node
+    )
+{
+    return (ULONG)(Node->Name - Node->Path) + Node->Length;
+}
+
+static FORCEINLINE ULONG
+__StoreWatchNextComponent(
+    IN  PCHAR   Path,
+    IN  ULONG   Start
+    )
+{
+    ULONG       End;
+
+    // The leading '/' of an absolute path is treated as a component in
+    // its own right so that absolute and relative paths do not collide
+    if (Start == 0 && Path[0] == '/')
+        return 1;
+
+    End = Start;
+    while (Path[End] != '\0' && Path[End] != '/')
+        End++;
+
+    return End;
+}
+
+// Find the child of Parent that Path[0..End) names. Path must start
+// with the path of Parent.
+static FORCEINLINE PXENBUS_STORE_WATCH_NODE
+__StoreWatchIndexFindChild(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PXENBUS_STORE_WATCH_NODE    Parent,
+    IN  PCHAR                       Path,
+    IN  ULONG                       End
+    )
+{
+    ULONG                           Start;
+    ULONG                           Hash;
+    PLIST_ENTRY                     Bucket;
+    PLIST_ENTRY                     ListEntry;
+
+    Start = __StoreWatchNodePathLength(Parent);
+    ASSERT3U(Start, <=, End);
+
+    Hash = __StoreWatchHash(Parent->Hash, &Path[Start], End - Start);
+    Bucket = __StoreWatchIndexBucket(Index, Hash);
+
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_STORE_WATCH_NODE    Child;
+
+        Child = CONTAINING_RECORD(ListEntry, XENBUS_STORE_WATCH_NODE, BucketListEntry);
+
+        if (Child->Hash == Hash &&
+            Child->Parent == Parent &&
+            __StoreWatchNodePathLength(Child) == End &&
+            strncmp(Child->Path, Path, End) == 0)
+            return Child;
+    }
+
+    return NULL;
+}
+
+// Child->Path, Name and Length must already be filled in
+static FORCEINLINE VOID
+__StoreWatchIndexInsertChild(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PXENBUS_STORE_WATCH_NODE    Parent,
+    IN  PXENBUS_STORE_WATCH_NODE    Child
+    )
+{
+    ULONG                           Start;
+    ULONG                           End;
+
+    Start = __StoreWatchNodePathLength(Parent);
+    End = __StoreWatchNodePathLength(Child);
+
+    Child->Hash = __StoreWatchHash(Parent->Hash, &Child->Path[Start], End - Start);
+
+    InitializeListHead(&Child->ChildList);
+    InitializeListHead(&Child->WatchList);
+
+    Child->Parent = Parent;
+    InsertTailList(&Parent->ChildList, &Child->ListEntry);
+    InsertTailList(__StoreWatchIndexBucket(Index, Child->Hash),
+                   &Child->BucketListEntry);
+    Index->NodeCount++;
+}
+
+static FORCEINLINE VOID
+__StoreWatchIndexRemoveChild(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PXENBUS_STORE_WATCH_NODE    Child
+    )
+{
+    ASSERT(IsListEmpty(&Child->ChildList));
+    ASSERT(IsListEmpty(&Child->WatchList));
+
+    RemoveEntryList(&Child->ListEntry);
+    RemoveEntryList(&Child->BucketListEntry);
+    --Index->NodeCount;
+}
+
+// Is Path (or an ancestor) watched, under a registration that xenstored
+// has acknowledged? This costs a hash lookup per path component,
+// however many watches there are.
+static FORCEINLINE BOOLEAN
+__StoreWatchIndexIsWatched(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PCHAR                       Path
+    )
+{
+    PXENBUS_STORE_WATCH_NODE        Node;
+    BOOLEAN                         Registered;
+    ULONG                           Start;
+
+    Node = &Index->Root;
+    Registered = FALSE;
+    Start = 0;
+
+    while (Path[Start] != '\0') {
+        ULONG   End;
+
+        End = __StoreWatchNextComponent(Path, Start);
+
+        Node = __StoreWatchIndexFindChild(Index, Node, Path, End);
+        if (Node == NULL)
+            break;
+
+        if (Node->State == XENBUS_STORE_WATCH_REGISTERED)
+            Registered = TRUE;
+
+        if (Registered && !IsListEmpty(&Node->WatchList))
+            return TRUE;
+
+        Start = (Path[End] == '/') ? End + 1 : End;
+    }
+
+    return FALSE;
+}
+
+static FORCEINLINE PXENBUS_STORE_WATCH_NODE
+__StoreWatchIndexFindId(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  USHORT                      Id
+    )
+{
+    USHORT                          Slot;
+    PXENBUS_STORE_WATCH_TABLE       Table;
+
+    Slot = (USHORT)(Id - Index->IdBase);
+
+    Table = Index->Table[Slot >> XENBUS_STORE_WATCH_TABLE_SHIFT];
+    if (Table == NULL)
+        return NULL;
+
+    return Table->Node[Slot & XENBUS_STORE_WATCH_TABLE_MASK];
+}
+
+static FORCEINLINE VOID
+__StoreWatchIndexPushSlot(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  USHORT                      Slot
+    )
+{
+    PXENBUS_STORE_WATCH_TABLE       Table;
+
+    Table = Index->Table[Slot >> XENBUS_STORE_WATCH_TABLE_SHIFT];
+    ASSERT(Table != NULL);
+
+    Table->Node[Slot & XENBUS_STORE_WATCH_TABLE_MASK] = NULL;
+    Table->Next[Slot & XENBUS_STORE_WATCH_TABLE_MASK] = 0;
+
+    // Free slots are re-used in FIFO order so that an id is not handed
+    // out again until all the others have been
+    if (Index->FreeCount++ == 0) {
+        Index->FreeHead = Slot;
+    } else {
+        USHORT  Tail = Index->FreeTail;
+
+        Table = Index->Table[Tail >> XENBUS_STORE_WATCH_TABLE_SHIFT];
+        Table->Next[Tail & XENBUS_STORE_WATCH_TABLE_MASK] = Slot;
+    }
+
+    Index->FreeTail = Slot;
+}
+
+// Add a table of free ids. Returns FALSE if the id space is exhausted.
+static FORCEINLINE BOOLEAN
+__StoreWatchIndexGrow(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PXENBUS_STORE_WATCH_TABLE   Table
+    )
+{
+    ULONG                           Count;
+    USHORT                          Slot;
+
+    if (Index->TableCount == XENBUS_STORE_WATCH_TABLE_COUNT)
+        return FALSE;
+
+    Count = Index->TableCount++;
+    Index->Table[Count] = Table;
+
+    Slot = (USHORT)(Count << XENBUS_STORE_WATCH_TABLE_SHIFT);
+    for (Count = 0; Count < XENBUS_STORE_WATCH_TABLE_SIZE; Count++)
+        __StoreWatchIndexPushSlot(Index, (USHORT)(Slot + Count));
+
+    return TRUE;
+}
+
+// The caller must have grown the table if FreeCount is zero
+static FORCEINLINE VOID
+__StoreWatchIndexGetId(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PXENBUS_STORE_WATCH_NODE    Node
+    )
+{
+    PXENBUS_STORE_WATCH_TABLE       Table;
+    USHORT                          Slot;
+
+    ASSERT(Index->FreeCount != 0);
+    --Index->FreeCount;
+
+    Slot = Index->FreeHead;
+
+    Table = Index->Table[Slot >> XENBUS_STORE_WATCH_TABLE_SHIFT];
+    Index->FreeHead = Table->Next[Slot & XENBUS_STORE_WATCH_TABLE_MASK];
+
+    ASSERT3P(Table->Node[Slot & XENBUS_STORE_WATCH_TABLE_MASK], ==, NULL);
+    Table->Node[Slot & XENBUS_STORE_WATCH_TABLE_MASK] = Node;
+    Table->Next[Slot & XENBUS_STORE_WATCH_TABLE_MASK] = 0;
+
+    Node->Id = (USHORT)(Slot + Index->IdBase);
+}
+
+static FORCEINLINE VOID
+__StoreWatchIndexPutId(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PXENBUS_STORE_WATCH_NODE    Node
+    )
+{
+    ASSERT3P(__StoreWatchIndexFindId(Index, Node->Id), ==, Node);
+
+    __StoreWatchIndexPushSlot(Index, (USHORT)(Node->Id - Index->IdBase));
+
+    Node->Id = 0;
+}
+
+#endif  // _XENBUS_STORE_WATCH_H
@@ -0,0 +1,158 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Just enough of the kernel environment for the driver headers that
+// are built on the host to compile
+
+#ifndef _HOST_NTDDK_H
+#define _HOST_NTDDK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define IN
+#define OUT
+#define OPTIONAL
+
+#define FORCEINLINE     inline __attribute__((always_inline))
+
+typedef void            VOID, *PVOID;
+typedef char            CHAR, *PCHAR;
+typedef uint8_t         UCHAR, *PUCHAR;
+typedef uint8_t         BOOLEAN, *PBOOLEAN;
+typedef uint16_t        USHORT, *PUSHORT;
+typedef int32_t         LONG, *PLONG;
+typedef uint32_t        ULONG, *PULONG;
+typedef int64_t         LONGLONG, *PLONGLONG;
+typedef uint64_t        ULONGLONG, *PULONGLONG;
+typedef uintptr_t       ULONG_PTR, *PULONG_PTR;
+typedef LONG            NTSTATUS;
+
+#define TRUE    1
+#define FALSE   0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+
+#define NT_SUCCESS(_status) ((NTSTATUS)(_status) >= 0)
+
+#define FIELD_OFFSET(_type, _field) offsetof(_type, _field)
+
+#define __min(_a, _b)   (((_a) < (_b)) ? (_a) : (_b))
+#define __max(_a, _b)   (((_a) > (_b)) ? (_a) : (_b))
+
+#define KeMemoryBarrier()   __sync_synchronize()
+
+#define RtlCopyMemory(_dst, _src, _len) memcpy((_dst), (_src), (_len))
+#define RtlZeroMemory(_dst, _len)       memset((_dst), 0, (_len))
+
+static inline UCHAR
+_BitScanForward(
+    OUT PULONG  Index,
+    IN  ULONG   Mask
+    )
+{
+    if (Mask == 0)
+        return 0;
+
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return 1;
+}
+
+static inline UCHAR
+_BitScanForward64(
+    OUT PULONG      Index,
+    IN  ULONGLONG   Mask
+    )
+{
+    if (Mask == 0)
+        return 0;
+
+    *Index = (ULONG)__builtin_ctzll(Mask);
+    return 1;
+}
+
+#define CONTAINING_RECORD(_address, _type, _field) \
+        ((_type *)((PCHAR)(_address) - offsetof(_type, _field)))
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static inline VOID
+InitializeListHead(
+    IN  PLIST_ENTRY ListHead
+    )
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+static inline BOOLEAN
+IsListEmpty(
+    IN  const LIST_ENTRY    *ListHead
+    )
+{
+    return (ListHead->Flink == ListHead) ? TRUE : FALSE;
+}
+
+static inline BOOLEAN
+RemoveEntryList(
+    IN  PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY     Flink = Entry->Flink;
+    PLIST_ENTRY     Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+
+    return (Flink == Blink) ? TRUE : FALSE;
+}
+
+static inline VOID
+InsertTailList(
+    IN  PLIST_ENTRY ListHead,
+    IN  PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY     Blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+#endif  // _HOST_NTDDK_H
@@ -0,0 +1,431 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Benchmark for the 2-level event channel scan. The find-first-set scan
+// in shared_info_scan.h is timed against the bit-at-a-time loop that it
+// replaced, over synthetic pending, mask and selector patterns, and the
+// two are checked to deliver ports in the same order and to leave the
+// round-robin position in the same place.
+
+#include <ntddk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "shared_info_scan.h"
+
+#define PORT_COUNT  (XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR)
+
+typedef struct _PATTERN {
+    ULONG_PTR   SelectorMask;
+    ULONG_PTR   Pending[XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT];
+    ULONG_PTR   Mask[XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT];
+    ULONG       Port;
+} PATTERN, *PPATTERN;
+
+typedef struct _RECORD {
+    ULONG   Count;
+    ULONG   Port[PORT_COUNT];
+} RECORD, *PRECORD;
+
+static ULONGLONG
+Now(
+    VOID
+    )
+{
+    struct timespec Time;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return ((ULONGLONG)Time.tv_sec * 1000000000ull) + Time.tv_nsec;
+}
+
+static ULONG
+Random(
+    IN OUT  PULONG  Seed
+    )
+{
+    *Seed = (*Seed * 1103515245u) + 12345u;
+    return *Seed >> 8;
+}
+
+static ULONG_PTR
+RandomWord(
+    IN OUT  PULONG  Seed,
+    IN      ULONG   Percent
+    )
+{
+    ULONG_PTR       Word;
+    ULONG           Bit;
+
+    Word = 0;
+    for (Bit = 0; Bit < XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR; Bit++)
+        if (Random(Seed) % 100 < Percent)
+            Word |= (ULONG_PTR)1 << Bit;
+
+    return Word;
+}
+
+static BOOLEAN
+SharedInfoTestBit(
+    IN  ULONG_PTR   *Mask,
+    IN  ULONG       Bit
+    )
+{
+    KeMemoryBarrier();
+
+    return (*Mask & ((ULONG_PTR)1 << Bit)) ? TRUE : FALSE;
+}
+
+// The loop that SharedInfoEvtchnScan() replaced
+static BOOLEAN
+OldScan(
+    IN      ULONG_PTR   SelectorMask,
+    IN      ULONG_PTR   *Pending,
+    IN      ULONG_PTR   *Mask,
+    IN OUT  PULONG      Port,
+    IN      BOOLEAN     (*Event)(PVOID, ULONG),
+    IN      PVOID       Argument
+    )
+{
+    ULONG               Next;
+    BOOLEAN             DoneSomething;
+
+    DoneSomething = FALSE;
+    Next = *Port;
+
+    while (SelectorMask != 0) {
+        ULONG   SelectorBit;
+        ULONG   PortBit;
+
+        SelectorBit = Next / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+        PortBit = Next % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+
+        if (SharedInfoTestBit(&SelectorMask, SelectorBit)) {
+            ULONG_PTR   PortMask;
+
+            PortMask = Pending[SelectorBit];
+            PortMask &= ~Mask[SelectorBit];
+
+            while (PortMask != 0 && PortBit < XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) {
+                if (SharedInfoTestBit(&PortMask, PortBit)) {
+                    DoneSomething |= Event(Argument, (SelectorBit * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) + PortBit);
+
+                    PortMask &= ~((ULONG_PTR)1 << PortBit);
+                }
+
+                PortBit++;
+            }
+
+            if (PortMask == 0)
+                SelectorMask &= ~((ULONG_PTR)1 << SelectorBit);
+        }
+
+        Next = (SelectorBit + 1) * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+
+        if (Next >= PORT_COUNT)
+            Next = 0;
+    }
+
+    *Port = Next;
+
+    return DoneSomething;
+}
+
+static BOOLEAN
+RecordEvent(
+    IN  PVOID   Argument,
+    IN  ULONG   Port
+    )
+{
+    PRECORD     Record = Argument;
+
+    if (Record->Count < PORT_COUNT)
+        Record->Port[Record->Count] = Port;
+    Record->Count++;
+
+    return TRUE;
+}
+
+static BOOLEAN
+CountEvent(
+    IN  PVOID   Argument,
+    IN  ULONG   Port
+    )
+{
+    PULONG      Count = Argument;
+
+    *Count += Port;
+    return TRUE;
+}
+
+typedef enum _SHAPE {
+    SHAPE_SINGLE,       // One pending port
+    SHAPE_SPARSE,       // A few pending ports spread around
+    SHAPE_CLUSTER,      // One selector's worth of pending ports
+    SHAPE_DENSE,        // Half of all ports pending
+    SHAPE_MASKED,       // Dense, with most of them masked
+    SHAPE_RANDOM,       // Any density, stray selector bits, any start
+    SHAPE_COUNT
+} SHAPE;
+
+static const CHAR *ShapeName[SHAPE_COUNT] = {
+    "single",
+    "sparse",
+    "cluster",
+    "dense",
+    "masked",
+    "random"
+};
+
+static VOID
+Generate(
+    IN      SHAPE       Shape,
+    IN OUT  PULONG      Seed,
+    OUT     PPATTERN    Pattern
+    )
+{
+    ULONG               Selector;
+    ULONG               Index;
+
+    memset(Pattern, 0, sizeof (PATTERN));
+
+    switch (Shape) {
+    case SHAPE_SINGLE: {
+        ULONG   Port = Random(Seed) % PORT_COUNT;
+
+        Pattern->Pending[Port / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR] |=
+            (ULONG_PTR)1 << (Port % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR);
+        break;
+    }
+    case SHAPE_SPARSE:
+        for (Index = 0; Index < 8; Index++) {
+            ULONG   Port = Random(Seed) % PORT_COUNT;
+
+            Pattern->Pending[Port / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR] |=
+                (ULONG_PTR)1 << (Port % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR);
+        }
+        break;
+
+    case SHAPE_CLUSTER:
+        Selector = Random(Seed) % XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT;
+        Pattern->Pending[Selector] = (ULONG_PTR)-1;
+        break;
+
+    case SHAPE_DENSE:
+    case SHAPE_MASKED:
+        for (Selector = 0; Selector < XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT; Selector++) {
+            Pattern->Pending[Selector] = RandomWord(Seed, 50);
+
+            if (Shape == SHAPE_MASKED)
+                Pattern->Mask[Selector] = RandomWord(Seed, 90);
+        }
+        break;
+
+    case SHAPE_RANDOM: {
+        ULONG   Percent = Random(Seed) % 101;
+
+        for (Selector = 0; Selector < XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT; Selector++) {
+            if (Random(Seed) % 4 == 0)
+                continue;
+
+            Pattern->Pending[Selector] = RandomWord(Seed, Percent);
+            Pattern->Mask[Selector] = RandomWord(Seed, Random(Seed) % 101);
+        }
+        break;
+    }
+    default:
+        abort();
+    }
+
+    // Xen sets the selector bit for each word that it sets a pending bit
+    // in. Random patterns also get stray and missing selector bits.
+    for (Selector = 0; Selector < XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT; Selector++)
+        if (Pattern->Pending[Selector] != 0)
+            Pattern->SelectorMask |= (ULONG_PTR)1 << Selector;
+
+    if (Shape == SHAPE_RANDOM) {
+        Pattern->SelectorMask ^= RandomWord(Seed, 10);
+        Pattern->Port = Random(Seed) % PORT_COUNT;
+    } else {
+        Pattern->Port = (Random(Seed) % XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT) *
+                        XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
+    }
+}
+
+// Returns the number of patterns on which the two scans disagreed
+static ULONG
+Compare(
+    IN  SHAPE   Shape,
+    IN  ULONG   Count,
+    IN  ULONG   Seed
+    )
+{
+    static RECORD   Old;
+    static RECORD   New;
+    PATTERN         Pattern;
+    ULONG           Index;
+    ULONG           Mismatches;
+
+    Mismatches = 0;
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   OldPort;
+        ULONG   NewPort;
+
+        Generate(Shape, &Seed, &Pattern);
+
+        Old.Count = 0;
+        OldPort = Pattern.Port;
+        (VOID) OldScan(Pattern.SelectorMask, Pattern.Pending, Pattern.Mask,
+                       &OldPort, RecordEvent, &Old);
+
+        New.Count = 0;
+        NewPort = Pattern.Port;
+        (VOID) SharedInfoEvtchnScan(Pattern.SelectorMask, Pattern.Pending,
+                                    Pattern.Mask, &NewPort, RecordEvent, &New);
+
+        if (Old.Count == New.Count &&
+            memcmp(Old.Port, New.Port, sizeof (ULONG) * __min(Old.Count, PORT_COUNT)) == 0 &&
+            OldPort == NewPort)
+            continue;
+
+        if (Mismatches++ == 0)
+            fprintf(stderr,
+                    "%s: pattern %u differs: %u/%u ports, final port %u/%u\n",
+                    ShapeName[Shape], Index,
+                    Old.Count, New.Count, OldPort, NewPort);
+    }
+
+    return Mismatches;
+}
+
+#define PATTERN_COUNT   64
+
+static double
+Time(
+    IN  BOOLEAN     (*Scan)(ULONG_PTR, ULONG_PTR *, ULONG_PTR *, PULONG,
+                            BOOLEAN (*)(PVOID, ULONG), PVOID),
+    IN  PPATTERN    Pattern,
+    IN  ULONG       Iterations
+    )
+{
+    volatile ULONG  Sink;
+    ULONG           Count;
+    ULONGLONG       Start;
+    ULONG           Index;
+
+    Count = 0;
+    Start = Now();
+
+    for (Index = 0; Index < Iterations; Index++) {
+        PPATTERN    Current = &Pattern[Index % PATTERN_COUNT];
+        ULONG       Port = Current->Port;
+
+        (VOID) Scan(Current->SelectorMask, Current->Pending, Current->Mask,
+                    &Port, CountEvent, &Count);
+    }
+
+    Sink = Count;
+    (VOID) Sink;
+
+    return (double)(Now() - Start) / Iterations;
+}
+
+static BOOLEAN
+NewScan(
+    IN      ULONG_PTR   SelectorMask,
+    IN      ULONG_PTR   *Pending,
+    IN      ULONG_PTR   *Mask,
+    IN OUT  PULONG      Port,
+    IN      BOOLEAN     (*Event)(PVOID, ULONG),
+    IN      PVOID       Argument
+    )
+{
+    return SharedInfoEvtchnScan(SelectorMask, Pending, Mask, Port,
+                                Event, Argument);
+}
+
+int
+main(
+    int         argc,
+    char        **argv
+    )
+{
+    static PATTERN  Pattern[PATTERN_COUNT];
+    ULONG           Iterations;
+    ULONG           Failures;
+    SHAPE           Shape;
+
+    Iterations = (argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) : 100000;
+    if (Iterations == 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    printf("%-8s %12s %12s %8s %10s\n",
+           "pattern", "old ns/scan", "new ns/scan", "speedup", "order");
+
+    Failures = 0;
+
+    for (Shape = 0; Shape < SHAPE_COUNT; Shape++) {
+        ULONG   Seed = 0x5eed0000 + Shape;
+        ULONG   Mismatches;
+        double  Old;
+        double  New;
+        ULONG   Index;
+
+        Mismatches = Compare(Shape, Iterations / 10 + 1, Seed);
+        Failures += Mismatches;
+
+        for (Index = 0; Index < PATTERN_COUNT; Index++)
+            Generate(Shape, &Seed, &Pattern[Index]);
+
+        // Warm up, then alternate so that neither gets a cold cache
+        (VOID) Time(OldScan, Pattern, Iterations / 10 + 1);
+        (VOID) Time(NewScan, Pattern, Iterations / 10 + 1);
+
+        Old = Time(OldScan, Pattern, Iterations);
+        New = Time(NewScan, Pattern, Iterations);
+
+        printf("%-8s %12.1f %12.1f %7.1fx %10s\n",
+               ShapeName[Shape], Old, New, Old / New,
+               (Mismatches == 0) ? "same" : "DIFFERS");
+    }
+
+    if (Failures != 0) {
+        fprintf(stderr, "%u patterns scanned differently\n", Failures);
+        return 1;
+    }
+
+    return 0;
+}
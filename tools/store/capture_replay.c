@@ -0,0 +1,761 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Parses the store capture that the driver dumps through its debug
+// callback (see StoreDebugCapture() in src/xenbus/store.c) back into
+// xenstore messages and feeds the captured requests back through the
+// ring, using the driver's ring copy routines, to the fake xenstored in
+// store_peer.c. The peer is first seeded with the values and children
+// that the captured replies reveal. Requests are pipelined as the ring
+// allows, either as fast as possible or, with -t, no earlier than their
+// captured offset from the first request. Each reply is compared with
+// the captured one and the run's throughput and latency are reported,
+// so that a fix can be measured against the traffic that showed the
+// problem. Transaction ids are mapped onto the ones that the peer
+// hands out, and a request in a transaction is held back until the
+// transaction's start has been answered.
+
+#include <ntddk.h>
+#include <xen.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store_peer.h"
+
+#define LINE_LENGTH     1024
+
+typedef struct _CAPTURE_RECORD {
+    ULONGLONG           Microseconds;
+    BOOLEAN             Response;
+    struct xsd_sockmsg  Header;
+    ULONG               Length;
+    CHAR                Payload[XENSTORE_PAYLOAD_MAX];
+} CAPTURE_RECORD, *PCAPTURE_RECORD;
+
+typedef struct _CAPTURE {
+    PCAPTURE_RECORD     Record;
+    ULONG               Count;
+    ULONG               Size;
+} CAPTURE, *PCAPTURE;
+
+typedef struct _REPLAY_REQUEST {
+    PCAPTURE_RECORD     Request;
+    PCAPTURE_RECORD     Reply;
+    LONG                Transaction;    // The request that started it
+    ULONGLONG           Sent;
+    BOOLEAN             Done;
+} REPLAY_REQUEST, *PREPLAY_REQUEST;
+
+#define TRANSACTION_COUNT   64
+
+typedef struct _REPLAY {
+    BOOLEAN         Timing;
+    BOOLEAN         Verbose;
+    struct {
+        ULONG       Captured;
+        ULONG       Live;
+    }               Transaction[TRANSACTION_COUNT];
+    PREPLAY_REQUEST Request;
+    ULONG           Requests;
+    PULONGLONG      Latency;
+    ULONG           Replies;
+    ULONG           Differences;
+    ULONG           Events;
+} REPLAY, *PREPLAY;
+
+static ULONGLONG
+Now(
+    VOID
+    )
+{
+    struct timespec Time;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return ((ULONGLONG)Time.tv_sec * 1000000000ull) + Time.tv_nsec;
+}
+
+static LONG
+TypeFromName(
+    IN  const CHAR  *Name
+    )
+{
+#define _TYPE_FROM_NAME(_Type)          \
+    if (strcmp(Name, #_Type) == 0)      \
+        return XS_ ## _Type;
+
+    _TYPE_FROM_NAME(DEBUG);
+    _TYPE_FROM_NAME(DIRECTORY);
+    _TYPE_FROM_NAME(READ);
+    _TYPE_FROM_NAME(GET_PERMS);
+    _TYPE_FROM_NAME(WATCH);
+    _TYPE_FROM_NAME(UNWATCH);
+    _TYPE_FROM_NAME(TRANSACTION_START);
+    _TYPE_FROM_NAME(TRANSACTION_END);
+    _TYPE_FROM_NAME(INTRODUCE);
+    _TYPE_FROM_NAME(RELEASE);
+    _TYPE_FROM_NAME(GET_DOMAIN_PATH);
+    _TYPE_FROM_NAME(WRITE);
+    _TYPE_FROM_NAME(MKDIR);
+    _TYPE_FROM_NAME(RM);
+    _TYPE_FROM_NAME(SET_PERMS);
+    _TYPE_FROM_NAME(WATCH_EVENT);
+    _TYPE_FROM_NAME(ERROR);
+    _TYPE_FROM_NAME(IS_DOMAIN_INTRODUCED);
+    _TYPE_FROM_NAME(RESUME);
+    _TYPE_FROM_NAME(SET_TARGET);
+    _TYPE_FROM_NAME(RESTRICT);
+    _TYPE_FROM_NAME(RESET_WATCHES);
+    _TYPE_FROM_NAME(DIRECTORY_PART);
+
+    return -1;
+
+#undef  _TYPE_FROM_NAME
+}
+
+static LONG
+HexDigit(
+    IN  CHAR    Character
+    )
+{
+    if (Character >= '0' && Character <= '9')
+        return Character - '0';
+    if (Character >= 'A' && Character <= 'F')
+        return Character - 'A' + 10;
+    if (Character >= 'a' && Character <= 'f')
+        return Character - 'a' + 10;
+
+    return -1;
+}
+
+// Append the quoted text that starts at Text to the record's payload,
+// undoing the escapes that StoreCaptureRender() applies
+static BOOLEAN
+Unescape(
+    IN  PCHAR           Text,
+    IN  PCAPTURE_RECORD Record
+    )
+{
+    while (*Text != '"') {
+        CHAR    Character;
+
+        if (*Text == '\0')
+            return FALSE;
+
+        if (*Text != '\\') {
+            Character = *Text++;
+        } else if (Text[1] == '0') {
+            Character = '\0';
+            Text += 2;
+        } else if (Text[1] == 'x' &&
+                   HexDigit(Text[2]) >= 0 &&
+                   HexDigit(Text[3]) >= 0) {
+            Character = (CHAR)((HexDigit(Text[2]) << 4) | HexDigit(Text[3]));
+            Text += 4;
+        } else {
+            return FALSE;
+        }
+
+        if (Record->Length == XENSTORE_PAYLOAD_MAX)
+            return FALSE;
+
+        Record->Payload[Record->Length++] = Character;
+    }
+
+    return TRUE;
+}
+
+static PCAPTURE_RECORD
+CaptureAppend(
+    IN  PCAPTURE    Capture
+    )
+{
+    if (Capture->Count == Capture->Size) {
+        Capture->Size = (Capture->Size == 0) ? 64 : Capture->Size * 2;
+        Capture->Record = realloc(Capture->Record,
+                                  Capture->Size * sizeof (CAPTURE_RECORD));
+        if (Capture->Record == NULL)
+            abort();
+    }
+
+    return &Capture->Record[Capture->Count++];
+}
+
+// Lines may carry a log prefix so look for the start of a record, or of
+// a continuation, anywhere in the line
+static BOOLEAN
+CaptureParseLine(
+    IN  PCAPTURE    Capture,
+    IN  PCHAR       Line,
+    IN  ULONG       Number
+    )
+{
+    PCHAR           Cursor;
+
+    for (Cursor = Line; *Cursor != '\0'; Cursor++) {
+        if (Cursor[0] == '-' && Cursor[1] == ' ') {
+            PCAPTURE_RECORD     Record;
+            unsigned long long  Microseconds;
+            CHAR                Direction;
+            CHAR                Name[32];
+            unsigned int        req_id;
+            unsigned int        tx_id;
+            unsigned int        len;
+            LONG                Type;
+            int                 Offset;
+
+            Offset = 0;
+            if (sscanf(Cursor + 2,
+                       "%llu %c %31s req_id = %x tx_id = %x len = %u \"%n",
+                       &Microseconds, &Direction, Name,
+                       &req_id, &tx_id, &len, &Offset) != 6 ||
+                Offset == 0)
+                continue;
+
+            Type = TypeFromName(Name);
+            if (Type < 0 || (Direction != '<' && Direction != '>')) {
+                fprintf(stderr, "line %u: bad record\n", Number);
+                return FALSE;
+            }
+
+            Record = CaptureAppend(Capture);
+            Record->Microseconds = Microseconds;
+            Record->Response = (Direction == '<') ? TRUE : FALSE;
+            Record->Header.type = (ULONG)Type;
+            Record->Header.req_id = req_id;
+            Record->Header.tx_id = tx_id;
+            Record->Header.len = len;
+            Record->Length = 0;
+
+            if (!Unescape(Cursor + 2 + Offset, Record)) {
+                fprintf(stderr, "line %u: bad payload\n", Number);
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+
+        if (Cursor[0] == '+' && Cursor[1] == ' ' && Cursor[2] == '"') {
+            if (Capture->Count == 0)
+                continue;
+
+            if (!Unescape(Cursor + 3, &Capture->Record[Capture->Count - 1])) {
+                fprintf(stderr, "line %u: bad payload\n", Number);
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
+CaptureRead(
+    IN  PCAPTURE    Capture,
+    IN  FILE        *File
+    )
+{
+    CHAR            Line[LINE_LENGTH];
+    ULONG           Number;
+    ULONG           Index;
+    BOOLEAN         Success;
+
+    Number = 0;
+    while (fgets(Line, sizeof (Line), File) != NULL) {
+        if (!CaptureParseLine(Capture, Line, ++Number))
+            return FALSE;
+    }
+
+    Success = TRUE;
+    for (Index = 0; Index < Capture->Count; Index++) {
+        PCAPTURE_RECORD Record = &Capture->Record[Index];
+
+        if (Record->Length != Record->Header.len) {
+            fprintf(stderr, "record %u: %u of %u payload bytes\n",
+                    Index, Record->Length, Record->Header.len);
+            Success = FALSE;
+        }
+    }
+
+    return Success;
+}
+
+// The captured reply to the request at Index
+static PCAPTURE_RECORD
+CaptureFindReply(
+    IN  PCAPTURE    Capture,
+    IN  ULONG       Index
+    )
+{
+    PCAPTURE_RECORD Request = &Capture->Record[Index];
+
+    while (++Index < Capture->Count) {
+        PCAPTURE_RECORD Record = &Capture->Record[Index];
+
+        if (Record->Response &&
+            Record->Header.type != XS_WATCH_EVENT &&
+            Record->Header.req_id == Request->Header.req_id)
+            return Record;
+    }
+
+    return NULL;
+}
+
+static ULONG
+ReplayMapTransaction(
+    IN  PREPLAY Replay,
+    IN  ULONG   Captured
+    )
+{
+    ULONG       Index;
+
+    if (Captured == 0)
+        return 0;
+
+    for (Index = 0; Index < TRANSACTION_COUNT; Index++) {
+        if (Replay->Transaction[Index].Captured == Captured)
+            return Replay->Transaction[Index].Live;
+    }
+
+    // The transaction started before the capture did
+    return Captured;
+}
+
+static VOID
+ReplayAddTransaction(
+    IN  PREPLAY Replay,
+    IN  ULONG   Captured,
+    IN  ULONG   Live
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < TRANSACTION_COUNT; Index++) {
+        if (Replay->Transaction[Index].Captured == 0 ||
+            Replay->Transaction[Index].Captured == Captured) {
+            Replay->Transaction[Index].Captured = Captured;
+            Replay->Transaction[Index].Live = Live;
+            return;
+        }
+    }
+
+    fprintf(stderr, "too many transactions\n");
+}
+
+// Give the peer the values that the captured reads returned and the
+// children that the captured directory listings named. The records are
+// walked backwards so that the earliest answer wins, and the children
+// are created in reverse because the peer lists the newest child first.
+static BOOLEAN
+ReplaySeed(
+    IN  PPEER       Peer,
+    IN  PCAPTURE    Capture
+    )
+{
+    ULONG           Index;
+
+    for (Index = Capture->Count; Index-- != 0;) {
+        PCAPTURE_RECORD Request = &Capture->Record[Index];
+        PCAPTURE_RECORD Reply;
+        CHAR            Path[XENSTORE_PAYLOAD_MAX + 1];
+        ULONG           Offset[XENSTORE_PAYLOAD_MAX / 2];
+        ULONG           Count;
+        ULONG           Length;
+
+        if (Request->Response)
+            continue;
+
+        Reply = CaptureFindReply(Capture, Index);
+        if (Reply == NULL || Reply->Header.type != Request->Header.type)
+            continue;
+
+        Length = (ULONG)strnlen(Request->Payload, Request->Length);
+        RtlCopyMemory(Path, Request->Payload, Length);
+        Path[Length] = '\0';
+
+        switch (Reply->Header.type) {
+        case XS_READ:
+            if (PeerSet(Peer, Path, Reply->Payload, Reply->Length) < 0)
+                return FALSE;
+
+            break;
+
+        case XS_DIRECTORY:
+            Count = 0;
+            for (Length = 0; Length < Reply->Length; Length++) {
+                if (Length == 0 || Reply->Payload[Length - 1] == '\0')
+                    Offset[Count++] = Length;
+            }
+
+            while (Count-- != 0) {
+                CHAR    Child[2 * XENSTORE_PAYLOAD_MAX + 2];
+
+                (VOID) snprintf(Child, sizeof (Child), "%s%s%.*s",
+                                Path,
+                                (Path[strlen(Path) - 1] == '/') ? "" : "/",
+                                (int)(Reply->Length - Offset[Count]),
+                                Reply->Payload + Offset[Count]);
+
+                if (PeerSet(Peer, Child, NULL, 0) < 0)
+                    return FALSE;
+            }
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+// A new transaction gets a new id so only its outcome is compared
+static VOID
+ReplayCheck(
+    IN  PREPLAY             Replay,
+    IN  PREPLAY_REQUEST     Request,
+    IN  struct xsd_sockmsg  *Header,
+    IN  PCHAR               Payload
+    )
+{
+    PCAPTURE_RECORD         Captured = Request->Reply;
+
+    if (Captured == NULL)
+        return;
+
+    if (Header->type == XS_TRANSACTION_START &&
+        Captured->Header.type == XS_TRANSACTION_START) {
+        ReplayAddTransaction(Replay,
+                             (ULONG)strtoul(Captured->Payload, NULL, 10),
+                             (ULONG)strtoul(Payload, NULL, 10));
+        return;
+    }
+
+    if (Header->type == Captured->Header.type &&
+        Header->len == Captured->Length &&
+        memcmp(Payload, Captured->Payload, Header->len) == 0)
+        return;
+
+    Replay->Differences++;
+
+    if (Replay->Verbose)
+        fprintf(stderr, "req_id %08x: type %u len %u, captured type %u len %u\n",
+                Request->Request->Header.req_id,
+                Header->type, Header->len,
+                Captured->Header.type, Captured->Length);
+}
+
+// Find the request whose reply handed out the captured transaction id
+// that the request at Index runs in, or -1 if it started before the
+// capture did
+static LONG
+ReplayFindTransaction(
+    IN  PREPLAY     Replay,
+    IN  ULONG       Index
+    )
+{
+    ULONG           tx_id = Replay->Request[Index].Request->Header.tx_id;
+
+    if (tx_id == 0)
+        return -1;
+
+    while (Index-- != 0) {
+        PCAPTURE_RECORD Reply = Replay->Request[Index].Reply;
+
+        if (Reply != NULL &&
+            Reply->Header.type == XS_TRANSACTION_START &&
+            strtoul(Reply->Payload, NULL, 10) == tx_id)
+            return (LONG)Index;
+    }
+
+    return -1;
+}
+
+static BOOLEAN
+ReplayPrepare(
+    IN  PREPLAY     Replay,
+    IN  PCAPTURE    Capture
+    )
+{
+    ULONG           Index;
+
+    Replay->Request = calloc(Capture->Count, sizeof (REPLAY_REQUEST));
+    Replay->Latency = calloc(Capture->Count, sizeof (ULONGLONG));
+    if (Replay->Request == NULL || Replay->Latency == NULL)
+        return FALSE;
+
+    for (Index = 0; Index < Capture->Count; Index++) {
+        PCAPTURE_RECORD Record = &Capture->Record[Index];
+        PREPLAY_REQUEST Request;
+
+        if (Record->Response)
+            continue;
+
+        Request = &Replay->Request[Replay->Requests];
+        Request->Request = Record;
+        Request->Reply = CaptureFindReply(Capture, Index);
+        Request->Transaction = ReplayFindTransaction(Replay, Replay->Requests);
+
+        Replay->Requests++;
+    }
+
+    return TRUE;
+}
+
+// Whether the next request may go on to the ring yet
+static BOOLEAN
+ReplayReady(
+    IN  PREPLAY         Replay,
+    IN  PREPLAY_REQUEST Request,
+    IN  ULONGLONG       Begin
+    )
+{
+    ULONGLONG           First = Replay->Request[0].Request->Microseconds;
+
+    if (Request->Transaction >= 0 &&
+        !Replay->Request[Request->Transaction].Done)
+        return FALSE;
+
+    if (Replay->Timing &&
+        Now() - Begin < (Request->Request->Microseconds - First) * 1000)
+        return FALSE;
+
+    return TRUE;
+}
+
+static int
+CompareLatency(
+    IN  const VOID  *First,
+    IN  const VOID  *Second
+    )
+{
+    ULONGLONG   Left = *(const ULONGLONG *)First;
+    ULONGLONG   Right = *(const ULONGLONG *)Second;
+
+    return (Left < Right) ? -1 : (Left > Right) ? 1 : 0;
+}
+
+// Each request is sent with its index as its req_id, so that replies
+// can be matched however the captured ids were chosen
+static BOOLEAN
+ReplayRun(
+    IN  PREPLAY     Replay,
+    IN  PGUEST      Guest
+    )
+{
+    ULONG           Sent;
+    ULONGLONG       Begin;
+    ULONGLONG       Elapsed;
+
+    Sent = 0;
+    Begin = Now();
+
+    while (Replay->Replies < Replay->Requests) {
+        struct xsd_sockmsg  *Header;
+        PCHAR               Payload;
+        PREPLAY_REQUEST     Request;
+
+        if (Guest->OutOffset == Guest->OutLength &&
+            Sent < Replay->Requests &&
+            ReplayReady(Replay, &Replay->Request[Sent], Begin)) {
+            struct xsd_sockmsg  Message;
+
+            Request = &Replay->Request[Sent];
+
+            Message = Request->Request->Header;
+            Message.req_id = Sent;
+            Message.tx_id = ReplayMapTransaction(Replay, Message.tx_id);
+
+            GuestSend(Guest, &Message, Request->Request->Payload);
+            Request->Sent = Now();
+            Sent++;
+        }
+
+        if (!GuestPoll(Guest, &Header, &Payload)) {
+            // Let the peer run if neither ring moved
+            if (!Guest->Progress)
+                sched_yield();
+
+            continue;
+        }
+
+        if (Header->type == XS_WATCH_EVENT) {
+            Replay->Events++;
+            continue;
+        }
+
+        if (Header->req_id >= Sent || Replay->Request[Header->req_id].Done) {
+            fprintf(stderr, "unexpected req_id %u\n", Header->req_id);
+            return FALSE;
+        }
+
+        Request = &Replay->Request[Header->req_id];
+        Request->Done = TRUE;
+
+        Replay->Latency[Replay->Replies++] = Now() - Request->Sent;
+
+        ReplayCheck(Replay, Request, Header, Payload);
+    }
+
+    Elapsed = Now() - Begin;
+
+    qsort(Replay->Latency, Replay->Replies, sizeof (ULONGLONG), CompareLatency);
+
+    printf("%s: %u requests in %.2f ms, %.0f req/s  p50 %.2f us  p99 %.2f us  max %.2f us\n",
+           (Replay->Timing) ? "timed" : "as fast as possible",
+           Replay->Replies,
+           Elapsed / 1e6,
+           (Replay->Replies * 1e9) / (double)Elapsed,
+           Replay->Latency[Replay->Replies / 2] / 1e3,
+           Replay->Latency[(Replay->Replies * 99) / 100] / 1e3,
+           Replay->Latency[Replay->Replies - 1] / 1e3);
+
+    printf("%u replies differ, %u watch events\n",
+           Replay->Differences, Replay->Events);
+
+    return (Replay->Differences == 0) ? TRUE : FALSE;
+}
+
+static VOID
+Usage(
+    IN  const CHAR  *Name
+    )
+{
+    fprintf(stderr,
+            "usage: %s [-t] [-v] [capture]\n",
+            Name);
+    exit(2);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    struct xenstore_domain_interface    *Shared;
+    PPEER                               Peer;
+    PGUEST                              Guest;
+    CAPTURE                             Capture;
+    REPLAY                              State;
+    FILE                                *File;
+    ULONG                               Index;
+    ULONG                               Replies;
+    ULONG                               Events;
+    BOOLEAN                             Success;
+    int                                 Option;
+
+    memset(&Capture, 0, sizeof (Capture));
+    memset(&State, 0, sizeof (State));
+
+    while ((Option = getopt(argc, argv, "tv")) != -1) {
+        switch (Option) {
+        case 't':
+            State.Timing = TRUE;
+            break;
+
+        case 'v':
+            State.Verbose = TRUE;
+            break;
+
+        default:
+            Usage(argv[0]);
+        }
+    }
+
+    if (optind < argc - 1)
+        Usage(argv[0]);
+
+    File = (optind < argc) ? fopen(argv[optind], "r") : stdin;
+    if (File == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (!CaptureRead(&Capture, File))
+        return 1;
+
+    if (!ReplayPrepare(&State, &Capture))
+        return 1;
+
+    Replies = Events = 0;
+    for (Index = 0; Index < Capture.Count; Index++) {
+        PCAPTURE_RECORD Record = &Capture.Record[Index];
+
+        if (!Record->Response)
+            continue;
+
+        if (Record->Header.type == XS_WATCH_EVENT)
+            Events++;
+        else
+            Replies++;
+    }
+
+    printf("%u records: %u requests, %u replies, %u watch events\n",
+           Capture.Count, State.Requests, Replies, Events);
+
+    if (State.Requests == 0)
+        return 0;
+
+    Shared = calloc(1, sizeof (*Shared));
+    Peer = calloc(1, sizeof (*Peer));
+    Guest = calloc(1, sizeof (*Guest));
+    if (Shared == NULL || Peer == NULL || Guest == NULL)
+        return 1;
+
+    Peer->Node = calloc(PEER_NODE_COUNT, sizeof (PEER_NODE));
+    if (Peer->Node == NULL)
+        return 1;
+
+    if (!ReplaySeed(Peer, &Capture)) {
+        fprintf(stderr, "too many nodes\n");
+        return 1;
+    }
+
+    Guest->Shared = Shared;
+
+    if (!PeerStart(Peer, Shared))
+        return 1;
+
+    Success = ReplayRun(&State, Guest);
+
+    PeerStop(Peer);
+
+    return (Success) ? 0 : 1;
+}
@@ -0,0 +1,355 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Throughput and latency of the ring protocol on a Linux host, measured
+// against the fake xenstored in store_peer.c. The guest side is driven
+// through the same ring copy routines that the driver uses.
+
+#include <ntddk.h>
+#include <xen.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store_peer.h"
+
+static ULONGLONG
+Now(
+    VOID
+    )
+{
+    struct timespec Time;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return ((ULONGLONG)Time.tv_sec * 1000000000ull) + Time.tv_nsec;
+}
+
+//
+// Benchmarks
+//
+
+typedef enum _BENCH_TYPE {
+    BENCH_WRITE,
+    BENCH_READ,
+    BENCH_DIRECTORY,
+    BENCH_WATCH,
+    BENCH_TYPE_COUNT
+} BENCH_TYPE;
+
+static const CHAR *BenchName[BENCH_TYPE_COUNT] = {
+    "write", "read", "directory", "watch"
+};
+
+typedef struct _BENCH {
+    ULONG   Count;      // Requests per run
+    ULONG   Depth;      // Requests in flight
+    ULONG   Nodes;      // Distinct nodes touched
+    ULONG   Size;       // Value length
+} BENCH, *PBENCH;
+
+static VOID
+BenchValue(
+    IN  ULONG   Node,
+    IN  ULONG   Size,
+    OUT PCHAR   Value
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < Size; Index++)
+        Value[Index] = (CHAR)('a' + ((Node + Index) % 26));
+}
+
+static int
+CompareLatency(
+    const void  *First,
+    const void  *Second
+    )
+{
+    ULONGLONG   Left = *(const ULONGLONG *)First;
+    ULONGLONG   Right = *(const ULONGLONG *)Second;
+
+    return (Left < Right) ? -1 : (Left > Right) ? 1 : 0;
+}
+
+static BOOLEAN
+BenchRun(
+    IN  PGUEST      Guest,
+    IN  PBENCH      Bench,
+    IN  BENCH_TYPE  Type
+    )
+{
+    PULONGLONG      Start;
+    PULONGLONG      Latency;
+    CHAR            Value[XENSTORE_PAYLOAD_MAX];
+    CHAR            Path[64];
+    ULONG           Base;
+    ULONG           Sent;
+    ULONG           Done;
+    ULONG           Events;
+    ULONG           Expected;
+    ULONGLONG       Begin;
+    ULONGLONG       Elapsed;
+    BOOLEAN         Success;
+
+    Start = calloc(Bench->Count, sizeof (ULONGLONG));
+    Latency = calloc(Bench->Count, sizeof (ULONGLONG));
+    if (Start == NULL || Latency == NULL)
+        return FALSE;
+
+    Expected = (Type == BENCH_WATCH) ? Bench->Count : 0;
+
+    Success = TRUE;
+    Base = Guest->Id;
+    Sent = Done = Events = 0;
+
+    Begin = Now();
+
+    while (Done < Bench->Count || Events < Expected) {
+        struct xsd_sockmsg  *Header;
+        PCHAR               Payload;
+
+        if (Guest->OutOffset == Guest->OutLength &&
+            Sent < Bench->Count &&
+            Sent - Done < Bench->Depth) {
+            ULONG   Node = Sent % Bench->Nodes;
+
+            switch (Type) {
+            case BENCH_WRITE:
+            case BENCH_WATCH:
+                (VOID) snprintf(Path, sizeof (Path), "/bench/%s/%u",
+                                (Type == BENCH_WATCH) ? "watch" : "data",
+                                Node);
+                BenchValue(Node, Bench->Size, Value);
+                (VOID) GuestPrepare(Guest, XS_WRITE, Path, Value, Bench->Size);
+                break;
+
+            case BENCH_READ:
+                (VOID) snprintf(Path, sizeof (Path), "/bench/data/%u", Node);
+                (VOID) GuestPrepare(Guest, XS_READ, Path, NULL, 0);
+                break;
+
+            case BENCH_DIRECTORY:
+                (VOID) GuestPrepare(Guest, XS_DIRECTORY, "/bench/data", NULL, 0);
+                break;
+
+            default:
+                abort();
+            }
+
+            Start[Sent++] = Now();
+        }
+
+        if (!GuestPoll(Guest, &Header, &Payload)) {
+            // Let the peer run if neither ring moved
+            if (!Guest->Progress)
+                sched_yield();
+
+            continue;
+        }
+
+        if (Header->type == XS_WATCH_EVENT) {
+            Events++;
+            continue;
+        }
+
+        if (Header->req_id - Base >= Sent) {
+            fprintf(stderr, "%s: unexpected req_id %u\n",
+                    BenchName[Type], Header->req_id);
+            Success = FALSE;
+            break;
+        }
+
+        Latency[Done++] = Now() - Start[Header->req_id - Base];
+
+        if (Header->type == XS_ERROR) {
+            fprintf(stderr, "%s: error %s\n", BenchName[Type], Payload);
+            Success = FALSE;
+            continue;
+        }
+
+        if (Type == BENCH_READ) {
+            ULONG   Node = (Header->req_id - Base) % Bench->Nodes;
+
+            BenchValue(Node, Bench->Size, Value);
+            if (Header->len != Bench->Size ||
+                memcmp(Payload, Value, Bench->Size) != 0) {
+                fprintf(stderr, "read: bad value for node %u\n", Node);
+                Success = FALSE;
+            }
+        }
+    }
+
+    Elapsed = Now() - Begin;
+
+    qsort(Latency, Done, sizeof (ULONGLONG), CompareLatency);
+
+    printf("%-9s %8u ops %10.0f ops/s  p50 %7.2f us  p99 %7.2f us  max %8.2f us",
+           BenchName[Type],
+           Done,
+           (Done * 1e9) / (double)Elapsed,
+           Latency[Done / 2] / 1e3,
+           Latency[(Done * 99) / 100] / 1e3,
+           Latency[Done - 1] / 1e3);
+
+    if (Type == BENCH_WATCH)
+        printf("  %u events", Events);
+
+    printf("\n");
+
+    free(Latency);
+    free(Start);
+
+    return Success;
+}
+
+// Register a watch, synchronously, and swallow the event that fires
+// straight away
+static BOOLEAN
+BenchWatch(
+    IN  PGUEST      Guest,
+    IN  const CHAR  *Path
+    )
+{
+    ULONG           Id;
+    BOOLEAN         Replied;
+    BOOLEAN         Fired;
+
+    Id = GuestPrepare(Guest, XS_WATCH, Path, "bench", sizeof ("bench"));
+
+    Replied = Fired = FALSE;
+    while (!Replied || !Fired) {
+        struct xsd_sockmsg  *Header;
+        PCHAR               Payload;
+
+        if (!GuestPoll(Guest, &Header, &Payload)) {
+            sched_yield();
+            continue;
+        }
+
+        if (Header->type == XS_WATCH_EVENT) {
+            Fired = TRUE;
+        } else if (Header->req_id == Id && Header->type == XS_WATCH) {
+            Replied = TRUE;
+        } else {
+            fprintf(stderr, "watch: unexpected reply type %u\n", Header->type);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static VOID
+Usage(
+    IN  const CHAR  *Name
+    )
+{
+    fprintf(stderr,
+            "usage: %s [-n count] [-d depth] [-k nodes] [-s size]\n",
+            Name);
+    exit(2);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    struct xenstore_domain_interface    *Shared;
+    PPEER                               Peer;
+    PGUEST                              Guest;
+    BENCH                               Bench;
+    BENCH_TYPE                          Type;
+    BOOLEAN                             Success;
+    int                                 Option;
+
+    Bench.Count = 100000;
+    Bench.Depth = 1;
+    Bench.Nodes = 64;
+    Bench.Size = 32;
+
+    while ((Option = getopt(argc, argv, "n:d:k:s:")) != -1) {
+        switch (Option) {
+        case 'n':
+            Bench.Count = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'd':
+            Bench.Depth = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'k':
+            Bench.Nodes = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+
+        case 's':
+            Bench.Size = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            Usage(argv[0]);
+        }
+    }
+
+    if (Bench.Count == 0 || Bench.Depth == 0 || Bench.Nodes == 0 ||
+        Bench.Size > XENSTORE_PAYLOAD_MAX - 64)
+        Usage(argv[0]);
+
+    Shared = calloc(1, sizeof (*Shared));
+    Peer = calloc(1, sizeof (*Peer));
+    Guest = calloc(1, sizeof (*Guest));
+    if (Shared == NULL || Peer == NULL || Guest == NULL)
+        return 1;
+
+    Guest->Shared = Shared;
+    Guest->Id = 1;
+
+    if (!PeerStart(Peer, Shared))
+        return 1;
+
+    printf("count %u depth %u nodes %u size %u\n",
+           Bench.Count, Bench.Depth, Bench.Nodes, Bench.Size);
+
+    Success = BenchWatch(Guest, "/bench/watch");
+
+    for (Type = 0; Success && Type < BENCH_TYPE_COUNT; Type++)
+        Success = BenchRun(Guest, &Bench, Type);
+
+    PeerStop(Peer);
+
+    return (Success) ? 0 : 1;
+}
@@ -0,0 +1,616 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// A stand-in for xenstored, serving the shared ring page from a thread
+// of its own, and the guest end of the ring, which is driven through the
+// same ring copy routines that the driver uses (see store_peer.h).
+
+#include <ntddk.h>
+#include <xen.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "store_ring.h"
+#include "store_peer.h"
+
+static BOOLEAN
+PeerRead(
+    IN  PPEER   Peer,
+    IN  PCHAR   Data,
+    IN  ULONG   Length
+    )
+{
+    struct xenstore_domain_interface    *Shared = Peer->Shared;
+
+    while (Length != 0) {
+        XENSTORE_RING_IDX   cons;
+        XENSTORE_RING_IDX   prod;
+        ULONG               Index;
+        ULONG               CopyLength;
+
+        KeMemoryBarrier();
+
+        cons = Shared->req_cons;
+        prod = Shared->req_prod;
+
+        KeMemoryBarrier();
+
+        if (prod == cons) {
+            if (Peer->Stop)
+                return FALSE;
+
+            sched_yield();
+            continue;
+        }
+
+        Index = MASK_XENSTORE_IDX(cons);
+
+        CopyLength = __min(Length, prod - cons);
+        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+
+        RtlCopyMemory(Data, &Shared->req[Index], CopyLength);
+
+        Data += CopyLength;
+        Length -= CopyLength;
+
+        KeMemoryBarrier();
+
+        Shared->req_cons = cons + CopyLength;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
+PeerWrite(
+    IN  PPEER   Peer,
+    IN  PCHAR   Data,
+    IN  ULONG   Length
+    )
+{
+    struct xenstore_domain_interface    *Shared = Peer->Shared;
+
+    while (Length != 0) {
+        XENSTORE_RING_IDX   cons;
+        XENSTORE_RING_IDX   prod;
+        ULONG               Index;
+        ULONG               CopyLength;
+
+        KeMemoryBarrier();
+
+        cons = Shared->rsp_cons;
+        prod = Shared->rsp_prod;
+
+        KeMemoryBarrier();
+
+        if (prod - cons == XENSTORE_RING_SIZE) {
+            if (Peer->Stop)
+                return FALSE;
+
+            sched_yield();
+            continue;
+        }
+
+        Index = MASK_XENSTORE_IDX(prod);
+
+        CopyLength = __min(Length, XENSTORE_RING_SIZE - (prod - cons));
+        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+
+        RtlCopyMemory(&Shared->rsp[Index], Data, CopyLength);
+
+        Data += CopyLength;
+        Length -= CopyLength;
+
+        KeMemoryBarrier();
+
+        Shared->rsp_prod = prod + CopyLength;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
+PeerReply(
+    IN  PPEER       Peer,
+    IN  ULONG       Type,
+    IN  ULONG       Id,
+    IN  const CHAR  *Data,
+    IN  ULONG       Length
+    )
+{
+    struct xsd_sockmsg  *Header = (struct xsd_sockmsg *)Peer->Reply;
+
+    Header->type = Type;
+    Header->req_id = Id;
+    Header->tx_id = 0;
+    Header->len = Length;
+
+    RtlCopyMemory(Peer->Reply + HEADER_LENGTH, Data, Length);
+
+    return PeerWrite(Peer, Peer->Reply, HEADER_LENGTH + Length);
+}
+
+static BOOLEAN
+PeerError(
+    IN  PPEER       Peer,
+    IN  ULONG       Id,
+    IN  const CHAR  *Errno
+    )
+{
+    return PeerReply(Peer, XS_ERROR, Id, Errno, (ULONG)strlen(Errno) + 1);
+}
+
+static ULONG
+PeerHash(
+    IN  const CHAR  *Path
+    )
+{
+    ULONG           Hash = 2166136261u;
+
+    while (*Path != '\0')
+        Hash = (Hash ^ (UCHAR)*Path++) * 16777619u;
+
+    return Hash;
+}
+
+// Find the node for Path, creating it if Create is set. The table is
+// open-addressed and never shrinks.
+static LONG
+PeerLookup(
+    IN  PPEER       Peer,
+    IN  const CHAR  *Path,
+    IN  BOOLEAN     Create
+    )
+{
+    ULONG           Index;
+
+    Index = PeerHash(Path) & (PEER_NODE_COUNT - 1);
+
+    while (Peer->Node[Index].Path != NULL) {
+        if (strcmp(Peer->Node[Index].Path, Path) == 0)
+            return (LONG)Index;
+
+        Index = (Index + 1) & (PEER_NODE_COUNT - 1);
+    }
+
+    if (!Create || Peer->NodeCount == PEER_NODE_COUNT / 2)
+        return -1;
+
+    Peer->Node[Index].Path = strdup(Path);
+    Peer->Node[Index].Parent = -1;
+    Peer->Node[Index].Child = -1;
+    Peer->Node[Index].Sibling = -1;
+    Peer->NodeCount++;
+
+    return (LONG)Index;
+}
+
+// Create Path, and any of its ancestors that are missing, linking each
+// new node into its parent's list of children
+static LONG
+PeerCreate(
+    IN  PPEER       Peer,
+    IN  const CHAR  *Path
+    )
+{
+    LONG            Index;
+    PCHAR           Separator;
+    LONG            Parent;
+
+    Index = PeerLookup(Peer, Path, FALSE);
+    if (Index >= 0)
+        return Index;
+
+    Parent = -1;
+
+    Separator = strrchr(Path, '/');
+    if (Separator != NULL && Separator != Path) {
+        PCHAR   Ancestor = strndup(Path, Separator - Path);
+
+        Parent = PeerCreate(Peer, Ancestor);
+        free(Ancestor);
+
+        if (Parent < 0)
+            return -1;
+    }
+
+    Index = PeerLookup(Peer, Path, TRUE);
+    if (Index < 0)
+        return -1;
+
+    if (Parent >= 0) {
+        Peer->Node[Index].Parent = Parent;
+        Peer->Node[Index].Sibling = Peer->Node[Parent].Child;
+        Peer->Node[Parent].Child = Index;
+    }
+
+    return Index;
+}
+
+static BOOLEAN
+PeerFireWatches(
+    IN  PPEER       Peer,
+    IN  const CHAR  *Path
+    )
+{
+    ULONG           Index;
+
+    for (Index = 0; Index < PEER_WATCH_COUNT; Index++) {
+        PPEER_WATCH Watch = &Peer->Watch[Index];
+        CHAR        Event[XENSTORE_PAYLOAD_MAX];
+        ULONG       PathLength;
+        ULONG       TokenLength;
+        ULONG       Length;
+
+        if (Watch->Path == NULL)
+            continue;
+
+        Length = (ULONG)strlen(Watch->Path);
+        if (strncmp(Watch->Path, Path, Length) != 0 ||
+            (Path[Length] != '\0' && Path[Length] != '/'))
+            continue;
+
+        PathLength = (ULONG)strlen(Path) + 1;
+        TokenLength = (ULONG)strlen(Watch->Token) + 1;
+
+        RtlCopyMemory(Event, Path, PathLength);
+        RtlCopyMemory(Event + PathLength, Watch->Token, TokenLength);
+
+        if (!PeerReply(Peer, XS_WATCH_EVENT, 0, Event, PathLength + TokenLength))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
+PeerHandle(
+    IN  PPEER               Peer,
+    IN  struct xsd_sockmsg  *Header,
+    IN  PCHAR               Payload
+    )
+{
+    PCHAR                   Path = Payload;
+    ULONG                   PathLength;
+    LONG                    Index;
+
+    Payload[Header->len] = '\0';
+    PathLength = (ULONG)strlen(Path) + 1;
+
+    switch (Header->type) {
+    case XS_READ:
+        Index = PeerLookup(Peer, Path, FALSE);
+        if (Index < 0 || Peer->Node[Index].Value == NULL)
+            return PeerError(Peer, Header->req_id, "ENOENT");
+
+        return PeerReply(Peer,
+                         XS_READ,
+                         Header->req_id,
+                         Peer->Node[Index].Value,
+                         Peer->Node[Index].Length);
+
+    case XS_WRITE: {
+        PPEER_NODE  Node;
+        ULONG       Length;
+
+        if (PathLength > Header->len)
+            return PeerError(Peer, Header->req_id, "EINVAL");
+
+        Index = PeerCreate(Peer, Path);
+        if (Index < 0)
+            return PeerError(Peer, Header->req_id, "ENOSPC");
+
+        Node = &Peer->Node[Index];
+        Length = Header->len - PathLength;
+
+        free(Node->Value);
+        Node->Value = malloc(Length + 1);
+        RtlCopyMemory(Node->Value, Payload + PathLength, Length);
+        Node->Length = Length;
+
+        if (!PeerReply(Peer, XS_WRITE, Header->req_id, "OK", 3))
+            return FALSE;
+
+        return PeerFireWatches(Peer, Path);
+    }
+    case XS_DIRECTORY: {
+        CHAR    Data[XENSTORE_PAYLOAD_MAX];
+        ULONG   Length;
+        LONG    Child;
+
+        Index = PeerLookup(Peer, Path, FALSE);
+        if (Index < 0)
+            return PeerError(Peer, Header->req_id, "ENOENT");
+
+        Length = 0;
+        for (Child = Peer->Node[Index].Child;
+             Child >= 0;
+             Child = Peer->Node[Child].Sibling) {
+            PCHAR   Name = strrchr(Peer->Node[Child].Path, '/') + 1;
+            ULONG   NameLength = (ULONG)strlen(Name) + 1;
+
+            if (Length + NameLength > sizeof (Data))
+                return PeerError(Peer, Header->req_id, "E2BIG");
+
+            RtlCopyMemory(Data + Length, Name, NameLength);
+            Length += NameLength;
+        }
+
+        return PeerReply(Peer, XS_DIRECTORY, Header->req_id, Data, Length);
+    }
+    case XS_MKDIR:
+        if (PeerCreate(Peer, Path) < 0)
+            return PeerError(Peer, Header->req_id, "ENOSPC");
+
+        return PeerReply(Peer, XS_MKDIR, Header->req_id, "OK", 3);
+
+    // Transactions get ids but no isolation; every request is applied
+    // as it arrives
+    case XS_TRANSACTION_START: {
+        CHAR    Id[16];
+
+        (VOID) snprintf(Id, sizeof (Id), "%u", ++Peer->Transaction);
+
+        return PeerReply(Peer,
+                         XS_TRANSACTION_START,
+                         Header->req_id,
+                         Id,
+                         (ULONG)strlen(Id) + 1);
+    }
+    case XS_TRANSACTION_END:
+        return PeerReply(Peer, XS_TRANSACTION_END, Header->req_id, "OK", 3);
+
+    case XS_WATCH:
+    case XS_UNWATCH: {
+        PCHAR   Token = Path + PathLength;
+        ULONG   Slot;
+
+        if (PathLength >= Header->len)
+            return PeerError(Peer, Header->req_id, "EINVAL");
+
+        for (Slot = 0; Slot < PEER_WATCH_COUNT; Slot++) {
+            PPEER_WATCH Watch = &Peer->Watch[Slot];
+
+            if (Header->type == XS_WATCH && Watch->Path == NULL) {
+                Watch->Path = strdup(Path);
+                Watch->Token = strdup(Token);
+                break;
+            }
+
+            if (Header->type == XS_UNWATCH &&
+                Watch->Path != NULL &&
+                strcmp(Watch->Path, Path) == 0 &&
+                strcmp(Watch->Token, Token) == 0) {
+                free(Watch->Path);
+                free(Watch->Token);
+                Watch->Path = Watch->Token = NULL;
+                break;
+            }
+        }
+
+        if (Slot == PEER_WATCH_COUNT)
+            return PeerError(Peer,
+                             Header->req_id,
+                             (Header->type == XS_WATCH) ? "ENOSPC" : "ENOENT");
+
+        if (!PeerReply(Peer, Header->type, Header->req_id, "OK", 3))
+            return FALSE;
+
+        // xenstored always fires a new watch once
+        return (Header->type == XS_WATCH) ? PeerFireWatches(Peer, Path) : TRUE;
+    }
+    default:
+        return PeerError(Peer, Header->req_id, "EINVAL");
+    }
+}
+
+static PVOID
+PeerThread(
+    IN  PVOID   Argument
+    )
+{
+    PPEER       Peer = Argument;
+
+    for (;;) {
+        struct xsd_sockmsg  *Header = (struct xsd_sockmsg *)Peer->Request;
+
+        if (!PeerRead(Peer, Peer->Request, HEADER_LENGTH))
+            break;
+
+        if (Header->len > XENSTORE_PAYLOAD_MAX) {
+            fprintf(stderr, "peer: bad length %u\n", Header->len);
+            abort();
+        }
+
+        if (!PeerRead(Peer, Peer->Request + HEADER_LENGTH, Header->len))
+            break;
+
+        if (!PeerHandle(Peer, Header, Peer->Request + HEADER_LENGTH))
+            break;
+    }
+
+    return NULL;
+}
+
+LONG
+PeerSet(
+    IN  PPEER       Peer,
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Value OPTIONAL,
+    IN  ULONG       Length
+    )
+{
+    LONG            Index;
+    PPEER_NODE      Node;
+
+    Index = PeerCreate(Peer, Path);
+    if (Index < 0 || Value == NULL)
+        return Index;
+
+    Node = &Peer->Node[Index];
+
+    free(Node->Value);
+    Node->Value = malloc(Length + 1);
+    RtlCopyMemory(Node->Value, Value, Length);
+    Node->Length = Length;
+
+    return Index;
+}
+
+BOOLEAN
+PeerStart(
+    IN  PPEER                               Peer,
+    IN  struct xenstore_domain_interface    *Shared
+    )
+{
+    Peer->Shared = Shared;
+
+    if (Peer->Node == NULL) {
+        Peer->Node = calloc(PEER_NODE_COUNT, sizeof (PEER_NODE));
+        if (Peer->Node == NULL)
+            return FALSE;
+    }
+
+    return (pthread_create(&Peer->Thread, NULL, PeerThread, Peer) == 0) ?
+           TRUE :
+           FALSE;
+}
+
+VOID
+PeerStop(
+    IN  PPEER   Peer
+    )
+{
+    Peer->Stop = TRUE;
+    (VOID) pthread_join(Peer->Thread, NULL);
+}
+
+//
+// The guest side, which only touches the ring through the driver's
+// StoreCopyToRing() and StoreCopyFromRing()
+//
+
+VOID
+GuestSend(
+    IN  PGUEST                      Guest,
+    IN  const struct xsd_sockmsg    *Header,
+    IN  const CHAR                  *Payload
+    )
+{
+    RtlCopyMemory(Guest->Out, Header, HEADER_LENGTH);
+    RtlCopyMemory(Guest->Out + HEADER_LENGTH, Payload, Header->len);
+
+    Guest->OutLength = HEADER_LENGTH + Header->len;
+    Guest->OutOffset = 0;
+}
+
+ULONG
+GuestPrepare(
+    IN  PGUEST      Guest,
+    IN  ULONG       Type,
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Data OPTIONAL,
+    IN  ULONG       Length
+    )
+{
+    struct xsd_sockmsg  *Header = (struct xsd_sockmsg *)Guest->Out;
+    ULONG               PathLength;
+
+    PathLength = (ULONG)strlen(Path) + 1;
+
+    Header->type = Type;
+    Header->req_id = Guest->Id++;
+    Header->tx_id = 0;
+    Header->len = PathLength + Length;
+
+    RtlCopyMemory(Guest->Out + HEADER_LENGTH, Path, PathLength);
+    if (Data != NULL)
+        RtlCopyMemory(Guest->Out + HEADER_LENGTH + PathLength, Data, Length);
+
+    Guest->OutLength = HEADER_LENGTH + Header->len;
+    Guest->OutOffset = 0;
+
+    return Header->req_id;
+}
+
+BOOLEAN
+GuestPoll(
+    IN  PGUEST          Guest,
+    OUT struct xsd_sockmsg  **Header,
+    OUT PCHAR           *Payload
+    )
+{
+    struct xsd_sockmsg  *In = (struct xsd_sockmsg *)Guest->In;
+    ULONG               Copied;
+    ULONG               Length;
+
+    Guest->Progress = FALSE;
+
+    if (Guest->OutOffset < Guest->OutLength) {
+        Copied = StoreCopyToRing(Guest->Shared,
+                                 Guest->Out + Guest->OutOffset,
+                                 Guest->OutLength - Guest->OutOffset);
+        Guest->OutOffset += Copied;
+        Guest->Progress |= (Copied != 0);
+    }
+
+    if (Guest->InOffset < HEADER_LENGTH) {
+        Copied = StoreCopyFromRing(Guest->Shared,
+                                   Guest->In + Guest->InOffset,
+                                   HEADER_LENGTH - Guest->InOffset);
+        Guest->InOffset += Copied;
+        Guest->Progress |= (Copied != 0);
+
+        if (Guest->InOffset < HEADER_LENGTH)
+            return FALSE;
+    }
+
+    Length = HEADER_LENGTH + In->len;
+
+    Copied = StoreCopyFromRing(Guest->Shared,
+                               Guest->In + Guest->InOffset,
+                               Length - Guest->InOffset);
+    Guest->InOffset += Copied;
+    Guest->Progress |= (Copied != 0);
+
+    if (Guest->InOffset < Length)
+        return FALSE;
+
+    Guest->In[Length] = '\0';
+    Guest->InOffset = 0;
+
+    *Header = In;
+    *Payload = Guest->In + HEADER_LENGTH;
+    return TRUE;
+}
@@ -0,0 +1,138 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// The fake xenstored and the guest end of the ring shared by ring_bench
+// and capture_replay. The peer serves the shared page from a thread of
+// its own. It understands reads, writes, directories, mkdir, watches and
+// transaction start and end, and answers anything else with EINVAL.
+// The guest only touches the ring through the driver's StoreCopyToRing()
+// and StoreCopyFromRing().
+
+#ifndef _STORE_PEER_H
+#define _STORE_PEER_H
+
+#include <ntddk.h>
+#include <xen.h>
+
+#include <pthread.h>
+
+#define HEADER_LENGTH   ((ULONG)sizeof (struct xsd_sockmsg))
+#define MESSAGE_LENGTH  (HEADER_LENGTH + XENSTORE_PAYLOAD_MAX)
+
+#define PEER_NODE_COUNT     (1 << 17)
+#define PEER_WATCH_COUNT    64
+
+typedef struct _PEER_NODE {
+    PCHAR   Path;
+    PCHAR   Value;
+    ULONG   Length;
+    LONG    Parent;
+    LONG    Child;
+    LONG    Sibling;
+} PEER_NODE, *PPEER_NODE;
+
+typedef struct _PEER_WATCH {
+    PCHAR   Path;
+    PCHAR   Token;
+} PEER_WATCH, *PPEER_WATCH;
+
+typedef struct _PEER {
+    struct xenstore_domain_interface    *Shared;
+    pthread_t                           Thread;
+    volatile BOOLEAN                    Stop;
+    PPEER_NODE                          Node;
+    ULONG                               NodeCount;
+    PEER_WATCH                          Watch[PEER_WATCH_COUNT];
+    ULONG                               Transaction;
+    CHAR                                Request[MESSAGE_LENGTH + 1];
+    CHAR                                Reply[MESSAGE_LENGTH];
+} PEER, *PPEER;
+
+// Create Path, and any missing ancestors, and give it Value if there is
+// one. Only for use before the peer is started.
+extern LONG
+PeerSet(
+    IN  PPEER       Peer,
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Value OPTIONAL,
+    IN  ULONG       Length
+    );
+
+extern BOOLEAN
+PeerStart(
+    IN  PPEER                               Peer,
+    IN  struct xenstore_domain_interface    *Shared
+    );
+
+extern VOID
+PeerStop(
+    IN  PPEER   Peer
+    );
+
+typedef struct _GUEST {
+    struct xenstore_domain_interface    *Shared;
+    CHAR                                Out[MESSAGE_LENGTH];
+    ULONG                               OutLength;
+    ULONG                               OutOffset;
+    CHAR                                In[MESSAGE_LENGTH + 1];
+    ULONG                               InOffset;
+    ULONG                               Id;
+    BOOLEAN                             Progress;
+} GUEST, *PGUEST;
+
+// Queue a request built from Path and Data, returning its req_id
+extern ULONG
+GuestPrepare(
+    IN  PGUEST      Guest,
+    IN  ULONG       Type,
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Data OPTIONAL,
+    IN  ULONG       Length
+    );
+
+// Queue a request exactly as given
+extern VOID
+GuestSend(
+    IN  PGUEST                      Guest,
+    IN  const struct xsd_sockmsg    *Header,
+    IN  const CHAR                  *Payload
+    );
+
+// Make whatever progress the rings allow, in the same way as the
+// driver's poll loop. Returns TRUE when a whole message has arrived.
+extern BOOLEAN
+GuestPoll(
+    IN  PGUEST              Guest,
+    OUT struct xsd_sockmsg  **Header,
+    OUT PCHAR               *Payload
+    );
+
+#endif  // _STORE_PEER_H
@@ -0,0 +1,291 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Microbenchmark for the store watch index: id allocation, looking up
+// the node for a watch event by id, and the check made on every cached
+// read that a path is covered by a watch. Each is timed as the number of
+// watches grows to the full 64k id space, alongside the linear walk of
+// the watch list that the cache check used to make.
+
+#include <ntddk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "store_watch.h"
+
+#define DEVICES_PER_DOMAIN  16
+
+static ULONGLONG
+Now(
+    VOID
+    )
+{
+    struct timespec Time;
+
+    (VOID) clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return ((ULONGLONG)Time.tv_sec * 1000000000ull) + Time.tv_nsec;
+}
+
+static ULONG
+Random(
+    IN OUT  PULONG  Seed
+    )
+{
+    *Seed = (*Seed * 1103515245u) + 12345u;
+    return *Seed >> 8;
+}
+
+static VOID
+WatchPath(
+    IN  ULONG   Watch,
+    OUT PCHAR   Path,
+    IN  ULONG   Length
+    )
+{
+    (VOID) snprintf(Path, Length, "/local/domain/%u/device/vif/%u",
+                    Watch / DEVICES_PER_DOMAIN,
+                    Watch % DEVICES_PER_DOMAIN);
+}
+
+// The same walk as StoreWatchNodeLookup(), allocating from the C heap
+static PXENBUS_STORE_WATCH_NODE
+Lookup(
+    IN  PXENBUS_STORE_WATCH_INDEX   Index,
+    IN  PCHAR                       Path
+    )
+{
+    PXENBUS_STORE_WATCH_NODE        Node;
+    ULONG                           Start;
+
+    Node = &Index->Root;
+    Start = 0;
+
+    while (Path[Start] != '\0') {
+        PXENBUS_STORE_WATCH_NODE    Child;
+        ULONG                       End;
+
+        End = __StoreWatchNextComponent(Path, Start);
+
+        Child = __StoreWatchIndexFindChild(Index, Node, Path, End);
+        if (Child == NULL) {
+            Child = calloc(1, FIELD_OFFSET(XENBUS_STORE_WATCH_NODE, Path) +
+                              End +
+                              sizeof (CHAR));
+            if (Child == NULL)
+                abort();
+
+            RtlCopyMemory(Child->Path, Path, End);
+            Child->Name = &Child->Path[Start];
+            Child->Length = End - Start;
+
+            __StoreWatchIndexInsertChild(Index, Node, Child);
+
+            if (__StoreWatchIndexRehashNeeded(Index)) {
+                PLIST_ENTRY Bucket;
+
+                Bucket = malloc(sizeof (LIST_ENTRY) << (Index->BucketShift + 1));
+                if (Bucket == NULL)
+                    abort();
+
+                free(__StoreWatchIndexRehash(Index, Bucket));
+            }
+        }
+
+        Node = Child;
+        Start = (Path[End] == '/') ? End + 1 : End;
+    }
+
+    return Node;
+}
+
+// What StoreCacheIsWatched() did before the index
+static BOOLEAN
+LinearIsWatched(
+    IN  PCHAR   *Watch,
+    IN  ULONG   Count,
+    IN  PCHAR   Path
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Length = (ULONG)strlen(Watch[Index]);
+
+        if (strncmp(Watch[Index], Path, Length) == 0 &&
+            (Path[Length] == '\0' || Path[Length] == '/'))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static BOOLEAN
+Run(
+    IN  ULONG   Count,
+    IN  ULONG   Iterations
+    )
+{
+    PXENBUS_STORE_WATCH_INDEX   Index;
+    PXENBUS_STORE_WATCH_NODE    *Node;
+    PCHAR                       *WatchPath_;
+    PLIST_ENTRY                 Watch;
+    CHAR                        Path[128];
+    ULONG                       Seed;
+    ULONG                       Iteration;
+    ULONG                       Hits;
+    ULONGLONG                   Begin;
+    double                      Allocate;
+    double                      FindId;
+    double                      Indexed;
+    double                      Linear;
+    ULONG                       LinearIterations;
+    ULONG                       Watch_;
+    BOOLEAN                     Success;
+
+    Index = calloc(1, sizeof (XENBUS_STORE_WATCH_INDEX));
+    Node = calloc(Count, sizeof (PXENBUS_STORE_WATCH_NODE));
+    Watch = calloc(Count, sizeof (LIST_ENTRY));
+    WatchPath_ = calloc(Count, sizeof (PCHAR));
+    if (Index == NULL || Node == NULL || Watch == NULL || WatchPath_ == NULL)
+        abort();
+
+    __StoreWatchIndexInitialize(Index, 0x1234);
+
+    for (Watch_ = 0; Watch_ < Count; Watch_++) {
+        WatchPath(Watch_, Path, sizeof (Path));
+        WatchPath_[Watch_] = strdup(Path);
+
+        Node[Watch_] = Lookup(Index, Path);
+        Node[Watch_]->State = XENBUS_STORE_WATCH_REGISTERED;
+        InsertTailList(&Node[Watch_]->WatchList, &Watch[Watch_]);
+    }
+
+    Begin = Now();
+    for (Watch_ = 0; Watch_ < Count; Watch_++) {
+        if (Index->FreeCount == 0 &&
+            !__StoreWatchIndexGrow(Index, calloc(1, sizeof (XENBUS_STORE_WATCH_TABLE))))
+            abort();
+
+        __StoreWatchIndexGetId(Index, Node[Watch_]);
+    }
+    Allocate = (double)(Now() - Begin) / Count;
+
+    Success = TRUE;
+    Seed = Count;
+
+    Hits = 0;
+    Begin = Now();
+    for (Iteration = 0; Iteration < Iterations; Iteration++) {
+        ULONG   Target = Random(&Seed) % Count;
+
+        if (__StoreWatchIndexFindId(Index, Node[Target]->Id) == Node[Target])
+            Hits++;
+    }
+    FindId = (double)(Now() - Begin) / Iterations;
+
+    if (Hits != Iterations) {
+        fprintf(stderr, "%u: id lookup failed\n", Count);
+        Success = FALSE;
+    }
+
+    // Half the paths are below a watch and half are not
+    Hits = 0;
+    Begin = Now();
+    for (Iteration = 0; Iteration < Iterations; Iteration++) {
+        ULONG   Target = Random(&Seed) % Count;
+
+        (VOID) snprintf(Path, sizeof (Path), "/local/domain/%u/%s",
+                        Target / DEVICES_PER_DOMAIN,
+                        (Iteration & 1) ? "data/updated" : "device/vif/0/state");
+
+        if (__StoreWatchIndexIsWatched(Index, Path))
+            Hits++;
+    }
+    Indexed = (double)(Now() - Begin) / Iterations;
+
+    if (Hits != Iterations / 2) {
+        fprintf(stderr, "%u: indexed check found %u of %u\n",
+                Count, Hits, Iterations / 2);
+        Success = FALSE;
+    }
+
+    // The linear walk is too slow to run as many times
+    LinearIterations = __max(Iterations / Count, 64u) & ~1u;
+
+    Hits = 0;
+    Begin = Now();
+    for (Iteration = 0; Iteration < LinearIterations; Iteration++) {
+        ULONG   Target = Random(&Seed) % Count;
+
+        (VOID) snprintf(Path, sizeof (Path), "/local/domain/%u/%s",
+                        Target / DEVICES_PER_DOMAIN,
+                        (Iteration & 1) ? "data/updated" : "device/vif/0/state");
+
+        if (LinearIsWatched(WatchPath_, Count, Path))
+            Hits++;
+    }
+    Linear = (double)(Now() - Begin) / LinearIterations;
+
+    if (Hits != LinearIterations / 2) {
+        fprintf(stderr, "%u: linear check found %u of %u\n",
+                Count, Hits, LinearIterations / 2);
+        Success = FALSE;
+    }
+
+    printf("%6u watches  %6u buckets  get id %7.1f ns  find id %6.1f ns  "
+           "is watched %7.1f ns  (linear %10.1f ns)\n",
+           Count, 1u << Index->BucketShift, Allocate, FindId, Indexed, Linear);
+
+    // Leak the nodes and tables: the process is about to exit
+    return Success;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    ULONG   Iterations;
+    ULONG   Count;
+    BOOLEAN Success;
+
+    Iterations = (argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) : 1000000;
+
+    Success = TRUE;
+    for (Count = 1024; Count <= 0x10000; Count *= 4)
+        Success &= Run(Count, Iterations);
+
+    return (Success) ? 0 : 1;
+}